@@ -14,6 +14,15 @@
  * @see test
  */
 #define TESTS 1
+
+/** If defined, benchmarks will be enabled
+ *
+ * When undefined, the list of benchmarks will not be populated. Benchmarks are run after the tests on boot, and report
+ *  their results using printk.
+ *
+ * @see test::Benchmark
+ */
+#define BENCHMARKS 1
 /** @} */
 
 /** @name Additional Logging
@@ -37,6 +46,12 @@
 
 /** If defined, then extra debug information will be printk'd by the serial port driver */
 #define DEBUG_SERIAL 0
+
+/** If defined, then the contention statistics of every named mutex will be printk'd after the benchmarks are run
+ *
+ * @see mutex::dump_all
+ */
+#define DEBUG_LOCKS 0
 /** @} */
 
 /** @name Memory Management
@@ -49,6 +64,23 @@
  **/
 #define KMEM_SENTINEL 1
 
+/** @name Scheduling
+ *
+ * @{
+ */
+/** If defined, then idle CPUs stop their timer rather than taking SWITCHES_PER_SECOND interrupts a second
+ *
+ * This is the default value of lapic::tickless.
+ */
+#define TICKLESS 1
+
+/** If defined, threads are scheduled by task::FairPolicy by default, rather than task::RoundRobinPolicy
+ *
+ * @see task::set_policy
+ */
+#define FAIR_SCHEDULER 1
+/** @} */
+
 /** @name Code Checks
  *
  * @{
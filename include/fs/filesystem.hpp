@@ -24,7 +24,10 @@ enum class InodeType { DIRECTORY, FILE };
 /** An entry in a directory's Inode list */
 struct InodeEntry {
     uint64_t inode; /**< The inode number of the child */
-    Utf8 name; /**< The filename of the child */
+    Utf8 name; /**< The filename of the child, which is interned so looking it up only needs pointer comparisons */
+
+    InodeEntry() : inode(0) {};
+    InodeEntry(uint64_t inode, Utf8 name) : inode(inode), name(name.intern()) {};
 };
 
 /** A single inode
@@ -159,10 +162,13 @@ private:
     shared_ptr<Inode> inode;
 
 public:
-    /** The name of this element of the file path */
+    /** The name of this element of the file path, this is always interned */
     Utf8 name;
 
-    /** Create a new FilePathEntry */
+    /** Create a new FilePathEntry
+     *
+     * The name is interned, so it can be matched against InodeEntry names quickly.
+     */
     FilePathEntry(Utf8 name = Utf8(""), shared_ptr<FilePathEntry> parent = nullptr, shared_ptr<Inode> inode = nullptr);
 
     /** Retreive the Inode from the filesystem for this FilePathEntry and its parents
@@ -197,7 +203,7 @@ public:
  *
  * @param path The path to create
  * @param base The root directory to start creating the path from
- * @return The FilePathEntry of the last entry in the path
+ * @return The FilePathEntry of the last entry in the path, or null if the path is not valid UTF-8
  */
 shared_ptr<FilePathEntry> parse_path(const Utf8& path, shared_ptr<FilePathEntry>& base);
 
@@ -3,6 +3,7 @@
 
 #include "main/common.hpp"
 #include "hw/ps2.hpp"
+#include "task/task.hpp"
 
 namespace ps2keyboard {
     const uint16_t MASK_RELEASE = 0x8000;
@@ -17,9 +18,12 @@ namespace ps2keyboard {
     const uint8_t RESEND = 0xfe;
     const uint8_t ERR_2 = 0xff;
 
+    /** How long to wait for the keyboard to respond, in nanoseconds */
+    const uint64_t TIMEOUT = 500000000;
+
     class Ps2KeyboardDriver : public ps2::Ps2Driver {
     public:
-        Ps2KeyboardDriver(ps2::Ps2Port &port) : ps2::Ps2Driver(port) {};
+        Ps2KeyboardDriver(ps2::Ps2Port &port) : ps2::Ps2Driver(port), input_queue(Utf8("ps2keyboard")) {};
 
         void configure() override;
         void handle() override;
@@ -35,6 +39,9 @@ namespace ps2keyboard {
 
         volatile int16_t last_input;
         volatile bool self_test_passed;
+        task::WaitQueue input_queue; /**< Woken when last_input is set or the self test passes */
+
+        void wait_for_input();
     };
 }
 
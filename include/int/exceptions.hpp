@@ -74,7 +74,15 @@ namespace exceptions {
      * @param[in] errcode The selector index of the segment selector when it is at fault, otherwise 0
      */
     void gpf(idt_proc_state_t state, uint32_t errcode);
-    /** Handles \#PF by panicing, which displays the invalid address
+    /** Page fault error code bit, set if the page was present (so the fault was a protection violation) */
+    const uint32_t PAGE_FAULT_PRESENT = 0x01;
+    /** Page fault error code bit, set if the fault was caused by a write */
+    const uint32_t PAGE_FAULT_WRITE = 0x02;
+
+    /** Handles \#PF by asking the current thread's memory map to resolve it, and panicing if it can't
+     *
+     * Faults on pages which aren't present generate them, and writes to read only pages copy pages that are shared
+     *  copy-on-write (see vm::Map::resolve_fault).
      *
      * @param[in] state The values of all the registers
      * @param[in] errcode Information about the page fault
@@ -34,26 +34,144 @@ namespace lapic {
     const uint32_t LVT_MASK = (1 << 16);
     const uint32_t TIMER_MODE_PERIODIC = (1 << 17);
     const uint32_t TIMER_MODE_ONE_SHOT = (0 << 17);
+    const uint32_t TIMER_MODE_TSC_DEADLINE = (2 << 17);
 
     const uint32_t SWITCHES_PER_SECOND = 1000;
 
+    /** An event which runs a callback from the timer interrupt of the CPU it was added on
+     *
+     * The event must stay valid until it has either fired or been cancelled.
+     */
+    struct timer_event_t {
+        uint64_t deadline; /**< The TSC value at or after which the event fires */
+        void (*callback)(void *); /**< Called with interrupts disabled when the event fires */
+        void *data; /**< The argument to `callback` */
+        timer_event_t *next; /**< The next event in the CPU's queue */
+        bool pending; /**< Whether the event is waiting to fire */
+    };
+
+    /** Counters kept by the LAPIC timer of each CPU */
+    struct timer_stats_t {
+        uint64_t interrupts; /**< The number of timer interrupts the CPU has taken */
+        uint64_t expired; /**< The number of timer events which have fired */
+        uint64_t programmed; /**< The number of times the timer has been set for a new expiry */
+    };
+
+    /** Whether CPUs stop their scheduler tick while they are idle
+     *
+     * This defaults to `TICKLESS`, and is changed with lapic::set_tickless.
+     */
+    extern volatile bool tickless;
+    /** Whether the timer is using TSC-deadline mode rather than one-shot mode */
+    extern bool tsc_deadline;
+
+    /** Commands that can be sent to other CPUs with send_command or send_command_all */
     enum command_t {
-        CMD_INVLPG
+        CMD_INVLPG, /**< Invalidate the TLB entries of `argument_b` pages starting at the address `argument` */
+        CMD_FLUSH_TLB, /**< Invalidate all TLB entries, including global ones */
+        CMD_UNLOAD_MAP /**< Stop using the vm::Map `argument` if it is currently loaded */
+    };
+
+    /** Counters for commands sent by lapic::send_command and lapic::send_command_all */
+    struct command_stats_t {
+        uint64_t commands; /**< The number of commands sent */
+        uint64_t ipis; /**< The number of IPIs sent to deliver those commands */
+        uint64_t wait_cycles; /**< The number of TSC cycles spent waiting for other CPUs to complete them */
     };
+    /** Statistics about all the commands sent so far */
+    extern volatile command_stats_t command_stats;
 
     void init();
     void setup();
     void timer(idt_proc_state_t state);
     void handle_command(idt_proc_state_t state);
     void handle_panic(idt_proc_state_t state);
+    void handle_wake(idt_proc_state_t state);
     void eoi();
     void awaken_others();
 
     void ipi(uint8_t vector, uint32_t proc);
     void ipi_all(uint8_t vector);
+    /** Wake up a CPU that is idle, so it checks its run queue again
+     *
+     * If the CPU is running a thread, it calls task::task_timer_yield, which preempts the thread if the scheduler has
+     *  asked for it to be.
+     *
+     * @param proc The CPU to wake up, which may be this one
+     */
+    void wake(uint32_t proc);
+
+    /** Ask a single other CPU to run a command, and wait for it to complete
+     *
+     * @param command The command to run
+     * @param argument The first argument to the command
+     * @param argument_b The second argument to the command
+     * @param proc The CPU to run the command on
+     */
+    void send_command(command_t command, uint32_t argument, uint32_t argument_b, uint32_t proc);
+    /** Ask a set of other CPUs to run a command, and wait for them all to complete it
+     *
+     * The IPIs are all sent before waiting for any of the CPUs, and the current CPU is always ignored.
+     *
+     * @param command The command to run
+     * @param argument The first argument to the command
+     * @param argument_b The second argument to the command
+     * @param cpus The CPUs to run the command on
+     * @return The number of IPIs sent
+     */
+    uint32_t send_command_mask(command_t command, uint32_t argument, uint32_t argument_b, cpu_mask_t cpus);
+    /** Ask every other online CPU to run a command, and wait for them all to complete it
+     *
+     * This sends a single broadcast IPI, and waits for all the CPUs at once.
+     *
+     * @param command The command to run
+     * @param argument The first argument to the command
+     * @param argument_b The second argument to the command
+     */
+    void send_command_all(command_t command, uint32_t argument, uint32_t argument_b = 0);
 
-    void send_command(command_t command, uint32_t argument, uint32_t proc);
-    void send_command_all(command_t command, uint32_t argument);
+    /** Add an event to the current CPU's timer queue, and program the timer if it is now the next to fire
+     *
+     * Interrupts must be disabled, and the event must not already be pending.
+     *
+     * @param event The event, whose callback and data must be set
+     * @param deadline The TSC value at which to fire it
+     */
+    void add_timer(timer_event_t &event, uint64_t deadline);
+    /** Remove an event from the current CPU's timer queue, if it hasn't fired yet
+     *
+     * Interrupts must be disabled.
+     *
+     * @param event The event
+     * @return Whether the event was pending
+     */
+    bool cancel_timer(timer_event_t &event);
+    /** Start the scheduler tick on this CPU, giving the thread about to be run a time slice
+     *
+     * If lapic::tickless is false, the tick keeps firing SWITCHES_PER_SECOND times a second instead, and the scheduler
+     *  ignores the ticks that arrive before the slice is over.
+     *
+     * Interrupts must be disabled.
+     *
+     * @param slice The length of the time slice, in nanoseconds
+     */
+    void start_tick(uint64_t slice);
+    /** Stop the scheduler tick on this CPU because it is about to idle, unless lapic::tickless is false
+     *
+     * Interrupts must be disabled.
+     */
+    void stop_tick();
+    /** Change whether idle CPUs stop their scheduler tick, waking every other CPU so they notice
+     *
+     * @param enabled Whether to stop the tick while idle
+     */
+    void set_tickless(bool enabled);
+    /** Returns the timer counters of a CPU
+     *
+     * @param proc The CPU
+     * @return Its timer statistics
+     */
+    timer_stats_t timer_stats(uint32_t proc);
 }
 
 #endif
@@ -131,6 +131,7 @@
 
 #define INT_LAPIC_COMMAND 0x8
 #define INT_LAPIC_PANIC 0x9
+#define INT_LAPIC_WAKE 0xa
 
 /*
  *
@@ -7,6 +7,7 @@ extern "C" {
 uint32_t push_flags();
 uint32_t push_cli();
 void __attribute__((fastcall)) pop_flags(uint32_t flags);
+uint64_t read_tsc();
 }
 
 #endif
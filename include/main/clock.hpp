@@ -0,0 +1,65 @@
+#ifndef _HPP_MAIN_CLOCK_
+#define _HPP_MAIN_CLOCK_
+
+#include <stdint.h>
+
+/** A high resolution monotonic clock, based on the TSC
+ *
+ * The TSC is calibrated against the PIT's counter by clock::init when the kernel boots, and clock::now_ns converts it to
+ *  nanoseconds since then. This is much finer than pit::time, which only changes PER_SECOND times a second.
+ *
+ * Each other CPU compares its TSC with the boot CPU's when it comes online (in clock::setup), and if they differ by more
+ *  than the comparison can measure, its readings are adjusted to match. This makes readings taken on different CPUs
+ *  comparable, to within the time it takes to pass a cache line between them.
+ *
+ * The clock assumes that the TSC runs at a constant rate, which is true of every CPU that the kernel is likely to be
+ *  run on (including QEMU).
+ */
+namespace clock {
+    const uint64_t NS_PER_SEC = 1000000000ull;
+
+    /** The number of TSC cycles per second, or 0 if clock::init hasn't been called yet */
+    extern volatile uint64_t tsc_per_sec;
+    /** The largest error clock::init could have made in measuring tsc_per_sec, in parts per million */
+    extern uint32_t calibration_error_ppm;
+
+    /** Calibrate the TSC against the PIT, called once on the boot CPU after pit::init
+     *
+     * This takes about 50ms, and doesn't need interrupts.
+     */
+    void init();
+    /** Match this CPU's clock with the boot CPU's, called once on every other CPU when it comes online
+     *
+     * The boot CPU must be running clock::sync_with_ap at the same time.
+     */
+    void setup();
+    /** Help a CPU that is running clock::setup match its clock with this one, called on the boot CPU */
+    void sync_with_ap();
+
+    /** Returns the number of nanoseconds since clock::init was called
+     *
+     * This never goes backwards on a given CPU. Before clock::init is called, this returns 0.
+     *
+     * @return The current time, in nanoseconds
+     */
+    uint64_t now_ns();
+    /** Returns the TSC value of the current CPU, adjusted to match the boot CPU's
+     *
+     * @return The current TSC
+     */
+    uint64_t now_tsc();
+    /** Convert a number of TSC cycles to nanoseconds
+     *
+     * @param cycles The number of cycles
+     * @return The number of nanoseconds they take
+     */
+    uint64_t tsc_to_ns(uint64_t cycles);
+    /** Convert a number of nanoseconds to TSC cycles
+     *
+     * @param ns The number of nanoseconds
+     * @return The number of TSC cycles in that time
+     */
+    uint64_t ns_to_tsc(uint64_t ns);
+}
+
+#endif
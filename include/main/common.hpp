@@ -87,6 +87,13 @@ typedef uintptr_t addr_logical_t;
 
 #define MAX_CORES 32
 
+/** A set of CPUs, where bit `n` is set if CPU `n` is in the set
+ *
+ * This must have at least MAX_CORES bits.
+ */
+typedef uint32_t cpu_mask_t;
+#define CPU_MASK(id) ((cpu_mask_t)1 << (id))
+
 #define GDT_SELECTOR(rpl, ti, index) ((rpl) | ((ti) << 2) | ((index) << 3))
 
 template<class T> using callback_t = void (*)(T);
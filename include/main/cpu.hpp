@@ -15,6 +15,7 @@
 #include "hw/acpi.hpp"
 #include "structures/shared_ptr.hpp"
 #include "int/lapic.hpp"
+#include "mem/kmem.hpp"
 
 namespace cpu {
     /** Represents the current state of a CPU
@@ -31,11 +32,23 @@ namespace cpu {
 
         volatile lapic::command_t command; /**< The command that was sent to this CPU via an IPI */
         volatile uint32_t command_arg; /**< The command argument for the IPI command */
+        volatile uint32_t command_arg_b; /**< The second command argument for the IPI command */
+        volatile bool command_pending; /**< Whether there is a command waiting for this CPU to run it */
         volatile bool command_finished; /**< A flag to be set by the handle_command function on command completion */
+
+        vm::Map *loaded_map; /**< The memory map in CR3, which may be left loaded after its thread stops running */
+
+        kmem::cpu_cache_t kmem_cache; /**< Recently freed small objects, used by kmem to avoid taking its lock */
     };
 
     extern "C" addr_logical_t *stacks[MAX_CORES];
 
+    /** The set of CPUs which are awake and running kernel code
+     *
+     * Every online CPU may have any of the kernel's mappings in its TLB.
+     */
+    extern volatile cpu_mask_t online;
+
     const uint32_t CF = 0x1;
     const uint32_t PF = 0x4;
     const uint32_t AF = 0x10;
@@ -63,6 +76,12 @@ namespace cpu {
      *  memory allocation to be working
      */
     void init();
+    /** Sets up the currently running CPU, this must be called on every CPU after cpu::init
+     *
+     * This loads the CPU's per-CPU segment, which makes cpu::id much cheaper, and enables any CPU features the kernel
+     *  uses.
+     */
+    void setup();
     /** Returns the currently running thread
      *
      * Reads the "thread" property of the CPU, but disables interrupts to avoid race conditions
@@ -72,6 +91,13 @@ namespace cpu {
      */
     shared_ptr<task::Thread> current_thread_noint();
 
+    /** Returns the id of the currently running CPU
+     *
+     * Interrupts should be disabled while calling this and using its result, since the thread may otherwise be moved to
+     *  another CPU.
+     *
+     * @return The id of the current CPU
+     */
     uint32_t id();
 }
 
@@ -17,7 +17,9 @@ enum error_t {
     EBUSY,
     ENOENT,
     ENOTDIR,
-    ENOPATHBASE /* No base for path */
+    ENOPATHBASE, /* No base for path */
+    ETIMEDOUT,
+    EINVAL
 };
 
 #endif
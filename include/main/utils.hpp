@@ -8,13 +8,82 @@
  * Contains a number of utility functions, stuff like memcpy and strlen
  */
 
-inline void* memcpy(void* destination, const void* source, size_t num) {
-    for (size_t i = 0; i < num; i++) {
-        ((char*)destination)[i] = ((char*)source)[i];
-    }
-    return destination;
+extern "C" {
+/** Copies `num` bytes from `source` to `destination`, which must not overlap
+ *
+ * Large copies use SSE2 if memory_setup has found it to be available.
+ *
+ * @param destination Where to copy the memory to
+ * @param source Where to copy the memory from
+ * @param num The number of bytes to copy
+ * @return `destination`
+ */
+void *memcpy(void *destination, const void *source, size_t num);
+/** Copies `num` bytes from `source` to `destination`, which may overlap
+ *
+ * @param destination Where to copy the memory to
+ * @param source Where to copy the memory from
+ * @param num The number of bytes to copy
+ * @return `destination`
+ */
+void *memmove(void *destination, const void *source, size_t num);
+/** Sets `num` bytes starting at `ptr` to `value`
+ *
+ * @param ptr The memory to set
+ * @param value The value to set each byte to, converted to an `unsigned char`
+ * @param num The number of bytes to set
+ * @return `ptr`
+ */
+void *memset(void *ptr, int value, size_t num);
+/** Compares the first `num` bytes of two blocks of memory
+ *
+ * @param a The first block
+ * @param b The second block
+ * @param num The number of bytes to compare
+ * @return 0 if they are equal, otherwise the difference between the first pair of bytes that differ
+ */
+int memcmp(const void *a, const void *b, size_t num);
 }
 
+/** Sets every byte in a single page aligned page to 0
+ *
+ * @param page The page to clear
+ */
+void zero_page(void *page);
+/** Copies a single page aligned page to another
+ *
+ * @param destination The page to copy to
+ * @param source The page to copy from
+ */
+void copy_page(void *destination, const void *source);
+/** Selects the fastest memory functions for the current CPU
+ *
+ * If the CPU supports SSE2, this enables it and the memory functions will use it for large copies. This is called by
+ *  cpu::setup.
+ */
+void memory_setup();
+/** Returns whether memory_setup found and enabled SSE2
+ *
+ * The kernel does not save the SSE registers on an interrupt or task switch, so they must only be used with
+ *  interrupts disabled.
+ *
+ * @return Whether SSE2 instructions may be used
+ */
+bool sse2_enabled();
+
+/** Adds xmm registers to the clobber list of an inline assembly block, after its other clobbers
+ *
+ * The kernel is built without SSE, so the compiler never keeps anything in the xmm registers and refuses to accept
+ *  them as clobbers. If it is built with SSE, they are listed so that nothing is kept in them across the assembly.
+ *
+ * For example, `: "memory" SSE_CLOBBERS("xmm0", "xmm1")`.
+ */
+#ifdef __SSE__
+#define SSE_CLOBBERS(...) , __VA_ARGS__
+#else
+#define SSE_CLOBBERS(...)
+#endif
+
 inline size_t strlen(const char* str) {
     if (!str) {
         panic("Null in _strlen");
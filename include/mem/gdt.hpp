@@ -25,6 +25,13 @@ namespace gdt {
     const uint8_t CODE_OFFSET = 0x10;
     const uint8_t DATA_OFFSET = 0x08;
 
+    /** Index of the first per-CPU data segment
+     *
+     * Each CPU loads its own copy of the data segment into `fs`, which allows cpu::id to find the current CPU without
+     *  executing `cpuid`.
+     */
+    const uint8_t CPU_INDEX_BASE = 3;
+
     void set_entry(table_entry_t *entry, uint32_t base, uint32_t limit, uint8_t flags, uint8_t access);
     extern "C" void gdt_init();
 
@@ -6,7 +6,7 @@
 
 #include "main/common.hpp"
 #include "mem/page.hpp"
-#include "structures/mutex.hpp"
+#include "structures/spinlock.hpp"
 
 /** Manages kernel memory allocation
   *
@@ -16,6 +16,14 @@
   * Memory allocated through this class is located in kernel memory, meaning it is visible to all threads running in
   *  kernel mode.
   *
+  * Small allocations (up to kmem::SLAB_MAX_SIZE bytes) are served from per size class slabs, which are whole pages
+  *  carved up into equally sized objects. Allocating or freeing one of these runs in O(1) time. Larger allocations are
+  *  served from a general address ordered free list.
+  *
+  * Each CPU also keeps a small "magazine" of recently freed slab objects for each size class, in its cpu::Status. Most
+  *  small allocations and frees only touch the current CPU's magazine, and so do not need to take kmem::lock. When a
+  *  magazine runs empty or fills up, half of it is refilled from or drained to the shared slabs in one go.
+  *
   * The memory pool used by kmem grows automatically when it is full.
   *
   * Allocating and freeing memory is thread safe. It also disables interrupts while doing so, allowing you to use
@@ -38,6 +46,32 @@ namespace kmem {
      */
     const uint8_t KMALLOC_NOLOCK = (1 << 1);
 
+    /** A kmalloc flag that if set indicates that the allocation should not be served from a slab
+     *
+     * The memory will instead come from the general free list, no matter how small it is. This is mostly useful for
+     *  benchmarking and debugging.
+     */
+    const uint8_t KMALLOC_NOSLAB = (1 << 2);
+
+    /** The largest allocation size which will be served from a slab */
+    const size_t SLAB_MAX_SIZE = 2048;
+    /** The number of slab size classes, the smallest is 16 bytes and each one is double the size of the last */
+    const uint32_t SLAB_CLASSES = 8;
+    /** The number of objects a single per-CPU magazine can hold */
+    const uint32_t MAGAZINE_SIZE = 32;
+
+    /** A stack of free slab objects of a single size class, owned by a single CPU */
+    struct magazine_t {
+        uint32_t count = 0; /**< The number of objects in the magazine */
+        void *objects[MAGAZINE_SIZE]; /**< The objects themselves, `objects[count - 1]` is the next to be allocated */
+    };
+
+    /** The per-CPU allocation cache, this lives in the cpu's cpu::Status */
+    struct cpu_cache_t {
+        magazine_t magazines[SLAB_CLASSES]; /**< One magazine for each slab size class */
+        uint64_t allocations = 0; /**< How many times kmalloc has been called on this CPU */
+    };
+
     /** A kernel memory map, indicating where different areas of the kernel lie. */
     struct map_t {
         addr_logical_t kernel_ro_start; /**< Base address of kernel readonly memory */
@@ -57,17 +91,23 @@ namespace kmem {
      */
     extern map_t map;
 
-    /** A mutex used by the kmem and page namespaces to protect their internal structures
+    /** A spinlock used by the kmem and page namespaces to protect their internal structures
      *
-     * This should not be used by anything else
+     * This should not be used by anything else, and must only be held with interrupts disabled
      */
-    extern mutex::Mutex mutex;
+    extern spinlock::Spinlock lock;
 
     /** Initialises the kmem system, this must be called before any dynamic memory is used
      *
      * This populates kmem::map, calls page::init and sets up kmem for memory allocation.
      */
     void init();
+    /** Start using the per-CPU caches in cpu::Status
+     *
+     * Until this is called, all allocations go through the shared pool. This is called by cpu::init once every CPU's
+     *  status structure exists.
+     */
+    void enable_cpu_caches();
     /** Allocate `size` bytes of kernel memory, and return a pointer to the start of the allocated memory
      *
      * If for some reason this is impossible (e.g. running out of virtual/physical memory), we panic instead.
@@ -93,6 +133,13 @@ namespace kmem {
      * @param ptr A pointer to the memory to free
      */
     void kfree(void *ptr);
+    /** Returns how many times kmalloc has been called since the per-CPU caches were enabled, on every CPU
+     *
+     * This is meant for benchmarks and debugging; allocations on other CPUs may be missed or counted late.
+     *
+     * @return The number of allocations
+     */
+    uint64_t allocations();
     /** Frees previously allocated memory
      *
      * Like kfree, but does not try to get a lock or disable interrupts. This should not be used by any function outside
@@ -8,24 +8,56 @@
 #include "mem/vm.hpp"
 #include "mem/page.hpp"
 #include "structures/list.hpp"
+#include "structures/radix_tree.hpp"
 #include "structures/shared_ptr.hpp"
 
 namespace object {
+    /** How many pages around a page fault are generated at once, when the faults don't look sequential */
+    const uint32_t FAULT_AROUND_PAGES = 4;
+    /** The most pages that are generated at once for sequential faults */
+    const uint32_t READ_AHEAD_MAX_PAGES = 32;
+
+    /** Object flag for objects which are not copied when the maps they are in are cloned, such as thread stacks */
+    const uint8_t FLAG_NO_CLONE = 0x01;
+    /** Object flag for objects whose faults generate the whole 4MiB aligned region around them at once, so that it can
+     *  be mapped with a single 4MiB page
+     */
+    const uint8_t FLAG_LARGE_PAGES = 0x02;
+
+    /** A run of pages which have been generated for an object */
     class PageEntry {
     public:
-        uint32_t offset;
-        page::Page *page;
-        unique_ptr<PageEntry> next;
+        uint32_t offset; /**< The offset into the object of the first page, in bytes */
+        uint32_t count; /**< How many pages there are */
+        page::Page *page; /**< The pages themselves */
+        bool shared; /**< Whether the frames may also belong to a clone of the object, if so they are mapped read only */
     };
 
     class Object;
 
-    class Object {
+    class Object : public shared_ptr_ns::RefCounted {
     private:
         list<ObjectInMap *> objects_in_maps;
 
+        template<class F> void each_page_in(int64_t first, int64_t last, F f);
+        uint8_t flags_for(const PageEntry &entry);
+        void map_entry(PageEntry &entry);
+
+    protected:
+        /** Give a copy of this object all of this object's pages, shared copy-on-write
+         *
+         * The pages are mapped read only in both objects until they are written to.
+         *
+         * @param copy An object with no pages of its own
+         */
+        void share_pages(Object &copy);
+
     public:
-        unique_ptr<PageEntry> pages = nullptr;
+        /** The pages which have been generated, keyed by the page number (offset / PAGE_SIZE) of their first page
+         *
+         * Entries never overlap.
+         */
+        radix_tree::RadixTree<PageEntry> pages;
         uint32_t max_pages;
         uint8_t page_flags;
         uint8_t object_flags;
@@ -37,11 +69,51 @@ namespace object {
         //void shift_right(uint32_t amount);
         //void shift_left(uint32_t amount);
 
+        /** Make sure the given pages have been generated, and map them into every map the object is in
+         *
+         * Pages in the range which already exist are left as they are; every gap between them is filled with a single
+         *  call to Object::do_generate.
+         *
+         * @param addr The offset of the first page, in bytes
+         * @param count The number of pages
+         */
         void generate(uint32_t addr, uint32_t count);
+        /** Returns the entry containing the page at the given offset
+         *
+         * This runs in `O(log n)` time, for `n` the number of pages in the object.
+         *
+         * @param addr An offset into the object, in bytes
+         * @return The entry, or nullptr if that page hasn't been generated
+         */
+        PageEntry *find_page(uint32_t addr);
         virtual page::Page *do_generate(addr_logical_t addr, uint32_t count) = 0;
+        /** Create a copy of this object, for a clone of a map that it is in
+         *
+         * Objects which can be copied create a new object of the same type and call Object::share_pages, so the pages
+         *  are only copied when they are written to. Objects which can't return nullptr, and the clone of the map
+         *  shares this object instead.
+         *
+         * @return The copy, or nullptr
+         */
+        virtual shared_ptr<Object> clone();
+        /** Handle a write to a read only page which is shared with a clone of this object
+         *
+         * If the clone still has the page, it is copied, and only this object's page table entries are changed to the
+         *  copy. Otherwise this object has the only reference left, and its entries are made writable again.
+         *
+         * @param addr An offset into the object, in bytes
+         * @return False if the page isn't shared, in which case the write can't be allowed
+         */
+        bool copy_on_write(uint32_t addr);
 
         void add_object_in_map(ObjectInMap *oim);
         void remove_object_in_map(ObjectInMap *oim);
+        /** Returns one of the places this object is mapped into the given map
+         *
+         * @param map The map
+         * @return The ObjectInMap for the mapping, or nullptr if it isn't mapped into it
+         */
+        ObjectInMap *find_in_map(vm::Map *map);
     };
 
     class EmptyObject : public Object {
@@ -49,6 +121,7 @@ namespace object {
         EmptyObject(uint32_t max_pages, uint8_t page_flags, uint8_t object_flags, uint32_t offset) :
             Object(max_pages, page_flags, object_flags, offset) {};
         page::Page *do_generate(addr_logical_t addr, uint32_t count) override;
+        shared_ptr<Object> clone() override;
     };
 
     class ObjectInMap {
@@ -61,6 +134,23 @@ namespace object {
 
         ObjectInMap(shared_ptr<Object> object, vm::Map *map, uint32_t base, int64_t offset, uint32_t pages);
         ~ObjectInMap();
+
+        /** Generate the pages needed to resolve a page fault in this mapping
+         *
+         * As well as the page that was faulted on, this generates the pages around it (FAULT_AROUND_PAGES of them,
+         *  aligned). If the fault was on the page just after the last ones generated, the faults look sequential and
+         *  the next pages are generated instead, doubling the number each time up to READ_AHEAD_MAX_PAGES.
+         *
+         * If the object has FLAG_LARGE_PAGES and the mapping covers the whole 4MiB aligned region containing the
+         *  fault, all of that region is generated instead.
+         *
+         * @param addr The offset into the object of the page that was faulted on, in bytes
+         */
+        void fault(uint32_t addr);
+
+    private:
+        uint32_t next_fault = 0; // The offset that a sequential fault would be at
+        uint32_t window = 0; // How many pages were generated by the last fault
     };
 }
 
@@ -67,12 +67,63 @@ namespace page {
     Page *alloc_nokmalloc(uint8_t flags, unsigned int count);
     Page *create(uint32_t base, uint8_t flags, unsigned int count);
     void free(Page *page);
+    /** Create a new chain of descriptors for the same frames as the given chain
+     *
+     * Each frame remembers how many descriptors refer to it, and page::free only frees the frame once all of them have
+     *  been freed.
+     *
+     * @param page The pages to share
+     * @return A new descriptor chain, which must be freed separately
+     */
+    Page *share(Page *page);
+    /** Returns how many descriptors refer to the frame at the given address
+     *
+     * @param addr The physical address of the frame
+     * @return The number of descriptors, or 0 if the frame wasn't handed out by page::alloc
+     */
+    uint32_t references(addr_phys_t addr);
+    uint32_t free_count(); // The number of free physical pages
     void used(Page *page, bool lock = true);
     void *kinstall(Page *page, uint8_t page_flags);
-    void *kinstall_append(Page *page, uint8_t page_flags, bool lock = true); // Doesn't kmalloc, but doesn't reuse any existing memory
+    // Doesn't reuse any existing memory, and only kmallocs when aligning a run for 4MiB pages skips some address space
+    void *kinstall_append(Page *page, uint8_t page_flags, bool lock = true);
     // either
     void kuninstall(volatile void *base, Page *page);
 
+    /** Whether a run of frames can be mapped by a single 4MiB page directory entry
+     *
+     * The run must also be mapped at a 4MiB aligned virtual address. page::kinstall, page::kinstall_append and
+     *  vm::Map::insert all do this automatically when they can. When part of a 4MiB page is unmapped it is split back
+     *  into a page table.
+     *
+     * @param phys The physical address of the first frame
+     * @param frames How many physically consecutive frames there are from there
+     * @return Whether they can use a 4MiB page
+     */
+    inline bool fits_large(addr_phys_t phys, uint32_t frames) {
+        return phys % PAGE_DIR_SIZE == 0 && frames >= PAGE_TABLE_LENGTH;
+    }
+
+    /** Fill in the kernel's entries in a new page directory, and keep them up to date from now on
+     *
+     * The kernel's entries change when it maps or unmaps 4MiB pages.
+     *
+     * @param dir The page directory
+     */
+    void add_dir(volatile page_dir_t *dir);
+    /** Stop updating a page directory that was passed to page::add_dir
+     *
+     * @param dir The page directory
+     */
+    void remove_dir(volatile page_dir_t *dir);
+
+    // Flushes more pages than this are done by flushing the whole TLB instead of page by page
+    const uint32_t TLB_FLUSH_THRESHOLD = 32;
+    // Invalidates the kernel TLB entries for `count` pages starting at `base` on every CPU
+    void flush_tlb(addr_logical_t base, uint32_t count);
+    // Invalidates every TLB entry on the current CPU, including the kernel's global ones
+    void flush_tlb_local();
+
 }
 
 #endif
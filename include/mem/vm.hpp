@@ -8,6 +8,7 @@
 #include "mem/page.hpp"
 #include "structures/list.hpp"
 #include "structures/shared_ptr.hpp"
+#include "structures/interval_tree.hpp"
 
 namespace object {
     class Object;
@@ -15,12 +16,32 @@ namespace object {
 }
 
 namespace vm {
+    /** A virtual memory map, which is a page directory and the objects mapped into it
+     *
+     * Each map keeps track of which CPUs may have its entries in their TLBs. When pages are unmapped, only CPUs that are
+     *  currently running the map are sent an IPI. CPUs which have it loaded but aren't running it have a flush
+     *  deferred until they next call Map::enter.
+     *
+     * If vm::lazy_switching is set, Map::exit leaves the map in CR3, and Map::enter only reloads CR3 if a different map
+     *  (or a deferred flush) requires it. The kernel half of every map is the same, so this is safe, and saves flushing
+     *  the TLB when switching between threads of the same map or to the scheduler.
+     *
+     * The objects mapped into the map are kept in an interval tree indexed by the addresses they cover, so finding the
+     *  object to resolve a page fault with, or removing an object, takes `O(log n)` time in the number of objects.
+     *
+     * Map::clone creates a copy of a map whose objects share their pages with the original copy-on-write. Shared pages
+     *  are mapped read only, and the first write to one from either map faults and is resolved by
+     *  object::Object::copy_on_write.
+     */
     class Map {
     private:
-        list<unique_ptr<object::ObjectInMap>> objects_in_maps;
-        uint32_t using_cpu = 0xffffffff;
+        interval_tree::IntervalTree<unique_ptr<object::ObjectInMap>> objects_in_maps;
+        volatile cpu_mask_t running_cpus = 0; // CPUs currently running a thread using this map
+        volatile cpu_mask_t loaded_cpus = 0; // CPUs that may have entries from this map in their TLBs
+        volatile cpu_mask_t stale_cpus = 0; // CPUs that must flush their TLBs before using this map again
 
-        void invlpg(addr_logical_t addr);
+        void invlpg(addr_logical_t addr, uint32_t pages);
+        addr_phys_t claim();
 
     public:
         page::Page *physical_dir;
@@ -28,12 +49,39 @@ namespace vm {
         unique_ptr<page::logical_tables_t> logical_tables;
         uint32_t pid;
         uint32_t task_id;
+        volatile uint32_t flush_ipis = 0; /**< The number of IPIs sent to flush this map from other CPUs' TLBs */
+        volatile uint32_t faults = 0; /**< The number of page faults that have been resolved in this map */
+        volatile uint32_t cow_faults = 0; /**< How many of those were writes to pages shared with a clone */
 
         Map(uint32_t pid, uint32_t task_id, bool kernel);
         ~Map();
+        /** Returns which CPUs are currently running a thread using this map
+         *
+         * @return A mask of the CPUs
+         */
+        cpu_mask_t running() const {
+            return running_cpus;
+        }
         void insert(int64_t addr, page::Page *page, uint8_t page_flags, uint32_t min, uint32_t max);
         void clear(int64_t addr, uint32_t pages);
-        bool resolve_fault(addr_logical_t addr);
+        /** Resolve a page fault on an address in this map
+         *
+         * @param addr The address that was faulted on
+         * @param protection Whether the page was present and the fault was a write to it
+         * @return Whether the fault could be resolved
+         */
+        bool resolve_fault(addr_logical_t addr, bool protection);
+        /** Create a new map containing the same objects as this one
+         *
+         * Objects which can be (see object::Object::clone) are copied copy-on-write, others are shared between the two
+         *  maps. Objects with the object::FLAG_NO_CLONE flag are left out.
+         *
+         * @param pid The process id of the new map
+         * @param task_id The task id of the new map
+         * @param kernel Whether the new map is for the kernel
+         * @return The new map
+         */
+        unique_ptr<Map> clone(uint32_t pid, uint32_t task_id, bool kernel);
 
         void add_object(const shared_ptr<object::Object>& object, uint32_t base, int64_t offset, uint32_t pages);
         void remove_object(const shared_ptr<object::Object>& object);
@@ -41,7 +89,31 @@ namespace vm {
 
         void enter();
         void exit();
+        /** Stop running this map on the current CPU and start running another, without loading CR3
+         *
+         * This is for switching directly from one thread to another. Since every thread's stack is at the same address,
+         *  the caller must load CR3 at the same time as it changes to the new thread's stack.
+         *
+         * Interrupts must be disabled.
+         *
+         * @param next The map to run next
+         * @return The physical address of next's page directory, or 0 if CR3 doesn't need to be loaded
+         */
+        addr_phys_t switch_to(Map *next);
+
+        /** If the given map is loaded on the current CPU, switch to the kernel's page directory instead
+         *
+         * Interrupts must be disabled.
+         *
+         * @param map The map to unload
+         */
+        static void unload(Map *map);
     };
+
+    /** Whether CPUs should keep a map loaded after leaving it, see vm::Map */
+    extern volatile bool lazy_switching;
+    /** The number of times CR3 has been loaded by Map::enter, Map::exit or a switch from Map::switch_to */
+    extern volatile uint32_t cr3_loads;
 }
 
 #endif
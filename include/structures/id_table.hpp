@@ -0,0 +1,71 @@
+#ifndef _HPP_STRUCT_ID_TABLE_
+#define _HPP_STRUCT_ID_TABLE_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "main/common.hpp"
+#include "structures/shared_ptr.hpp"
+#include "structures/spinlock.hpp"
+
+/** Contains a table of objects indexed by a numeric id */
+namespace id_table {
+    /** A table mapping ids to shared_ptrs, which can be read without taking any locks
+     *
+     * The table is an array indexed directly by id, so lookups run in `O(1)` time. Lookups are safe from interrupt
+     *  handlers and any CPU at the same time as the table is being changed; they never take a lock and so never wait
+     *  for (or slow down) writers. Writers are serialised by a spinlock.
+     *
+     * Rather than being changed in place, replaced entries (and the old array, when the table grows) are handed to
+     *  rcu::retire, and freed once no lookup can still be reading them.
+     *
+     * Ids are expected to be handed out in increasing order and not reused, as the array grows to fit the largest id
+     *  it has ever held and never shrinks.
+     */
+    template<class T> class IdTable {
+    public:
+        /** Create a new, empty table */
+        IdTable();
+        ~IdTable();
+
+        IdTable(const IdTable &other) = delete;
+        IdTable &operator=(const IdTable &other) = delete;
+
+        /** Look up the object with the given id
+         *
+         * @param id The id to look up
+         * @return The object, or an empty pointer if there is none
+         */
+        shared_ptr<T> get(uint32_t id) const;
+        /** Set the object with the given id, replacing any object already there
+         *
+         * @param id The id to set
+         * @param value The object to store
+         */
+        void set(uint32_t id, shared_ptr<T> value);
+        /** Remove the object with the given id, if there is one
+         *
+         * @param id The id to remove
+         */
+        void remove(uint32_t id);
+
+    private:
+        static const uint32_t INITIAL_LENGTH = 16;
+
+        // Each slot is a separately allocated shared_ptr, so a slot can be replaced with a single pointer write
+        struct Array {
+            uint32_t length;
+            shared_ptr<T> *volatile *slots;
+        };
+
+        Array *volatile array;
+        spinlock::Spinlock lock;
+
+        static Array *new_array(uint32_t length);
+        static void free_array(void *array);
+        static void free_slot(void *slot);
+    };
+}
+
+#include "structures/id_table.tpp"
+#endif
@@ -0,0 +1,106 @@
+#include "task/rcu.hpp"
+
+namespace id_table {
+    template<class T> IdTable<T>::IdTable() : array(new_array(INITIAL_LENGTH)) {}
+
+    template<class T> IdTable<T>::~IdTable() {
+        for(uint32_t i = 0; i < array->length; i ++) {
+            delete array->slots[i];
+        }
+        free_array(array);
+    }
+
+    template<class T> typename IdTable<T>::Array *IdTable<T>::new_array(uint32_t length) {
+        Array *a = new Array;
+        a->length = length;
+        a->slots = new shared_ptr<T> *volatile[length];
+        for(uint32_t i = 0; i < length; i ++) {
+            a->slots[i] = nullptr;
+        }
+        return a;
+    }
+
+    template<class T> void IdTable<T>::free_array(void *array) {
+        Array *a = (Array *)array;
+        delete[] a->slots;
+        delete a;
+    }
+
+    template<class T> void IdTable<T>::free_slot(void *slot) {
+        delete (shared_ptr<T> *)slot;
+    }
+
+    template<class T> shared_ptr<T> IdTable<T>::get(uint32_t id) const {
+        shared_ptr<T> found;
+
+        uint32_t flags = rcu::read_lock();
+        Array *a = array;
+        if(id < a->length) {
+            shared_ptr<T> *slot = a->slots[id];
+            if(slot) {
+                found = *slot;
+            }
+        }
+        rcu::read_unlock(flags);
+
+        return found;
+    }
+
+    template<class T> void IdTable<T>::set(uint32_t id, shared_ptr<T> value) {
+        shared_ptr<T> *slot = new shared_ptr<T>(move(value));
+        shared_ptr<T> *old_slot;
+        Array *old_array = nullptr;
+
+        uint32_t eflags = push_cli();
+        lock.lock();
+        if(id >= array->length) {
+            uint32_t length = array->length;
+            while(id >= length) {
+                length *= 2;
+            }
+
+            Array *grown = new_array(length);
+            for(uint32_t i = 0; i < array->length; i ++) {
+                grown->slots[i] = array->slots[i];
+            }
+
+            // The new array must be filled in before readers can see it
+            __sync_synchronize();
+            old_array = array;
+            array = grown;
+        }
+
+        old_slot = array->slots[id];
+        __sync_synchronize();
+        array->slots[id] = slot;
+        lock.unlock();
+        pop_flags(eflags);
+
+        // Both of these may still be being read by lookups on other CPUs
+        if(old_array) {
+            rcu::retire(&free_array, old_array);
+        }
+        if(old_slot) {
+            rcu::retire(&free_slot, old_slot);
+        }
+        rcu::reclaim();
+    }
+
+    template<class T> void IdTable<T>::remove(uint32_t id) {
+        shared_ptr<T> *old_slot = nullptr;
+
+        uint32_t eflags = push_cli();
+        lock.lock();
+        if(id < array->length) {
+            old_slot = array->slots[id];
+            array->slots[id] = nullptr;
+        }
+        lock.unlock();
+        pop_flags(eflags);
+
+        if(old_slot) {
+            rcu::retire(&free_slot, old_slot);
+        }
+        rcu::reclaim();
+    }
+}
@@ -0,0 +1,120 @@
+#ifndef _HPP_STRUCT_INTERVAL_TREE_
+#define _HPP_STRUCT_INTERVAL_TREE_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "main/common.hpp"
+
+/** Contains a tree of values indexed by ranges of numbers */
+namespace interval_tree {
+    /** A set of values, each associated with a half open interval `[start, end)`, which can be searched by position
+     *
+     * This is an AVL tree ordered by the start of each interval, where each node also stores the largest end of any
+     *  interval below it. This lets searches skip any subtree which ends before the position they are looking for, so
+     *  inserting, removing and finding a value all run in `O(log n)` time (plus the number of matching intervals).
+     *
+     * Intervals may overlap, and several may start at the same position. When more than one interval contains a
+     *  position, IntervalTree::find returns the one which was inserted most recently.
+     *
+     * This is not thread safe.
+     */
+    template<class T> class IntervalTree {
+    public:
+        IntervalTree() {};
+        ~IntervalTree();
+
+        IntervalTree(const IntervalTree &other) = delete;
+        IntervalTree &operator=(const IntervalTree &other) = delete;
+
+        /** Add a value to the tree
+         *
+         * @param start The first position in the interval
+         * @param end The position after the last one in the interval, this must be greater than start
+         * @param value The value
+         */
+        void insert(uint64_t start, uint64_t end, T value);
+        /** Find the value whose interval contains the given position
+         *
+         * If more than one does, the one added most recently is returned.
+         *
+         * @param position The position to look up
+         * @return A pointer to the value, or nullptr if no interval contains the position
+         */
+        T *find(uint64_t position);
+        /** Remove one value which starts at the given position
+         *
+         * @param start The start of the value's interval
+         * @param match A function taking a `T&` which returns true for the value to remove
+         * @return Whether a value was removed
+         */
+        template<class F> bool remove(uint64_t start, F match);
+        /** Call a function on every value whose interval overlaps `[start, end)`, in order of their starts
+         *
+         * The function must not change the tree.
+         *
+         * @param start The start of the range
+         * @param end The end of the range
+         * @param f A function taking the interval's start, its end and a `T&`
+         */
+        template<class F> void overlapping(uint64_t start, uint64_t end, F f);
+        /** Call a function on every value in the tree, in order of their starts
+         *
+         * The function must not change the tree.
+         *
+         * @param f A function taking the interval's start, its end and a `T&`
+         */
+        template<class F> void each(F f);
+        /** Remove every value from the tree */
+        void clear();
+
+        /** Returns the number of values in the tree
+         *
+         * @return The number of values
+         */
+        size_t size() const {
+            return count;
+        }
+        /** Returns whether there are no values in the tree
+         *
+         * @return Whether it is empty
+         */
+        bool empty() const {
+            return count == 0;
+        }
+
+    private:
+        struct Node {
+            uint64_t start;
+            uint64_t end;
+            uint64_t max_end; // The largest end of this node and everything below it
+            uint32_t sequence; // Larger for nodes that were inserted later
+            int32_t height;
+            Node *left;
+            Node *right;
+            T value;
+
+            Node(uint64_t start, uint64_t end, uint32_t sequence, T &&value) : start(start), end(end), max_end(end),
+                sequence(sequence), height(1), left(nullptr), right(nullptr), value(move(value)) {};
+        };
+
+        Node *root = nullptr;
+        size_t count = 0;
+        uint32_t next_sequence = 0;
+
+        static int32_t height(Node *node);
+        static void update(Node *node);
+        static Node *rotate_left(Node *node);
+        static Node *rotate_right(Node *node);
+        static Node *balance(Node *node);
+        static Node *insert_node(Node *root, Node *node);
+        static Node *remove_min(Node *root, Node *&min);
+        template<class F> static Node *remove_node(Node *root, uint64_t start, F &match, Node *&removed);
+        static void find_node(Node *root, uint64_t position, Node *&best);
+        template<class F> static void overlapping_nodes(Node *root, uint64_t start, uint64_t end, F &f);
+        static void delete_nodes(Node *root);
+    };
+}
+
+#include "structures/interval_tree.tpp"
+#endif
@@ -0,0 +1,204 @@
+namespace interval_tree {
+    template<class T> IntervalTree<T>::~IntervalTree() {
+        clear();
+    }
+
+    template<class T> int32_t IntervalTree<T>::height(Node *node) {
+        return node ? node->height : 0;
+    }
+
+    // Recalculates the height and max_end of a node from its children
+    template<class T> void IntervalTree<T>::update(Node *node) {
+        int32_t left = height(node->left);
+        int32_t right = height(node->right);
+
+        node->height = 1 + (left > right ? left : right);
+        node->max_end = node->end;
+        if(node->left && node->left->max_end > node->max_end) {
+            node->max_end = node->left->max_end;
+        }
+        if(node->right && node->right->max_end > node->max_end) {
+            node->max_end = node->right->max_end;
+        }
+    }
+
+    template<class T> typename IntervalTree<T>::Node *IntervalTree<T>::rotate_left(Node *node) {
+        Node *right = node->right;
+
+        node->right = right->left;
+        right->left = node;
+        update(node);
+        update(right);
+        return right;
+    }
+
+    template<class T> typename IntervalTree<T>::Node *IntervalTree<T>::rotate_right(Node *node) {
+        Node *left = node->left;
+
+        node->left = left->right;
+        left->right = node;
+        update(node);
+        update(left);
+        return left;
+    }
+
+    // Updates a node whose children have changed, and rotates it if they now differ in height by more than one
+    template<class T> typename IntervalTree<T>::Node *IntervalTree<T>::balance(Node *node) {
+        update(node);
+        int32_t diff = height(node->left) - height(node->right);
+
+        if(diff > 1) {
+            if(height(node->left->left) < height(node->left->right)) {
+                node->left = rotate_left(node->left);
+            }
+            return rotate_right(node);
+        }else if(diff < -1) {
+            if(height(node->right->right) < height(node->right->left)) {
+                node->right = rotate_right(node->right);
+            }
+            return rotate_left(node);
+        }
+
+        return node;
+    }
+
+    template<class T> typename IntervalTree<T>::Node *IntervalTree<T>::insert_node(Node *root, Node *node) {
+        if(!root) {
+            return node;
+        }
+
+        if(node->start < root->start) {
+            root->left = insert_node(root->left, node);
+        }else{
+            root->right = insert_node(root->right, node);
+        }
+        return balance(root);
+    }
+
+    template<class T> typename IntervalTree<T>::Node *IntervalTree<T>::remove_min(Node *root, Node *&min) {
+        if(!root->left) {
+            min = root;
+            return root->right;
+        }
+
+        root->left = remove_min(root->left, min);
+        return balance(root);
+    }
+
+    template<class T> template<class F> typename IntervalTree<T>::Node *IntervalTree<T>::remove_node(Node *root,
+    uint64_t start, F &match, Node *&removed) {
+        if(!root) {
+            return nullptr;
+        }
+
+        if(start < root->start) {
+            root->left = remove_node(root->left, start, match, removed);
+        }else if(start > root->start) {
+            root->right = remove_node(root->right, start, match, removed);
+        }else if(match(root->value)) {
+            Node *left = root->left;
+            Node *right = root->right;
+            Node *min;
+
+            removed = root;
+            if(!right) {
+                return left;
+            }
+
+            // Replace it with the first node after it
+            right = remove_min(right, min);
+            min->left = left;
+            min->right = right;
+            return balance(min);
+        }else{
+            // Rotations can leave intervals with the same start on either side
+            root->left = remove_node(root->left, start, match, removed);
+            if(!removed) {
+                root->right = remove_node(root->right, start, match, removed);
+            }
+        }
+
+        return balance(root);
+    }
+
+    template<class T> void IntervalTree<T>::find_node(Node *root, uint64_t position, Node *&best) {
+        while(root && root->max_end > position) {
+            find_node(root->left, position, best);
+
+            if(root->start > position) {
+                // Everything to the right starts after it too
+                return;
+            }
+            if(position < root->end && (!best || root->sequence > best->sequence)) {
+                best = root;
+            }
+            root = root->right;
+        }
+    }
+
+    template<class T> template<class F> void IntervalTree<T>::overlapping_nodes(Node *root, uint64_t start,
+    uint64_t end, F &f) {
+        while(root && root->max_end > start) {
+            overlapping_nodes(root->left, start, end, f);
+
+            if(root->start >= end) {
+                return;
+            }
+            if(root->end > start) {
+                f(root->start, root->end, root->value);
+            }
+            root = root->right;
+        }
+    }
+
+    template<class T> void IntervalTree<T>::delete_nodes(Node *root) {
+        while(root) {
+            Node *right = root->right;
+            delete_nodes(root->left);
+            delete root;
+            root = right;
+        }
+    }
+
+
+    template<class T> void IntervalTree<T>::insert(uint64_t start, uint64_t end, T value) {
+        Node *node = new Node(start, end, next_sequence ++, move(value));
+
+        root = insert_node(root, node);
+        count ++;
+    }
+
+    template<class T> T *IntervalTree<T>::find(uint64_t position) {
+        Node *best = nullptr;
+
+        find_node(root, position, best);
+        return best ? &best->value : nullptr;
+    }
+
+    template<class T> template<class F> bool IntervalTree<T>::remove(uint64_t start, F match) {
+        Node *removed = nullptr;
+
+        root = remove_node(root, start, match, removed);
+        if(!removed) {
+            return false;
+        }
+
+        delete removed;
+        count --;
+        return true;
+    }
+
+    template<class T> template<class F> void IntervalTree<T>::overlapping(uint64_t start, uint64_t end, F f) {
+        overlapping_nodes(root, start, end, f);
+    }
+
+    template<class T> template<class F> void IntervalTree<T>::each(F f) {
+        overlapping_nodes(root, 0, UINT64_MAX, f);
+    }
+
+    template<class T> void IntervalTree<T>::clear() {
+        delete_nodes(root);
+        root = nullptr;
+        count = 0;
+    }
+}
@@ -52,6 +52,10 @@ public:
     public:
         Iterator(Entry* e) : entry(e) {}
         Iterator(const Iterator& e) : entry(e.entry) {}
+        Iterator& operator=(const Iterator& e) {
+            entry = e.entry;
+            return *this;
+        }
 
         T& operator*() const {return entry->object;}
         T* operator->() const {return &(entry->object);}
@@ -81,6 +85,10 @@ public:
     public:
         CIterator(const Entry* e) : entry(e) {}
         CIterator(const CIterator& e) : entry(e.entry) {}
+        CIterator& operator=(const CIterator& e) {
+            entry = e.entry;
+            return *this;
+        }
 
         const T& operator*() const {return entry->object;}
         const T* operator->() const {return &(entry->object);}
@@ -209,6 +217,15 @@ public:
      * @return A new iterator, pointing to the element following the deleted one
      */
     Iterator erase(Iterator pos);
+    /** Insert an item after the element that the iterator is pointing to
+     *
+     * If the iterator is end(), the item is added to the front of the list instead.
+     *
+     * @param pos The iterator to insert the item after
+     * @param value The item to add, which will be moved
+     * @return An iterator pointing to the new item
+     */
+    Iterator insert_after(Iterator pos, T&& value);
 
     /** Returns an iterator to the first element of the list
      *
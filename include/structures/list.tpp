@@ -173,6 +173,24 @@ template<class T> typename list<T>::Iterator list<T>::erase(list<T>::Iterator it
     panic("Tried to erase an iterator that isn't in the list");
 }
 
+template<class T> typename list<T>::Iterator list<T>::insert_after(list<T>::Iterator pos, T&& value) {
+    Entry *prev = pos.entry;
+
+    if(!prev) {
+        push_front(move(value));
+        return Iterator(head.get());
+    }
+
+    unique_ptr<Entry> insert = make_unique<Entry>(move(value));
+    insert->next = move(prev->next);
+    prev->next = move(insert);
+    if(tail == prev) {
+        tail = prev->next.get();
+    }
+    count ++;
+    return Iterator(prev->next.get());
+}
+
 template<class T> void list<T>::clear() {
     head = nullptr;
     tail = nullptr;
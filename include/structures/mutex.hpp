@@ -8,40 +8,94 @@
 
 #include "main/errno.h"
 
+namespace task {
+    class Thread;
+    class WaitQueue;
+}
+
 /** Contains a thread mutex
  */
 namespace mutex {
+    /** Print the contention statistics of every named mutex */
+    void dump_all();
+
+    /** Contention statistics for a single mutex */
+    struct stats_t {
+        uint64_t acquisitions; /**< The number of times the mutex has been locked */
+        uint64_t contended; /**< How many of those found the mutex already locked */
+        uint64_t wait_cycles; /**< The number of TSC cycles spent waiting for the mutex while it was contended */
+    };
+
     /** Implementation of a mutex, supporting lock, trylock and unlock.
      *
-     * These mutexes must only be used in a thread.
+     * A thread that finds the mutex locked spins for a while if the owner is running on another CPU (since it will
+     *  probably unlock it soon), and otherwise sleeps until the mutex is handed to it. When a mutex with sleeping threads
+     *  is unlocked, it stays locked and ownership passes directly to the thread that has been waiting the longest.
+     *
+     * If interrupts are disabled, or the mutex is locked outside of a thread, it is busy-waited on instead.
+     *
+     * Mutexes given a name are added to a list of mutexes whose statistics are printed by mutex::dump_all.
      */
     class Mutex {
     public:
+        /** The number of times to spin waiting for an owner running on another CPU before sleeping */
+        static const uint32_t SPIN_LIMIT = 1000;
+
         /** Create a new Mutex */
         Mutex();
+        /** Create a new named Mutex, which will be included in mutex::dump_all
+         *
+         * @param name The name of the mutex, which must remain valid for as long as the mutex does
+         */
+        Mutex(const char *name);
+        /** Create a new, unlocked Mutex; the lock state, name and statistics of the other mutex are not copied */
+        Mutex(const Mutex &other) : Mutex() {};
+        Mutex &operator=(const Mutex &other) = delete;
+        ~Mutex();
 
         /** Gets a lock on the mutex, or blocks
          *
          * If the mutex is already locked, this blocks until the lock is released.
          *
-         * TODO: This is currently implemented as a while(true) loop, it should be changed to thread yielding.
-         *
          * @return EOK when we get the lock
          */
         int lock();
+        /** Gets a lock on the mutex, or gives up after a timeout
+         *
+         * @param timeout The maximum number of nanoseconds to wait for
+         * @return EOK when we get the lock, or ETIMEDOUT if the timeout expired first
+         */
+        int lock_for(uint64_t timeout);
         /** Gets a lock on the mutex, or returns EBUSY
          *
          * @return EOK when the mutex is locked or EBUSY if is already locked
          */
         int trylock();
         /** Unlock a previously locked mutex
+         *
+         * If any threads are sleeping on the mutex, the one that has been waiting the longest becomes its owner.
          *
          * @return EOK
          */
         int unlock();
 
+        /** Print the name and contention statistics of this mutex */
+        void dump() const;
+
+        const char *name; /**< The name of the mutex, or nullptr if it has none */
+        stats_t stats; /**< Contention statistics, only updated while the mutex is locked */
+
     private:
         volatile bool flag;
+        task::Thread *volatile owner;
+        task::WaitQueue *volatile waiters;
+        Mutex *next_named;
+
+        bool acquire(task::Thread *thread);
+        bool sleep(task::Thread *thread, bool timed, uint64_t deadline);
+        int lock(bool timed, uint64_t deadline);
+
+        friend void dump_all();
     };
 }
 
@@ -0,0 +1,133 @@
+#ifndef _HPP_STRUCT_RADIX_TREE_
+#define _HPP_STRUCT_RADIX_TREE_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "main/common.hpp"
+
+/** Contains a tree of values indexed by 32 bit keys */
+namespace radix_tree {
+    /** A set of values, each with a unique 32 bit key, which can be searched for the nearest key to a given one
+     *
+     * Keys are split into groups of RadixTree::BITS bits, and each group (most significant first) picks which child of
+     *  a node to go down to. Values are stored in the nodes on the bottom level. Every node has a bitmap of which of
+     *  its children are present, so finding the next key before or after a position looks at one word per level rather
+     *  than every child.
+     *
+     * The tree is only as tall as it needs to be to hold the largest key in it. Finding, inserting and removing a key,
+     *  and finding the keys either side of a position, all run in `O(log k)` time for the largest key `k` no matter
+     *  how many values there are.
+     *
+     * This is not thread safe.
+     */
+    template<class T> class RadixTree {
+    public:
+        /** How many bits of the key each level of the tree uses */
+        static const uint32_t BITS = 5;
+        /** How many children each node has */
+        static const uint32_t FANOUT = 1 << BITS;
+
+        RadixTree() {};
+        ~RadixTree();
+
+        RadixTree(const RadixTree &other) = delete;
+        RadixTree &operator=(const RadixTree &other) = delete;
+
+        /** Add a value to the tree, replacing the value with the same key if there is one
+         *
+         * @param key The key
+         * @param value The value
+         * @return A pointer to the value in the tree
+         */
+        T *insert(uint32_t key, T value);
+        /** Find the value with the given key
+         *
+         * @param key The key
+         * @return A pointer to the value, or nullptr if there isn't one
+         */
+        T *find(uint32_t key);
+        /** Find the value with the largest key which is less than or equal to the given one
+         *
+         * @param key The key to search from
+         * @param found Set to the key of the value, if one is found
+         * @return A pointer to the value, or nullptr if every key is greater than `key`
+         */
+        T *find_before(uint32_t key, uint32_t &found);
+        /** Find the value with the smallest key which is greater than or equal to the given one
+         *
+         * @param key The key to search from
+         * @param found Set to the key of the value, if one is found
+         * @return A pointer to the value, or nullptr if every key is less than `key`
+         */
+        T *find_after(uint32_t key, uint32_t &found);
+        /** Remove the value with the given key
+         *
+         * @param key The key
+         * @return Whether a value was removed
+         */
+        bool remove(uint32_t key);
+        /** Call a function on every value whose key is in `[first, end)`, in order of their keys
+         *
+         * The function may insert and remove values; ones inserted after the current key will be visited too.
+         *
+         * @param first The first key
+         * @param end The key after the last one
+         * @param f A function taking the key and a `T&`
+         */
+        template<class F> void range(uint32_t first, uint64_t end, F f);
+        /** Call a function on every value in the tree, in order of their keys
+         *
+         * @param f A function taking the key and a `T&`
+         */
+        template<class F> void each(F f);
+        /** Remove every value from the tree */
+        void clear();
+
+        /** Returns the number of values in the tree
+         *
+         * @return The number of values
+         */
+        size_t size() const {
+            return count;
+        }
+        /** Returns whether there are no values in the tree
+         *
+         * @return Whether it is empty
+         */
+        bool empty() const {
+            return count == 0;
+        }
+
+    private:
+        // Levels are numbered from the bottom, starting at 1. Nodes on level 1 are Leafs, all the others are Nodes.
+        // Neither is ever left empty; a node is deleted as soon as its last child is removed.
+        struct Node {
+            uint32_t present = 0; // Bit `n` is set if children[n] is
+            void *children[FANOUT];
+        };
+        struct Leaf {
+            uint32_t present = 0; // Bit `n` is set if the value in slot `n` has been constructed
+            alignas(T) uint8_t storage[sizeof(T) * FANOUT];
+
+            T *value(uint32_t slot) {
+                return (T *)storage + slot;
+            }
+        };
+
+        void *root = nullptr;
+        uint32_t height = 0;
+        size_t count = 0;
+
+        static uint32_t slot(uint32_t key, uint32_t level);
+        static uint32_t low_bits(uint32_t level);
+        bool covers(uint32_t key) const;
+        static T *last(void *node, uint32_t level, uint32_t key, uint32_t &found);
+        static T *first(void *node, uint32_t level, uint32_t key, uint32_t &found);
+        bool remove_key(void *node, uint32_t level, uint32_t key);
+        static void delete_nodes(void *node, uint32_t level);
+    };
+}
+
+#include "structures/radix_tree.tpp"
+#endif
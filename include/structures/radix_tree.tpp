@@ -0,0 +1,264 @@
+namespace radix_tree {
+    template<class T> RadixTree<T>::~RadixTree() {
+        clear();
+    }
+
+    // The index of the child to use for the key on the given level
+    template<class T> uint32_t RadixTree<T>::slot(uint32_t key, uint32_t level) {
+        return (key >> (BITS * (level - 1))) & (FANOUT - 1);
+    }
+
+    // A mask of the bits of a key which are used by the given level and the ones below it
+    template<class T> uint32_t RadixTree<T>::low_bits(uint32_t level) {
+        uint64_t bits = BITS * level;
+        return bits >= 32 ? UINT32_MAX : (1u << bits) - 1;
+    }
+
+    // Whether the key fits in the tree without adding more levels
+    template<class T> bool RadixTree<T>::covers(uint32_t key) const {
+        return height && (key & ~low_bits(height)) == 0;
+    }
+
+    // The value with the largest key <= key below the node, which must be on the given level
+    template<class T> T *RadixTree<T>::last(void *node, uint32_t level, uint32_t key, uint32_t &found) {
+        uint32_t s = slot(key, level);
+        uint32_t at_or_below = (2u << s) - 1;
+
+        if(level == 1) {
+            Leaf *leaf = (Leaf *)node;
+            uint32_t mask = leaf->present & at_or_below;
+
+            if(!mask) {
+                return nullptr;
+            }
+            s = 31 - __builtin_clz(mask);
+            found = (key & ~(FANOUT - 1)) | s;
+            return leaf->value(s);
+        }
+
+        Node *inner = (Node *)node;
+        if(inner->present & (1u << s)) {
+            T *in_child = last(inner->children[s], level - 1, key, found);
+            if(in_child) {
+                return in_child;
+            }
+        }
+
+        // Nothing in that child, so it's the largest key in the closest child before it
+        uint32_t mask = inner->present & (at_or_below >> 1);
+        if(!mask) {
+            return nullptr;
+        }
+        s = 31 - __builtin_clz(mask);
+        key = (key & ~low_bits(level)) | (s << (BITS * (level - 1))) | low_bits(level - 1);
+        return last(inner->children[s], level - 1, key, found);
+    }
+
+    // The value with the smallest key >= key below the node, which must be on the given level
+    template<class T> T *RadixTree<T>::first(void *node, uint32_t level, uint32_t key, uint32_t &found) {
+        uint32_t s = slot(key, level);
+        uint32_t below = (1u << s) - 1;
+
+        if(level == 1) {
+            Leaf *leaf = (Leaf *)node;
+            uint32_t mask = leaf->present & ~below;
+
+            if(!mask) {
+                return nullptr;
+            }
+            s = __builtin_ctz(mask);
+            found = (key & ~(FANOUT - 1)) | s;
+            return leaf->value(s);
+        }
+
+        Node *inner = (Node *)node;
+        if(inner->present & (1u << s)) {
+            T *in_child = first(inner->children[s], level - 1, key, found);
+            if(in_child) {
+                return in_child;
+            }
+        }
+
+        // Nothing in that child, so it's the smallest key in the closest child after it
+        uint32_t mask = inner->present & ~((below << 1) | 1);
+        if(!mask) {
+            return nullptr;
+        }
+        s = __builtin_ctz(mask);
+        key = (key & ~low_bits(level)) | (s << (BITS * (level - 1)));
+        return first(inner->children[s], level - 1, key, found);
+    }
+
+    // Removes the key from below the node, the node itself is left for the caller to delete if it is now empty
+    template<class T> bool RadixTree<T>::remove_key(void *node, uint32_t level, uint32_t key) {
+        uint32_t s = slot(key, level);
+
+        if(level == 1) {
+            Leaf *leaf = (Leaf *)node;
+
+            if(!(leaf->present & (1u << s))) {
+                return false;
+            }
+            leaf->value(s)->~T();
+            leaf->present &= ~(1u << s);
+            return true;
+        }
+
+        Node *inner = (Node *)node;
+        if(!(inner->present & (1u << s)) || !remove_key(inner->children[s], level - 1, key)) {
+            return false;
+        }
+
+        // Nodes below this are always Nodes or Leafs, but present is the first member of both
+        if(!((Node *)inner->children[s])->present) {
+            delete_nodes(inner->children[s], level - 1);
+            inner->present &= ~(1u << s);
+        }
+        return true;
+    }
+
+    template<class T> void RadixTree<T>::delete_nodes(void *node, uint32_t level) {
+        if(level == 1) {
+            Leaf *leaf = (Leaf *)node;
+
+            for(uint32_t mask = leaf->present; mask; mask &= mask - 1) {
+                leaf->value(__builtin_ctz(mask))->~T();
+            }
+            delete leaf;
+            return;
+        }
+
+        Node *inner = (Node *)node;
+        for(uint32_t mask = inner->present; mask; mask &= mask - 1) {
+            delete_nodes(inner->children[__builtin_ctz(mask)], level - 1);
+        }
+        delete inner;
+    }
+
+
+    template<class T> T *RadixTree<T>::insert(uint32_t key, T value) {
+        if(!root) {
+            root = new Leaf;
+            height = 1;
+        }
+
+        // Add levels on top until the key fits
+        while(!covers(key)) {
+            Node *above = new Node;
+            above->present = 1;
+            above->children[0] = root;
+            root = above;
+            height ++;
+        }
+
+        void *node = root;
+        for(uint32_t level = height; level > 1; level --) {
+            Node *inner = (Node *)node;
+            uint32_t s = slot(key, level);
+
+            if(!(inner->present & (1u << s))) {
+                inner->children[s] = level == 2 ? (void *)new Leaf : (void *)new Node;
+                inner->present |= 1u << s;
+            }
+            node = inner->children[s];
+        }
+
+        Leaf *leaf = (Leaf *)node;
+        uint32_t s = slot(key, 1);
+        if(leaf->present & (1u << s)) {
+            *leaf->value(s) = move(value);
+        }else{
+            new (leaf->value(s)) T(move(value));
+            leaf->present |= 1u << s;
+            count ++;
+        }
+        return leaf->value(s);
+    }
+
+    template<class T> T *RadixTree<T>::find(uint32_t key) {
+        if(!covers(key)) {
+            return nullptr;
+        }
+
+        void *node = root;
+        for(uint32_t level = height; level > 1; level --) {
+            Node *inner = (Node *)node;
+            uint32_t s = slot(key, level);
+
+            if(!(inner->present & (1u << s))) {
+                return nullptr;
+            }
+            node = inner->children[s];
+        }
+
+        Leaf *leaf = (Leaf *)node;
+        uint32_t s = slot(key, 1);
+        return (leaf->present & (1u << s)) ? leaf->value(s) : nullptr;
+    }
+
+    template<class T> T *RadixTree<T>::find_before(uint32_t key, uint32_t &found) {
+        if(!root) {
+            return nullptr;
+        }
+
+        if(!covers(key)) {
+            key = low_bits(height);
+        }
+        return last(root, height, key, found);
+    }
+
+    template<class T> T *RadixTree<T>::find_after(uint32_t key, uint32_t &found) {
+        if(!covers(key)) {
+            return nullptr;
+        }
+
+        return first(root, height, key, found);
+    }
+
+    template<class T> bool RadixTree<T>::remove(uint32_t key) {
+        if(!covers(key) || !remove_key(root, height, key)) {
+            return false;
+        }
+        count --;
+
+        if(!((Node *)root)->present) {
+            delete_nodes(root, height);
+            root = nullptr;
+            height = 0;
+            return true;
+        }
+
+        // Drop levels off the top while they aren't needed
+        while(height > 1 && ((Node *)root)->present == 1) {
+            Node *old = (Node *)root;
+            root = old->children[0];
+            delete old;
+            height --;
+        }
+        return true;
+    }
+
+    template<class T> template<class F> void RadixTree<T>::range(uint32_t first, uint64_t end, F f) {
+        uint32_t key;
+
+        for(T *value = find_after(first, key); value && key < end; value = find_after(key + 1, key)) {
+            f(key, *value);
+            if(key == UINT32_MAX) {
+                return;
+            }
+        }
+    }
+
+    template<class T> template<class F> void RadixTree<T>::each(F f) {
+        range(0, (uint64_t)UINT32_MAX + 1, f);
+    }
+
+    template<class T> void RadixTree<T>::clear() {
+        if(root) {
+            delete_nodes(root, height);
+        }
+        root = nullptr;
+        height = 0;
+        count = 0;
+    }
+}
@@ -7,15 +7,91 @@
 #include "main/panic.hpp"
 
 namespace shared_ptr_ns {
+/** The use count shared by every shared_ptr owning the same object
+ *
+ * `destroy` is called with it when the count reaches 0, and knows how the object (and this) were allocated.
+ */
 struct Data {
-    uint32_t uses = 1;
+    volatile uint32_t uses;
+    void (*destroy)(Data *data);
+
+    Data(uint32_t uses, void (*destroy)(Data *data)) : uses(uses), destroy(destroy) {};
+};
+
+// The use count of an object that was allocated by itself, such as one passed to shared_ptr's constructor
+template<class T> struct SeparateData : public Data {
+    T *object;
+
+    SeparateData(T *object) : Data(1, &SeparateData::destroy_separate), object(object) {};
+
+    static void destroy_separate(Data *data) {
+        SeparateData *self = (SeparateData *)data;
+        delete self->object;
+        delete self;
+    }
+};
+
+// The use count of an object created by make_shared, which is allocated together with it
+template<class T> struct InlineData : public Data {
+    alignas(T) uint8_t storage[sizeof(T)];
+
+    InlineData() : Data(1, &InlineData::destroy_inline) {};
+
+    T *get() {
+        return (T *)storage;
+    }
+
+    static void destroy_inline(Data *data) {
+        InlineData *self = (InlineData *)data;
+        self->get()->~T();
+        delete self;
+    }
+};
+
+/** A base class for objects which carry their own use count, so that shared_ptrs to them never allocate anything
+ *
+ * This is for objects which shared_ptrs are made to very often, such as task::Thread. make_shared allocates only the
+ *  object itself, and a shared_ptr can be made from a raw pointer to one (such as `this`) at any time; it shares
+ *  ownership with any other shared_ptrs to the object, rather than taking it over.
+ *
+ * The object must have been allocated with `new` (or make_shared). It is deleted through the type of the first
+ *  shared_ptr that was made to it, so if that is a base class, its destructor must be virtual.
+ */
+class RefCounted {
+public:
+    RefCounted() : refs(0, nullptr) {};
+    // The count belongs to the object, not its value
+    RefCounted(const RefCounted &other) : refs(0, nullptr) {};
+    RefCounted &operator=(const RefCounted &other) {
+        return *this;
+    }
+
+private:
+    Data refs;
+
+    template<class T> friend class shared_ptr;
+
+    template<class T> static void destroy_intrusive(Data *data) {
+        // refs is the only member, so it is at the start of the RefCounted; this is only called if T is derived from it
+        delete (T *)(RefCounted *)data;
+    }
 };
 
+// Only used in decltype, to pick between the overloads for RefCounted and other objects at compile time
+cpp::true_type _ref_counted_tag(const volatile RefCounted *ref);
+cpp::false_type _ref_counted_tag(const volatile void *ref);
+
 /** A smart pointer where multiple own and manage a single object, deleting it when all shared_ptrs goes out of scope
  *
  * Multiple shared_ptrs can own the same object, and the object is deleted only when there are no more shared_ptrs
  *  owning it (e.g., when the last one is deleted or falls out of scope).
  *
+ * As in C++11, the use count is updated atomically, so different shared_ptrs owning the same object can be copied and
+ *  destroyed on different CPUs at the same time. A single shared_ptr object is not thread safe.
+ *
+ * Like `std::make_shared`, make_shared allocates the use count and the object together. Objects of classes derived
+ *  from RefCounted keep the count themselves instead.
+ *
  * This is an implementation of shared_ptr from C++11, with the following differences:
  * * A custom deleter is not yet supported.
  * * Pointer comparsions are not yet supported.
@@ -26,14 +102,12 @@ public:
      */
     shared_ptr() : ref(nullptr), data(nullptr) {};
     /** Create a new shared_ptr owning `ref`
+     *
+     * If T is derived from RefCounted, this shares ownership with any other shared_ptrs to the object.
      *
      * @param ref The pointer to own
      */
-    shared_ptr(T *ref) : ref(ref) {
-        if(ref) {
-            data = new Data();
-        }
-    };
+    shared_ptr(T *ref) : ref(ref), data(adopt(ref)) {};
     /** Create a new shared_ptr managing the shared resource from the given shared_ptr
      *
      * @param other The other shared_ptr to share from
@@ -41,7 +115,7 @@ public:
     template<class U> shared_ptr(const shared_ptr<U>& other) : ref(other.ref) {
         data = other.data;
         if(ref) {
-            data->uses ++;
+            __sync_fetch_and_add(&data->uses, 1);
         }
     }
     /** Create a new shared_ptr from the given shared_ptr
@@ -60,7 +134,7 @@ public:
      */
     shared_ptr(const shared_ptr& other) : ref(other.ref), data(other.data) {
         if(ref) {
-            data->uses ++;
+            __sync_fetch_and_add(&data->uses, 1);
         }
     }
     /** Create a new shared_ptr from the given shared_ptr
@@ -130,7 +204,7 @@ public:
     void swap(shared_ptr<T>& other);
     /** Returns the number of shared_ptrs sharing the resource */
     uint32_t use_count() {
-        return data->uses;
+        return data ? data->uses : 0;
     }
 
     /** Returns the managed object */
@@ -169,11 +243,20 @@ private:
     Data *data;
 
     void decrement_usage(); // Also deletes if appropriate
+    static Data *adopt(T *ref); // Returns the use count of a newly owned pointer
+    static Data *adopt(T *ref, cpp::true_type intrusive);
+    static Data *adopt(T *ref, cpp::false_type intrusive);
+    // make_shared for RefCounted and other objects
+    template<class... Args> static shared_ptr make(cpp::true_type intrusive, Args&&... args);
+    template<class... Args> static shared_ptr make(cpp::false_type intrusive, Args&&... args);
+
+    template<class U, class... Args> friend shared_ptr<U> make_shared(Args&&... args);
 };
 
 /** Creates a shared_ptr managing a newly created and allocated T
  *
- * The constructor for T will be called as appropriate depending on `args`.
+ * The constructor for T will be called as appropriate depending on `args`. The object and its use count are allocated
+ *  with a single call to kmalloc.
  *
  * @param args The arguments to pass through to T's constructor.
  * @return A shared_ptr to the newly allocated object.
@@ -8,17 +8,36 @@ template<class T> shared_ptr<T>::~shared_ptr() {
 
 template<class T> void shared_ptr<T>::decrement_usage() {
     if(ref) {
-        data->uses --;
-        if(!data->uses) {
-            delete ref;
-            delete data;
+        if(!__sync_sub_and_fetch(&data->uses, 1)) {
+            data->destroy(data);
         }
     }
 }
 
+template<class T> Data *shared_ptr<T>::adopt(T *ref) {
+    if(!ref) {
+        return nullptr;
+    }
+
+    return adopt(ref, decltype(_ref_counted_tag(ref))());
+}
+
+template<class T> Data *shared_ptr<T>::adopt(T *ref, cpp::true_type intrusive) {
+    Data *data = &((RefCounted *)ref)->refs;
+    if(!data->destroy) {
+        data->destroy = &RefCounted::destroy_intrusive<T>;
+    }
+    __sync_fetch_and_add(&data->uses, 1);
+    return data;
+}
+
+template<class T> Data *shared_ptr<T>::adopt(T *ref, cpp::false_type intrusive) {
+    return new SeparateData<T>(ref);
+}
+
 template<class T> shared_ptr<T>& shared_ptr<T>::operator=(shared_ptr<T>& r) {
     if(r.ref) {
-        r.data->uses ++;
+        __sync_fetch_and_add(&r.data->uses, 1);
     }
     decrement_usage();
 
@@ -50,7 +69,7 @@ template<class T> void shared_ptr<T>::reset(T *ptr) {
     decrement_usage();
 
     ref = ptr;
-    data = new Data();
+    data = adopt(ptr);
 }
 
 template<class T> void shared_ptr<T>::swap(shared_ptr<T>& other) {
@@ -64,7 +83,22 @@ template<class T> void shared_ptr<T>::swap(shared_ptr<T>& other) {
 }
 
 
-template<class T, class... Args> shared_ptr<T> make_shared(Args&&... args) {
+template<class T> template<class... Args>
+shared_ptr<T> shared_ptr<T>::make(cpp::true_type intrusive, Args&&... args) {
     return shared_ptr<T>(new T(cpp::forward<Args>(args)...));
 }
+
+template<class T> template<class... Args>
+shared_ptr<T> shared_ptr<T>::make(cpp::false_type intrusive, Args&&... args) {
+    shared_ptr<T> ptr;
+    InlineData<T> *block = new InlineData<T>();
+    ptr.ref = new(block->storage) T(cpp::forward<Args>(args)...);
+    ptr.data = block;
+    return ptr;
+}
+
+
+template<class T, class... Args> shared_ptr<T> make_shared(Args&&... args) {
+    return shared_ptr<T>::make(decltype(_ref_counted_tag((T *)nullptr))(), cpp::forward<Args>(args)...);
+}
 }
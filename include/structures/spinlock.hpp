@@ -0,0 +1,122 @@
+#ifndef _H_STRUCTURES_SPINLOCK_
+#define _H_STRUCTURES_SPINLOCK_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "main/errno.h"
+#include "main/asm_utils.hpp"
+
+/** Contains locks that busy-wait, for use with interrupts disabled
+ *
+ * Unlike mutex::Mutex, these never sleep, and so can be used in interrupt handlers and in the scheduler. They must only
+ *  be held with interrupts disabled; otherwise an interrupt handler on the same CPU which takes the lock would wait
+ *  forever. spinlock::IrqSave and spinlock::McsIrqSave disable interrupts and take a lock for the length of a scope.
+ *
+ * Both locks are fair; CPUs get the lock in the order they started waiting for it.
+ */
+namespace spinlock {
+    /** A ticket lock
+     *
+     * Each CPU that wants the lock takes a ticket, and waits until that ticket is being served. Waiting CPUs only read
+     *  the lock, so the cache line is only written to when the lock changes hands.
+     */
+    class Spinlock {
+    public:
+        /** Create a new, unlocked Spinlock */
+        Spinlock() : serving(0), next(0) {};
+
+        /** Gets a lock on the spinlock, spinning until it is available
+         *
+         * @return EOK when we get the lock
+         */
+        int lock();
+        /** Gets a lock on the spinlock, or returns EBUSY
+         *
+         * @return EOK when the spinlock is locked or EBUSY if is already locked or other CPUs are waiting for it
+         */
+        int trylock();
+        /** Unlock a previously locked spinlock
+         *
+         * @return EOK
+         */
+        int unlock();
+
+    private:
+        volatile uint16_t serving;
+        volatile uint16_t next;
+    };
+
+    /** An MCS queue lock
+     *
+     * Each CPU waiting for the lock spins on its own McsLock::Node, which is passed to McsLock::lock and
+     *  McsLock::unlock. This means that only the next CPU in line is disturbed when the lock is released, which scales
+     *  better than Spinlock when many CPUs are contending for it.
+     */
+    class McsLock {
+    public:
+        /** A CPU's place in the queue, which must stay valid until the lock has been unlocked */
+        struct Node {
+            Node *volatile next;
+            volatile bool waiting;
+        };
+
+        /** Create a new, unlocked McsLock */
+        McsLock() : tail(nullptr) {};
+
+        /** Gets a lock on the lock, spinning until it is available
+         *
+         * @param node A node for this CPU to wait on
+         * @return EOK when we get the lock
+         */
+        int lock(Node &node);
+        /** Unlock a previously locked lock
+         *
+         * @param node The node that was passed to McsLock::lock
+         * @return EOK
+         */
+        int unlock(Node &node);
+
+    private:
+        Node *volatile tail;
+    };
+
+    /** Disables interrupts and locks a Spinlock, restoring both when it goes out of scope */
+    class IrqSave {
+    public:
+        IrqSave(Spinlock &spinlock) : spinlock(spinlock) {
+            eflags = push_cli();
+            spinlock.lock();
+        }
+
+        ~IrqSave() {
+            spinlock.unlock();
+            pop_flags(eflags);
+        }
+
+    private:
+        Spinlock &spinlock;
+        uint32_t eflags;
+    };
+
+    /** Disables interrupts and locks an McsLock, restoring both when it goes out of scope */
+    class McsIrqSave {
+    public:
+        McsIrqSave(McsLock &mcs) : mcs(mcs) {
+            eflags = push_cli();
+            mcs.lock(node);
+        }
+
+        ~McsIrqSave() {
+            mcs.unlock(node);
+            pop_flags(eflags);
+        }
+
+    private:
+        McsLock &mcs;
+        McsLock::Node node;
+        uint32_t eflags;
+    };
+}
+
+#endif
@@ -7,8 +7,49 @@
 
 #include "structures/shared_ptr.hpp"
 
-/** Contains a UTF-8 encoded string class */
+/** Contains a UTF-8 encoded string class, and functions for checking UTF-8 encoded text
+ *
+ * The functions that scan strings use SSE2 for long strings if it is available (see sse2_enabled), and work one byte
+ *  at a time otherwise.
+ */
 namespace utf8 {
+    /** Returns the length of the longest prefix of the given bytes which is valid UTF-8
+     *
+     * Valid UTF-8 is as defined by RFC 3629; overlong encodings, surrogates and code points above U+10FFFF are
+     *  invalid. A multibyte sequence which is cut off by the end of the buffer is also invalid.
+     *
+     * @param string The bytes to check
+     * @param length The number of bytes
+     * @return The number of bytes before the first invalid sequence, or `length` if they are all valid
+     */
+    size_t valid_length(const char *string, size_t length);
+    /** Returns whether the given bytes are valid UTF-8
+     *
+     * See valid_length for what is valid.
+     *
+     * @param string The bytes to check
+     * @param length The number of bytes
+     * @return Whether every byte is part of a valid UTF-8 sequence
+     */
+    bool valid(const char *string, size_t length);
+    /** Returns the number of code points in the given UTF-8 encoded bytes
+     *
+     * This counts the bytes which are not continuation bytes, so the result for invalid UTF-8 is not meaningful.
+     *
+     * @param string The bytes to count
+     * @param length The number of bytes
+     * @return The number of code points
+     */
+    size_t count_chars(const char *string, size_t length);
+    /** Returns the index of the first occurence of a byte in the given bytes
+     *
+     * @param string The bytes to search
+     * @param length The number of bytes
+     * @param c The byte to search for
+     * @return Its index, or Utf8::npos if it isn't there
+     */
+    size_t find_byte(const char *string, size_t length, char c);
+
     /** A string class, similar to std::string mapping UTF-8 encoded text
      *
      * A Utf8 instance contains a null-terminated character string, which is assumed to contain UTF-8 encoded text.
@@ -20,6 +61,12 @@ namespace utf8 {
      *
      * Utf8s are immutable; the strings they store should not be modified.
      *
+     * Strings of at most Utf8::SMALL_SIZE bytes that the Utf8 has to make (such as substrings) are stored inside the
+     *  Utf8 itself rather than in a kmalloced buffer, so creating them doesn't allocate any memory.
+     *
+     * Strings that are compared against each other often should be interned (see Utf8::intern). All interned copies of
+     *  the same string share one buffer, so they can be compared by just comparing pointers.
+     *
      * The Utf8 class is visible to the global scope.
      */
     class Utf8 {
@@ -78,7 +125,7 @@ namespace utf8 {
         uint32_t bytes() const;
         /** Returns the number of logical UTF-8 characters in the string
          *
-         * This is calculated on the spot, in O(n) time.
+         * This is calculated in O(n) time the first time it is called, and is cached after that.
          *
          * @return The number of characters in the string
          */
@@ -88,7 +135,8 @@ namespace utf8 {
          * If the length would result in the substring overruning the end of the source string, the rest of the string
          *  is taken instead.
          *
-         * This runs in O(n) time.
+         * This runs in O(n) time, and only allocates memory if the substring is longer than Utf8::SMALL_SIZE. Taking a
+         *  "substring" of the whole string returns a copy of this Utf8 in O(1) time.
          *
          * @param pos The position to start the substring at
          * @param len The number of bytes in the substring
@@ -96,6 +144,44 @@ namespace utf8 {
          */
         Utf8 substr(size_t pos, size_t len) const;
 
+        /** Returns whether this string is valid UTF-8
+         *
+         * See utf8::valid_length for what is valid. This runs in O(n) time.
+         *
+         * @return Whether the string is valid
+         */
+        bool valid() const;
+
+        /** Returns a hash of the string's contents
+         *
+         * Equal strings always have the same hash. This is calculated in O(n) time the first time it is called, and
+         *  is cached after that.
+         *
+         * @return The hash, which is never 0
+         */
+        uint32_t hash() const;
+
+        /** Returns an interned copy of this string
+         *
+         * There is one global table of interned strings, and every interned copy of a given string points to the same
+         *  buffer in it. Comparing two interned strings with Utf8::operator== only compares their pointers, so this
+         *  should be used for names that are compared against each other often (such as file names).
+         *
+         * The buffers in the intern table are never freed.
+         *
+         * Interning a string that is already in the table runs in O(n) time, without allocating or taking any locks.
+         *
+         * @return An interned Utf8 with the same contents as this one
+         */
+        Utf8 intern() const;
+        /** Returns whether this Utf8 was returned by Utf8::intern
+         *
+         * @return Whether the string is interned
+         */
+        bool interned() const {
+            return atom;
+        }
+
         /** Returns whether this string is empty (i.e. bytes() == 0)
          *
          * @return Whether the string is empty
@@ -184,7 +270,8 @@ namespace utf8 {
          *
          * Two Utf8s are equal iff they are the same length, and all bytes inside the strings are equal.
          *
-         * Comparing a string runs in O(n) time.
+         * Comparing a string runs in O(n) time, unless both strings are interned or their hashes have already been
+         *  calculated and differ, in which case it runs in O(1) time.
          */
         bool operator==(const Utf8& other) const;
         /** Compare this Utf8 with another
@@ -275,10 +362,20 @@ namespace utf8 {
          */
         static const size_t npos = -1;
 
+        /** The longest string, in bytes and excluding the null terminator, that can be stored inside a Utf8 */
+        static const size_t SMALL_SIZE = 15;
+
     private:
         shared_ptr_ns::shared_ptr<const char> string_ptr;
         const char *string;
         size_t byte_count = 0;
+        mutable uint32_t hash_value = 0; // 0 if it hasn't been calculated yet
+        mutable uint32_t char_count = npos; // npos if it hasn't been calculated yet
+        bool atom = false;
+        char small[SMALL_SIZE + 1];
+
+        void copy_from(const Utf8 &other);
+        char *reserve(size_t length);
     };
 }
 
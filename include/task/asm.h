@@ -4,8 +4,10 @@
 #include <stdint.h>
 
 void task_asm_entry_point();
+void task_asm_restore_full();
 void __attribute__((fastcall,noreturn)) task_asm_enter(uint32_t sp);
 int __attribute__((fastcall)) task_asm_yield(uint32_t sp);
 int __attribute__((fastcall)) task_asm_set_stack(uint32_t sp, void (*next)());
+void __attribute__((fastcall)) task_asm_switch(uint32_t *save_sp, uint32_t sp, uint32_t dir);
 
 #endif
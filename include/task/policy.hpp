@@ -0,0 +1,184 @@
+#ifndef _HPP_TASK_POLICY_
+#define _HPP_TASK_POLICY_
+
+#include <stdint.h>
+
+#include "main/common.hpp"
+#include "structures/list.hpp"
+#include "structures/shared_ptr.hpp"
+#include "task/task.hpp"
+
+/** Scheduling policies, which decide which runnable thread each CPU runs next and for how long
+ *
+ * The scheduler (task::schedule) handles everything that doesn't depend on the policy: locking the per-CPU run queues,
+ *  moving threads between CPUs, idling, and measuring how long each thread runs for. The policy is only ever called with
+ *  the lock of the run queue it is given held and interrupts disabled, so it must not sleep or take other locks.
+ *
+ * Threads are never run on a CPU that isn't in their Thread::affinity mask; policies must not return one from
+ *  Policy::pick.
+ *
+ * The policy in use is changed with task::set_policy.
+ */
+namespace task {
+    /** The threads waiting to run on a single CPU, in whatever order that CPU's policy wants them run */
+    struct RunQueue {
+        list<shared_ptr<Thread>> threads; /**< The queued threads, not including the one that is running */
+        int64_t min_vruntime; /**< Never decreases, the vruntime that FairPolicy measures the queue's threads against */
+        bool running; /**< Whether the CPU is currently running a thread */
+        int64_t running_vruntime; /**< The vruntime of that thread when it started running */
+    };
+
+    /** Why a thread is being added to a run queue */
+    enum enqueue_reason_t {
+        ENQUEUE_WOKEN, /**< It has just been created, or was sleeping and has been woken */
+        ENQUEUE_PREEMPTED, /**< Its time slice ran out, or a thread that woke up preempted it */
+        ENQUEUE_YIELDED, /**< It called task::task_yield */
+    };
+
+    /** A scheduling policy
+     *
+     * Only Policy::enqueue and Policy::pick have to be implemented; the defaults for everything else give every thread
+     *  the same time slice and ignore how long threads have run for.
+     */
+    class Policy {
+    public:
+        const char *name; /**< The name of the policy, for debugging */
+
+        Policy(const char *name) : name(name) {};
+
+        /** Add a thread that has become runnable to a run queue
+         *
+         * @param queue The queue
+         * @param thread The thread
+         * @param reason Why it is being added
+         */
+        virtual void enqueue(RunQueue &queue, shared_ptr<Thread> thread, enqueue_reason_t reason) = 0;
+        /** Remove the thread that should be run next from a run queue
+         *
+         * @param queue The queue
+         * @param cpu The CPU that the thread will be run on, which may not be the queue's if it is stealing work
+         * @return The thread, or an empty pointer if no queued thread may run on that CPU
+         */
+        virtual shared_ptr<Thread> pick(RunQueue &queue, uint32_t cpu) = 0;
+        /** Remove a specific thread from a run queue, such as one that may no longer run on the queue's CPU
+         *
+         * @param queue The queue
+         * @param thread The thread
+         * @return The queue's pointer to the thread, or an empty pointer if it wasn't on the queue
+         */
+        virtual shared_ptr<Thread> remove(RunQueue &queue, Thread &thread);
+        /** Account for the time a thread has just spent running on the queue's CPU
+         *
+         * @param queue The queue
+         * @param thread The thread, which is not on the queue
+         * @param ns How long it ran for, in nanoseconds
+         */
+        virtual void charge(RunQueue &queue, Thread &thread, uint64_t ns);
+        /** Returns how long a thread that is about to be run may run before it is preempted
+         *
+         * @param queue The queue it was picked from
+         * @param thread The thread
+         * @return The length of its time slice, in nanoseconds
+         */
+        virtual uint64_t slice(RunQueue &queue, Thread &thread);
+        /** Returns true iff a thread that has just woken up should preempt the thread running on the queue's CPU
+         *
+         * This is called after the thread has been added to the queue, and only if the CPU is running a thread.
+         *
+         * @param queue The queue
+         * @param thread The thread that woke up
+         * @return Whether the running thread should be stopped so the queue's CPU can pick again
+         */
+        virtual bool preempts(RunQueue &queue, Thread &thread);
+        /** Prepare a thread that is being moved to another CPU to leave a queue's accounting
+         *
+         * The thread is not on the queue, it will be passed to Policy::attach for its new queue afterwards.
+         *
+         * @param queue The queue it is leaving
+         * @param thread The thread
+         */
+        virtual void detach(RunQueue &queue, Thread &thread);
+        /** Bring a thread which is new, or has been moved from another CPU, into a queue's accounting
+         *
+         * This is called before Policy::enqueue.
+         *
+         * @param queue The queue it is joining
+         * @param thread The thread
+         */
+        virtual void attach(RunQueue &queue, Thread &thread);
+
+    protected:
+        /** Remove and return the first thread in the queue that may run on the given CPU
+         *
+         * @param queue The queue
+         * @param cpu The CPU
+         * @return The thread, or an empty pointer if there are none
+         */
+        static shared_ptr<Thread> take_first(RunQueue &queue, uint32_t cpu);
+    };
+
+    /** Runs threads in the order they became runnable, each for a 1/lapic::SWITCHES_PER_SECOND second time slice
+     *
+     * Nice values are ignored.
+     */
+    class RoundRobinPolicy : public Policy {
+    public:
+        RoundRobinPolicy() : Policy("round robin") {};
+
+        void enqueue(RunQueue &queue, shared_ptr<Thread> thread, enqueue_reason_t reason) override;
+        shared_ptr<Thread> pick(RunQueue &queue, uint32_t cpu) override;
+    };
+
+    /** Shares each CPU between its threads in proportion to their weights, which depend on their nice values
+     *
+     * Each thread has a virtual runtime (Thread::vruntime), which is how long it has run for, scaled down by its weight.
+     *  The thread with the smallest virtual runtime is always run next, so a thread with twice the weight of another
+     *  gets to run twice as much. Each nice value is about 1.25 times the weight of the next one up.
+     *
+     * Virtual runtimes are kept relative to their queue's RunQueue::min_vruntime, so a thread that sleeps can't build up
+     *  credit to run for longer than everyone else when it wakes. Instead, waking threads are given a small bonus
+     *  (SLEEPER_CREDIT), which puts them ahead of threads that have been using the CPU and, if it is enough, preempts
+     *  the running thread. This keeps threads that mostly sleep (such as ones waiting for input) responsive while
+     *  threads that use as much CPU as they can are running.
+     *
+     * Threads that yield are put behind every other queued thread.
+     */
+    class FairPolicy : public Policy {
+    public:
+        /** The weight of a thread with a nice value of 0 */
+        static const uint32_t NICE_0_WEIGHT = 1024;
+        /** Every runnable thread should get to run at least once in this many nanoseconds */
+        static const uint64_t LATENCY = 6000000;
+        /** The shortest time slice a thread is given, in nanoseconds */
+        static const uint64_t MIN_GRANULARITY = 750000;
+        /** How far ahead of the running thread a waking thread's vruntime must be for it to preempt it */
+        static const uint64_t WAKEUP_GRANULARITY = 1000000;
+        /** How far behind the queue's min_vruntime a thread's vruntime may be put when it wakes up */
+        static const uint64_t SLEEPER_CREDIT = LATENCY / 2;
+
+        FairPolicy() : Policy("fair") {};
+
+        /** Returns the weight of a thread with the given nice value
+         *
+         * @param nice The nice value, between NICE_MIN and NICE_MAX
+         * @return Its weight
+         */
+        static uint32_t weight(int8_t nice);
+
+        void enqueue(RunQueue &queue, shared_ptr<Thread> thread, enqueue_reason_t reason) override;
+        shared_ptr<Thread> pick(RunQueue &queue, uint32_t cpu) override;
+        void charge(RunQueue &queue, Thread &thread, uint64_t ns) override;
+        uint64_t slice(RunQueue &queue, Thread &thread) override;
+        bool preempts(RunQueue &queue, Thread &thread) override;
+        void detach(RunQueue &queue, Thread &thread) override;
+        void attach(RunQueue &queue, Thread &thread) override;
+
+    private:
+        void update_min(RunQueue &queue, int64_t vruntime);
+    };
+
+    extern RoundRobinPolicy round_robin_policy;
+    extern FairPolicy fair_policy;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _HPP_TASK_RCU_
+#define _HPP_TASK_RCU_
+
+#include <stdint.h>
+
+#include "main/asm_utils.hpp"
+
+/** Read-copy-update: lets shared structures be read without taking any locks
+ *
+ * Readers wrap their accesses in rcu::read_lock and rcu::read_unlock, which only disable interrupts, and so never block
+ *  or write to shared memory. Writers publish a new version of whatever they change, and then hand the old version to
+ *  rcu::retire rather than freeing it. It is then destroyed by rcu::reclaim once every CPU has passed through a
+ *  "quiescent state" (a call to task::schedule), after which no reader can still be using it.
+ *
+ * Read sections must not sleep or yield, and rcu::retire must not be called from inside one.
+ */
+namespace rcu {
+    /** The number of objects that have been retired, but not yet destroyed */
+    extern volatile uint32_t pending;
+
+    /** Start a read section
+     *
+     * @return A value to pass to rcu::read_unlock
+     */
+    static inline uint32_t read_lock() {
+        return push_cli();
+    }
+    /** End a read section, after which nothing read inside it may be used
+     *
+     * @param flags The value returned by rcu::read_lock
+     */
+    static inline void read_unlock(uint32_t flags) {
+        pop_flags(flags);
+    }
+
+    /** Record that the current CPU is outside any read section, called by the scheduler
+     *
+     * Interrupts must be disabled.
+     */
+    void quiescent();
+    /** Record that the current CPU is about to halt until an interrupt, called by the scheduler
+     *
+     * Idle CPUs may not take any interrupts for a long time, so rcu::reclaim wakes them up if it is waiting for them to
+     *  pass a quiescent state. Interrupts must be disabled.
+     */
+    void idle_enter();
+    /** Record that the current CPU has stopped halting, called by the scheduler
+     *
+     * Interrupts must be disabled.
+     */
+    void idle_exit();
+    /** Destroy an object once no reader can be using it
+     *
+     * The object must already be unreachable to new readers.
+     *
+     * @param destroy A function which destroys the object, it is called with `object` as its only argument
+     * @param object The object to destroy
+     */
+    void retire(void (*destroy)(void *), void *object);
+    /** Destroy every retired object that no reader can still be using
+     *
+     * This is called by writers after they retire objects, but may be called by anything that isn't in a read section.
+     */
+    void reclaim();
+}
+
+#endif
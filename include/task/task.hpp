@@ -3,24 +3,35 @@
 
 #include <stddef.h>
 
+#include "main/errno.h"
 #include "mem/vm.hpp"
 #include "mem/object.hpp"
 #include "mem/page.hpp"
 #include "structures/unique_ptr.hpp"
 #include "structures/list.hpp"
+#include "structures/id_table.hpp"
 #include "structures/shared_ptr.hpp"
+#include "structures/spinlock.hpp"
+#include "structures/utf8.hpp"
+#include "task/timer.hpp"
 
 namespace task {
     const uint32_t TASK_STACK_TOP = KERNEL_VM_BASE;
+    /** The nice value of the threads which get the largest share of the CPU */
+    const int8_t NICE_MIN = -20;
+    /** The nice value of the threads which get the smallest share of the CPU */
+    const int8_t NICE_MAX = 19;
 
     class Process;
     class Thread;
+    class WaitQueue;
+    class Policy;
 
     typedef uint32_t wchan_t;
 
     class Process {
     private:
-        list<shared_ptr<Thread>> threads;
+        id_table::IdTable<Thread> threads;
 
     public:
         uint32_t process_id;
@@ -29,12 +40,24 @@ namespace task {
         uint32_t thread_counter;
 
         Process(uint32_t owner, uint32_t group);
-        shared_ptr<Thread> new_thread(addr_logical_t entry_point);
+        /** Create a new thread in this process and make it runnable
+         *
+         * @param entry_point The address the thread starts running at
+         * @param copy If not nullptr, the thread's memory map starts as a copy-on-write clone of this map (see
+         *  vm::Map::clone) rather than being empty
+         * @return The new thread
+         */
+        shared_ptr<Thread> new_thread(addr_logical_t entry_point, vm::Map *copy = nullptr);
+        /** Look up one of this process' threads, this never blocks and is safe from interrupt handlers
+         *
+         * @param id The thread id
+         * @return The thread, or an empty pointer if it doesn't exist or has ended
+         */
         shared_ptr<Thread> get_thread(uint32_t id) const;
         void remove_thread(uint32_t id);
     };
 
-    class Thread {
+    class Thread : public shared_ptr_ns::RefCounted {
     public:
         shared_ptr<Process> process;
 
@@ -46,19 +69,245 @@ namespace task {
         shared_ptr<object::Object> stack;
         addr_logical_t stack_pointer;
 
-        wchan_t wchan;
+        WaitQueue *blocked_on; /**< The wait queue this thread is sleeping on, or nullptr if it can be run */
 
         bool in_use;
         bool ended;
 
-        Thread(shared_ptr<Process> process, addr_logical_t entry);
+        /** Between NICE_MIN and NICE_MAX, threads with lower values get a larger share of the CPU; see set_nice */
+        int8_t nice;
+        /** The CPUs this thread may run on; see set_affinity */
+        volatile cpu_mask_t affinity;
+        /** How long this thread has run for, scaled by its weight, used by the scheduling policy */
+        int64_t vruntime;
+        /** The clock::now_ns time at which the thread last started running */
+        uint64_t run_start;
+        /** The CPU whose run queue vruntime is measured against, or ~0 if it has never been on one */
+        uint32_t last_cpu;
+        /** Nanoseconds spent running, only changed by the scheduler while it holds its lock; use get_cpu_time */
+        uint64_t cpu_time;
+
+        Thread(shared_ptr<Process> process, addr_logical_t entry, vm::Map *copy = nullptr);
         ~Thread();
 
         void end();
-        void resume();
+        /** Change this thread's nice value, which takes effect from the next time it is put on a run queue
+         *
+         * @param nice The new nice value, which is clamped to between NICE_MIN and NICE_MAX
+         */
+        void set_nice(int32_t nice);
+        /** Change the CPUs this thread may run on
+         *
+         * If the thread is waiting on the run queue of a CPU it may no longer run on, it is moved to another. If it is
+         *  the current thread and the current CPU isn't in the mask, it yields so it can move.
+         *
+         * @param mask The CPUs it may run on
+         * @return EINVAL if none of the CPUs in the mask are online (and the affinity isn't changed), otherwise EOK
+         */
+        error_t set_affinity(cpu_mask_t mask);
+        /** Returns how long this thread has spent running, not including the time slice it is currently running in
+         *
+         * @return The thread's CPU time, in nanoseconds
+         */
+        uint64_t get_cpu_time();
+    };
+
+    /** Resumes the thread that created it once a given amount of time has passed
+     *
+     * This is used to give a sleeping thread a timeout. The timer is cancelled when the object is destroyed. Outside of a
+     *  thread (such as while the kernel is booting), Timeout::expired still becomes true, but nothing is woken.
+     */
+    class Timeout {
+    public:
+        /** Start a new timeout
+         *
+         * @param ns The number of nanoseconds until it expires
+         */
+        Timeout(uint64_t ns);
+        ~Timeout();
+        Timeout(const Timeout &other) = delete;
+        Timeout &operator=(const Timeout &other) = delete;
+
+        /** Returns true iff the timeout has expired
+         *
+         * @return Whether the time has passed
+         */
+        bool expired() const;
+
+    private:
+        uint64_t deadline;
+        volatile bool fired;
+        shared_ptr<Thread> thread;
+        timer::Timer timer;
+
+        static void expire(void *data);
+    };
+
+    /** A queue of threads which are sleeping until some event happens
+     *
+     * A thread that needs to wait for something (such as an interrupt) calls WaitQueue::wait_until with a condition, and
+     *  whatever makes that condition true then calls WaitQueue::wake_one or WaitQueue::wake_all. Sleeping threads are
+     *  not on any run queue, so the scheduler never picks them and CPUs with nothing else to do can halt.
+     *
+     * Waking threads is safe from interrupt handlers. If wait_until is called outside of a thread (such as while the
+     *  kernel is booting), it halts until an interrupt arrives instead of sleeping.
+     */
+    class WaitQueue {
+    private:
+        spinlock::Spinlock lock;
+        list<shared_ptr<Thread>> waiters;
+
+        bool prepare_wait();
+        bool cancel_wait();
+        void sleep();
+        static void halt();
+        shared_ptr<Thread> take_front();
+
+    public:
+        Utf8 name; /**< The name of this queue, for debugging */
+
+        /** Create a new, empty wait queue
+         *
+         * @param name The name of the queue
+         */
+        WaitQueue(Utf8 name) : name(move(name)) {};
+
+        /** Sleep until the next call to WaitQueue::wake_one or WaitQueue::wake_all that wakes this thread
+         *
+         * Unless whatever wakes the thread can only happen after this call, WaitQueue::wait_until should be used instead.
+         */
+        void wait();
+        /** Sleep until the given condition is true
+         *
+         * The condition is checked after the thread has been added to the queue, so a wakeup between checking it and
+         *  sleeping is never lost.
+         *
+         * @param condition A function which returns true when the thread should stop waiting
+         */
+        template<class F> void wait_until(F condition) {
+            while(!condition()) {
+                if(!prepare_wait()) {
+                    halt();
+                    continue;
+                }
+
+                if(condition()) {
+                    cancel_wait();
+                    return;
+                }
+
+                sleep();
+            }
+        }
+        /** Sleep until the given condition is true, or a timeout expires
+         *
+         * If the thread is taken off the queue by a waker at the same time as the timeout expires, it is treated as
+         *  having been woken, and the condition is checked again.
+         *
+         * @param condition A function which returns true when the thread should stop waiting
+         * @param timeout The maximum number of nanoseconds to wait for
+         * @return Whether the condition became true, which is false if the timeout expired
+         */
+        template<class F> bool wait_until(F condition, uint64_t timeout) {
+            Timeout t(timeout);
+
+            // The thread is never on the queue at the top of this loop
+            while(!condition()) {
+                if(t.expired()) {
+                    return false;
+                }
+
+                if(!prepare_wait()) {
+                    halt();
+                    continue;
+                }
+
+                if(condition() || t.expired()) {
+                    if(cancel_wait()) {
+                        return condition();
+                    }
+                    continue;
+                }
+
+                sleep();
+
+                // If it was the timeout that woke us, we are still on the queue
+                if(t.expired() && cancel_wait()) {
+                    return condition();
+                }
+            }
+
+            return true;
+        }
+
+        /** Wake the thread that has been waiting the longest, if there are any
+         *
+         * @return Whether a thread was woken
+         */
+        bool wake_one();
+        /** Wake every thread waiting on this queue
+         *
+         * @return The number of threads woken
+         */
+        uint32_t wake_all();
+        /** Remove the thread that has been waiting the longest from the queue, without waking it
+         *
+         * The caller must wake it with task::resume.
+         *
+         * @return The thread, or an empty pointer if there are none
+         */
+        shared_ptr<Thread> dequeue();
+        /** Remove the thread that has been waiting the longest from the queue, without waking it
+         *
+         * `with` is called with the thread while the queue is still locked, which lets the caller give it something
+         *  (such as a mutex) before a waiter that is timing out can see that it has been taken off the queue. It must
+         *  not sleep.
+         *
+         * @param with A function taking a Thread *, which is only called if a thread is removed
+         * @return The thread, or an empty pointer if there are none
+         */
+        template<class F> shared_ptr<Thread> dequeue(F with) {
+            shared_ptr<Thread> thread;
+
+            uint32_t eflags = push_cli();
+            lock.lock();
+            thread = take_front();
+            if(thread) {
+                with(thread.get());
+            }
+            lock.unlock();
+            pop_flags(eflags);
+
+            return thread;
+        }
+        /** Returns true iff no threads are waiting on this queue
+         *
+         * @return Whether the queue is empty
+         */
+        bool empty() const;
+    };
+
+    /** Counters kept by the scheduler, summed across all CPUs by task::scheduler_stats */
+    struct scheduler_stats_t {
+        uint64_t switches; /**< The number of threads taken off a run queue to be run */
+        uint64_t steals; /**< How many of those were taken from another CPU's run queue */
+        uint64_t contended; /**< The number of times a run queue's lock was held by another CPU when it was needed */
+        uint64_t wakeups; /**< The number of IPIs sent to wake up idle CPUs */
+        uint64_t direct; /**< How many switches went straight from one thread to the next, without task::schedule */
     };
 
     extern shared_ptr<Process> kernel_process;
+    /** Whether task::task_yield may switch directly to the next thread on the CPU's run queue
+     *
+     * Otherwise, every switch goes through task::schedule on the CPU's own stack. Switching directly only saves the
+     *  registers that the compiler expects a call to preserve, and doesn't need to reference count the threads.
+     */
+    extern volatile bool direct_switching;
+    /** Look up a process by its id, this never blocks and is safe from interrupt handlers
+     *
+     * @param id The process id
+     * @return The process, or an empty pointer if it doesn't exist
+     */
     shared_ptr<Process> get_process(uint32_t id);
 
     void init();
@@ -68,10 +317,68 @@ namespace task {
     extern "C" void __attribute__((noreturn)) task_yield_done(uint32_t sp);
     extern "C" void task_timer_yield();
     extern "C" void __attribute__((noreturn)) task_end();
+    /** Run threads from this CPU's run queue forever
+     *
+     * Each CPU has its own run queue. If it is empty, a thread is taken from the longest run queue of another CPU, and
+     *  if there are none of those either, the CPU halts until another CPU gives it a thread.
+     */
     void __attribute__((noreturn)) schedule();
+    /** Sleep on the given wait channel until it is woken
+     *
+     * @param wchan The wait channel, as returned by task::new_wchan
+     */
     void wait(wchan_t wchan);
-
+    /** Sleep for at least the given amount of time
+     *
+     * Outside of a thread, this halts (or spins, if interrupts are disabled) instead.
+     *
+     * @param ns The number of nanoseconds to sleep for, the thread may wake up to a jiffy later than this
+     */
+    void sleep_for(uint64_t ns);
+    /** Wake up the thread that has been waiting the longest on a wait channel
+     *
+     * @param wchan The wait channel
+     * @return Whether a thread was woken
+     */
+    bool wake_one(wchan_t wchan);
+    /** Wake up every thread waiting on a wait channel
+     *
+     * @param wchan The wait channel
+     * @return The number of threads woken
+     */
+    uint32_t wake_all(wchan_t wchan);
+    /** Create a new wait channel, which has its own WaitQueue
+     *
+     * @param name The name of the wait channel
+     * @return The new wait channel
+     */
     wchan_t new_wchan(Utf8 name);
+    /** Make a sleeping thread runnable again, removing it from the wait queue it is sleeping on is up to the caller
+     *
+     * If the thread has not finished switching out yet, it will be put on a run queue when it does.
+     *
+     * @param thread The thread to wake
+     * @return Whether the thread was sleeping
+     */
+    bool resume(shared_ptr<Thread> thread);
+
+    /** Returns the scheduler's counters, summed across all CPUs
+     *
+     * @return The scheduler statistics
+     */
+    scheduler_stats_t scheduler_stats();
+    /** Change the scheduling policy used by every CPU
+     *
+     * The threads on each CPU's run queue are reordered by the new policy.
+     *
+     * @param policy The new policy, which must never be destroyed
+     */
+    void set_policy(Policy &policy);
+    /** Returns the scheduling policy in use
+     *
+     * @return The current policy
+     */
+    Policy &get_policy();
 
 
     bool in_thread();
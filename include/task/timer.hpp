@@ -0,0 +1,94 @@
+#ifndef _HPP_TASK_TIMER_
+#define _HPP_TASK_TIMER_
+
+#include <stdint.h>
+
+/** Kernel timers, which run a callback once a given time has passed
+ *
+ * Each CPU has a hierarchical timer wheel. Timers are kept in lists ("slots") by when they expire, rounded to a jiffy
+ *  (2^JIFFY_SHIFT nanoseconds, about a millisecond). The lowest level has a slot for each of the next LEVEL_SIZE
+ *  jiffies, and each level above has slots LEVEL_SIZE times as long as the level below. When the wheel reaches the start
+ *  of a slot in a higher level, the timers in it are moved ("cascaded") down into the levels below.
+ *
+ * This makes adding and cancelling a timer `O(1)`, no matter how many are pending. The wheel only has to do work when a
+ *  slot with timers in it is reached, so the LAPIC timer is only set for those (see lapic::add_timer); idle CPUs
+ *  without any timers don't take timer interrupts at all.
+ *
+ * Timers are added to the wheel of the CPU that adds them, and their callbacks run in that CPU's timer interrupt with
+ *  interrupts disabled. They can be cancelled from any CPU.
+ */
+namespace timer {
+    /** The length of a jiffy, as a power of two number of nanoseconds */
+    const uint32_t JIFFY_SHIFT = 20;
+    /** log2 of the number of slots in each level of the wheel */
+    const uint32_t LEVEL_BITS = 6;
+    /** The number of slots in each level of the wheel */
+    const uint32_t LEVEL_SIZE = 1 << LEVEL_BITS;
+    /** The number of levels in the wheel, timers further in the future than the top level covers fire early */
+    const uint32_t LEVELS = 6;
+
+    /** A single timer, which must stay valid until it has either fired or been cancelled */
+    class Timer {
+    public:
+        void (*callback)(void *); /**< Called with `data` when the timer expires */
+        void *data; /**< The argument to `callback` */
+
+        /** Create a new timer which isn't pending
+         *
+         * @param callback The function to call when the timer expires
+         * @param data The argument to `callback`
+         */
+        Timer(void (*callback)(void *) = nullptr, void *data = nullptr)
+            : callback(callback), data(data), expires(0), next(nullptr), pprev(nullptr), cpu(0), level(0), slot(0) {};
+        Timer(const Timer &other) = delete;
+        Timer &operator=(const Timer &other) = delete;
+
+        /** Returns true iff the timer has been added and hasn't fired or been cancelled yet */
+        bool pending() const {
+            return pprev != nullptr;
+        }
+
+    private:
+        uint64_t expires; // In jiffies
+        Timer *next;
+        Timer **pprev; // The pointer to this timer in its slot, or nullptr if it isn't in one
+        volatile uint32_t cpu;
+        uint8_t level;
+        uint8_t slot;
+
+        friend struct _wheel_t;
+        friend void add(Timer &timer, uint64_t deadline);
+        friend bool cancel(Timer &timer);
+    };
+
+    /** Counters for the timer wheels, summed across all CPUs by timer::stats */
+    struct stats_t {
+        uint64_t added; /**< The number of timers added */
+        uint64_t cancelled; /**< The number of pending timers cancelled */
+        uint64_t expired; /**< The number of timers whose callbacks have been run */
+        uint64_t cascaded; /**< The number of times a timer has been moved down a level */
+    };
+
+    /** Add a timer to the current CPU's wheel, cancelling it first if it is pending
+     *
+     * @param timer The timer
+     * @param deadline The clock::now_ns time at which it should expire, it may be up to a jiffy late
+     */
+    void add(Timer &timer, uint64_t deadline);
+    /** Stop a timer from expiring
+     *
+     * If the timer's callback is running on another CPU, this waits for it to finish, so the timer can be freed after
+     *  this returns.
+     *
+     * @param timer The timer
+     * @return Whether the timer was pending
+     */
+    bool cancel(Timer &timer);
+    /** Returns the counters of every CPU's wheel, added together
+     *
+     * @return The timer statistics
+     */
+    stats_t stats();
+}
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef _HPP_BENCH_
+#define _HPP_BENCH_
+
+#include <stddef.h>
+
+#include "main/common.hpp"
+#include "structures/utf8.hpp"
+#include "structures/list.hpp"
+
+/** Allows registering and executing of benchmarks
+ *
+ * Benchmarks work similarly to tests (see the test namespace); a subclass of test::Benchmark should be created, and its
+ *  test::Benchmark::run_benchmark method must be implemented with the measurements to make. An object of type
+ *  test::AddBenchmark should then be created with the class as its template parameter. All benchmarks should be in the
+ *  _benchmarks namespace.
+ *
+ * As an example:
+ *
+ * @code
+namespace _benchmarks {
+class FooBenchmark : public test::Benchmark {
+public:
+    FooBenchmark() : test::Benchmark("Foo Benchmark") {};
+
+    void run_benchmark() override {
+        uint32_t ops = 0;
+
+        start("Calling foo");
+        while(running()) {
+            foo();
+            ops ++;
+        }
+        stop(ops);
+    }
+};
+
+test::AddBenchmark<FooBenchmark> fooBenchmark;
+}
+ * @endcode
+ *
+ * A measurement is started with test::Benchmark::start and finished with test::Benchmark::stop, which prints the number
+ *  of operations per second and cycles per operation. test::Benchmark::running can be used as a loop condition to run a
+ *  measurement for a fixed amount of time.
+ *
+ * Timing uses the TSC for cycle counts and clock::now_ns for wall time. The length of a measurement is counted in PIT
+ *  ticks, so benchmarks must be run from a thread with interrupts enabled.
+ *
+ * If the compile time constant `BENCHMARKS` is not defined, then no benchmarks will be added to the benchmark list.
+ */
+namespace test {
+    /** A single benchmark
+     *
+     * A benchmark contains a number of measurements, each started with Benchmark::start and ended with
+     *  Benchmark::stop.
+     */
+    class Benchmark {
+    private:
+        const char *current_measurement;
+        uint64_t start_cycles;
+        uint32_t start_ticks;
+        uint64_t start_ns;
+
+    protected:
+        /** Method for subclasses to specify the body of the benchmark
+         *
+         * See the description in the namespace docs of how to use this.
+         */
+        virtual void run_benchmark()=0;
+
+        /** Start a new measurement
+         *
+         * @param name The name of the measurement
+         */
+        void start(const char *name);
+        /** Whether the current measurement has been running for less than its duration
+         *
+         * @param ticks The duration of the measurement, in PIT ticks
+         * @return True iff the measurement should continue
+         */
+        bool running(uint32_t ticks = DEFAULT_TICKS);
+        /** Stop the current measurement and print the results
+         *
+         * @param ops The number of operations performed since Benchmark::start
+         * @return The number of TSC cycles the measurement took
+         */
+        uint64_t stop(uint64_t ops);
+        /** Print a value associated with this benchmark, in addition to the results of Benchmark::stop
+         *
+         * @param fmt The format of the message
+         * @param ... Parameters for the format
+         */
+        void __attribute__((format(printf, 2, 3))) report(const char *fmt, ...);
+
+    public:
+        /** The default duration of a measurement, in PIT ticks (roughly a quarter of a second) */
+        static const uint32_t DEFAULT_TICKS = 20;
+
+        Utf8 name;
+        /** Create a new benchmark with the given name
+         *
+         * @param name The name of the benchmark
+         */
+        Benchmark(const char *name) : name(Utf8(name)) {};
+        virtual ~Benchmark() {};
+
+        /** Run the benchmark, printing its results */
+        void do_benchmark();
+    };
+
+    /** A list of all the currently installed benchmarks */
+    extern list<Benchmark *> benchmarks;
+    /** Run every installed benchmark, printing the results of each */
+    void run_benchmarks();
+
+    /** Class that, as a side effect of its constructor, adds a benchmark
+     *
+     * Will do nothing if the macro BENCHMARKS is undefined.
+     *
+     * Its constructor creates a new instance of T, and adds it to test::benchmarks
+     */
+    template<class T> class AddBenchmark {
+    public:
+        AddBenchmark() {
+#if BENCHMARKS
+            T *t = new T;
+            benchmarks.push_front(t);
+#endif
+        }
+    };
+}
+
+#endif
@@ -20,7 +20,7 @@ namespace filesystem {
 
 
     FilePathEntry::FilePathEntry(Utf8 name, shared_ptr<FilePathEntry> parent, shared_ptr<Inode> inode)
-        : parent(parent), inode(inode), name(name) {}
+        : parent(parent), inode(inode), name(name.intern()) {}
 
     error_t FilePathEntry::populate(FilePathEntry& error_loc) {
         error_t err;
@@ -111,6 +111,10 @@ namespace filesystem {
         size_t oldpos = 0;
         shared_ptr<FilePathEntry> parent = base;
 
+        if(!path.valid()) {
+            return nullptr;
+        }
+
         while((pos = path.find('/', oldpos)) != Utf8::npos) {
             Utf8 fname = path.substr(oldpos, pos - oldpos);
 
@@ -14,7 +14,7 @@ class TestStorage : public Storage {
 public:
     Failable<page::Page *> read(addr_logical_t addr, uint32_t count) override {
         page::Page *page = page::alloc(0, count);
-        uint8_t *installed = (uint8_t *)page::kinstall(page, 0);
+        uint8_t *installed = (uint8_t *)page::kinstall(page, page::PAGE_TABLE_RW);
 
         for(uint32_t i = 0; i < PAGE_SIZE * count; i +=4) {
             installed[i + 0] = 'T';
@@ -127,6 +127,9 @@ public:
         err = child->populate(err_loc);
         assert(err);
 
+        child = parse_path(Utf8("./a/\xc0\xaf/file"), root);
+        assert(!child);
+
         test("Silly paths");
         child = parse_path(Utf8("./a/././.././a/./../file"), root);
         err = child->populate(err_loc);
@@ -7,6 +7,8 @@
 #include "main/panic.hpp"
 #include "structures/mutex.hpp"
 #include "hw/ps2keyboard.hpp"
+#include "main/clock.hpp"
+#include "task/task.hpp"
 
 extern "C" {
     #include "hw/ports.h"
@@ -18,7 +20,11 @@ namespace ps2 {
     static bool dual = false;
     static bool known_dual = false;
     Ps2Port ports[2];
-    static mutex::Mutex _mutex;
+    static mutex::Mutex _mutex("ps2");
+
+    const uint32_t _FAST_POLLS = 16;
+    const uint64_t _POLL_NS = 1000000;
+    const uint64_t _TIMEOUT_NS = 100000000;
 
     static uint8_t _read_data() {
         return inb(IO_PORT_PS2_DATA);
@@ -36,18 +42,30 @@ namespace ps2 {
         return inb(IO_PORT_PS2_STATUS);
     }
 
+    // Waits for the controller's input buffer to be clear, polling quickly at first and then sleeping between polls
+    static void _wait_input_clear() {
+        uint64_t deadline = clock::now_ns() + _TIMEOUT_NS;
+
+        for(uint32_t i = 0; _read_status() & STAT_INBUFF; i ++) {
+            if(i < _FAST_POLLS) {
+                io_wait();
+            }else if(clock::now_ns() < deadline) {
+                task::sleep_for(_POLL_NS);
+            }else{
+                kwarn("PS2 controller timed out\n");
+                return;
+            }
+        }
+    }
+
     static void _write_double_command(uint8_t com, uint8_t arg) {
         _write_command(com);
-        while(_read_status() & STAT_INBUFF) {
-            io_wait();
-        }
+        _wait_input_clear();
         _write_data(arg);
     }
 
     static uint8_t _wait_read_data() {
-        while(_read_status() & STAT_INBUFF) {
-            io_wait();
-        }
+        _wait_input_clear();
 
         return _read_data();
     }
@@ -19,13 +19,19 @@ extern "C" {
 // Break -> 0x0f
 
 namespace ps2keyboard {
+    void Ps2KeyboardDriver::wait_for_input() {
+        if(!input_queue.wait_until([this]() { return last_input != -1; }, TIMEOUT)) {
+            kwarn("PS2 keyboard timed out waiting for a response\n");
+        }
+    }
+
     uint8_t Ps2KeyboardDriver::send(uint8_t byte) {
         io_wait();
         last_input = -1;
 
         do {
             port.write(byte);
-            while(last_input == -1) {}
+            wait_for_input();
         } while(last_input == RESEND);
 
         return last_input;
@@ -38,7 +44,7 @@ namespace ps2keyboard {
         do {
             port.write(byte_a);
             port.write(byte_b);
-            while(last_input == -1) {}
+            wait_for_input();
         } while(last_input == RESEND);
 
         return last_input;
@@ -57,7 +63,9 @@ namespace ps2keyboard {
         // TODO: Result
         send(0xff);
 
-        while (!self_test_passed) {}
+        if(!input_queue.wait_until([this]() { return self_test_passed; }, TIMEOUT)) {
+            kwarn("PS2 keyboard timed out during its self test\n");
+        }
 
         // Set to scancode 2
         send(0xf0);
@@ -69,11 +77,13 @@ namespace ps2keyboard {
         if(input == PASS) {
             // Passed a self test
             self_test_passed = true;
+            input_queue.wake_all();
             return;
         }
 
         if(last_input == -1) {
             last_input = (int16_t)input;
+            input_queue.wake_all();
             return;
         }
 
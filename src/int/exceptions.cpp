@@ -72,7 +72,9 @@ namespace exceptions {
         uint32_t addr;
         __asm__("mov %%cr2, %0" : "=r"(addr));
 
-        if(!(cpu::current_thread() && cpu::current_thread()->vm->resolve_fault(addr))) {
+        bool protection = (errcode & PAGE_FAULT_PRESENT) && (errcode & PAGE_FAULT_WRITE);
+
+        if(!(cpu::current_thread() && cpu::current_thread()->vm->resolve_fault(addr, protection))) {
             panic_at(state.ebp, eip, "Unresolved Page Fault %x [Address: %p]", errcode, addr);
         }
     }
@@ -1,17 +1,19 @@
 #include <stdint.h>
 
 #include "main/cpu.hpp"
+#include "main/clock.hpp"
 #include "hw/pit.hpp"
 #include "int/idt.hpp"
 #include "int/lapic.hpp"
 #include "main/printk.hpp"
 #include "mem/kmem.hpp"
 #include "mem/page.hpp"
+#include "mem/vm.hpp"
 #include "task/task.hpp"
 #include "int/numbers.h"
 #include "hw/acpi.hpp"
 #include "hw/utils.h"
-#include "structures/mutex.hpp"
+#include "structures/spinlock.hpp"
 #include "main/asm_utils.hpp"
 
 namespace lapic {
@@ -21,17 +23,35 @@ namespace lapic {
     static volatile uint32_t _callibration_ticks;
     static volatile uint32_t _ticks_per_sec;
 
-    static mutex::Mutex _command_mutex;
+
+    static spinlock::Spinlock _command_lock;
+
+    volatile command_stats_t command_stats;
+
+    volatile bool tickless = TICKLESS;
+    bool tsc_deadline;
+
+    // Each CPU's pending timer events, sorted by deadline. Only touched by that CPU, with interrupts disabled
+    struct _timer_queue_t {
+        timer_event_t *head;
+        timer_event_t tick;
+        bool oneshot; // Whether the timer has been calibrated and switched out of periodic mode
+        bool resched; // Set by the tick, the current thread should yield once the interrupt is done
+        timer_stats_t stats;
+    };
+    static _timer_queue_t _timers[MAX_CORES];
 
     extern "C" volatile char _startofap;
     extern "C" volatile char _endofap;
     extern "C" volatile uint32_t low_ap_page_table;
 
-    static volatile bool _calibrated[MAX_CORES];
-
     const uint32_t _CAL_INIT = 1000;
     const uint32_t _CAL_DIV = 3;
     const uint32_t _JUMP_BASE = 0x1000;
+    const uint8_t _SHORTHAND_NONE = 0;
+    const uint8_t _SHORTHAND_ALL_EXCLUDING_SELF = 3;
+    const uint32_t _MSR_TSC_DEADLINE = 0x6e0;
+    const uint32_t _CPUID_TSC_DEADLINE = (1 << 24);
 
     static uint32_t _read(uint32_t reg) {
         return _base[reg / sizeof(uint32_t)];
@@ -49,12 +69,89 @@ namespace lapic {
         _write(LVT_TIMER, TIMER_MODE_PERIODIC | INT_LAPIC_BASE);
     }
 
+    static void _write_deadline(uint64_t deadline) {
+        asm volatile ("wrmsr" : : "c"(_MSR_TSC_DEADLINE), "a"((uint32_t)deadline), "d"((uint32_t)(deadline >> 32)));
+    }
+
+    // Sets the timer to fire at the deadline of the first event in the queue, or stops it if there are none
+    static void _program(_timer_queue_t &queue) {
+        if(!queue.oneshot) {
+            return;
+        }
+
+        if(!queue.head) {
+            if(tsc_deadline) {
+                _write_deadline(0);
+            }else{
+                _write(TIMER_INITIAL, 0);
+            }
+            return;
+        }
+
+        queue.stats.programmed ++;
+        if(tsc_deadline) {
+            _write_deadline(queue.head->deadline);
+        }else{
+            uint64_t now = read_tsc();
+            uint64_t cycles = queue.head->deadline > now ? queue.head->deadline - now : 0;
+
+            // Events more than a second away are reached in several steps, so this can't overflow
+            if(cycles > clock::tsc_per_sec) {
+                cycles = clock::tsc_per_sec;
+            }
+
+            uint64_t count = cycles * (_ticks_per_sec / _CAL_DIV) / clock::tsc_per_sec;
+            _write(TIMER_INITIAL, count ? count : 1);
+        }
+    }
 
-    static void _ipi(uint32_t vector, uint8_t dest, uint8_t init_deassert, uint32_t target) {
+    // Switches this CPU's timer from periodic mode, which is only used for calibration
+    static void _start_oneshot(_timer_queue_t &queue) {
+        if(tsc_deadline) {
+            _write(LVT_TIMER, TIMER_MODE_TSC_DEADLINE | INT_LAPIC_BASE);
+            // Make sure the mode has changed before setting the deadline
+            asm volatile ("mfence" : : : "memory");
+        }else{
+            _write(TIMER_DIVIDE_CONFIGURATION, _CAL_DIV);
+            _write(LVT_TIMER, TIMER_MODE_ONE_SHOT | INT_LAPIC_BASE);
+        }
+
+        queue.oneshot = true;
+        _program(queue);
+    }
+
+    static void _tick(void *data) {
+        _timer_queue_t &queue = *(_timer_queue_t *)data;
+
+        queue.resched = true;
+        if(!tickless) {
+            add_timer(queue.tick, read_tsc() + clock::tsc_per_sec / SWITCHES_PER_SECOND);
+        }
+    }
+
+    // Runs the callbacks of every event which has expired
+    static void _expire(_timer_queue_t &queue) {
+        uint64_t now = read_tsc();
+
+        while(queue.head && queue.head->deadline <= now) {
+            timer_event_t *event = queue.head;
+            queue.head = event->next;
+            event->pending = false;
+            queue.stats.expired ++;
+            event->callback(event->data);
+        }
+
+        _program(queue);
+    }
+
+
+    static void _ipi(uint32_t vector, uint8_t dest, uint8_t init_deassert, uint32_t target,
+        uint8_t shorthand = _SHORTHAND_NONE) {
         uint32_t val = 0;
         val |= vector & 0xff;
         val |= dest << 8;
         val |= init_deassert << 14;
+        val |= shorthand << 18;
 
         _write(ICR_B, target << 24);
         _write(ICR_A, val);
@@ -63,12 +160,14 @@ namespace lapic {
     IDT_TELL_INTERRUPT(ltimer);
     IDT_TELL_INTERRUPT(lcommand);
     IDT_TELL_INTERRUPT(lpanic);
+    IDT_TELL_INTERRUPT(lwake);
     void init() {
         page::Page *page;
 
         IDT_ALLOW_INTERRUPT(INT_LAPIC_BASE + INT_LAPIC_TIMER, ltimer);
         IDT_ALLOW_INTERRUPT(INT_LAPIC_BASE + INT_LAPIC_COMMAND, lcommand);
         IDT_ALLOW_INTERRUPT(INT_LAPIC_BASE + INT_LAPIC_PANIC, lpanic);
+        IDT_ALLOW_INTERRUPT(INT_LAPIC_BASE + INT_LAPIC_WAKE, lwake);
 
         page = page::create(acpi::lapic_base, page::FLAG_KERNEL, 1);
         _base = (uint32_t *)page::kinstall(page, page::PAGE_TABLE_CACHEDISABLE | page::PAGE_TABLE_RW);
@@ -78,6 +177,10 @@ namespace lapic {
         _write(SPURIOUS_INT_VECTOR, 0x1ff);
 
         // Set up the timer
+        uint32_t ecx;
+        asm volatile ("cpuid" : "=c"(ecx) : "a"(1) : "ebx", "edx");
+        tsc_deadline = ecx & _CPUID_TSC_DEADLINE;
+
         _deadline = pit::time;
         idt::install(INT_LAPIC_BASE, timer, GDT_SELECTOR(0, 0, 2), idt::GATE_32_INT);
         _set_timer(_CAL_INIT, _CAL_DIV);
@@ -85,6 +188,7 @@ namespace lapic {
         // And the command handler
         idt::install(INT_LAPIC_BASE + INT_LAPIC_COMMAND, handle_command, GDT_SELECTOR(0, 0, 2), idt::GATE_32_INT);
         idt::install(INT_LAPIC_BASE + INT_LAPIC_PANIC, handle_panic, GDT_SELECTOR(0, 0, 2), idt::GATE_32_INT);
+        idt::install(INT_LAPIC_BASE + INT_LAPIC_WAKE, handle_wake, GDT_SELECTOR(0, 0, 2), idt::GATE_32_INT);
     }
 
 
@@ -101,6 +205,20 @@ namespace lapic {
         (void)state;
 
         uint32_t id = cpu::id();
+        _timer_queue_t &queue = _timers[id];
+        queue.stats.interrupts ++;
+
+        if(queue.oneshot) {
+            _expire(queue);
+            eoi();
+
+            if(queue.resched) {
+                queue.resched = false;
+                task::task_timer_yield();
+            }
+            return;
+        }
+
         if(id == 0) {
             switch(_stage) {
                 case 0:
@@ -116,38 +234,111 @@ namespace lapic {
                     if(_deadline < pit::time) {
                         _stage = 2;
                         _ticks_per_sec = _callibration_ticks * _CAL_INIT * _CAL_DIV;
-                        _write(TIMER_INITIAL, _ticks_per_sec / _CAL_DIV / SWITCHES_PER_SECOND);
                         _callibration_ticks = 0;
+                        _start_oneshot(queue);
                     }else{
                         _callibration_ticks ++;
                     }
                     eoi();
                     break;
 
-                case 2:
-                    eoi();
-                    task::task_timer_yield();
-                    break;
-
                 default:
                     eoi();
                     break;
             }
         }else{
-            if(_calibrated[id]) {
-                eoi();
-                task::task_timer_yield();
-            }else{
-                if(_ticks_per_sec) {
-                    _set_timer(_ticks_per_sec / _CAL_DIV / SWITCHES_PER_SECOND, _CAL_DIV);
-                    _write(TIMER_INITIAL, _ticks_per_sec / _CAL_DIV / SWITCHES_PER_SECOND);
-                    _calibrated[id] = true;
-                }else{
-                    // Do nothing
+            if(_ticks_per_sec) {
+                _start_oneshot(queue);
+            }
+            eoi();
+        }
+    }
+
+    void add_timer(timer_event_t &event, uint64_t deadline) {
+        _timer_queue_t &queue = _timers[cpu::id()];
+        timer_event_t **next = &queue.head;
+
+        event.deadline = deadline;
+        event.pending = true;
+        while(*next && (*next)->deadline <= deadline) {
+            next = &(*next)->next;
+        }
+        event.next = *next;
+        *next = &event;
+
+        if(queue.head == &event) {
+            _program(queue);
+        }
+    }
+
+    bool cancel_timer(timer_event_t &event) {
+        _timer_queue_t &queue = _timers[cpu::id()];
+
+        if(!event.pending) {
+            return false;
+        }
+
+        for(timer_event_t **next = &queue.head; *next; next = &(*next)->next) {
+            if(*next == &event) {
+                *next = event.next;
+                event.pending = false;
+
+                // If it was first, the timer would go off for nothing
+                if(next == &queue.head) {
+                    _program(queue);
                 }
-                eoi();
+                return true;
             }
         }
+
+        return false;
+    }
+
+    void start_tick(uint64_t slice) {
+        _timer_queue_t &queue = _timers[cpu::id()];
+
+        if(!queue.oneshot || (queue.tick.pending && !tickless)) {
+            // Without tickless mode the tick keeps its own period
+            return;
+        }
+
+        cancel_timer(queue.tick);
+        queue.tick.callback = &_tick;
+        queue.tick.data = &queue;
+        add_timer(queue.tick, read_tsc() + clock::ns_to_tsc(slice));
+    }
+
+    void stop_tick() {
+        _timer_queue_t &queue = _timers[cpu::id()];
+
+        queue.resched = false;
+        if(tickless) {
+            cancel_timer(queue.tick);
+        }else if(queue.oneshot && !queue.tick.pending) {
+            queue.tick.callback = &_tick;
+            queue.tick.data = &queue;
+            add_timer(queue.tick, read_tsc() + clock::tsc_per_sec / SWITCHES_PER_SECOND);
+        }
+    }
+
+    void set_tickless(bool enabled) {
+        tickless = enabled;
+
+        uint32_t eflags = push_cli();
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            if((cpu::online & CPU_MASK(i)) && i != cpu::id()) {
+                wake(i);
+            }
+        }
+        pop_flags(eflags);
+    }
+
+    timer_stats_t timer_stats(uint32_t proc) {
+        uint32_t eflags = push_cli();
+        timer_stats_t stats = _timers[proc].stats;
+        pop_flags(eflags);
+
+        return stats;
     }
 
 
@@ -171,6 +362,7 @@ namespace lapic {
             _ipi((uint32_t)_JUMP_BASE / PAGE_SIZE, 6, 1, id);
 
             while(!cpu::info_of(id).awoken);
+            clock::sync_with_ap();
         }
     }
 
@@ -185,50 +377,149 @@ namespace lapic {
         _ipi(vector, 0, 0, proc);
     }
 
+    void wake(uint32_t proc) {
+        ipi(INT_LAPIC_BASE + INT_LAPIC_WAKE, proc);
+    }
+
     void ipi_all(uint8_t vector) {
         for(uint32_t i = 0; i < acpi::proc_count && i < MAX_CORES; i ++) {
             ipi(vector, i);
         }
     }
 
-    void send_command(command_t command, uint32_t argument, uint32_t proc) {
-        _command_mutex.lock();
-        cpu::Status &status = cpu::info_of(proc);
-        status.command_finished = 0;
+    static void _run_command(cpu::Status &status) {
+        if(!status.command_pending) {
+            // Already done while waiting for the command lock
+            return;
+        }
+
+        switch(status.command) {
+            case CMD_INVLPG:
+                for(uint32_t i = 0; i < status.command_arg_b; i ++) {
+                    asm volatile ("invlpg (%0)" : : "r"(status.command_arg + i * PAGE_SIZE) : "memory");
+                }
+                break;
+
+            case CMD_FLUSH_TLB:
+                page::flush_tlb_local();
+                break;
+
+            case CMD_UNLOAD_MAP:
+                vm::Map::unload((vm::Map *)status.command_arg);
+                break;
+
+            default:
+                panic("Unknown IPI command 0x%x", status.command);
+        }
+
+        status.command_pending = false;
+        status.command_finished = true;
+    }
+
+    // Interrupts must be disabled. Another CPU may be waiting for us to run a command while holding the lock, so keep
+    //  running any that come in
+    static void _lock_commands() {
+        cpu::Status &status = cpu::info();
+
+        while(_command_lock.trylock()) {
+            _run_command(status);
+        }
+    }
+
+    static void _set_command(cpu::Status &status, command_t command, uint32_t argument, uint32_t argument_b) {
+        status.command_finished = false;
         status.command = command;
         status.command_arg = argument;
-        ipi(INT_LAPIC_BASE + INT_LAPIC_COMMAND, proc);
-        while(!status.command_finished) {};
-        _command_mutex.unlock();
+        status.command_arg_b = argument_b;
+        status.command_pending = true;
     }
 
-    void send_command_all(command_t command, uint32_t argument) {
-        // TODO: This better
-        uint32_t eflags = push_cli();
-        uint32_t id = cpu::id();
-        for(uint32_t i = 0; i < acpi::proc_count; i ++) {
-            if(i != id) {
-                send_command(command, argument, i);
+    // Sets the command on every CPU in the (non-empty) mask, sends the IPIs and then waits for them all to finish
+    // If `broadcast` is true, the mask must be every other online CPU, and a single IPI is sent to all of them
+    static uint32_t _send_and_wait(command_t command, uint32_t argument, uint32_t argument_b, cpu_mask_t cpus,
+        bool broadcast) {
+        uint32_t ipis = 0;
+
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            if(cpus & CPU_MASK(i)) {
+                _set_command(cpu::info_of(i), command, argument, argument_b);
             }
         }
 
-        pop_flags(eflags);
+        if(broadcast) {
+            // CPUs that aren't online ignore the IPI, and will have nothing pending when they do come online
+            _ipi(INT_LAPIC_BASE + INT_LAPIC_COMMAND, 0, 0, 0, _SHORTHAND_ALL_EXCLUDING_SELF);
+            ipis = 1;
+        }else{
+            for(uint32_t i = 0; i < MAX_CORES; i ++) {
+                if(cpus & CPU_MASK(i)) {
+                    ipi(INT_LAPIC_BASE + INT_LAPIC_COMMAND, i);
+                    ipis ++;
+                }
+            }
+        }
+
+        uint64_t start = read_tsc();
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            if(cpus & CPU_MASK(i)) {
+                while(!cpu::info_of(i).command_finished) {};
+            }
+        }
+        command_stats.wait_cycles += read_tsc() - start;
+        command_stats.ipis += ipis;
+        command_stats.commands ++;
+
+        return ipis;
     }
 
-    void handle_command(idt_proc_state_t state) {
-        cpu::Status &status = cpu::info();
+    void send_command(command_t command, uint32_t argument, uint32_t argument_b, uint32_t proc) {
+        send_command_mask(command, argument, argument_b, CPU_MASK(proc));
+    }
 
-        switch(status.command) {
-            case CMD_INVLPG:
-                asm volatile ("invlpg (%0)" : : "r"(status.command_arg));
-                break;
+    uint32_t send_command_mask(command_t command, uint32_t argument, uint32_t argument_b, cpu_mask_t cpus) {
+        uint32_t eflags = push_cli();
+        uint32_t ipis;
 
-            default:
-                panic("Unknown IPI command 0x%x", status.command);
+        cpus &= cpu::online & ~CPU_MASK(cpu::id());
+        if(!cpus) {
+            pop_flags(eflags);
+            return 0;
         }
 
-        status.command_finished = true;
+        _lock_commands();
+        ipis = _send_and_wait(command, argument, argument_b, cpus, false);
+
+        _command_lock.unlock();
+        pop_flags(eflags);
+        return ipis;
+    }
+
+    void send_command_all(command_t command, uint32_t argument, uint32_t argument_b) {
+        uint32_t eflags = push_cli();
+        cpu_mask_t cpus = cpu::online & ~CPU_MASK(cpu::id());
+
+        if(!cpus) {
+            // Nothing else is running
+            pop_flags(eflags);
+            return;
+        }
+
+        _lock_commands();
+        _send_and_wait(command, argument, argument_b, cpus, true);
+
+        _command_lock.unlock();
+        pop_flags(eflags);
+    }
+
+    void handle_command(idt_proc_state_t state) {
+        _run_command(cpu::info());
+        eoi();
+    }
+
+    void handle_wake(idt_proc_state_t state) {
+        // The interrupt itself ends the hlt an idle CPU is in, a busy one may have been asked to preempt its thread
         eoi();
+        task::task_timer_yield();
     }
 
     void handle_panic(idt_proc_state_t state) {
@@ -38,14 +38,14 @@ enter_protected:
     mov low_ap_page_table, %eax
     mov %eax, %cr3
 
-    # Enable 4MiB pages
+    # Enable 4MiB pages and global pages
     mov %cr4, %ecx
-    or $0x00000010, %ecx
+    or $0x00000090, %ecx
     mov %ecx, %cr4
 
-    # And flick the switch
+    # And flick the switch, with write protection so the kernel faults on writes to read only pages as well
     mov %cr0, %ecx
-    or  $0x80000000, %ecx
+    or  $0x80010000, %ecx
     mov %ecx, %cr0
 
     # ... Right, now we need to get a stack
@@ -16,3 +16,8 @@ pop_flags:
     push %ecx;
     popf;
     ret;
+
+.globl read_tsc
+read_tsc:
+    rdtsc;
+    ret;
@@ -0,0 +1,256 @@
+#include <stdint.h>
+
+#include "main/clock.hpp"
+#include "main/cpu.hpp"
+#include "main/printk.hpp"
+#include "main/asm_utils.hpp"
+#include "hw/pit.hpp"
+#include "structures/spinlock.hpp"
+#include "task/task.hpp"
+#include "test/test.hpp"
+
+extern "C" {
+    #include "hw/ports.h"
+    #include "hw/utils.h"
+}
+
+namespace clock {
+    volatile uint64_t tsc_per_sec;
+    uint32_t calibration_error_ppm;
+
+    // The TSC when the clock was calibrated, which is time 0
+    static uint64_t _base;
+    // now_ns is ((tsc - _base) * _mult) >> _shift, with _mult fitting in 32 bits
+    static uint32_t _mult;
+    static uint32_t _shift;
+    // And ns_to_tsc is (ns * _tsc_mult) >> _tsc_shift
+    static uint32_t _tsc_mult;
+    static uint32_t _tsc_shift;
+    // Added to each CPU's TSC to make it match the boot CPU's
+    static int64_t _offsets[MAX_CORES];
+
+    static volatile uint32_t _sync_request;
+    static volatile uint32_t _sync_reply;
+    static volatile uint64_t _sync_tsc;
+
+    // About 50ms
+    const uint32_t _CALIBRATION_COUNTS = pit::FREQUENCY / 20;
+    const uint32_t _SYNC_ROUNDS = 64;
+
+    // Latches and reads channel 0's counter, which counts down from pit::DIVISOR to 1 and then starts again
+    static uint32_t _read_pit() {
+        uint32_t count;
+
+        outb(IO_PORT_PIT_MODE, 0);
+        count = inb(IO_PORT_PIT_0);
+        count |= inb(IO_PORT_PIT_0) << 8;
+        return count;
+    }
+
+    // Finds the largest shift (up to 32) for which `(to << shift) / from` fits in 32 bits, so multiplying by that and
+    //  shifting right converts from one unit to the other
+    static void _pick_mult(uint64_t from, uint64_t to, uint32_t &mult, uint32_t &shift) {
+        uint64_t m;
+
+        shift = 32;
+        while(to >> (64 - shift)) {
+            // `to << shift` would overflow
+            shift --;
+        }
+        m = (to << shift) / from;
+        while(m >> 32) {
+            shift --;
+            m = (to << shift) / from;
+        }
+        mult = m;
+    }
+
+    // Works out (value * mult) >> shift, split up so that it doesn't overflow
+    static uint64_t _scale(uint64_t value, uint32_t mult, uint32_t shift) {
+        uint32_t high = value >> 32;
+        uint32_t low = value;
+
+        return (((uint64_t)high * mult) << (32 - shift)) + (((uint64_t)low * mult) >> shift);
+    }
+
+    void init() {
+        uint32_t eflags = push_cli();
+        uint32_t counts = 0;
+        uint32_t previous = _read_pit();
+        uint64_t start = read_tsc();
+        uint64_t end;
+
+        while(counts < _CALIBRATION_COUNTS) {
+            uint32_t current = _read_pit();
+            if(current <= previous) {
+                counts += previous - current;
+            }else{
+                // Reloaded
+                counts += previous + pit::DIVISOR - current;
+            }
+            previous = current;
+        }
+        end = read_tsc();
+        pop_flags(eflags);
+
+        // Each reading of the PIT may be off by a count
+        calibration_error_ppm = 2 * 1000000 / counts;
+
+        uint64_t per_sec = (end - start) * pit::FREQUENCY / counts;
+
+        // These are the only divisions; converting between the units later is just a multiply and a shift
+        _pick_mult(per_sec, NS_PER_SEC, _mult, _shift);
+        _pick_mult(NS_PER_SEC, per_sec, _tsc_mult, _tsc_shift);
+        _base = start;
+        tsc_per_sec = per_sec;
+
+        printk("TSC: %llu cycles/sec (+/- %d ppm)\n", per_sec, calibration_error_ppm);
+    }
+
+    void setup() {
+        uint64_t best = ~0ull;
+        int64_t offset = 0;
+
+        for(uint32_t i = 0; i < _SYNC_ROUNDS; i ++) {
+            uint32_t request = _sync_reply + 1;
+            uint64_t before = read_tsc();
+            _sync_request = request;
+            while(_sync_reply != request) {
+                asm volatile ("pause");
+            }
+            uint64_t after = read_tsc();
+
+            // The boot CPU read its TSC somewhere between `before` and `after`, so assume it was in the middle
+            if(after - before < best) {
+                best = after - before;
+                offset = (int64_t)(_sync_tsc - (before + best / 2));
+            }
+        }
+
+        // If the difference is smaller than the uncertainty, the TSCs are probably already synchronised
+        if(offset > (int64_t)best || -offset > (int64_t)best) {
+            uint32_t eflags = push_cli();
+            _offsets[cpu::id()] = offset;
+            pop_flags(eflags);
+        }
+    }
+
+    void sync_with_ap() {
+        for(uint32_t i = 0; i < _SYNC_ROUNDS; i ++) {
+            while(_sync_request == _sync_reply) {
+                asm volatile ("pause");
+            }
+            _sync_tsc = read_tsc();
+            _sync_reply = _sync_request;
+        }
+    }
+
+    uint64_t now_tsc() {
+        uint32_t eflags = push_cli();
+        uint64_t tsc = read_tsc() + _offsets[cpu::id()];
+        pop_flags(eflags);
+
+        return tsc;
+    }
+
+    uint64_t now_ns() {
+        uint64_t tsc = now_tsc();
+
+        if(tsc < _base) {
+            return 0;
+        }
+        return tsc_to_ns(tsc - _base);
+    }
+
+    uint64_t tsc_to_ns(uint64_t cycles) {
+        return _scale(cycles, _mult, _shift);
+    }
+
+    uint64_t ns_to_tsc(uint64_t ns) {
+        return _scale(ns, _tsc_mult, _tsc_shift);
+    }
+}
+
+namespace _tests {
+static spinlock::Spinlock clock_lock;
+static volatile uint64_t clock_last;
+static volatile uint32_t clock_backwards;
+static volatile cpu_mask_t clock_cpus;
+static volatile uint32_t clock_finished;
+
+// Each reading is compared with the last one taken on any CPU; the lock orders them
+static void _clock_worker() {
+    for(uint32_t i = 0; i < 2000; i ++) {
+        uint32_t eflags = push_cli();
+        clock_lock.lock();
+        uint64_t now = clock::now_ns();
+        if(now < clock_last) {
+            clock_backwards ++;
+        }
+        clock_last = now;
+        clock_cpus |= CPU_MASK(cpu::id());
+        clock_lock.unlock();
+        pop_flags(eflags);
+
+        if(i % 16 == 0) {
+            task::task_yield();
+        }
+    }
+    __sync_fetch_and_add(&clock_finished, 1);
+}
+
+class ClockTest : public test::TestCase {
+public:
+    ClockTest() : test::TestCase("Clock Test") {};
+
+    static const uint32_t THREADS = 4;
+    static const uint32_t TICKS = pit::PER_SECOND / 2;
+
+    void run_test() override {
+        test("Monotonic on one CPU");
+        uint32_t eflags = push_cli();
+        uint64_t last = clock::now_ns();
+        bool ok = true;
+        for(uint32_t i = 0; i < 10000; i ++) {
+            uint64_t now = clock::now_ns();
+            ok = ok && now >= last;
+            last = now;
+        }
+        pop_flags(eflags);
+        assert(ok);
+        assert(last > 0);
+
+        test("Monotonic across CPUs");
+        clock_last = 0;
+        clock_backwards = 0;
+        clock_cpus = 0;
+        clock_finished = 0;
+        for(uint32_t i = 0; i < THREADS; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&_clock_worker);
+        }
+        while(clock_finished < THREADS) task::task_yield();
+        assert(clock_backwards == 0);
+
+        test("Calibration error");
+        uint32_t ticks = pit::time;
+        while(pit::time == ticks) task::task_yield();
+        ticks = pit::time;
+        uint64_t start = clock::now_ns();
+        while(pit::time - ticks < TICKS) task::task_yield();
+        uint64_t elapsed = clock::now_ns() - start;
+
+        uint64_t expected = (uint64_t)TICKS * pit::DIVISOR * clock::NS_PER_SEC / pit::FREQUENCY;
+        uint64_t error = elapsed > expected ? elapsed - expected : expected - elapsed;
+        uint64_t ppm = error * 1000000 / expected;
+        uint32_t cpus = 0;
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            if(clock_cpus & CPU_MASK(i)) cpus ++;
+        }
+        printk("Clock: %d CPU(s) compared, %llu ppm from the PIT over %d ticks\n", cpus, ppm, TICKS);
+        // The PIT tick itself may have been noticed late
+        assert(ppm < 10000);
+    }
+};
+
+test::AddTestCase<ClockTest> clockTest;
+}
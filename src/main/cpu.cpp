@@ -6,6 +6,8 @@
 #include "mem/page.hpp"
 #include "main/panic.hpp"
 #include "main/asm_utils.hpp"
+#include "mem/gdt.hpp"
+#include "mem/kmem.hpp"
 #include "structures/unique_ptr.hpp"
 #include "structures/shared_ptr.hpp"
 
@@ -18,6 +20,7 @@
 
 namespace cpu {
     static unique_ptr<Status> cpu_status[MAX_CORES]; // Enough space for as many processors as we can get
+    volatile cpu_mask_t online;
 
     extern "C" addr_logical_t *stacks[MAX_CORES];
     addr_logical_t *stacks[MAX_CORES] = {};
@@ -25,6 +28,14 @@ namespace cpu {
     uint32_t id() {
         CHECK_IF_CLR;
         uint32_t volatile id;
+        uint32_t selector;
+
+        // If cpu::setup has been called, the CPU id is stored in the fs segment selector
+        __asm__ volatile ("mov %%fs, %0" : "=r" (selector));
+        selector = (selector & 0xffff) >> 3;
+        if(selector >= gdt::CPU_INDEX_BASE) {
+            return selector - gdt::CPU_INDEX_BASE;
+        }
 
         __asm__ volatile ("\
             mov $1, %%eax\n\
@@ -60,9 +71,22 @@ namespace cpu {
             cpu_status[i]->cpu_id = i;
             cpu_status[i]->stack = page::kinstall(page, page::PAGE_TABLE_RW);
             cpu_status[i]->awoken = false;
+            cpu_status[i]->command_pending = false;
+            cpu_status[i]->command_finished = true;
             stacks[i] = (addr_logical_t *)(cpu_status[i]->stack);
             cpu_status[i]->thread = NULL;
+            cpu_status[i]->loaded_map = nullptr;
         }
+
+        kmem::enable_cpu_caches();
+    }
+
+    void setup() {
+        uint32_t selector = GDT_SELECTOR(0, 0, gdt::CPU_INDEX_BASE + id());
+
+        __asm__ volatile ("mov %0, %%fs" : : "r" (selector));
+
+        memory_setup();
     }
 
     shared_ptr<task::Thread>current_thread() {
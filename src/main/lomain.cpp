@@ -141,12 +141,12 @@ extern "C" volatile page::page_dir_t *low_kernel_main(multiboot::info_t *mbi) {
             entry = (page::page_table_entry_t *)table;
             for(j = 0; j < PAGE_TABLE_LENGTH; j ++) {
                 addr_phys_t addr = (i * PAGE_DIR_SIZE) + (j * PAGE_SIZE) - KERNEL_VM_BASE;
-                if(addr >= map_low.kernel_ro_start && addr < map_low.kernel_ro_end + PAGE_SIZE) {
+                if(addr >= map_low.kernel_ro_start && addr < map_low.kernel_ro_end) {
                     // Kernel text
-                    *entry = addr | page::PAGE_TABLE_PRESENT;
+                    *entry = addr | page::PAGE_TABLE_PRESENT | page::PAGE_TABLE_GLOBAL;
                 }else if(addr >= map_low.kernel_rw_start && addr < map_low.vm_end + PAGE_SIZE) {
                     // Page table
-                    *entry = addr | page::PAGE_TABLE_RW | page::PAGE_TABLE_PRESENT;
+                    *entry = addr | page::PAGE_TABLE_RW | page::PAGE_TABLE_PRESENT | page::PAGE_TABLE_GLOBAL;
                 }else{
                     // Absent
                     *entry = (uint32_t)(0x0);
@@ -4,6 +4,7 @@
 
 #include "task/task.hpp"
 #include "main/cpu.hpp"
+#include "main/clock.hpp"
 #include "mem/object.hpp"
 #include "main/vga.hpp"
 #include "hw/pit.hpp"
@@ -17,11 +18,13 @@
 #include "mem/page.hpp"
 #include "mem/kmem.hpp"
 #include "structures/mutex.hpp"
+#include "structures/utf8.hpp"
 #include "main/printk.hpp"
 #include "structures/elf.hpp"
 #include "main/panic.hpp"
 #include "hw/pci/pci.hpp"
 #include "test/test.hpp"
+#include "test/bench.hpp"
 #include "display/display.hpp"
 #include "fs/physical_mem_storage.hpp"
 #include "fs/expanse_fs.hpp"
@@ -46,6 +49,10 @@ extern "C" void _init();
 void main_thread() {
     list<test::TestResult> res = test::run_tests();
     test::print_results(res, true);
+    test::run_benchmarks();
+#if DEBUG_LOCKS
+    mutex::dump_all();
+#endif
 
     display::Display& d = vga::addDisplay<display::TestDisplay>();
     // vga::switchDisplay(d.id);
@@ -90,6 +97,13 @@ extern "C" void __attribute__((noreturn)) kernel_main() {
 
     vga::init();
     printk("Cantos\n");
+    size_t cmdline_length = strlen(multiboot::cmdline);
+    size_t cmdline_valid = utf8::valid_length(multiboot::cmdline, cmdline_length);
+    if(cmdline_valid != cmdline_length) {
+        // Possibly truncated in the middle of a character when it was copied
+        kwarn("Kernel command line is not valid UTF-8 after %d bytes, ignoring the rest\n", cmdline_valid);
+        multiboot::cmdline[cmdline_valid] = '\0';
+    }
     printk("Booted by %s [%s]\n", multiboot::boot_loader_name, multiboot::cmdline);
 #if DEBUG_MAP
     printk("Initial memory state:\n");
@@ -110,11 +124,14 @@ extern "C" void __attribute__((noreturn)) kernel_main() {
     }
 
     cpu::init();
+    cpu::setup();
+    cpu::online = CPU_MASK(cpu::id());
     pic::init();
     lapic::init();
     lapic::setup();
     ioapic::init();
     pit::init();
+    clock::init();
     pci::init();
 
     task::init();
@@ -142,10 +159,13 @@ extern "C" void __attribute__((noreturn)) kernel_main() {
 }
 
 extern "C" void __attribute__((noreturn)) ap_main() {
+    cpu::setup();
     cpu::info().awoken = true;
+    clock::setup();
 
     idt::setup();
     lapic::setup();
+    __sync_fetch_and_or(&cpu::online, CPU_MASK(cpu::id()));
 
     asm("sti");
 
@@ -11,7 +11,7 @@ static uint8_t clr = vga::COLOUR_WHITE | (vga::COLOUR_BLACK << 4);
 static uint8_t clr_warn = vga::COLOUR_MAGENTA | (vga::COLOUR_BLACK << 4);
 static uint8_t clr_err = vga::COLOUR_RED | (vga::COLOUR_BLACK << 4);
 
-static mutex::Mutex _mutex;
+static mutex::Mutex _mutex("printk");
 
 extern "C" {
     void __attribute__((format(printf, 1, 2))) printk(const char *fmt, ...) {
@@ -0,0 +1,361 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "main/utils.hpp"
+#include "main/asm_utils.hpp"
+#include "main/common.hpp"
+#include "test/test.hpp"
+
+// The kernel does not save the SSE registers on an interrupt or task switch, so any use of them must be done with
+//  interrupts disabled
+#define _SSE2_THRESHOLD 512
+// Interrupts are enabled again after every this many 64 byte blocks, so large copies don't hold them off for long
+#define _SSE2_CHUNK_BLOCKS (PAGE_SIZE / 64)
+#define _CPUID_SSE2 (1 << 26)
+#define _CR0_EM (1 << 2)
+#define _CR0_MP (1 << 1)
+#define _CR4_OSFXSR (1 << 9)
+
+static bool sse2;
+
+void memory_setup() {
+    uint32_t edx;
+    uint32_t cr;
+
+    __asm__ volatile ("cpuid" : "=d"(edx) : "a"(1) : "ebx", "ecx");
+    if(!(edx & _CPUID_SSE2)) {
+        return;
+    }
+
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr));
+    cr = (cr & ~_CR0_EM) | _CR0_MP;
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr));
+
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr));
+    cr |= _CR4_OSFXSR;
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr));
+
+    sse2 = true;
+}
+
+bool sse2_enabled() {
+    return sse2;
+}
+
+// Copies `blocks` 64 byte blocks, interrupts must be disabled
+static void _sse2_copy(void *destination, const void *source, size_t blocks) {
+    __asm__ volatile ("\
+        1:\n\
+        movdqu (%1), %%xmm0\n\
+        movdqu 16(%1), %%xmm1\n\
+        movdqu 32(%1), %%xmm2\n\
+        movdqu 48(%1), %%xmm3\n\
+        movdqu %%xmm0, (%0)\n\
+        movdqu %%xmm1, 16(%0)\n\
+        movdqu %%xmm2, 32(%0)\n\
+        movdqu %%xmm3, 48(%0)\n\
+        add $64, %0\n\
+        add $64, %1\n\
+        dec %2\n\
+        jnz 1b"
+        : "+r"(destination), "+r"(source), "+r"(blocks)
+        : : "memory" SSE_CLOBBERS("xmm0", "xmm1", "xmm2", "xmm3"));
+}
+
+// Sets `blocks` 64 byte blocks to the byte `value`, interrupts must be disabled
+static void _sse2_set(void *destination, uint32_t value, size_t blocks) {
+    __asm__ volatile ("\
+        movd %2, %%xmm0\n\
+        pshufd $0, %%xmm0, %%xmm0\n\
+        1:\n\
+        movdqu %%xmm0, (%0)\n\
+        movdqu %%xmm0, 16(%0)\n\
+        movdqu %%xmm0, 32(%0)\n\
+        movdqu %%xmm0, 48(%0)\n\
+        add $64, %0\n\
+        dec %1\n\
+        jnz 1b"
+        : "+r"(destination), "+r"(blocks) : "r"(value) : "memory" SSE_CLOBBERS("xmm0"));
+}
+
+// Copies words and then the remaining bytes, going forwards
+static void _copy_forwards(void *destination, const void *source, size_t num) {
+    size_t words = num / 4;
+    size_t bytes = num % 4;
+
+    __asm__ volatile ("rep movsl" : "+D"(destination), "+S"(source), "+c"(words) : : "memory");
+    __asm__ volatile ("rep movsb" : "+D"(destination), "+S"(source), "+c"(bytes) : : "memory");
+}
+
+extern "C" void *memcpy(void *destination, const void *source, size_t num) {
+    void *dest = destination;
+
+    if(sse2 && num >= _SSE2_THRESHOLD) {
+        for(size_t blocks = num / 64; blocks;) {
+            size_t chunk = blocks > _SSE2_CHUNK_BLOCKS ? _SSE2_CHUNK_BLOCKS : blocks;
+
+            uint32_t eflags = push_cli();
+            _sse2_copy(dest, source, chunk);
+            pop_flags(eflags);
+
+            dest = (uint8_t *)dest + chunk * 64;
+            source = (const uint8_t *)source + chunk * 64;
+            blocks -= chunk;
+        }
+        num &= 63;
+    }
+
+    _copy_forwards(dest, source, num);
+
+    return destination;
+}
+
+extern "C" void *memmove(void *destination, const void *source, size_t num) {
+    uint8_t *dest = (uint8_t *)destination;
+    const uint8_t *src = (const uint8_t *)source;
+
+    if(dest <= src || dest >= src + num) {
+        // Copying forwards is safe
+        _copy_forwards(dest, src, num);
+    }else{
+        // Copy backwards, the odd bytes at the end first and then the words
+        size_t bytes = num % 4;
+        size_t words = num / 4;
+        dest += num - 1;
+        src += num - 1;
+        __asm__ volatile ("std\n\trep movsb" : "+D"(dest), "+S"(src), "+c"(bytes) : : "memory");
+        dest -= 3;
+        src -= 3;
+        __asm__ volatile ("rep movsl\n\tcld" : "+D"(dest), "+S"(src), "+c"(words) : : "memory");
+    }
+
+    return destination;
+}
+
+extern "C" void *memset(void *ptr, int value, size_t num) {
+    void *dest = ptr;
+    uint32_t word = (uint8_t)value * 0x01010101;
+
+    if(sse2 && num >= _SSE2_THRESHOLD) {
+        for(size_t blocks = num / 64; blocks;) {
+            size_t chunk = blocks > _SSE2_CHUNK_BLOCKS ? _SSE2_CHUNK_BLOCKS : blocks;
+
+            uint32_t eflags = push_cli();
+            _sse2_set(dest, word, chunk);
+            pop_flags(eflags);
+
+            dest = (uint8_t *)dest + chunk * 64;
+            blocks -= chunk;
+        }
+        num &= 63;
+    }
+
+    size_t words = num / 4;
+    size_t bytes = num % 4;
+    __asm__ volatile ("rep stosl" : "+D"(dest), "+c"(words) : "a"(word) : "memory");
+    __asm__ volatile ("rep stosb" : "+D"(dest), "+c"(bytes) : "a"(word) : "memory");
+
+    return ptr;
+}
+
+extern "C" int memcmp(const void *a, const void *b, size_t num) {
+    const uint8_t *pa = (const uint8_t *)a;
+    const uint8_t *pb = (const uint8_t *)b;
+
+    // Skip over matching words, then find the byte that differs
+    while(num >= 4 && *(const uint32_t *)pa == *(const uint32_t *)pb) {
+        pa += 4;
+        pb += 4;
+        num -= 4;
+    }
+
+    for(; num; num --, pa ++, pb ++) {
+        if(*pa != *pb) {
+            return *pa - *pb;
+        }
+    }
+
+    return 0;
+}
+
+void zero_page(void *page) {
+    size_t count;
+
+    if(sse2) {
+        count = PAGE_SIZE / 64;
+        uint32_t eflags = push_cli();
+        __asm__ volatile ("\
+            pxor %%xmm0, %%xmm0\n\
+            1:\n\
+            movdqa %%xmm0, (%0)\n\
+            movdqa %%xmm0, 16(%0)\n\
+            movdqa %%xmm0, 32(%0)\n\
+            movdqa %%xmm0, 48(%0)\n\
+            add $64, %0\n\
+            dec %1\n\
+            jnz 1b"
+            : "+r"(page), "+r"(count) : : "memory" SSE_CLOBBERS("xmm0"));
+        pop_flags(eflags);
+    }else{
+        count = PAGE_SIZE / 4;
+        __asm__ volatile ("rep stosl" : "+D"(page), "+c"(count) : "a"(0) : "memory");
+    }
+}
+
+void copy_page(void *destination, const void *source) {
+    size_t count;
+
+    if(sse2) {
+        count = PAGE_SIZE / 64;
+        uint32_t eflags = push_cli();
+        __asm__ volatile ("\
+            1:\n\
+            movdqa (%1), %%xmm0\n\
+            movdqa 16(%1), %%xmm1\n\
+            movdqa 32(%1), %%xmm2\n\
+            movdqa 48(%1), %%xmm3\n\
+            movdqa %%xmm0, (%0)\n\
+            movdqa %%xmm1, 16(%0)\n\
+            movdqa %%xmm2, 32(%0)\n\
+            movdqa %%xmm3, 48(%0)\n\
+            add $64, %0\n\
+            add $64, %1\n\
+            dec %2\n\
+            jnz 1b"
+            : "+r"(destination), "+r"(source), "+r"(count)
+            : : "memory" SSE_CLOBBERS("xmm0", "xmm1", "xmm2", "xmm3"));
+        pop_flags(eflags);
+    }else{
+        count = PAGE_SIZE / 4;
+        __asm__ volatile ("rep movsl" : "+D"(destination), "+S"(source), "+c"(count) : : "memory");
+    }
+}
+
+#undef _SSE2_THRESHOLD
+#undef _SSE2_CHUNK_BLOCKS
+#undef _CPUID_SSE2
+#undef _CR0_EM
+#undef _CR0_MP
+#undef _CR4_OSFXSR
+
+
+namespace _tests {
+class UtilsTest : public test::TestCase {
+public:
+    UtilsTest() : test::TestCase("Memory Utilities Test") {};
+
+    // Past the SSE2 threshold and several times the size of an interrupt chunk
+    static const size_t SIZE = PAGE_SIZE * 3 + 200;
+    static const uint32_t LENGTHS = 12;
+
+    uint8_t *buffer;
+    uint8_t *expected;
+
+    void fill(uint8_t *b, size_t len, uint8_t seed) {
+        for(size_t i = 0; i < len; i ++) {
+            b[i] = (uint8_t)(i * 7 + seed);
+        }
+    }
+
+    bool matches(size_t len) {
+        for(size_t i = 0; i < len; i ++) {
+            if(buffer[i] != expected[i]) return false;
+        }
+        return true;
+    }
+
+    void run_test() override {
+        // Lengths either side of the 64 byte blocks and the SSE2 threshold
+        const size_t lengths[LENGTHS] = {0, 1, 3, 63, 64, 65, 511, 512, 513, 575, 4097, SIZE - 100};
+        uint8_t *source = new uint8_t[SIZE];
+        buffer = new uint8_t[SIZE];
+        expected = new uint8_t[SIZE];
+        fill(source, SIZE, 3);
+
+        test("Copying memory");
+        bool ok = true;
+        for(uint32_t l = 0; l < LENGTHS; l ++) {
+            for(size_t offset = 0; offset < 4; offset ++) {
+                size_t len = lengths[l];
+                fill(buffer, SIZE, 100);
+                fill(expected, SIZE, 100);
+                for(size_t i = 0; i < len; i ++) {
+                    expected[offset + 1 + i] = source[3 - offset + i];
+                }
+                memcpy(buffer + offset + 1, source + 3 - offset, len);
+                ok = ok && matches(SIZE);
+            }
+        }
+        assert(ok);
+
+        test("Moving overlapping memory");
+        for(uint32_t l = 0; l < LENGTHS; l ++) {
+            for(size_t distance = 1; distance < 70; distance += 17) {
+                size_t len = lengths[l];
+                if(len + distance > SIZE) continue;
+
+                // Forwards, to a higher address
+                fill(buffer, SIZE, 5);
+                fill(expected, SIZE, 5);
+                for(size_t i = len; i > 0; i --) {
+                    expected[distance + i - 1] = expected[i - 1];
+                }
+                memmove(buffer + distance, buffer, len);
+                ok = ok && matches(SIZE);
+
+                // Backwards, to a lower address
+                fill(buffer, SIZE, 9);
+                fill(expected, SIZE, 9);
+                for(size_t i = 0; i < len; i ++) {
+                    expected[i] = expected[distance + i];
+                }
+                memmove(buffer, buffer + distance, len);
+                ok = ok && matches(SIZE);
+            }
+        }
+        assert(ok);
+
+        test("Setting memory");
+        for(uint32_t l = 0; l < LENGTHS; l ++) {
+            for(size_t offset = 0; offset < 4; offset ++) {
+                size_t len = lengths[l];
+                fill(buffer, SIZE, 1);
+                fill(expected, SIZE, 1);
+                for(size_t i = 0; i < len; i ++) {
+                    expected[offset + i] = 0xA5;
+                }
+                memset(buffer + offset, 0xA5, len);
+                ok = ok && matches(SIZE);
+            }
+        }
+        assert(ok);
+
+        test("Clearing and copying pages");
+        // zero_page and copy_page need page aligned buffers
+        uint8_t *page = (uint8_t *)(((addr_logical_t)buffer + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+        uint8_t *other = (uint8_t *)(((addr_logical_t)source + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+        fill(buffer, SIZE, 11);
+        zero_page(page);
+        for(size_t i = 0; i < PAGE_SIZE; i ++) {
+            ok = ok && page[i] == 0;
+        }
+        if(page != buffer) {
+            ok = ok && page[-1] == (uint8_t)((page - buffer - 1) * 7 + 11);
+        }
+        ok = ok && page[PAGE_SIZE] == (uint8_t)((page - buffer + PAGE_SIZE) * 7 + 11);
+        fill(other, PAGE_SIZE, 13);
+        copy_page(page, other);
+        for(size_t i = 0; i < PAGE_SIZE; i ++) {
+            ok = ok && page[i] == other[i];
+        }
+        ok = ok && page[PAGE_SIZE] == (uint8_t)((page - buffer + PAGE_SIZE) * 7 + 11);
+        assert(ok);
+
+        delete[] source;
+        delete[] buffer;
+        delete[] expected;
+    }
+};
+
+test::AddTestCase<UtilsTest> utilsTest;
+}
@@ -39,7 +39,7 @@ void init() {
 }
 
 vector<unique_ptr<display::Display>> displays;
-mutex::Mutex displayMutex;
+mutex::Mutex displayMutex("display");
 int activeDisplay = -1;
 
 display::Display& getDisplay(int id) {
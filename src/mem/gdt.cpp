@@ -1,9 +1,10 @@
 #include <stdint.h>
 
 #include "mem/gdt.hpp"
+#include "main/common.hpp"
 
 namespace gdt {
-    const uint8_t _LENGTH = 3;
+    const uint8_t _LENGTH = CPU_INDEX_BASE + MAX_CORES;
 
     static volatile table_entry_t table[_LENGTH];
     extern "C" volatile descriptor_t gdt_descriptor;
@@ -48,6 +49,16 @@ namespace gdt {
             FLAG_GRANULARITY | FLAG_SIZE,
             ACCESS_PRESENT | GDT_ACCESS_PRIV(0) | ACCESS_EXECUTABLE | ACCESS_DC | ACCESS_RW
         );
+        entry ++;
+
+        // Per-CPU data segments
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            set_entry((table_entry_t *)entry, 0, 0xfffff,
+                FLAG_GRANULARITY | FLAG_SIZE,
+                ACCESS_PRESENT | GDT_ACCESS_PRIV(0) | ACCESS_RW
+            );
+            entry ++;
+        }
 
         gdt_descriptor.size = sizeof(table_entry_t) * _LENGTH;
         gdt_descriptor.offset = (uint32_t)table;
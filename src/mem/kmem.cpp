@@ -7,11 +7,15 @@
 #include "main/lomain.hpp"
 #include "test/test.hpp"
 #include "main/asm_utils.hpp"
+#include "main/cpu.hpp"
+#include "hw/acpi.hpp"
 
 namespace kmem {
     #define _MINIMUM_PAGES 2
     #define _SENTINEL_VAL 0x4b4d454d
     #define _SENTINEL_FREED 0x46524545
+    #define _SLAB_MIN_SHIFT 4
+    #define _SLAB_MIN_OBJECTS 16
 
     /** @private */
     extern "C" char _startofro;
@@ -21,7 +25,7 @@ namespace kmem {
     extern "C" char _endofrw;
 
     map_t map;
-    mutex::Mutex mutex;
+    spinlock::Spinlock lock;
 
     /** @private */
     struct kmem_header_t {
@@ -40,12 +44,29 @@ namespace kmem {
         kmem_free_t *next;
     };
 
+    // A slab object, when free the first word of its contents is used to link it into its class' free list
+    // The header's size is set to -(class + 1), which is how kfree knows to return it to a slab
+    /** @private */
+    struct kmem_slab_obj_t {
+        kmem_header_t header;
+        kmem_slab_obj_t *next;
+    };
+
+    /** @private */
+    struct kmem_slab_class_t {
+        kmem_slab_obj_t *free;
+        uint32_t objects;
+        uint32_t pages;
+    };
+
     static page::Page *kernel_start;
     static kmem_free_t *free_list;
     static kmem_free_t *free_end;
     static kmem_free_t *free_free_structs;
     static volatile uint32_t memory_total;
     static volatile uint32_t memory_used;
+    static kmem_slab_class_t slabs[SLAB_CLASSES];
+    static volatile bool cpu_caches;
 
     __attribute__((unused)) static void _print() {
         kmem_free_t *now;
@@ -199,6 +220,11 @@ namespace kmem {
     }
 
 
+    void enable_cpu_caches() {
+        cpu_caches = true;
+    }
+
+
     void clear_bottom() {
         // Clear the first 1MiB
         page::page_dir_t *dir;
@@ -207,6 +233,149 @@ namespace kmem {
         dir->entries[0] = 0x0;
     }
 
+    static uint32_t _slab_class(size_t size) {
+        if(size <= (1 << _SLAB_MIN_SHIFT)) return 0;
+        return (32 - __builtin_clz(size - 1)) - _SLAB_MIN_SHIFT;
+    }
+
+    static void _slab_grow(uint32_t cls) {
+        kmem_slab_class_t &slab = slabs[cls];
+        size_t stride = sizeof(kmem_header_t) + (1 << (cls + _SLAB_MIN_SHIFT));
+        size_t pages = (stride * _SLAB_MIN_OBJECTS + PAGE_SIZE - 1) / PAGE_SIZE;
+        page::Page *new_page;
+        addr_logical_t base;
+        uint32_t count;
+
+#if DEBUG_MEM
+        printk("Growing slab for %d byte objects by %d pages.\n", 1 << (cls + _SLAB_MIN_SHIFT), pages);
+#endif
+
+        // This calls kmalloc, but reserved allocations never come from a slab so we won't end up back here
+        new_page = page::alloc(page::FLAG_KERNEL | page::FLAG_RESERVED | page::FLAG_NOLOCK, pages);
+        base = (addr_logical_t)page::kinstall_append(new_page, page::PAGE_TABLE_RW, false);
+        page::used(new_page, false);
+
+        // Push the objects in reverse order, so they get handed out in address order
+        count = (pages * PAGE_SIZE) / stride;
+        for(uint32_t i = count; i > 0; i --) {
+            kmem_slab_obj_t *obj = (kmem_slab_obj_t *)(base + (i - 1) * stride);
+            obj->header.size = -(int)(cls + 1);
+            obj->next = slab.free;
+            slab.free = obj;
+        }
+
+        slab.objects += count;
+        slab.pages += pages;
+
+        // Slab pages are held by kmem and handed out in full, so they count as both. Slabs never give their pages back.
+        memory_total += pages * PAGE_SIZE;
+        memory_used += pages * PAGE_SIZE;
+    }
+
+    static void *_slab_alloc(size_t size) {
+        uint32_t cls = _slab_class(size);
+        kmem_slab_class_t &slab = slabs[cls];
+        kmem_slab_obj_t *obj;
+
+        if(!slab.free) {
+            _slab_grow(cls);
+        }
+
+        obj = slab.free;
+        slab.free = obj->next;
+#if KMEM_SENTINEL
+        obj->header.sentinel = _SENTINEL_VAL;
+#endif
+
+        return (void *)(&obj->header + 1);
+    }
+
+    static void _slab_free(kmem_header_t *hdr) {
+        kmem_slab_obj_t *obj = (kmem_slab_obj_t *)hdr;
+        kmem_slab_class_t &slab = slabs[-hdr->size - 1];
+
+        obj->next = slab.free;
+        slab.free = obj;
+    }
+
+    // Moves half a magazine's worth of objects from the shared slab into an empty magazine, kmem::lock must be held
+    static void _magazine_refill(magazine_t &mag, uint32_t cls) {
+        kmem_slab_class_t &slab = slabs[cls];
+
+        while(mag.count < MAGAZINE_SIZE / 2) {
+            if(!slab.free) {
+                _slab_grow(cls);
+            }
+
+            mag.objects[mag.count ++] = slab.free;
+            slab.free = slab.free->next;
+        }
+    }
+
+    // Moves the oldest half of a full magazine back into the shared slab, kmem::lock must be held
+    static void _magazine_drain(magazine_t &mag, uint32_t cls) {
+        kmem_slab_class_t &slab = slabs[cls];
+        uint32_t half = MAGAZINE_SIZE / 2;
+
+        for(uint32_t i = 0; i < half; i ++) {
+            kmem_slab_obj_t *obj = (kmem_slab_obj_t *)mag.objects[i];
+            obj->next = slab.free;
+            slab.free = obj;
+        }
+        for(uint32_t i = half; i < mag.count; i ++) {
+            mag.objects[i - half] = mag.objects[i];
+        }
+        mag.count -= half;
+    }
+
+    // Allocates an object from the current CPU's magazine, interrupts must be disabled
+    static void *_magazine_alloc(size_t size) {
+        uint32_t cls = _slab_class(size);
+        magazine_t &mag = cpu::info().kmem_cache.magazines[cls];
+        kmem_slab_obj_t *obj;
+
+        if(!mag.count) {
+            lock.lock();
+            _magazine_refill(mag, cls);
+            lock.unlock();
+        }
+
+        obj = (kmem_slab_obj_t *)mag.objects[-- mag.count];
+#if KMEM_SENTINEL
+        obj->header.sentinel = _SENTINEL_VAL;
+#endif
+
+        return (void *)(&obj->header + 1);
+    }
+
+    // Returns an object to the current CPU's magazine, interrupts must be disabled
+    static void _magazine_free(kmem_header_t *hdr) {
+        uint32_t cls = -hdr->size - 1;
+        magazine_t &mag = cpu::info().kmem_cache.magazines[cls];
+
+        if(mag.count == MAGAZINE_SIZE) {
+            lock.lock();
+            _magazine_drain(mag, cls);
+            lock.unlock();
+        }
+
+        mag.objects[mag.count ++] = hdr;
+    }
+
+    static void _check_sentinel(kmem_header_t *hdr) {
+#if KMEM_SENTINEL
+        if(hdr->sentinel == _SENTINEL_FREED) {
+            panic("Suspected double free found!");
+        }
+        if(hdr->sentinel != _SENTINEL_VAL) {
+            panic("Sentinel value was not set correctly!");
+        }
+        hdr->sentinel = _SENTINEL_FREED;
+#else
+        (void)hdr;
+#endif
+    }
+
     static void *__attribute__((alloc_size(1), malloc)) do_kmalloc(size_t size, uint8_t flags) {
         kmem_free_t *free = free_list;
         kmem_free_t *prev = NULL;
@@ -220,6 +389,13 @@ namespace kmem {
 #endif
 
         if(size == 0) return NULL;
+
+        // Small allocations come from the slabs, reserved ones always use the free list since they may be needed to
+        //  grow a slab
+        if(size <= SLAB_MAX_SIZE && !(flags & (KMALLOC_RESERVED | KMALLOC_NOSLAB))) {
+            return _slab_alloc(size);
+        }
+
         _verify("kmalloc@before alloc");
 
         // Align size to four bytes
@@ -299,6 +475,11 @@ namespace kmem {
         }
         pages_needed += _MINIMUM_PAGES;
 
+        // Large amounts are rounded to whole 4MiB blocks, which page::kinstall_append maps with 4MiB pages
+        if(pages_needed >= PAGE_TABLE_LENGTH) {
+            pages_needed = (pages_needed + PAGE_TABLE_LENGTH - 1) & ~(PAGE_TABLE_LENGTH - 1);
+        }
+
 #if DEBUG_MEM
         printk("Extending memory by %d pages (%x/%x).\n", pages_needed, memory_used, memory_total);
 #endif
@@ -310,11 +491,11 @@ namespace kmem {
 
         if(prev && prev->base + prev->size == installed_loc) {
             // Can just grow the last block because there is free at the end
-            prev->size += new_page->consecutive * PAGE_SIZE;
+            prev->size += new_page->count() * PAGE_SIZE;
         }else{
             // Well, looks like we have to use the start of the newly allocated block
             // Conveniently there is memory right up to the end of it.
-            int space_allocated = new_page->consecutive * PAGE_SIZE - sizeof(kmem_header_t) - sizeof(kmem_free_t);
+            int space_allocated = new_page->count() * PAGE_SIZE - sizeof(kmem_header_t) - sizeof(kmem_free_t);
             hdr = (kmem_header_t *)installed_loc;
             hdr->size = sizeof(kmem_free_t);
 #if KMEM_SENTINEL
@@ -341,13 +522,27 @@ namespace kmem {
     void *__attribute__((alloc_size(1), malloc)) kmalloc(size_t size, uint8_t flags) {
         uint32_t eflags = 0;
         void *ret;
+
+        // Fast path, small allocations come from this CPU's magazine without taking the lock
+        if(cpu_caches && size && size <= SLAB_MAX_SIZE
+        && !(flags & (KMALLOC_RESERVED | KMALLOC_NOSLAB | KMALLOC_NOLOCK))) {
+            eflags = push_cli();
+            cpu::info().kmem_cache.allocations ++;
+            ret = _magazine_alloc(size);
+            pop_flags(eflags);
+            return ret;
+        }
+
         if(!(flags & KMALLOC_NOLOCK)) {
             eflags = push_cli();
-            mutex.lock();
+            if(cpu_caches) {
+                cpu::info().kmem_cache.allocations ++;
+            }
+            lock.lock();
         }
         ret = do_kmalloc(size, flags);
         if(!(flags & KMALLOC_NOLOCK)) {
-            mutex.unlock();
+            lock.unlock();
             pop_flags(eflags);
         }
         return ret;
@@ -369,14 +564,36 @@ namespace kmem {
     }
 
 
-     void kfree(void *ptr) {
+    void kfree(void *ptr) {
+        kmem_header_t *hdr = ((kmem_header_t *)ptr) - 1;
         uint32_t eflags = push_cli();
-        mutex.lock();
+
+        if(ptr && cpu_caches && hdr->size < 0) {
+            // A slab object, it can go into this CPU's magazine
+            _check_sentinel(hdr);
+            _magazine_free(hdr);
+            pop_flags(eflags);
+            return;
+        }
+
+        lock.lock();
         kfree_nolock(ptr);
-        mutex.unlock();
+        lock.unlock();
         pop_flags(eflags);
     }
 
+    uint64_t allocations() {
+        uint64_t total = 0;
+
+        if(cpu_caches) {
+            for(uint32_t i = 0; i < acpi::proc_count; i ++) {
+                total += cpu::info_of(i).kmem_cache.allocations;
+            }
+        }
+
+        return total;
+    }
+
     void kfree_nolock(void *ptr) {
         if(!ptr) {
             // Ignore NULL
@@ -390,15 +607,12 @@ namespace kmem {
 #if DEBUG_VMEM
         printk("Freeing %p (%d bytes).\n", ptr, hdr->size);
 #endif
-#if KMEM_SENTINEL
-        if(hdr->sentinel == _SENTINEL_FREED) {
-            panic("Suspected double free found!");
-        }
-        if(hdr->sentinel != _SENTINEL_VAL) {
-            panic("Sentinel value was not set correctly!");
+        _check_sentinel(hdr);
+
+        if(hdr->size < 0) {
+            _slab_free(hdr);
+            return;
         }
-        hdr->sentinel = _SENTINEL_FREED;
-#endif
 
         new_entry = _get_struct();
 
@@ -438,4 +652,78 @@ namespace kmem {
 
     #undef _MINIMUM_PAGES
     #undef _SENTINEL_VAL
+    #undef _SENTINEL_FREED
+    #undef _SLAB_MIN_SHIFT
+    #undef _SLAB_MIN_OBJECTS
+}
+
+
+namespace _tests {
+class KmemTest : public test::TestCase {
+public:
+    KmemTest() : test::TestCase("Kernel Memory Test") {};
+
+    void run_test() override {
+        test("Slab allocations");
+        uint8_t *a = (uint8_t *)kmem::kmalloc(1, 0);
+        uint8_t *b = (uint8_t *)kmem::kmalloc(17, 0);
+        uint8_t *c = (uint8_t *)kmem::kmalloc(kmem::SLAB_MAX_SIZE, 0);
+        assert(a && b && c);
+        assert(a != b && b != c);
+        for(size_t i = 0; i < kmem::SLAB_MAX_SIZE; i ++) c[i] = 0xcc;
+        for(size_t i = 0; i < 17; i ++) b[i] = 0xbb;
+        *a = 0xaa;
+        assert(*a == 0xaa);
+        assert(b[16] == 0xbb);
+        assert(c[0] == 0xcc);
+
+        test("Slab reuse");
+        uint32_t eflags = push_cli();
+        kmem::kfree(b);
+        uint8_t *d = (uint8_t *)kmem::kmalloc(32, 0);
+        pop_flags(eflags);
+        assert(d == b);
+        kmem::kfree(a);
+        kmem::kfree(c);
+        kmem::kfree(d);
+
+        test("Magazine refill and drain");
+        uint8_t *many[kmem::MAGAZINE_SIZE * 3];
+        for(size_t i = 0; i < kmem::MAGAZINE_SIZE * 3; i ++) {
+            many[i] = (uint8_t *)kmem::kmalloc(64, 0);
+            many[i][0] = i;
+            many[i][63] = i;
+        }
+        for(size_t i = 0; i < kmem::MAGAZINE_SIZE * 3; i ++) {
+            assert(many[i][0] == (uint8_t)i && many[i][63] == (uint8_t)i);
+            kmem::kfree(many[i]);
+        }
+
+        test("Large and non-slab allocations");
+        uint8_t *e = (uint8_t *)kmem::kmalloc(kmem::SLAB_MAX_SIZE + 1, 0);
+        uint8_t *f = (uint8_t *)kmem::kmalloc(16, kmem::KMALLOC_NOSLAB);
+        assert(e && f);
+        e[kmem::SLAB_MAX_SIZE] = 0xee;
+        f[15] = 0xff;
+        assert(e[kmem::SLAB_MAX_SIZE] == 0xee);
+        assert(f[15] == 0xff);
+        kmem::kfree(e);
+        kmem::kfree(f);
+
+        test("Many allocations");
+        void *ptrs[256];
+        for(size_t i = 0; i < 256; i ++) {
+            ptrs[i] = kmem::kmalloc(i * 8 + 1, 0);
+            *(uint8_t *)ptrs[i] = i;
+        }
+        for(size_t i = 0; i < 256; i ++) {
+            assert(*(uint8_t *)ptrs[i] == (uint8_t)i);
+        }
+        for(size_t i = 0; i < 256; i ++) {
+            kmem::kfree(ptrs[i]);
+        }
+    }
+};
+
+test::AddTestCase<KmemTest> kmemTest;
 }
@@ -19,16 +19,12 @@ namespace object {
     max_pages(max_pages), page_flags(page_flags), object_flags(object_flags) {}
 
     Object::~Object() {
-        PageEntry *page_entry;
-        PageEntry *next;
-
         // And then destroy all the pages
-        for(page_entry = this->pages.get(); page_entry; page_entry = next) {
-            page::free(page_entry->page);
-            next = page_entry->next.get();
-        }
+        pages.each([](uint32_t key, PageEntry &page_entry) {
+            page::free(page_entry.page);
+        });
 
-        pages = nullptr;
+        pages.clear();
     }
 
 
@@ -166,10 +162,40 @@ namespace object {
     }*/
 
 
+    PageEntry *Object::find_page(uint32_t addr) {
+        uint32_t key;
+        PageEntry *entry = pages.find_before(addr / PAGE_SIZE, key);
+
+        if(entry && addr < entry->offset + entry->count * PAGE_SIZE) {
+            return entry;
+        }
+        return nullptr;
+    }
+
+    // Calls f on every entry with pages in [first, last), which are offsets in bytes
+    template<class F> void Object::each_page_in(int64_t first, int64_t last, F f) {
+        uint32_t from;
+
+        if(first < 0) {
+            first = 0;
+        }
+        if(last <= first) {
+            return;
+        }
+
+        // The entry containing first starts before it
+        if(!pages.find_before(first / PAGE_SIZE, from)) {
+            from = 0;
+        }
+        pages.range(from, (last + PAGE_SIZE - 1) / PAGE_SIZE, [&](uint32_t key, PageEntry &page_entry) {
+            if(page_entry.offset + (int64_t)page_entry.count * PAGE_SIZE > first) {
+                f(page_entry);
+            }
+        });
+    }
+
     // count is in pages, Addr is an address not in pages
     void Object::generate(uint32_t addr, uint32_t count) {
-        PageEntry *next = nullptr;
-        PageEntry *prev = nullptr;
         page::Page *page;
 
         // If we would go greater than the maximum number of pages, cap it
@@ -182,63 +208,143 @@ namespace object {
             count = max_pages - (addr / PAGE_SIZE);
         }
 
-        // Find the location to insert the page into
-        for(next = pages.get(); next && next->offset < addr; (prev = next), (next = next->next.get()));
+        uint32_t end = addr + count * PAGE_SIZE;
 
-        // If we are bumping into the next block of pages, then reduce the amount of pages to load appropriately
-        if(next && addr + (count * PAGE_SIZE) >= next->offset) {
-            count = (next->offset - addr) / PAGE_SIZE;
-        }
+        while(addr < end) {
+            PageEntry *existing = find_page(addr);
+            if(existing) {
+                // Already generated, skip past it
+                addr = existing->offset + existing->count * PAGE_SIZE;
+                continue;
+            }
 
-        if(!count) return;
+            // Fill the gap up to the next entry (or the end of the range)
+            uint32_t gap_end = end;
+            uint32_t key;
+            PageEntry *next = pages.find_after(addr / PAGE_SIZE, key);
+            if(next && next->offset < gap_end) {
+                gap_end = next->offset;
+            }
+            count = (gap_end - addr) / PAGE_SIZE;
 
-        // Generate the pages
-        page = do_generate(addr, count);
-        unique_ptr<PageEntry> new_entry;
+            page = do_generate(addr, count);
 
-        // And create a new entry
-        new_entry = make_unique<PageEntry>();
-        new_entry->offset = addr;
-        new_entry->page = page;
-        new_entry->next = next;
-        if(prev) {
-            prev->next.release();
-            prev->next = move(new_entry);
-        }else{
-            pages.release();
-            pages = move(new_entry);
+            // Now update the tables
+            map_entry(*pages.insert(addr / PAGE_SIZE, {addr, count, page, false}));
+
+            addr = gap_end;
         }
+    }
 
-        // Now update the tables
+    uint8_t Object::flags_for(const PageEntry &entry) {
+        return entry.shared ? page_flags & ~page::PAGE_TABLE_RW : page_flags;
+    }
+
+    // Updates the page table entries for the entry in every map the object is in
+    void Object::map_entry(PageEntry &entry) {
         for(ObjectInMap *oim : objects_in_maps) {
-            oim->map->insert(oim->base + addr - oim->offset, page, page_flags, oim->base, oim->base + oim->pages * PAGE_SIZE);
+            oim->map->insert(oim->base + entry.offset - oim->offset, entry.page, flags_for(entry), oim->base,
+                oim->base + oim->pages * PAGE_SIZE);
         }
     }
 
+    shared_ptr<Object> Object::clone() {
+        return nullptr;
+    }
+
+    void Object::share_pages(Object &copy) {
+        pages.each([&](uint32_t key, PageEntry &entry) {
+            copy.pages.insert(key, {entry.offset, entry.count, page::share(entry.page), true});
+
+            if(!entry.shared) {
+                // Writes from now on must not be seen by the copy
+                entry.shared = true;
+                map_entry(entry);
+            }
+        });
+    }
+
+    bool Object::copy_on_write(uint32_t addr) {
+        PageEntry *entry = find_page(addr);
+
+        if(!entry || !entry->shared || !(page_flags & page::PAGE_TABLE_RW)) {
+            return false;
+        }
+
+        // Split the page out of its entry, so that only it is copied
+        addr &= ~(PAGE_SIZE - 1);
+        if(entry->offset < addr) {
+            uint32_t before = (addr - entry->offset) / PAGE_SIZE;
+            PageEntry after = {addr, entry->count - before, entry->page->split(before), true};
+
+            entry->count = before;
+            entry = pages.insert(addr / PAGE_SIZE, after);
+        }
+        if(entry->count > 1) {
+            pages.insert(addr / PAGE_SIZE + 1, {addr + PAGE_SIZE, entry->count - 1, entry->page->split(1), true});
+            entry->count = 1;
+        }
+
+        if(page::references(entry->page->mem_base) != 1) {
+            // The clone still has it, so this object needs its own copy
+            page::Page *copy = page::alloc(0, 1);
+            void *from = page::kinstall(entry->page, 0);
+            void *to = page::kinstall(copy, page::PAGE_TABLE_RW);
+
+            memcpy(to, from, PAGE_SIZE);
+
+            page::kuninstall(to, copy);
+            page::kuninstall(from, entry->page);
+            page::free(entry->page);
+            entry->page = copy;
+        }
+
+        entry->shared = false;
+        map_entry(*entry);
+        return true;
+    }
+
     void Object::add_object_in_map(ObjectInMap *oim) {
         objects_in_maps.push_front(oim);
 
         vm::Map *map = oim->map;
 
         // Fill in the pages already loaded into the vm
-        for(PageEntry *page_entry = pages.get(); page_entry; page_entry = page_entry->next.get()) {
-            map->insert(oim->base + page_entry->offset - oim->offset, page_entry->page, this->page_flags,
+        each_page_in(oim->offset, oim->offset + (int64_t)oim->pages * PAGE_SIZE, [&](PageEntry &page_entry) {
+            map->insert(oim->base + page_entry.offset - oim->offset, page_entry.page, flags_for(page_entry),
                 oim->base, oim->base + oim->pages * PAGE_SIZE);
-        }
+        });
     }
 
     void Object::remove_object_in_map(ObjectInMap *oim) {
-        PageEntry *page_entry;
+        // Erase all the page table entries, but only the ones in this mapping
+        int64_t first = oim->offset;
+        int64_t last = oim->offset + (int64_t)oim->pages * PAGE_SIZE;
+        each_page_in(first, last, [&](PageEntry &page_entry) {
+            int64_t start = page_entry.offset > first ? page_entry.offset : first;
+            int64_t end = page_entry.offset + (int64_t)page_entry.count * PAGE_SIZE;
+            if(end > last) {
+                end = last;
+            }
 
-        // Erase all the page table entries
-        for(page_entry = pages.get(); page_entry; page_entry = page_entry->next.get()) {
-            oim->map->clear(oim->base + page_entry->offset - oim->offset, page_entry->page->count());
-        }
+            oim->map->clear(oim->base + start - oim->offset, (end - start) / PAGE_SIZE);
+        });
 
         objects_in_maps.remove(oim);
     }
 
 
+    ObjectInMap *Object::find_in_map(vm::Map *map) {
+        for(ObjectInMap *oim : objects_in_maps) {
+            if(oim->map == map) {
+                return oim;
+            }
+        }
+
+        return nullptr;
+    }
+
+
     ObjectInMap::ObjectInMap(shared_ptr<Object> object, vm::Map *map, uint32_t base, int64_t offset, uint32_t pages)
         : object(object), map(map), base(base), offset(offset), pages(pages) {
         object->add_object_in_map(this);
@@ -248,11 +354,57 @@ namespace object {
         object->remove_object_in_map(this);
     }
 
+    void ObjectInMap::fault(uint32_t addr) {
+        uint32_t start;
+
+        if(object->object_flags & FLAG_LARGE_PAGES) {
+            int64_t region = ((int64_t)base + addr - offset) & ~(int64_t)(PAGE_DIR_SIZE - 1);
+            int64_t region_offset = region - base + offset;
+
+            if(region >= base && region + PAGE_DIR_SIZE <= base + (int64_t)pages * PAGE_SIZE && region_offset >= 0
+            && region_offset / PAGE_SIZE + PAGE_TABLE_LENGTH <= object->max_pages) {
+                object->generate(region_offset, PAGE_TABLE_LENGTH);
+                window = 0;
+                return;
+            }
+        }
+
+        if(window && addr == next_fault) {
+            // Sequential, carry on from where the last fault finished
+            window = window * 2 > READ_AHEAD_MAX_PAGES ? READ_AHEAD_MAX_PAGES : window * 2;
+            start = addr;
+        }else{
+            window = FAULT_AROUND_PAGES;
+            start = addr & ~(FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+        }
+
+        // Don't go outside the part of the object that is mapped
+        int64_t first = offset > 0 ? offset : 0;
+        int64_t last = offset + (int64_t)pages * PAGE_SIZE;
+        int64_t end = (int64_t)start + window * PAGE_SIZE;
+        if(start < first) {
+            start = first;
+        }
+        if(end > last) {
+            end = last;
+        }
+
+        object->generate(start, (end - start) / PAGE_SIZE);
+        next_fault = end;
+    }
+
 
     page::Page *EmptyObject::do_generate(addr_logical_t addr, uint32_t count) {
         (void)addr;
         return page::alloc(0, count);
     }
+
+    shared_ptr<Object> EmptyObject::clone() {
+        shared_ptr<Object> copy = make_shared<EmptyObject>(max_pages, page_flags, object_flags, 0);
+
+        share_pages(*copy);
+        return copy;
+    }
 }
 
 
@@ -272,7 +424,7 @@ public:
 
             printk("Generating %x\n", addr);
 
-            uint32_t *installed = (uint32_t *)page::kinstall(p, 0);
+            uint32_t *installed = (uint32_t *)page::kinstall(p, page::PAGE_TABLE_RW);
 
             for(uint32_t i = 0; i < count * PAGE_SIZE / 4; i ++) {
                 installed[i] = addr + (i * 4);
@@ -284,6 +436,21 @@ public:
         }
     };
 
+    // Only creates page descriptors without any memory behind them, so it can have far more pages than there is RAM
+    // It must never be mapped
+    class DescriptorObject : public object::Object {
+    public:
+        DescriptorObject(uint32_t max_pages, uint8_t page_flags, uint8_t object_flags, uint32_t offset) :
+            Object(max_pages, page_flags, object_flags, offset) {};
+
+        page::Page *do_generate(addr_logical_t addr, uint32_t count) {
+            (void)addr;
+            return page::create(0, 0, count);
+        }
+    };
+
+    static const uint32_t LARGE = 64 * 1024;
+
     void run_test() override {
         using namespace object;
 
@@ -312,6 +479,48 @@ public:
 
         test("Removing an object");
         map->remove_object(obj);
+
+        test("Faulting around");
+        shared_ptr<Object> big = make_shared<IncObject>(64, page::PAGE_TABLE_RW, 0, 0);
+        map->add_object(big, 0x100000, 0x0, 64);
+        uint32_t faults = map->faults;
+        for(uint32_t i = 0; i < 64; i ++) {
+            assert(*(int *)(0x100000 + i * PAGE_SIZE + 8) == (int)(i * PAGE_SIZE + 8));
+        }
+        assert(map->faults - faults < 8);
+        assert(big->pages.size() == map->faults - faults);
+        map->remove_object(big);
+
+        test("Faulting around at random");
+        big = make_shared<IncObject>(64, page::PAGE_TABLE_RW, 0, 0);
+        map->add_object(big, 0x100000, 0x0, 64);
+        faults = map->faults;
+        for(uint32_t i = 0; i < 64; i ++) {
+            uint32_t p = (i * 37) % 64;
+            assert(*(int *)(0x100000 + p * PAGE_SIZE) == (int)(p * PAGE_SIZE));
+        }
+        assert(map->faults - faults <= 64 / FAULT_AROUND_PAGES);
+        uint32_t next_offset = 0;
+        big->pages.each([&](uint32_t key, PageEntry &entry) {
+            assert(entry.offset == key * PAGE_SIZE);
+            assert(entry.offset >= next_offset);
+            next_offset = entry.offset + entry.count * PAGE_SIZE;
+        });
+        map->remove_object(big);
+
+        test("Populating a large object");
+        shared_ptr<Object> huge = make_shared<DescriptorObject>(LARGE, 0, 0, 0);
+        for(uint32_t i = 1; i < LARGE; i += 2) {
+            huge->generate(i * PAGE_SIZE, 1);
+        }
+        assert(huge->pages.size() == LARGE / 2);
+        huge->generate(0, LARGE);
+        assert(huge->pages.size() == LARGE);
+        for(uint32_t i = 0; i < LARGE; i ++) {
+            PageEntry *entry = huge->find_page(i * PAGE_SIZE + 8);
+            assert(entry && entry->offset == i * PAGE_SIZE && entry->count == 1);
+        }
+        huge = nullptr;
     }
 };
 
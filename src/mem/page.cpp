@@ -8,17 +8,41 @@
 #include "main/panic.hpp"
 #include "main/asm_utils.hpp"
 #include "int/lapic.hpp"
+#include "test/test.hpp"
 
 namespace page {
+    #define _MAX_ORDER 10
+    #define _MAX_BLOCK (1 << _MAX_ORDER)
+    #define _NO_FRAME 0xffffffff
+    #define _CR4_PGE (1 << 7)
+
     static Page *used_start;
     static Page static_page;
     static int page_id_counter;
-    static addr_phys_t allocation_pointer;
     static page_table_entry_t *cursor;
-    static multiboot::entry_t *current_map;
     static addr_logical_t virtual_pointer;
     page_dir_t *page_dir;
-    static Page *page_free_head;
+
+    // Physical frames are managed by a buddy allocator. Free blocks of each order (2^order frames, aligned to their size)
+    //  are kept in doubly linked lists threaded through the `links` array, and `free_bits[order]` has a bit set for
+    //  each block of that order at the head of a free list. `owned_bits` has a bit set for each frame that has been
+    //  handed out, so that page::free can ignore frames that it doesn't manage (such as those from page::create).
+    //  `share_counts` has, for each frame handed out, how many Page descriptors other than the first refer to it (see
+    //  page::share).
+    // All of these live in memory reserved by page::init, so nothing here needs kmalloc.
+    /** @private */
+    struct _frame_link_t {
+        uint32_t next;
+        uint32_t prev;
+    };
+    static _frame_link_t *links;
+    static uint32_t *free_bits[_MAX_ORDER + 1];
+    static uint32_t *owned_bits;
+    static uint16_t *share_counts;
+    static uint32_t free_heads[_MAX_ORDER + 1];
+    static uint32_t base_frame;
+    static uint32_t frame_count;
+    static volatile uint32_t frames_free;
 
     typedef struct _empty_virtual_slot_s _empty_virtual_slot_t;
     struct _empty_virtual_slot_s {
@@ -28,40 +52,202 @@ namespace page {
     };
     static _empty_virtual_slot_t *empty_slot;
 
-    static void invlpg(addr_logical_t addr) {
-        __asm__ volatile ("invlpg (%0)" : : "r"(addr));
-        lapic::send_command_all(lapic::CMD_INVLPG, addr);
+    // The page directories of every vm::Map, whose copies of the kernel's directory entries must be kept the same as
+    //  page_dir's. Protected by kmem::lock.
+    /** @private */
+    struct _dir_link_t {
+        volatile page_dir_t *dir;
+        _dir_link_t *next;
+    };
+    static _dir_link_t *dirs;
+
+    void flush_tlb_local() {
+        uint32_t cr4;
+
+        // Kernel mappings are global, so reloading CR3 doesn't remove them. Toggling CR4.PGE does.
+        __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+        __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4 & ~_CR4_PGE) : "memory");
+        __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    }
+
+
+    void flush_tlb(addr_logical_t base, uint32_t count) {
+        uint32_t eflags = push_cli();
+
+        if(count > TLB_FLUSH_THRESHOLD) {
+            flush_tlb_local();
+            lapic::send_command_all(lapic::CMD_FLUSH_TLB, 0);
+        }else{
+            for(uint32_t i = 0; i < count; i ++) {
+                __asm__ volatile ("invlpg (%0)" : : "r"(base + i * PAGE_SIZE) : "memory");
+            }
+            lapic::send_command_all(lapic::CMD_INVLPG, base, count);
+        }
+
+        pop_flags(eflags);
+    }
+
+
+    static bool _test_bit(uint32_t *bits, uint32_t index) {
+        return bits[index / 32] & (1 << (index % 32));
+    }
+
+    static void _set_bit(uint32_t *bits, uint32_t index, bool value) {
+        if(value) {
+            bits[index / 32] |= (1 << (index % 32));
+        }else{
+            bits[index / 32] &= ~(1 << (index % 32));
+        }
+    }
+
+    static bool _is_free(uint32_t frame, uint32_t order) {
+        return _test_bit(free_bits[order], (frame - base_frame) >> order);
+    }
+
+    static void _push_block(uint32_t frame, uint32_t order) {
+        _frame_link_t &link = links[frame - base_frame];
+
+        link.prev = _NO_FRAME;
+        link.next = free_heads[order];
+        if(link.next != _NO_FRAME) {
+            links[link.next - base_frame].prev = frame;
+        }
+        free_heads[order] = frame;
+        _set_bit(free_bits[order], (frame - base_frame) >> order, true);
+    }
+
+    static void _remove_block(uint32_t frame, uint32_t order) {
+        _frame_link_t &link = links[frame - base_frame];
+
+        if(link.prev != _NO_FRAME) {
+            links[link.prev - base_frame].next = link.next;
+        }else{
+            free_heads[order] = link.next;
+        }
+        if(link.next != _NO_FRAME) {
+            links[link.next - base_frame].prev = link.prev;
+        }
+        _set_bit(free_bits[order], (frame - base_frame) >> order, false);
     }
 
 
     static void _verify(const char *func) {
         (void)func;
     #if DEBUG_MEM
-        Page *now;
-        Page *prev = NULL;
-        for(now = page_free_head; now; ((prev = now), (now = now->next))) {
-            if(now->next) {
-                if(now->next->mem_base < now->mem_base) {
-                    panic("Free page list corruption, List out of order [%s]", func);
+        uint32_t total = 0;
+        for(uint32_t order = 0; order <= _MAX_ORDER; order ++) {
+            uint32_t prev = _NO_FRAME;
+            for(uint32_t now = free_heads[order]; now != _NO_FRAME; ((prev = now), (now = links[now - base_frame].next))) {
+                if(now % (1 << order)) {
+                    panic("Free frame corruption, block is not aligned to its order [%s]", func);
+                }
+
+                if(!_is_free(now, order)) {
+                    panic("Free frame corruption, block in free list is not marked free [%s]", func);
                 }
 
-                if(prev && prev->mem_base + (prev->consecutive * PAGE_SIZE) > now->mem_base) {
-                    panic("Free page list corruption, Overlapping pages [%s]", func);
+                if(links[now - base_frame].prev != prev) {
+                    panic("Free frame corruption, broken back link [%s]", func);
                 }
+
+                total += 1 << order;
             }
         }
+
+        if(total != frames_free) {
+            panic("Free frame corruption, free lists have %d frames but %d are free [%s]", total, frames_free, func);
+        }
     #endif
     }
 
 
-    static void _merge_free(Page *first) {
-        if(first->next && first->mem_base + (first->consecutive * PAGE_SIZE) == first->next->mem_base) {
-            Page *hold = first->next;
-            first->consecutive += hold->consecutive;
-            first->next = hold->next;
-            kmem::kfree_nolock(hold);
-            _verify(__func__);
+    // Frees a single block, merging it with its buddy as many times as possible
+    static void _free_block(uint32_t frame, uint32_t order) {
+        frames_free += 1 << order;
+
+        while(order < _MAX_ORDER) {
+            uint32_t buddy = frame ^ (1 << order);
+
+            if(buddy < base_frame || buddy >= base_frame + frame_count || !_is_free(buddy, order)) {
+                break;
+            }
+
+            _remove_block(buddy, order);
+            frame &= ~(1 << order);
+            order ++;
         }
+
+        _push_block(frame, order);
+    }
+
+    // Frees an arbitrary run of frames, by splitting it into the largest aligned blocks possible
+    static void _free_range(uint32_t frame, uint32_t count) {
+        while(count) {
+            uint32_t order = _MAX_ORDER;
+            while((frame % (1 << order)) || (uint32_t)(1 << order) > count) order --;
+
+            _free_block(frame, order);
+            frame += 1 << order;
+            count -= 1 << order;
+        }
+    }
+
+    // Allocates a block of exactly the given order, splitting a larger one if needed
+    static uint32_t _alloc_block(uint32_t order) {
+        uint32_t found = order;
+        uint32_t frame;
+
+        for(; found <= _MAX_ORDER && free_heads[found] == _NO_FRAME; found ++);
+        if(found > _MAX_ORDER) {
+            return _NO_FRAME;
+        }
+
+        frame = free_heads[found];
+        _remove_block(frame, found);
+
+        // Give the upper halves back until the block is the right size
+        while(found > order) {
+            found --;
+            _push_block(frame + (1 << found), found);
+        }
+
+        frames_free -= 1 << order;
+        return frame;
+    }
+
+    // Whether the frame was handed out by the allocator
+    static bool _owned(uint32_t frame) {
+        return frame >= base_frame && frame < base_frame + frame_count && _test_bit(owned_bits, frame - base_frame);
+    }
+
+    static void _set_owned(uint32_t frame, uint32_t count, bool owned) {
+        for(uint32_t i = 0; i < count; i ++) {
+            _set_bit(owned_bits, frame - base_frame + i, owned);
+        }
+    }
+
+    // Allocates a contiguous run of up to `count` frames, which may be fewer if memory is fragmented
+    static uint32_t _alloc_run(uint32_t count, uint32_t *got) {
+        uint32_t order = 0;
+        uint32_t frame;
+
+        while(order < _MAX_ORDER && (uint32_t)(1 << order) < count) order ++;
+
+        for(frame = _alloc_block(order); frame == _NO_FRAME; frame = _alloc_block(order)) {
+            if(order == 0) {
+                panic("Ran out of physical memory!");
+            }
+            order --;
+        }
+
+        *got = (uint32_t)(1 << order) < count ? (1 << order) : count;
+        _set_owned(frame, *got, true);
+        if(*got < (uint32_t)(1 << order)) {
+            _free_range(frame + *got, (1 << order) - *got);
+        }
+        _verify(__func__);
+
+        return frame;
     }
 
 
@@ -78,12 +264,13 @@ namespace page {
 
     void init() {
         page_table_t *page_table;
-
-        allocation_pointer = (addr_phys_t)kmem::map.memory_start - KERNEL_VM_BASE;
-
-        for(current_map = &(multiboot::mem_table[0]);
-            (current_map->base + current_map->length) < allocation_pointer;
-            current_map ++);
+        addr_phys_t reserved_start;
+        addr_phys_t reserved_end;
+        uint64_t highest = 0;
+        uint32_t words;
+        uint32_t *bits;
+        Page reserved;
+        multiboot::entry_t *region = NULL;
 
         // The cursor in the table to use
         // This is the logical address of the next unallocated space in the kernel address space
@@ -94,11 +281,85 @@ namespace page {
             &(page_table->entries[((kmem::map.vm_end >> page::PAGE_TABLE_SHIFT) & page::PAGE_TABLE_MASK)]))
                 + (addr_logical_t)KERNEL_VM_BASE);
         virtual_pointer = kmem::map.vm_end;
+
+        // Work out which frames need to be managed, everything usable above the kernel and below 4GiB
+        reserved_start = (addr_phys_t)kmem::map.memory_start - KERNEL_VM_BASE;
+        reserved_start = (reserved_start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        for(uint32_t i = 0; i < LOCAL_MM_COUNT; i ++) {
+            multiboot::entry_t *entry = &multiboot::mem_table[i];
+            uint64_t end = entry->base + entry->length;
+
+            if(entry->type != 1) continue;
+            if(end > TOTAL_VM_SIZE) end = TOTAL_VM_SIZE;
+            if(end > highest) highest = end;
+            if(entry->base <= reserved_start && end > reserved_start) region = entry;
+        }
+
+        if(!region) {
+            panic("Could not find the memory region the kernel is loaded into!");
+        }
+
+        base_frame = (reserved_start / PAGE_SIZE) & ~(_MAX_BLOCK - 1);
+        frame_count = (uint32_t)(highest / PAGE_SIZE) - base_frame;
+        frame_count = (frame_count + _MAX_BLOCK - 1) & ~(_MAX_BLOCK - 1);
+
+        // Then reserve space for the allocator's own structures directly after the kernel
+        reserved_end = reserved_start + frame_count * sizeof(_frame_link_t);
+        for(uint32_t order = 0; order <= _MAX_ORDER; order ++) {
+            reserved_end += ((frame_count >> order) + 31) / 32 * sizeof(uint32_t);
+        }
+        reserved_end += (frame_count + 31) / 32 * sizeof(uint32_t);
+        reserved_end += frame_count * sizeof(uint16_t);
+        reserved_end = (reserved_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+        if(reserved_end > region->base + region->length) {
+            panic("Not enough memory for the physical memory allocator!");
+        }
+
+        reserved.page_id = page_id_counter ++;
+        reserved.mem_base = reserved_start;
+        reserved.flags = FLAG_ALLOCATED | FLAG_KERNEL;
+        reserved.consecutive = (reserved_end - reserved_start) / PAGE_SIZE;
+        reserved.next = NULL;
+        links = (_frame_link_t *)kinstall_append(&reserved, PAGE_TABLE_RW, false);
+
+        bits = (uint32_t *)(links + frame_count);
+        for(uint32_t order = 0; order <= _MAX_ORDER; order ++) {
+            words = ((frame_count >> order) + 31) / 32;
+            free_bits[order] = bits;
+            memset(bits, 0, words * sizeof(uint32_t));
+            bits += words;
+            free_heads[order] = _NO_FRAME;
+        }
+        words = (frame_count + 31) / 32;
+        owned_bits = bits;
+        memset(bits, 0, words * sizeof(uint32_t));
+        share_counts = (uint16_t *)(bits + words);
+        memset(share_counts, 0, frame_count * sizeof(uint16_t));
+
+        // And finally give every usable region to the allocator
+        for(uint32_t i = 0; i < LOCAL_MM_COUNT; i ++) {
+            multiboot::entry_t *entry = &multiboot::mem_table[i];
+            uint64_t start = entry->base;
+            uint64_t end = entry->base + entry->length;
+
+            if(entry->type != 1) continue;
+            if(start < reserved_end) start = reserved_end;
+            if(end > TOTAL_VM_SIZE) end = TOTAL_VM_SIZE;
+            start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+            end &= ~(uint64_t)(PAGE_SIZE - 1);
+
+            if(end > start) {
+                _free_range(start / PAGE_SIZE, (end - start) / PAGE_SIZE);
+            }
+        }
+
+        _verify(__func__);
     }
 
 
     Page *create(uint32_t base, uint8_t flags, unsigned int count) {
-        kmem::mutex.lock();
+        spinlock::IrqSave guard(kmem::lock);
         Page *write;
 
         write = (Page *)kmem::kmalloc(sizeof(Page), kmem::KMALLOC_RESERVED | kmem::KMALLOC_NOLOCK);
@@ -111,53 +372,32 @@ namespace page {
         printk("Allocated %d pages.\n", count);
 #endif
 
-        kmem::mutex.unlock();
         return write;
     }
 
 
     Page *alloc_nokmalloc(uint8_t flags, unsigned int count) {
         Page *write = &static_page;
-        unsigned int size = count * PAGE_SIZE;
+        uint32_t got;
 
         uint32_t eflags;
         if(!(flags & FLAG_NOLOCK)) {
             eflags = push_cli();
-            kmem::mutex.lock();
-        }
-
-        if((allocation_pointer + size) >= (current_map->base + current_map->length)) {
-            size = (current_map->base + current_map->length) - allocation_pointer;
+            kmem::lock.lock();
         }
 
         write->page_id = page_id_counter ++;
-        write->mem_base = allocation_pointer;
+        write->mem_base = _alloc_run(count, &got) * PAGE_SIZE;
         write->flags = FLAG_ALLOCATED | flags;
-        write->consecutive = size / PAGE_SIZE;
+        write->consecutive = got;
         write->next = NULL;
-        allocation_pointer = write->mem_base + size;
-
-        if((write->mem_base + size) == (current_map->base + current_map->length)) {
-    #if DEBUG_MEM
-            printk("Have to skip to the next memory region.\n");
-    #endif
-            current_map ++;
-            for(; current_map->type != 1 && current_map < (multiboot::mem_table + sizeof(multiboot::mem_table)); current_map ++);
-            if(current_map >= (multiboot::mem_table + sizeof(multiboot::mem_table))) {
-                panic("Ran out of physical memory!");
-            }
-            if(current_map->base > UINT32_MAX) {
-                panic("Ran out of addressable physical memory!");
-            }
-            allocation_pointer = current_map->base;
-        }
 
 #if DEBUG_MEM
-        printk("Allocated %d pages at %p.\n", count, write->mem_base);
+        printk("Allocated %d pages at %p.\n", got, write->mem_base);
 #endif
 
         if(!(flags & FLAG_NOLOCK)) {
-            kmem::mutex.unlock();
+            kmem::lock.unlock();
             pop_flags(eflags);
         }
 
@@ -166,7 +406,8 @@ namespace page {
 
 
     Page *alloc(uint8_t flags, unsigned int count) {
-        Page *new_page;
+        Page *first = NULL;
+        Page *last = NULL;
         uint8_t alloc_flag = (flags & page::FLAG_RESERVED) ? kmem::KMALLOC_RESERVED : 0;
         alloc_flag |= kmem::KMALLOC_NOLOCK;
 
@@ -177,80 +418,131 @@ namespace page {
         uint32_t eflags;
         if(!(flags & FLAG_NOLOCK)) {
             eflags = push_cli();
-            kmem::mutex.lock();
-        }
-
-        // Collect all the pages in the free list
-        if(page_free_head) {
-            if(page_free_head->consecutive > count) {
-                new_page = (Page *)kmem::kmalloc(sizeof(Page), alloc_flag);
-                new_page->page_id = page_id_counter ++;
-                new_page->mem_base = page_free_head->mem_base;
-                new_page->consecutive = count;
-                page_free_head->mem_base += count * PAGE_SIZE;
-                page_free_head->consecutive -= count;
-            }else{
-                new_page = page_free_head;
-                page_free_head = new_page->next;
-            }
+            kmem::lock.lock();
+        }
+
+        // Take the largest runs we can get, chaining them together if the memory is fragmented
+        while(count) {
+            uint32_t got;
+            uint32_t frame = _alloc_run(count, &got);
+
+            // This calls kmalloc, which may itself allocate pages, but the buddy allocator is consistent at this point
+            Page *new_page = (Page *)kmem::kmalloc(sizeof(Page), alloc_flag);
+            new_page->page_id = page_id_counter ++;
+            new_page->mem_base = frame * PAGE_SIZE;
             new_page->flags = flags;
+            new_page->consecutive = got;
             new_page->next = NULL;
-            _verify(__func__);
-        }else{
-            new_page = (Page *)kmem::kmalloc(sizeof(Page), alloc_flag);
-            alloc_nokmalloc(flags | FLAG_NOLOCK, count);
-            memcpy(new_page, &static_page, sizeof(Page));
-        }
 
-        if(new_page->consecutive < count) {
-            new_page->next = alloc(flags, count - new_page->consecutive);
+            if(last) {
+                last->next = new_page;
+            }else{
+                first = new_page;
+            }
+            last = new_page;
+            count -= got;
         }
 
         if(!(flags & FLAG_NOLOCK)) {
-            kmem::mutex.unlock();
+            kmem::lock.unlock();
             pop_flags(eflags);
         }
 
-        return new_page;
+        return first;
     }
 
 
     void free(Page *page) {
-        Page *now;
-        Page *prev = NULL;
+        Page *next;
+        spinlock::IrqSave guard(kmem::lock);
+
+        for(; page; page = next) {
+            uint32_t frame = page->mem_base / PAGE_SIZE;
+            uint32_t run = 0;
+            next = page->next;
+
+            // Only give back frames we handed out, pages from page::create may point anywhere, and frames which
+            //  another descriptor still refers to just lose a share
+            for(uint32_t i = 0; i < page->consecutive; i ++) {
+                uint32_t f = frame + i;
+                if(_owned(f) && !share_counts[f - base_frame]) {
+                    _set_bit(owned_bits, f - base_frame, false);
+                    run ++;
+                }else{
+                    if(_owned(f)) share_counts[f - base_frame] --;
+                    if(run) _free_range(f - run, run);
+                    run = 0;
+                }
+            }
+            if(run) _free_range(frame + page->consecutive - run, run);
+            _verify(__func__);
 
-        if(!page) {
-            return;
+            kmem::kfree_nolock(page);
         }
+    }
 
-        if(page->next) {
-            free(page->next);
-        }
 
-        kmem::mutex.lock();
+    Page *share(Page *page) {
+        spinlock::IrqSave guard(kmem::lock);
+        Page *first = nullptr;
+        Page *last = nullptr;
 
-        for(now = page_free_head; now && now->mem_base < page->mem_base; ((prev = now), (now = now->next)));
-        if(prev) {
-            prev->next = page;
-        }else{
-            page_free_head = page;
+        for(; page; page = page->next) {
+            uint32_t frame = page->mem_base / PAGE_SIZE;
+
+            for(uint32_t i = 0; i < page->consecutive; i ++) {
+                if(_owned(frame + i)) {
+                    if(share_counts[frame + i - base_frame] == UINT16_MAX) {
+                        panic("Frame %x is shared too many times", frame + i);
+                    }
+                    share_counts[frame + i - base_frame] ++;
+                }
+            }
+
+            Page *new_page = (Page *)kmem::kmalloc(sizeof(Page), kmem::KMALLOC_NOLOCK);
+            new_page->page_id = page_id_counter ++;
+            new_page->mem_base = page->mem_base;
+            new_page->flags = page->flags;
+            new_page->consecutive = page->consecutive;
+            new_page->next = NULL;
+
+            if(last) {
+                last->next = new_page;
+            }else{
+                first = new_page;
+            }
+            last = new_page;
         }
-        page->next = now;
 
-        // Try to flatten the free entries
-        _merge_free(page);
-        if(prev) _merge_free(prev);
+        return first;
+    }
+
+    uint32_t references(addr_phys_t addr) {
+        spinlock::IrqSave guard(kmem::lock);
+        uint32_t frame = addr / PAGE_SIZE;
+
+        return _owned(frame) ? share_counts[frame - base_frame] + 1 : 0;
+    }
+
 
-        kmem::mutex.unlock();
+    uint32_t free_count() {
+        return frames_free;
     }
 
 
     void used(Page *page, bool lock) {
-        if(lock) kmem::mutex.lock();
+        uint32_t eflags;
+        if(lock) {
+            eflags = push_cli();
+            kmem::lock.lock();
+        }
         Page *old_next = page->next;
         page->next = used_start;
         used_start = page;
-        if(lock) kmem::mutex.unlock();
+        if(lock) {
+            kmem::lock.unlock();
+            pop_flags(eflags);
+        }
 
         if(old_next) {
             used(old_next, lock);
@@ -258,92 +550,237 @@ namespace page {
     }
 
 
-    void *kinstall_append(Page *page, uint8_t page_flags, bool lock) {
-        uint32_t i;
-        addr_logical_t first = 0;
-        if(lock) kmem::mutex.lock();
-        for(i = 0; i < page->consecutive; i ++) {
-            if(virtual_pointer >= TOTAL_VM_SIZE - PAGE_SIZE) {
-                panic("Ran out of kernel virtual address space!");
-            }
+    // Changes one of the kernel's directory entries, in every page directory. kmem::lock must be held.
+    static void _set_kernel_dir(uint32_t slot, page_dir_entry_t entry) {
+        page_dir->entries[slot] = entry;
+        for(_dir_link_t *link = dirs; link; link = link->next) {
+            link->dir->entries[slot] = entry;
+        }
+    }
 
-            *cursor = (page->mem_base + PAGE_SIZE * i) | page_flags | page::PAGE_TABLE_PRESENT;
-            if(!first) {
-                first = virtual_pointer;
-            }
+    // If the kernel maps the given slot with a 4MiB page, go back to using its page table there, with each entry
+    //  mapping the same frame as before. kmem::lock must be held.
+    static void _split_kernel_dir(uint32_t slot) {
+        page_dir_entry_t large = page_dir->entries[slot];
+        page_table_t *table = (page_table_t *)(page_dir + 1) + (slot - (KERNEL_VM_BASE >> PAGE_DIR_SHIFT));
 
-            virtual_pointer += PAGE_SIZE;
+        if(!(large & PAGE_TABLE_SIZE)) {
+            return;
+        }
 
-            cursor ++;
+        for(uint32_t i = 0; i < PAGE_TABLE_LENGTH; i ++) {
+            table->entries[i] = ((large & ~(PAGE_DIR_SIZE - 1)) + i * PAGE_SIZE)
+                | (large & PAGE_TABLE_FLAGMASK & ~PAGE_TABLE_SIZE);
         }
+        _set_kernel_dir(slot, ((addr_logical_t)table - KERNEL_VM_BASE) | PAGE_TABLE_RW | PAGE_TABLE_PRESENT);
+    }
 
-        kmem::map.memory_end = virtual_pointer;
-        if(lock) kmem::mutex.unlock();
+    void add_dir(volatile page_dir_t *dir) {
+        _dir_link_t *link = (_dir_link_t *)kmem::kmalloc(sizeof(_dir_link_t), 0);
+        spinlock::IrqSave guard(kmem::lock);
 
-        if(page->next) {
-            kinstall_append(page->next, page_flags);
+        for(uint32_t i = PAGE_TABLE_LENGTH - KERNEL_VM_PAGE_TABLES; i < PAGE_TABLE_LENGTH; i ++) {
+            dir->entries[i] = page_dir->entries[i];
         }
 
-#if DEBUG_MEM
-        printk("KInstalled %d new pages at %p onto %p.\n", page->consecutive, base, first);
-#endif
+        link->dir = dir;
+        link->next = dirs;
+        dirs = link;
+    }
 
-        return (void *)first;
+    void remove_dir(volatile page_dir_t *dir) {
+        _dir_link_t *link;
+        {
+            spinlock::IrqSave guard(kmem::lock);
+            _dir_link_t **prev = &dirs;
+
+            for(link = dirs; link && link->dir != dir; link = link->next) {
+                prev = &link->next;
+            }
+            if(!link) {
+                return;
+            }
+            *prev = link->next;
+        }
+
+        kmem::kfree(link);
     }
 
+    // Adds a record of some free kernel address space to the empty slots, merging it with its neighbours. kmem::lock
+    //  must be held.
+    static void _add_free_slot(_empty_virtual_slot_t *new_slot) {
+        _empty_virtual_slot_t *now;
+        _empty_virtual_slot_t *prev = NULL;
 
-    void *kinstall(Page *page, uint8_t page_flags) {
-        Page *current = page;
-        _empty_virtual_slot_t *slot = empty_slot;
-        _empty_virtual_slot_t *prev_slot = NULL;
-        unsigned int total_pages = 0;
-        addr_logical_t base = 0;
-        uint32_t page_offset;
-        page_table_entry_t *table_entry;
-        unsigned int i;
+        for(now = empty_slot; now && now->base < new_slot->base; ((prev = now), (now = now->next)));
 
-        // Count the total number of pages we need
-        total_pages = page->count();
+        if(prev) {
+            prev->next = new_slot;
+        }else{
+            empty_slot = new_slot;
+        }
+        new_slot->next = now;
 
-        uint32_t eflags = push_cli();
-        kmem::mutex.lock();
+        // Try to flatten the free entries
+        _merge_free_slots(new_slot);
+        if(prev) _merge_free_slots(prev);
+    }
 
-        // And search for an empty hole in virtual memory for it
-        for(; slot && (slot->pages < total_pages); (prev_slot = slot), (slot = slot->next));
+    // Takes `pages` pages of address space starting on an `align` byte boundary out of the empty slots, returning its
+    //  address or 0 if there is no space. Taking it from the middle of a slot needs another record for the part after
+    //  it, which is `spare`; it is set to NULL if it was used, and such slots are skipped if it is NULL.
+    //  kmem::lock must be held.
+    static addr_logical_t _take_free_slot(uint32_t pages, uint32_t align, _empty_virtual_slot_t *&spare) {
+        _empty_virtual_slot_t *prev = NULL;
+
+        for(_empty_virtual_slot_t *slot = empty_slot; slot; ((prev = slot), (slot = slot->next))) {
+            uint64_t base = ((uint64_t)slot->base + align - 1) & ~(uint64_t)(align - 1);
+            uint64_t end = (uint64_t)slot->base + (uint64_t)slot->pages * PAGE_SIZE;
 
-        if(slot) {
-            if(slot->pages == total_pages) {
-                if(prev_slot) {
-                    prev_slot->next = slot->next;
+            if(base + (uint64_t)pages * PAGE_SIZE > end) {
+                continue;
+            }
+
+            uint32_t before = (base - slot->base) / PAGE_SIZE;
+            uint32_t after = (end - base) / PAGE_SIZE - pages;
+
+            if(before && after) {
+                if(!spare) {
+                    continue;
+                }
+                spare->base = base + pages * PAGE_SIZE;
+                spare->pages = after;
+                spare->next = slot->next;
+                slot->next = spare;
+                slot->pages = before;
+                spare = NULL;
+            }else if(before) {
+                slot->pages = before;
+            }else if(after) {
+                slot->base += pages * PAGE_SIZE;
+                slot->pages = after;
+            }else{
+                if(prev) {
+                    prev->next = slot->next;
                 }else{
                     empty_slot = slot->next;
                 }
-                base = slot->base;
                 kmem::kfree_nolock(slot);
-            }else{
-                base = slot->base;
-                slot->pages -= total_pages;
-                slot->base += total_pages * PAGE_SIZE;
             }
 
-            if(base) {
-                page_offset = (base - KERNEL_VM_BASE) / PAGE_SIZE;
-                table_entry = (page_table_entry_t *)(page_dir + 1) + page_offset;
+            return base;
+        }
 
-                for(current = page; current; current = current->next) {
-                    for(i = 0; i < page->consecutive; i ++) {
-                        *table_entry = (current->mem_base + PAGE_SIZE * i) | page_flags | page::PAGE_TABLE_PRESENT;
-                        invlpg((addr_logical_t)current->mem_base + PAGE_SIZE * i);
-                        table_entry ++;
-                    }
+        return 0;
+    }
+
+    // Maps the pages into kernel memory starting at `base`, using 4MiB pages wherever they are aligned. The address
+    //  space must be unused and its page tables must not be split into 4MiB pages. kmem::lock must be held.
+    static void _map_kernel(addr_logical_t base, Page *page, uint8_t page_flags) {
+        page_table_entry_t *table_entry = (page_table_entry_t *)(page_dir + 1) + (base - KERNEL_VM_BASE) / PAGE_SIZE;
+
+        for(Page *current = page; current; current = current->next) {
+            for(uint32_t i = 0; i < current->consecutive; i ++) {
+                addr_phys_t phys = current->mem_base + PAGE_SIZE * i;
+
+                if(base % PAGE_DIR_SIZE == 0 && base <= TOTAL_VM_SIZE - PAGE_DIR_SIZE * 2
+                && fits_large(phys, current->consecutive - i)) {
+                    _set_kernel_dir(base >> PAGE_DIR_SHIFT,
+                        phys | page_flags | PAGE_TABLE_PRESENT | PAGE_TABLE_GLOBAL | PAGE_TABLE_SIZE);
+                    base += PAGE_DIR_SIZE;
+                    table_entry += PAGE_TABLE_LENGTH;
+                    i += PAGE_TABLE_LENGTH - 1;
+                }else{
+                    *table_entry = phys | page_flags | PAGE_TABLE_PRESENT | PAGE_TABLE_GLOBAL;
+                    base += PAGE_SIZE;
+                    table_entry ++;
                 }
+            }
+        }
+    }
+
+    void *kinstall_append(Page *page, uint8_t page_flags, bool lock) {
+        addr_logical_t first;
+        uint32_t total_pages = page->count();
+        uint32_t eflags;
+        if(lock) {
+            eflags = push_cli();
+            kmem::lock.lock();
+        }
 
-                kmem::mutex.unlock();
-                pop_flags(eflags);
-                return (void *)base;
+        // Runs which can use 4MiB pages are started on a 4MiB boundary, so that the TLB needs far fewer entries for
+        //  them. The address space skipped over is given to the empty slots so kinstall can use it later.
+        if(fits_large(page->mem_base, page->consecutive) && virtual_pointer % PAGE_DIR_SIZE) {
+            // This may grow kmem, which moves virtual_pointer, so it is done before working out how much is skipped
+            _empty_virtual_slot_t *gap =
+                (_empty_virtual_slot_t *)kmem::kmalloc(sizeof(_empty_virtual_slot_t), kmem::KMALLOC_NOLOCK);
+            uint32_t skipped = (PAGE_DIR_SIZE - virtual_pointer % PAGE_DIR_SIZE) % PAGE_DIR_SIZE / PAGE_SIZE;
+
+            if(skipped) {
+                gap->base = virtual_pointer;
+                gap->pages = skipped;
+                _add_free_slot(gap);
+                virtual_pointer += skipped * PAGE_SIZE;
+                cursor += skipped;
+            }else{
+                kmem::kfree_nolock(gap);
             }
         }
-        kmem::mutex.unlock();
+        first = virtual_pointer;
+
+        if((uint64_t)virtual_pointer + (uint64_t)total_pages * PAGE_SIZE > TOTAL_VM_SIZE - PAGE_SIZE) {
+            panic("Ran out of kernel virtual address space!");
+        }
+
+        _map_kernel(first, page, page_flags);
+        virtual_pointer += total_pages * PAGE_SIZE;
+        cursor += total_pages;
+
+        kmem::map.memory_end = virtual_pointer;
+        if(lock) {
+            kmem::lock.unlock();
+            pop_flags(eflags);
+        }
+
+#if DEBUG_MEM
+        printk("KInstalled %d new pages at %p.\n", total_pages, first);
+#endif
+
+        return (void *)first;
+    }
+
+
+    void *kinstall(Page *page, uint8_t page_flags) {
+        _empty_virtual_slot_t *spare = NULL;
+        addr_logical_t base;
+        bool large = fits_large(page->mem_base, page->consecutive);
+
+        // Count the total number of pages we need
+        uint32_t total_pages = page->count();
+
+        uint32_t eflags = push_cli();
+        kmem::lock.lock();
+
+        // Runs which can use 4MiB pages need a 4MiB aligned hole, which may be in the middle of an empty slot
+        if(large) {
+            spare = (_empty_virtual_slot_t *)kmem::kmalloc(sizeof(_empty_virtual_slot_t), kmem::KMALLOC_NOLOCK);
+        }
+
+        // And search for an empty hole in virtual memory for it
+        base = _take_free_slot(total_pages, large ? PAGE_DIR_SIZE : PAGE_SIZE, spare);
+        if(spare) {
+            kmem::kfree_nolock(spare);
+        }
+
+        if(base) {
+            // Slots are flushed from the TLB by kuninstall before they become free, so no flush is needed here
+            _map_kernel(base, page, page_flags);
+
+            kmem::lock.unlock();
+            pop_flags(eflags);
+            return (void *)base;
+        }
+        kmem::lock.unlock();
         pop_flags(eflags);
 
         // No free spaces could be found
@@ -352,54 +789,51 @@ namespace page {
 
 
     void kuninstall(volatile void *base, Page *page) {
-        _empty_virtual_slot_t *now;
-        _empty_virtual_slot_t *prev = NULL;
         _empty_virtual_slot_t *new_slot;
         uint32_t page_offset;
         page_table_entry_t *table_entry;
+        uint32_t total_pages;
         unsigned int i;
 
         if(!page) {
             return;
         }
 
-        uint32_t eflags = push_cli();
-        kmem::mutex.lock();
-
-        for(now = empty_slot; now && now->base < (addr_logical_t)base; ((prev = now), (now = now->next)));
+        total_pages = page->count();
 
-        new_slot = (_empty_virtual_slot_t *)kmem::kmalloc(sizeof(_empty_virtual_slot_t), kmem::KMALLOC_NOLOCK);
-        new_slot->base = (addr_logical_t)base;
-        new_slot->pages = page->consecutive;
+        uint32_t eflags = push_cli();
+        kmem::lock.lock();
 
-        if(prev) {
-            prev->next = new_slot;
-        }else{
-            empty_slot = new_slot;
+        // Any 4MiB pages are split up first, since only part of one might be being removed
+        for(uint32_t slot = (addr_logical_t)base >> PAGE_DIR_SHIFT;
+        slot <= ((addr_logical_t)base + total_pages * PAGE_SIZE - 1) >> PAGE_DIR_SHIFT; slot ++) {
+            _split_kernel_dir(slot);
         }
-        new_slot->next = now;
 
         // Remove the mappings in the page table
         page_offset = ((addr_logical_t)base - KERNEL_VM_BASE) / PAGE_SIZE;
         table_entry = (page_table_entry_t *)(page_dir + 1) + page_offset;
 
-        for(i = 0; i < page->consecutive; i ++) {
+        for(i = 0; i < total_pages; i ++) {
             *table_entry = 0;
             table_entry ++;
-            invlpg((addr_logical_t)base);
-            base = (void *)((addr_phys_t)base + PAGE_SIZE);
         }
 
-        // Try to flatten the free entries
-        _merge_free_slots(new_slot);
-        if(prev) _merge_free_slots(prev);
+        kmem::lock.unlock();
 
-        kmem::mutex.unlock();
-        pop_flags(eflags);
+        // Other CPUs may be waiting on the kmem lock with interrupts disabled, so it can't be held while flushing
+        flush_tlb((addr_logical_t)base, total_pages);
 
-        if(page->next) {
-            kuninstall(base, page->next);
-        }
+        // Now nothing can still be using the old mappings, the slot can be reused
+        kmem::lock.lock();
+
+        new_slot = (_empty_virtual_slot_t *)kmem::kmalloc(sizeof(_empty_virtual_slot_t), kmem::KMALLOC_NOLOCK);
+        new_slot->base = (addr_logical_t)base;
+        new_slot->pages = total_pages;
+        _add_free_slot(new_slot);
+
+        kmem::lock.unlock();
+        pop_flags(eflags);
     }
 
 
@@ -416,6 +850,11 @@ namespace page {
     Page *Page::split(uint32_t count) {
         if(count > this->consecutive) {
             return this->next->split(count - this->consecutive);
+        }else if(count == this->consecutive) {
+            // Already split here, so don't create an empty descriptor
+            Page *after = this->next;
+            this->next = nullptr;
+            return after;
         }else{
             Page *created = create(this->mem_base + count * PAGE_SIZE, this->flags, this->consecutive - count);
             created->next = this->next;
@@ -424,4 +863,100 @@ namespace page {
             return created;
         }
     }
+
+    #undef _MAX_ORDER
+    #undef _MAX_BLOCK
+    #undef _NO_FRAME
+    #undef _CR4_PGE
+}
+
+
+namespace _tests {
+class PageTest : public test::TestCase {
+public:
+    PageTest() : test::TestCase("Physical Page Test") {};
+
+    void run_test() override {
+        test("Allocating and freeing pages");
+        // Allocate and free once first, so any memory kmem needs for the page records is already there
+        page::free(page::alloc(0, 3000));
+        uint32_t before = page::free_count();
+        page::Page *a = page::alloc(0, 1);
+        page::Page *b = page::alloc(0, 5);
+        assert(a && b);
+        assert(a->count() == 1);
+        assert(b->count() == 5);
+        assert(a->mem_base % PAGE_SIZE == 0);
+        assert(a->mem_base != b->mem_base);
+        for(page::Page *p = b; p; p = p->next) {
+            assert(a->mem_base < p->mem_base || a->mem_base >= p->mem_base + p->consecutive * PAGE_SIZE);
+        }
+        page::free(a);
+        page::free(b);
+        assert(page::free_count() == before);
+
+        test("Large allocations");
+        page::Page *c = page::alloc(0, 3000);
+        assert(c->count() == 3000);
+        assert(page::free_count() == before - 3000);
+        page::free(c);
+        assert(page::free_count() == before);
+
+        test("Created pages are not freed");
+        page::Page *d = page::create(0xB8000, page::FLAG_KERNEL, 1);
+        page::free(d);
+        assert(page::free_count() == before);
+
+        test("Sharing pages");
+        page::Page *e = page::alloc(0, 4);
+        page::Page *f = page::share(e);
+        page::Page *g = page::share(f);
+        assert(f != e && f->count() == 4 && f->mem_base == e->mem_base);
+        assert(page::references(e->mem_base) == 3);
+        assert(page::references(0xB8000) == 0);
+        page::free(e);
+        page::free(g);
+        assert(page::free_count() == before - 4);
+        assert(page::references(f->mem_base) == 1);
+        page::Page *h = f->split(1);
+        assert(f->count() == 1 && h->count() == 3);
+        page::free(f);
+        page::free(h);
+        assert(page::free_count() == before);
+
+        test("Large kernel mappings");
+        page::Page *i = page::alloc(0, PAGE_TABLE_LENGTH);
+        volatile uint32_t *mapped = (volatile uint32_t *)page::kinstall(i, page::PAGE_TABLE_RW);
+        uint32_t slot = (addr_logical_t)mapped >> page::PAGE_DIR_SHIFT;
+        bool is_large = page::fits_large(i->mem_base, i->consecutive);
+        if(is_large) {
+            assert((addr_logical_t)mapped % PAGE_DIR_SIZE == 0);
+            assert(page::page_dir->entries[slot] & page::PAGE_TABLE_SIZE);
+        }
+        for(uint32_t p = 0; p < PAGE_TABLE_LENGTH; p ++) {
+            mapped[p * PAGE_SIZE / sizeof(uint32_t)] = p;
+        }
+        for(uint32_t p = 0; p < PAGE_TABLE_LENGTH; p ++) {
+            assert(mapped[p * PAGE_SIZE / sizeof(uint32_t)] == p);
+        }
+        page::kuninstall(mapped, i);
+        assert(!(page::page_dir->entries[slot] & page::PAGE_TABLE_SIZE));
+
+        test("Reusing large kernel mappings");
+        // More than the kernel's address space would hold if freed 4MiB ranges weren't used again
+        void *reused = page::kinstall(i, page::PAGE_TABLE_RW);
+        page::kuninstall(reused, i);
+        for(uint32_t n = 0; n < KERNEL_VM_SIZE / PAGE_DIR_SIZE + 16; n ++) {
+            void *again = page::kinstall(i, page::PAGE_TABLE_RW);
+            assert(again == reused);
+            if(is_large) {
+                assert(page::page_dir->entries[(addr_logical_t)again >> page::PAGE_DIR_SHIFT] & page::PAGE_TABLE_SIZE);
+            }
+            page::kuninstall(again, i);
+        }
+        page::free(i);
+    }
+};
+
+test::AddTestCase<PageTest> pageTest;
 }
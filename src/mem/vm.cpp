@@ -7,13 +7,23 @@
 #include "mem/kmem.hpp"
 #include "main/printk.hpp"
 #include "main/panic.hpp"
-#include "structures/mutex.hpp"
+#include "structures/spinlock.hpp"
+#include "structures/vector.hpp"
 #include "main/cpu.hpp"
 #include "main/asm_utils.hpp"
 #include "int/lapic.hpp"
+#include "task/task.hpp"
+#include "test/test.hpp"
 
 namespace vm {
-    mutex::Mutex _mutex;
+    spinlock::Spinlock _lock;
+    volatile bool lazy_switching = true;
+    volatile uint32_t cr3_loads;
+
+    static void _load_kernel_dir() {
+        __asm__ volatile ("mov %0, %%cr3" : : "r"((uint32_t)((addr_phys_t)page::page_dir - KERNEL_VM_BASE)) : "memory");
+        cr3_loads ++;
+    }
 
     Map::Map(uint32_t pid, uint32_t task_id, bool kernel) : pid(pid), task_id(task_id) {
         uint8_t kernel_flag = kernel ? page::FLAG_KERNEL : 0;
@@ -24,13 +34,10 @@ namespace vm {
         logical_tables = make_unique<page::logical_tables_t>();
 
         // Load the kernel tables into it
-        for(i = 0; i < PAGE_TABLE_LENGTH; i ++) {
-            if(i >= PAGE_TABLE_LENGTH - KERNEL_VM_PAGE_TABLES) {
-                logical_dir->entries[i] = page::page_dir->entries[i];
-            }else{
-                logical_dir->entries[i] = 0;
-            }
+        for(i = 0; i < PAGE_TABLE_LENGTH - KERNEL_VM_PAGE_TABLES; i ++) {
+            logical_dir->entries[i] = 0;
         }
+        page::add_dir(logical_dir);
 
         // And zero the logical tables
         for(i = 0; i < (sizeof(logical_tables->tables) / sizeof(logical_tables->tables[0])); i ++) {
@@ -47,6 +54,15 @@ namespace vm {
         // Remove all the objects first
         objects_in_maps.clear();
 
+        // And make sure no CPU still has the page directory in CR3
+        uint32_t eflags = push_cli();
+        unload(this);
+        cpu_mask_t others = loaded_cpus;
+        if(others) {
+            lapic::send_command_mask(lapic::CMD_UNLOAD_MAP, (addr_logical_t)this, 0, others);
+        }
+        pop_flags(eflags);
+
         for(int i = 0; i < PAGE_TABLE_LENGTH - KERNEL_VM_PAGE_TABLES; i ++) {
             if(logical_tables->pages[i]) {
                 page = logical_tables->pages[i];
@@ -56,6 +72,7 @@ namespace vm {
             }
         }
 
+        page::remove_dir(logical_dir);
         page::kuninstall(logical_dir, physical_dir);
         page::free(physical_dir);
     }
@@ -71,16 +88,56 @@ namespace vm {
         }else{
             page = page::alloc(0, 1);
             table = (page::page_table_t *)page::kinstall(page, page_flags | page::PAGE_TABLE_RW);
-            for(size_t i = 0; i < PAGE_TABLE_LENGTH; i ++) {
-                table->entries[i] = 0;
-            }
+            zero_page(table);
 
             map->logical_tables->pages[slot] = page;
             map->logical_tables->tables[slot] = table;
-            map->logical_dir->entries[slot] = page->mem_base | page::PAGE_TABLE_PRESENT | page_flags;
+            // Whether pages are writable is decided by their own entries, so the table itself always is
+            map->logical_dir->entries[slot] = page->mem_base | page::PAGE_TABLE_PRESENT | page::PAGE_TABLE_RW | page_flags;
+        }
+    }
+
+
+    // Replaces a 4MiB page with a page table mapping the same frames, so that part of it can be changed
+    static void _split_large(Map *map, uint32_t slot) {
+        page::page_dir_entry_t large = map->logical_dir->entries[slot];
+        page::Page *page = page::alloc(0, 1);
+        page::page_table_t *table = (page::page_table_t *)page::kinstall(page, page::PAGE_TABLE_RW);
+
+        for(uint32_t i = 0; i < PAGE_TABLE_LENGTH; i ++) {
+            table->entries[i] = ((large & ~(PAGE_DIR_SIZE - 1)) + i * PAGE_SIZE)
+                | (large & page::PAGE_TABLE_FLAGMASK & ~page::PAGE_TABLE_SIZE);
         }
+
+        map->logical_tables->pages[slot] = page;
+        map->logical_tables->tables[slot] = table;
+        map->logical_dir->entries[slot] = page->mem_base | page::PAGE_TABLE_PRESENT | page::PAGE_TABLE_RW
+            | (large & page::PAGE_TABLE_USER);
     }
 
+    // Whether the slot can be changed to a 4MiB page; it must not already have any pages in its page table, which is
+    //  freed if it does exist
+    static bool _make_large(Map *map, uint32_t slot) {
+        page::page_table_t *table = map->logical_tables->tables[slot];
+
+        if(!table) {
+            return true;
+        }
+
+        for(uint32_t i = 0; i < PAGE_TABLE_LENGTH; i ++) {
+            if(table->entries[i]) {
+                return false;
+            }
+        }
+
+        page::Page *page = map->logical_tables->pages[slot];
+        map->logical_dir->entries[slot] = 0;
+        map->logical_tables->pages[slot] = nullptr;
+        map->logical_tables->tables[slot] = nullptr;
+        page::kuninstall(table, page);
+        page::free(page);
+        return true;
+    }
 
     void Map::insert(int64_t addr, page::Page *page, uint8_t page_flags, uint32_t min, uint32_t max) {
         uint32_t dir_slot;
@@ -94,15 +151,30 @@ namespace vm {
         for(i = 0; i < page->consecutive; i ++) {
             dir_slot = addr >> page::PAGE_DIR_SHIFT;
             page_slot = (addr >> page::PAGE_TABLE_SHIFT) & page::PAGE_TABLE_MASK;
+            addr_phys_t phys = page->mem_base + i * PAGE_SIZE;
+
+            if(addr >= min && addr % PAGE_DIR_SIZE == 0 && addr + PAGE_DIR_SIZE <= max
+            && page::fits_large(phys, page->consecutive - i) && _make_large(this, dir_slot)) {
+                logical_dir->entries[dir_slot] = phys | page_flags | page::PAGE_TABLE_PRESENT | page::PAGE_TABLE_SIZE;
+                invlpg(addr, 1);
+
+                addr += PAGE_DIR_SIZE;
+                i += PAGE_TABLE_LENGTH - 1;
+                if(addr >= max) {
+                    return;
+                }
+                continue;
+            }
 
             if(addr >= min) {
-                if(!logical_tables->pages[dir_slot]) {
+                if(logical_dir->entries[dir_slot] & page::PAGE_TABLE_SIZE) {
+                    _split_large(this, dir_slot);
+                }else if(!logical_tables->pages[dir_slot]) {
                     _new_table(addr, this, page_flags);
                 }
 
-                logical_tables->tables[dir_slot]->entries[page_slot] =
-                    (page->mem_base + i * PAGE_SIZE) | page_flags | page::PAGE_TABLE_PRESENT;
-                invlpg(addr);
+                logical_tables->tables[dir_slot]->entries[page_slot] = phys | page_flags | page::PAGE_TABLE_PRESENT;
+                invlpg(addr, 1);
             }
 
             addr += PAGE_SIZE;
@@ -121,6 +193,7 @@ namespace vm {
     void Map::clear(int64_t addr, uint32_t pages) {
         uint32_t dir_slot;
         uint32_t page_slot;
+        int64_t base = addr;
         unsigned int i = 0;
 
         if(addr < 0) return;
@@ -129,86 +202,349 @@ namespace vm {
             dir_slot = addr >> page::PAGE_DIR_SHIFT;
             page_slot = (addr >> page::PAGE_TABLE_SHIFT) & page::PAGE_TABLE_MASK;
 
+            if(logical_dir->entries[dir_slot] & page::PAGE_TABLE_SIZE) {
+                if(addr % PAGE_DIR_SIZE == 0 && pages - i >= PAGE_TABLE_LENGTH) {
+                    // All of the 4MiB page is going
+                    logical_dir->entries[dir_slot] = 0;
+                    addr += PAGE_DIR_SIZE;
+                    i += PAGE_TABLE_LENGTH - 1;
+                    continue;
+                }
+                _split_large(this, dir_slot);
+            }
+
             logical_tables->tables[dir_slot]->entries[page_slot] = 0;
-            invlpg(addr);
 
             addr += PAGE_SIZE;
         }
+
+        invlpg(base, pages);
     }
 
 
-    bool Map::resolve_fault(addr_logical_t addr) {
+    bool Map::resolve_fault(addr_logical_t addr, bool protection) {
         asm volatile ("sti");
 
-        // Loop through the objects and see if any fit
-        for(unique_ptr<object::ObjectInMap> &oim : objects_in_maps) {
-            if(addr >= oim->base && addr < oim->base + oim->pages * PAGE_SIZE) {
-                // OK!
-                uint32_t excess = addr % PAGE_SIZE;
-                oim->object->generate(addr - oim->base + oim->offset - excess, 1);
-                return true;
+        unique_ptr<object::ObjectInMap> *found = objects_in_maps.find(addr);
+        if(!found) {
+            return false;
+        }
+
+        object::ObjectInMap *oim = found->get();
+        uint32_t excess = addr % PAGE_SIZE;
+        if(protection) {
+            if(!oim->object->copy_on_write(addr - oim->base + oim->offset - excess)) {
+                return false;
             }
+            cow_faults ++;
+        }else{
+            oim->fault(addr - oim->base + oim->offset - excess);
         }
+        faults ++;
+        return true;
+    }
+
+    unique_ptr<Map> Map::clone(uint32_t pid, uint32_t task_id, bool kernel) {
+        unique_ptr<Map> copy = make_unique<Map>(pid, task_id, kernel);
+        // Objects mapped more than once must only be copied once
+        vector<shared_ptr<object::Object>> originals;
+        vector<shared_ptr<object::Object>> copies;
+
+        objects_in_maps.each([&](uint64_t start, uint64_t end, unique_ptr<object::ObjectInMap> &oim) {
+            const shared_ptr<object::Object> &object = oim->object;
+            if(object->object_flags & object::FLAG_NO_CLONE) {
+                return;
+            }
+
+            size_t i;
+            for(i = 0; i < originals.size() && originals[i] != object; i ++);
+            if(i == originals.size()) {
+                shared_ptr<object::Object> object_copy = object->clone();
+                originals.push_back(object);
+                copies.push_back(object_copy ? object_copy : object);
+            }
 
-        return false;
+            copy->add_object(copies[i], oim->base, oim->offset, oim->pages);
+        });
+
+        return copy;
     }
 
 
     void Map::add_object(const shared_ptr<object::Object>& object, uint32_t base, int64_t offset, uint32_t pages) {
         unique_ptr<object::ObjectInMap> oim = make_unique<object::ObjectInMap>(object, this, base, offset, pages);
 
-        objects_in_maps.push_front(move(oim));
+        objects_in_maps.insert(base, (uint64_t)base + (uint64_t)pages * PAGE_SIZE, move(oim));
     }
 
     void Map::remove_object(const shared_ptr<object::Object>& object) {
-        for(auto i = objects_in_maps.begin(); i != objects_in_maps.end(); ) {
-            if((*i)->object == object) {
-                i = objects_in_maps.erase(i);
-            }else{
-                i ++;
+        // The object knows where it is mapped, so only its own mappings need to be looked at
+        object::ObjectInMap *oim;
+        while((oim = object->find_in_map(this))) {
+            if(!objects_in_maps.remove(oim->base, [&](unique_ptr<object::ObjectInMap> &o) { return o.get() == oim; })) {
+                panic("Object is mapped into a map which doesn't contain it");
             }
         }
     }
 
     void Map::remove_object_at(const shared_ptr<object::Object>& object, uint32_t base) {
-        for(auto i = objects_in_maps.begin(); i != objects_in_maps.end(); ) {
-            if((*i)->object == object && (*i)->base == base) {
-                i = objects_in_maps.erase(i);
-                break;
-            }else{
-                i ++;
+        objects_in_maps.remove(base, [&](unique_ptr<object::ObjectInMap> &oim) { return oim->object == object; });
+    }
+
+    // _lock must be held
+    addr_phys_t Map::claim() {
+        cpu::Status &info = cpu::info();
+        cpu_mask_t me = CPU_MASK(info.cpu_id);
+        bool load = !lazy_switching;
+
+        if(running_cpus) {
+            panic("Tried to set a VM which is already owned by another CPU");
+        }
+        running_cpus |= me;
+
+        if(info.loaded_map != this) {
+            // The previous map will be flushed from the TLB by loading CR3
+            if(info.loaded_map) {
+                info.loaded_map->loaded_cpus &= ~me;
+                info.loaded_map->stale_cpus &= ~me;
             }
+            load = true;
+        }
+        if(stale_cpus & me) {
+            // Some of our pages were unmapped since we last ran here
+            load = true;
+        }
+
+        loaded_cpus |= me;
+        stale_cpus &= ~me;
+        info.loaded_map = this;
+        if(load) {
+            cr3_loads ++;
+            return physical_dir->mem_base;
         }
+        return 0;
     }
 
     void Map::enter() {
-        _mutex.lock();
-        if(using_cpu != 0xffffffff) {
-            panic("Tried to set a VM which is already owned by another CPU");
+        _lock.lock();
+        addr_phys_t dir = claim();
+        if(dir) {
+            __asm__ volatile ("mov %0, %%cr3" : : "r"(dir) : "memory");
         }
-        using_cpu = cpu::id();
-        __asm__ volatile ("mov %0, %%cr3" : : "r"(physical_dir->mem_base));
-        _mutex.unlock();
+        _lock.unlock();
+    }
+
+    addr_phys_t Map::switch_to(Map *next) {
+        cpu_mask_t me = CPU_MASK(cpu::info().cpu_id);
+
+        _lock.lock();
+        running_cpus &= ~me;
+        addr_phys_t dir = next->claim();
+        _lock.unlock();
+
+        return dir;
     }
 
     void Map::exit() {
-        _mutex.lock();
-        using_cpu = 0xffffffff;
-        __asm__ volatile ("mov %0, %%cr3" : : "r"((addr_phys_t)page::page_dir - KERNEL_VM_BASE));
-        _mutex.unlock();
+        cpu::Status &info = cpu::info();
+        cpu_mask_t me = CPU_MASK(info.cpu_id);
+
+        _lock.lock();
+        running_cpus &= ~me;
+        if(!lazy_switching) {
+            loaded_cpus &= ~me;
+            info.loaded_map = nullptr;
+            _load_kernel_dir();
+        }
+        _lock.unlock();
+    }
+
+    void Map::unload(Map *map) {
+        cpu::Status &info = cpu::info();
+        cpu_mask_t me = CPU_MASK(info.cpu_id);
+
+        _lock.lock();
+        if(info.loaded_map == map) {
+            map->loaded_cpus &= ~me;
+            map->stale_cpus &= ~me;
+            info.loaded_map = nullptr;
+            _load_kernel_dir();
+        }
+        _lock.unlock();
     }
 
-    void Map::invlpg(addr_logical_t addr) {
+    void Map::invlpg(addr_logical_t addr, uint32_t pages) {
         uint32_t eflags = push_cli();
-        _mutex.lock();
-        if(using_cpu != 0xffffffff) {
-            if(using_cpu == cpu::id()) {
-                __asm__ volatile ("invlpg (%0)" : : "r"(addr));
-            }else{
-                lapic::send_command(lapic::CMD_INVLPG, addr, using_cpu);
+        cpu_mask_t me;
+        cpu_mask_t targets;
+
+        _lock.lock();
+        me = CPU_MASK(cpu::id());
+        if(loaded_cpus & me) {
+            for(uint32_t i = 0; i < pages; i ++) {
+                __asm__ volatile ("invlpg (%0)" : : "r"(addr + i * PAGE_SIZE));
             }
         }
-        _mutex.unlock();
+
+        // CPUs which have the map loaded but aren't running it can't use the stale entries until they enter it again
+        stale_cpus |= loaded_cpus & ~running_cpus & ~me;
+        targets = running_cpus & ~me;
+        _lock.unlock();
+
+        // Another CPU may be waiting on the lock in Map::enter with interrupts disabled, so it can't be held here
+        if(targets) {
+            flush_ipis += lapic::send_command_mask(lapic::CMD_INVLPG, addr, pages, targets);
+        }
+        pop_flags(eflags);
+    }
+}
+
+
+namespace _tests {
+static volatile bool worker_stop;
+static volatile uint32_t worker_beat;
+
+static void _vm_test_worker() {
+    while(!worker_stop) {
+        worker_beat ++;
+    }
+}
+
+static const addr_logical_t CLONE_BASE = 0x20000000;
+// 4MiB aligned, for testing large pages
+static const addr_logical_t LARGE_BASE = 0x30000000;
+static volatile uint32_t clone_seen[4];
+static volatile uint32_t clone_written;
+
+static void _vm_clone_worker() {
+    for(uint32_t i = 0; i < 4; i ++) {
+        clone_seen[i] = *(volatile uint32_t *)(CLONE_BASE + i * PAGE_SIZE);
+    }
+    *(volatile uint32_t *)CLONE_BASE = 100;
+    clone_written = *(volatile uint32_t *)CLONE_BASE;
+}
+
+class VmTest : public test::TestCase {
+public:
+    VmTest() : test::TestCase("Virtual Memory Map Test") {};
+
+    // Maps a page, and returns how many IPIs unmapping it took
+    uint32_t clear_ipis(vm::Map *map, page::Page *page, addr_logical_t addr) {
+        map->insert(addr, page, page::PAGE_TABLE_RW, 0, task::TASK_STACK_TOP);
+        uint32_t before = map->flush_ipis;
+        map->clear(addr, 1);
+        return map->flush_ipis - before;
+    }
+
+    void run_test() override {
+        // Just below the thread's stack, so the page table already exists
+        const addr_logical_t addr = task::TASK_STACK_TOP - PAGE_SIZE * 2;
+        page::Page *page = page::alloc(0, 1);
+
+        test("Clearing a map which was never entered");
+        vm::Map *map = new vm::Map(0, 0, false);
+        assert(clear_ipis(map, page, addr) == 0);
+        delete map;
+
+        uint32_t eflags = push_cli();
+        uint32_t here = cpu::id();
+        cpu_mask_t others = cpu::online & ~CPU_MASK(here);
         pop_flags(eflags);
+
+        if(others) {
+            test("Clearing a map running on another CPU");
+            // Keep this thread and the worker on different CPUs, so neither has to be descheduled for the other to run
+            shared_ptr<task::Thread> self = cpu::current_thread();
+            cpu_mask_t old_affinity = self->affinity;
+            self->set_affinity(CPU_MASK(here));
+            cpu_mask_t there = CPU_MASK(__builtin_ctz(others));
+
+            worker_stop = false;
+            worker_beat = 0;
+            shared_ptr<task::Thread> thread = task::kernel_process->new_thread((addr_logical_t)&_vm_test_worker);
+            thread->set_affinity(there);
+
+            // Before each attempt, wait until the worker has been seen running on its CPU
+            bool interrupted = false;
+            for(uint32_t i = 0; i < 1000 && !interrupted; i ++) {
+                uint32_t beat = worker_beat;
+                while(worker_beat == beat || !(thread->vm->running() & there)) {}
+
+                uint32_t ipis = clear_ipis(thread->vm.get(), page, addr);
+                assert(ipis <= 1);
+                interrupted = ipis == 1;
+            }
+            assert(interrupted);
+
+            test("Clearing a map whose thread has finished");
+            worker_stop = true;
+            while(!thread->ended) task::task_yield();
+            assert(clear_ipis(thread->vm.get(), page, addr) == 0);
+            self->set_affinity(old_affinity);
+        }
+
+        page::free(page);
+
+        test("Cloning a map");
+        map = cpu::current_thread()->vm.get();
+        shared_ptr<object::Object> obj = make_shared<object::EmptyObject>(4, page::PAGE_TABLE_RW, 0, 0);
+        map->add_object(obj, CLONE_BASE, 0, 4);
+        for(uint32_t i = 0; i < 4; i ++) {
+            *(volatile uint32_t *)(CLONE_BASE + i * PAGE_SIZE) = i + 1;
+        }
+        shared_ptr<task::Thread> clone = task::kernel_process->new_thread((addr_logical_t)&_vm_clone_worker, map);
+        while(!clone->ended) task::task_yield();
+        for(uint32_t i = 0; i < 4; i ++) {
+            assert(clone_seen[i] == i + 1);
+        }
+        assert(clone_written == 100);
+        assert(clone->vm->cow_faults == 1);
+        assert(*(volatile uint32_t *)CLONE_BASE == 1);
+
+        test("Writing to pages shared with a clone");
+        uint32_t cow_faults = map->cow_faults;
+        *(volatile uint32_t *)CLONE_BASE = 5;
+        *(volatile uint32_t *)(CLONE_BASE + PAGE_SIZE) = 6;
+        assert(map->cow_faults - cow_faults == 2);
+        assert(*(volatile uint32_t *)CLONE_BASE == 5);
+        assert(*(volatile uint32_t *)(CLONE_BASE + PAGE_SIZE) == 6);
+        // The clone copied the first page itself, so only the second one needed copying here
+        assert(page::references(obj->find_page(0)->page->mem_base) == 1);
+        assert(page::references(obj->find_page(PAGE_SIZE)->page->mem_base) == 1);
+        assert(page::references(obj->find_page(2 * PAGE_SIZE)->page->mem_base) == 2);
+        map->remove_object(obj);
+
+        test("Large pages");
+        const uint32_t large_pages = PAGE_TABLE_LENGTH * 2;
+        volatile uint32_t *large = (volatile uint32_t *)LARGE_BASE;
+        obj = make_shared<object::EmptyObject>(large_pages, page::PAGE_TABLE_RW, object::FLAG_LARGE_PAGES, 0);
+        map->add_object(obj, LARGE_BASE, 0, large_pages);
+        uint32_t faults = map->faults;
+        for(uint32_t i = 0; i < large_pages; i ++) {
+            large[i * PAGE_SIZE / sizeof(uint32_t)] = i;
+        }
+        // Each fault generates a whole 4MiB region
+        assert(map->faults - faults == 2);
+        assert(obj->pages.size() == 2);
+        for(uint32_t d = 0; d < 2; d ++) {
+            object::PageEntry *entry = obj->find_page(d * PAGE_DIR_SIZE);
+            if(page::fits_large(entry->page->mem_base, entry->page->consecutive)) {
+                assert(map->logical_dir->entries[(LARGE_BASE >> page::PAGE_DIR_SHIFT) + d] & page::PAGE_TABLE_SIZE);
+            }
+        }
+
+        test("Splitting large pages");
+        map->clear(LARGE_BASE + 5 * PAGE_SIZE, 1);
+        assert(!(map->logical_dir->entries[LARGE_BASE >> page::PAGE_DIR_SHIFT] & page::PAGE_TABLE_SIZE));
+        for(uint32_t i = 0; i < large_pages; i ++) {
+            // The object still has the cleared page, so a fault on it wouldn't map it again
+            if(i != 5) {
+                assert(large[i * PAGE_SIZE / sizeof(uint32_t)] == i);
+            }
+        }
+        map->remove_object(obj);
     }
+};
+
+test::AddTestCase<VmTest> vmTest;
 }
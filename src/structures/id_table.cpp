@@ -0,0 +1,115 @@
+#include <stdint.h>
+
+#include "structures/id_table.hpp"
+#include "task/task.hpp"
+#include "task/rcu.hpp"
+#include "test/test.hpp"
+
+namespace _tests {
+static const uint32_t MAGIC = 0x1d7ab1e5;
+static volatile uint32_t live;
+
+struct TestEntry {
+    uint32_t id;
+    volatile uint32_t magic;
+
+    TestEntry(uint32_t id) : id(id), magic(MAGIC) {
+        __sync_fetch_and_add(&live, 1);
+    }
+    ~TestEntry() {
+        // Make sure a lookup that finds a freed entry notices
+        magic = 0;
+        __sync_fetch_and_sub(&live, 1);
+    }
+};
+
+static id_table::IdTable<TestEntry> *table;
+static volatile bool stop;
+static volatile uint32_t bad;
+static volatile uint32_t lookups;
+static volatile uint32_t finished;
+
+static void _id_table_reader() {
+    uint32_t seed = task::get_thread()->task_id * 2654435761u;
+    uint32_t done = 0;
+
+    while(!stop) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+
+        uint32_t id = seed % 256;
+        shared_ptr<TestEntry> entry = table->get(id);
+        if(entry && (entry->magic != MAGIC || entry->id != id)) {
+            __sync_fetch_and_add(&bad, 1);
+        }
+
+        if(++ done % 64 == 0) {
+            task::task_yield();
+        }
+    }
+
+    __sync_fetch_and_add(&lookups, done);
+    __sync_fetch_and_add(&finished, 1);
+}
+
+class IdTableTest : public test::TestCase {
+public:
+    IdTableTest() : test::TestCase("Id Table Test") {};
+
+    static const uint32_t READERS = 4;
+
+    void run_test() override {
+        table = new id_table::IdTable<TestEntry>();
+        live = 0;
+
+        test("Setting and getting entries");
+        assert(!table->get(0));
+        assert(!table->get(1000));
+        table->set(1, make_shared<TestEntry>(1));
+        assert(table->get(1)->id == 1);
+        table->set(100, make_shared<TestEntry>(100));
+        assert(table->get(100)->id == 100);
+        assert(table->get(1)->id == 1);
+        assert(!table->get(2));
+
+        test("Removing entries");
+        table->remove(1);
+        table->remove(2);
+        assert(!table->get(1));
+        assert(table->get(100)->id == 100);
+
+        test("Concurrent lookups");
+        stop = false;
+        bad = 0;
+        lookups = 0;
+        finished = 0;
+        for(uint32_t i = 0; i < READERS; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&_id_table_reader);
+        }
+        for(uint32_t round = 0; round < 8; round ++) {
+            for(uint32_t id = 0; id < 256; id ++) {
+                table->set(id, make_shared<TestEntry>(id));
+            }
+            for(uint32_t id = round % 2; id < 256; id += 2) {
+                table->remove(id);
+            }
+            task::task_yield();
+        }
+        stop = true;
+        while(finished < READERS) task::task_yield();
+        assert(bad == 0);
+        assert(lookups > 0);
+
+        test("Reclaiming entries");
+        delete table;
+        for(uint32_t i = 0; i < 10000 && live; i ++) {
+            task::task_yield();
+            rcu::reclaim();
+        }
+        assert(live == 0);
+    }
+};
+
+test::AddTestCase<IdTableTest> idTableTest;
+}
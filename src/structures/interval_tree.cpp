@@ -0,0 +1,109 @@
+#include <stdint.h>
+
+#include "structures/interval_tree.hpp"
+#include "test/test.hpp"
+
+namespace _tests {
+class IntervalTreeTest : public test::TestCase {
+public:
+    IntervalTreeTest() : test::TestCase("Interval Tree Test") {};
+
+    static const uint32_t RANDOM = 512;
+
+    void run_test() override {
+        interval_tree::IntervalTree<uint32_t> tree;
+
+        test("Empty trees");
+        assert(tree.empty());
+        assert(!tree.find(0));
+        assert(!tree.remove(0, [](uint32_t &v) { return true; }));
+
+        test("Finding intervals");
+        tree.insert(10, 20, 1);
+        tree.insert(30, 40, 2);
+        tree.insert(0, 5, 3);
+        assert(tree.size() == 3);
+        assert(*tree.find(10) == 1);
+        assert(*tree.find(19) == 1);
+        assert(!tree.find(20));
+        assert(*tree.find(35) == 2);
+        assert(*tree.find(0) == 3);
+        assert(!tree.find(5));
+        assert(!tree.find(100));
+
+        test("Overlapping intervals");
+        tree.insert(15, 35, 4);
+        assert(*tree.find(16) == 4);
+        assert(*tree.find(12) == 1);
+        assert(*tree.find(36) == 2);
+        tree.insert(10, 12, 5);
+        assert(*tree.find(10) == 5);
+        assert(*tree.find(12) == 1);
+
+        uint32_t seen = 0;
+        uint64_t last_start = 0;
+        tree.overlapping(18, 31, [&](uint64_t start, uint64_t end, uint32_t &v) {
+            assert(start >= last_start);
+            last_start = start;
+            seen |= 1 << v;
+        });
+        assert(seen == ((1 << 1) | (1 << 2) | (1 << 4)));
+
+        test("Removing intervals");
+        assert(tree.remove(10, [](uint32_t &v) { return v == 1; }));
+        assert(*tree.find(10) == 5);
+        assert(!tree.find(13));
+        assert(!tree.remove(10, [](uint32_t &v) { return v == 1; }));
+        assert(tree.remove(15, [](uint32_t &v) { return true; }));
+        assert(!tree.find(16));
+        assert(tree.size() == 3);
+        tree.clear();
+        assert(tree.empty());
+
+        test("Many intervals");
+        uint64_t starts[RANDOM];
+        uint64_t ends[RANDOM];
+        bool present[RANDOM];
+        uint32_t seed = 12345;
+        for(uint32_t i = 0; i < RANDOM; i ++) {
+            seed = seed * 1103515245 + 12345;
+            starts[i] = (seed >> 8) % 100000;
+            ends[i] = starts[i] + 1 + (seed % 200);
+            present[i] = true;
+            tree.insert(starts[i], ends[i], i);
+        }
+        for(uint32_t i = 0; i < RANDOM; i += 3) {
+            assert(tree.remove(starts[i], [&](uint32_t &v) { return v == i; }));
+            present[i] = false;
+        }
+        for(uint32_t probe = 0; probe < 2000; probe ++) {
+            seed = seed * 1103515245 + 12345;
+            uint64_t position = (seed >> 8) % 100200;
+
+            // The most recently added (highest numbered) interval containing the position
+            uint32_t expected = RANDOM;
+            for(uint32_t i = 0; i < RANDOM; i ++) {
+                if(present[i] && starts[i] <= position && position < ends[i]) {
+                    expected = i;
+                }
+            }
+
+            uint32_t *found = tree.find(position);
+            if(expected == RANDOM) {
+                assert(!found);
+            }else{
+                assert(found && *found == expected);
+            }
+        }
+
+        uint32_t count = 0;
+        tree.each([&](uint64_t start, uint64_t end, uint32_t &v) {
+            assert(present[v] && starts[v] == start && ends[v] == end);
+            count ++;
+        });
+        assert(count == tree.size());
+    }
+};
+
+test::AddTestCase<IntervalTreeTest> intervalTreeTest;
+}
@@ -124,6 +124,21 @@ public:
         }
         assert(b.empty());
 
+        test("Insert after");
+        b.insert_after(b.end(), 2);
+        b.insert_after(b.begin(), 4);
+        b.insert_after(b.end(), 1);
+        b.insert_after(++ b.begin(), 3);
+        assert(b.size() == 4);
+        assert(b.back() == 4);
+        seeking = 1;
+        for(int e : b) {
+            assert(e == (seeking ++));
+        }
+        b.push_back(5);
+        assert(b.back() == 5);
+        b.clear();
+
         test("Emplace");
         uint8_t constructs = 0;
         class TestClass {
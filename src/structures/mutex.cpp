@@ -6,56 +6,292 @@
 #include "main/errno.h"
 #include "main/printk.hpp"
 #include "main/cpu.hpp"
+#include "main/clock.hpp"
 #include "task/task.hpp"
 #include "main/asm_utils.hpp"
+#include "test/test.hpp"
 
 namespace mutex {
-    Mutex::Mutex() {
-        this->flag = false;
+    static Mutex *_named;
+    static volatile bool _named_flag;
+
+    static void _lock_named() {
+        while(__sync_lock_test_and_set(&_named_flag, true)) {
+            asm volatile ("pause");
+        }
     }
 
-    int Mutex::lock() {
-        uint32_t eflags = push_flags();
-        while(true) {
-            int result = this->trylock();
+    static void _unlock_named() {
+        __sync_lock_release(&_named_flag);
+    }
 
-            if(result == EOK) {
-                return EOK;
+    // Returns the thread running on this CPU, or nullptr if there isn't one (or CPUs haven't been set up yet)
+    static task::Thread *_current_thread() {
+        if(!cpu::online) {
+            return nullptr;
+        }
+
+        uint32_t eflags = push_cli();
+        task::Thread *thread = cpu::info().thread.get();
+        pop_flags(eflags);
+        return thread;
+    }
+
+    // Whether the given thread is running on another CPU, in which case it will probably unlock the mutex soon
+    static bool _running_elsewhere(task::Thread *thread) {
+        bool running = false;
+
+        if(!thread) {
+            return false;
+        }
+
+        uint32_t eflags = push_cli();
+        uint32_t self = cpu::id();
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            if(i != self && (cpu::online & CPU_MASK(i)) && cpu::info_of(i).thread.get() == thread) {
+                running = true;
+                break;
             }
+        }
+        pop_flags(eflags);
 
-            if(eflags & cpu::IF) {
-                // Interrupts are enabled, so assume that we can freely halt and get interrupted and stuff
-                asm volatile ("cli");
-                uint32_t id = cpu::id();
-                if(cpu::info_of(id).thread) {
-                    asm volatile ("sti");
-                    task::task_yield();
-                }else{
-                    asm volatile ("sti");
-                    asm volatile ("hlt");
+        return running;
+    }
+
+    Mutex::Mutex() : name(nullptr), stats(), flag(false), owner(nullptr), waiters(nullptr),
+        next_named(nullptr) {}
+
+    Mutex::Mutex(const char *name) : Mutex() {
+        this->name = name;
+
+        uint32_t eflags = push_cli();
+        _lock_named();
+        next_named = _named;
+        _named = this;
+        _unlock_named();
+        pop_flags(eflags);
+    }
+
+    Mutex::~Mutex() {
+        if(name) {
+            uint32_t eflags = push_cli();
+            _lock_named();
+            for(Mutex **m = &_named; *m; m = &(*m)->next_named) {
+                if(*m == this) {
+                    *m = next_named;
+                    break;
                 }
-            }else{
-                // Interrupts are disabled, so assume that the user doesn't want any interrupt handlers to run
-                // Busy wait, not sure if there is a better way of doing this...
             }
+            _unlock_named();
+            pop_flags(eflags);
         }
+
+        delete waiters;
     }
 
-    int Mutex::trylock() {
+    bool Mutex::acquire(task::Thread *thread) {
         volatile bool swap = true;
 
         asm volatile ("xchg %0, %1" : "+r" (swap), "+m" (flag) : "r" (swap), "m" (flag));
 
         if(swap) {
+            return false;
+        }
+
+        owner = thread;
+        return true;
+    }
+
+    bool Mutex::sleep(task::Thread *thread, bool timed, uint64_t deadline) {
+        if(!waiters) {
+            // Created on first use, since most mutexes are never slept on and kmem may not be running yet
+            task::WaitQueue *queue = new task::WaitQueue(Utf8(name ? name : "mutex"));
+            if(!__sync_bool_compare_and_swap(&waiters, nullptr, queue)) {
+                delete queue;
+            }
+        }
+
+        // unlock either makes us the owner, or unlocks it after we have been added to the queue and can take it
+        auto condition = [this, thread]() { return owner == thread || acquire(thread); };
+        if(!timed) {
+            waiters->wait_until(condition);
+            return true;
+        }
+
+        uint64_t now = clock::now_ns();
+        return waiters->wait_until(condition, deadline > now ? deadline - now : 0);
+    }
+
+    int Mutex::lock() {
+        return lock(false, 0);
+    }
+
+    int Mutex::lock_for(uint64_t timeout) {
+        return lock(true, clock::now_ns() + timeout);
+    }
+
+    int Mutex::lock(bool timed, uint64_t deadline) {
+        uint32_t eflags = push_flags();
+        task::Thread *thread = _current_thread();
+        bool locked = false;
+
+        if(acquire(thread)) {
+            stats.acquisitions ++;
+            return EOK;
+        }
+
+        uint64_t start = read_tsc();
+        if((eflags & cpu::IF) && thread) {
+            // Spin while the owner is running, it may unlock the mutex soon
+            for(uint32_t i = 0; i < SPIN_LIMIT && !locked && _running_elsewhere(owner); i ++) {
+                asm volatile ("pause");
+                locked = acquire(thread);
+            }
+
+            if(!locked) {
+                locked = sleep(thread, timed, deadline);
+            }
+        }else{
+            while(!(locked = acquire(thread)) && !(timed && clock::now_ns() >= deadline)) {
+                if(eflags & cpu::IF) {
+                    // Interrupts are enabled but there is no thread to put to sleep, so wait for interrupts instead
+                    asm volatile ("hlt");
+                }else{
+                    // Interrupts are disabled, so assume that the user doesn't want any interrupt handlers to run
+                    asm volatile ("pause");
+                }
+            }
+        }
+
+        if(!locked) {
+            return ETIMEDOUT;
+        }
+
+        stats.acquisitions ++;
+        stats.contended ++;
+        stats.wait_cycles += read_tsc() - start;
+        return EOK;
+    }
+
+    int Mutex::trylock() {
+        if(!acquire(_current_thread())) {
             return EBUSY;
         }
 
+        stats.acquisitions ++;
         return EOK;
     }
 
     int Mutex::unlock() {
-        flag = false;
+        while(true) {
+            if(waiters) {
+                // Hand the mutex straight to the next thread, without unlocking it; this is done with the queue locked,
+                //  so a thread that is timing out sees that it has the mutex
+                shared_ptr<task::Thread> next = waiters->dequeue([this](task::Thread *thread) { owner = thread; });
+                if(next) {
+                    task::resume(move(next));
+                    return EOK;
+                }
+            }
 
-        return EOK;
+            owner = nullptr;
+            flag = false;
+
+            // A thread may have gone to sleep after we checked the queue; if so, take the mutex back and hand it over
+            __sync_synchronize();
+            if(!waiters || waiters->empty() || !acquire(_current_thread())) {
+                return EOK;
+            }
+        }
+    }
+
+    void Mutex::dump() const {
+        printk("%s: %llu acquisitions, %llu contended, %llu cycles waiting\n", name ? name : "(unnamed mutex)",
+            stats.acquisitions, stats.contended, stats.wait_cycles);
+    }
+
+    void dump_all() {
+        uint32_t eflags = push_cli();
+        _lock_named();
+        for(Mutex *m = _named; m; m = m->next_named) {
+            m->dump();
+        }
+        _unlock_named();
+        pop_flags(eflags);
+    }
+}
+
+namespace _tests {
+static mutex::Mutex *test_mutex;
+static volatile uint32_t counter;
+static volatile uint32_t finished;
+static volatile int timed_result;
+static volatile uint64_t timed_wait;
+
+static void _mutex_timed_worker() {
+    timed_result = test_mutex->lock_for(timed_wait);
+    if(timed_result == EOK) {
+        test_mutex->unlock();
+    }
+    __sync_fetch_and_add(&finished, 1);
+}
+
+static void _mutex_test_worker() {
+    for(uint32_t i = 0; i < 100; i ++) {
+        test_mutex->lock();
+        uint32_t value = counter;
+        // Give up the CPU while holding the lock, so the other threads have to wait for it
+        task::task_yield();
+        counter = value + 1;
+        test_mutex->unlock();
     }
+    __sync_fetch_and_add(&finished, 1);
+}
+
+class MutexTest : public test::TestCase {
+public:
+    MutexTest() : test::TestCase("Mutex Test") {};
+
+    static const uint32_t THREADS = 4;
+
+    void run_test() override {
+        test_mutex = new mutex::Mutex();
+        counter = 0;
+        finished = 0;
+
+        test("Contended mutex");
+        for(uint32_t i = 0; i < THREADS; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&_mutex_test_worker);
+        }
+        while(finished < THREADS) task::task_yield();
+        assert(counter == THREADS * 100);
+        assert(test_mutex->stats.acquisitions == THREADS * 100);
+        assert(test_mutex->stats.contended > 0);
+
+        test("Uncontended mutex");
+        assert(test_mutex->trylock() == EOK);
+        assert(test_mutex->trylock() == EBUSY);
+        test_mutex->unlock();
+        assert(test_mutex->stats.acquisitions == THREADS * 100 + 1);
+
+        test("Timing out");
+        test_mutex->lock();
+        finished = 0;
+        timed_wait = 20 * 1000000ull;
+        task::kernel_process->new_thread((addr_logical_t)&_mutex_timed_worker);
+        while(finished < 1) task::task_yield();
+        assert(timed_result == ETIMEDOUT);
+
+        timed_wait = 10 * clock::NS_PER_SEC;
+        task::kernel_process->new_thread((addr_logical_t)&_mutex_timed_worker);
+        task::sleep_for(10 * 1000000ull);
+        test_mutex->unlock();
+        while(finished < 2) task::task_yield();
+        assert(timed_result == EOK);
+
+        delete test_mutex;
+    }
+};
+
+test::AddTestCase<MutexTest> mutexTest;
 }
@@ -0,0 +1,142 @@
+#include <stdint.h>
+
+#include "structures/radix_tree.hpp"
+#include "test/test.hpp"
+
+namespace _tests {
+class RadixTreeTest : public test::TestCase {
+public:
+    RadixTreeTest() : test::TestCase("Radix Tree Test") {};
+
+    static const uint32_t RANDOM = 512;
+
+    void run_test() override {
+        radix_tree::RadixTree<uint32_t> tree;
+        uint32_t key;
+
+        test("Empty trees");
+        assert(tree.empty());
+        assert(!tree.find(0));
+        assert(!tree.find_before(UINT32_MAX, key));
+        assert(!tree.find_after(0, key));
+        assert(!tree.remove(0));
+
+        test("Finding keys");
+        tree.insert(5, 1);
+        tree.insert(40, 2);
+        tree.insert(1000, 3);
+        assert(tree.size() == 3);
+        assert(*tree.find(5) == 1);
+        assert(*tree.find(40) == 2);
+        assert(*tree.find(1000) == 3);
+        assert(!tree.find(6));
+        assert(!tree.find(1 << 20));
+        tree.insert(40, 4);
+        assert(*tree.find(40) == 4);
+        assert(tree.size() == 3);
+
+        test("Finding the closest keys");
+        assert(*tree.find_before(39, key) == 1 && key == 5);
+        assert(*tree.find_before(40, key) == 4 && key == 40);
+        assert(*tree.find_before(999, key) == 4 && key == 40);
+        assert(*tree.find_before(UINT32_MAX, key) == 3 && key == 1000);
+        assert(!tree.find_before(4, key));
+        assert(*tree.find_after(0, key) == 1 && key == 5);
+        assert(*tree.find_after(6, key) == 4 && key == 40);
+        assert(*tree.find_after(41, key) == 3 && key == 1000);
+        assert(!tree.find_after(1001, key));
+
+        test("Large keys");
+        tree.insert(UINT32_MAX, 5);
+        tree.insert(0, 6);
+        assert(*tree.find(UINT32_MAX) == 5);
+        assert(*tree.find_after(1001, key) == 5 && key == UINT32_MAX);
+        assert(*tree.find_before(UINT32_MAX - 1, key) == 3 && key == 1000);
+        assert(*tree.find_before(0, key) == 6 && key == 0);
+
+        uint32_t previous = 0;
+        uint32_t seen = 0;
+        tree.each([&](uint32_t k, uint32_t &v) {
+            assert(!seen || k > previous);
+            previous = k;
+            seen ++;
+        });
+        assert(seen == 5);
+
+        test("Removing keys");
+        assert(tree.remove(UINT32_MAX));
+        assert(!tree.remove(UINT32_MAX));
+        assert(!tree.find(UINT32_MAX));
+        assert(tree.remove(40));
+        assert(*tree.find_after(6, key) == 3 && key == 1000);
+        assert(tree.remove(0));
+        assert(tree.remove(5));
+        assert(tree.remove(1000));
+        assert(tree.empty());
+        assert(!tree.find_after(0, key));
+
+        test("Many keys");
+        uint32_t keys[RANDOM];
+        bool present[RANDOM];
+        uint32_t seed = 54321;
+        for(uint32_t i = 0; i < RANDOM; i ++) {
+            seed = seed * 1103515245 + 12345;
+            keys[i] = (seed >> 4) % 200000;
+            present[i] = true;
+            for(uint32_t j = 0; j < i; j ++) {
+                if(keys[j] == keys[i]) {
+                    present[j] = false;
+                }
+            }
+            tree.insert(keys[i], i);
+        }
+        for(uint32_t i = 0; i < RANDOM; i += 3) {
+            if(present[i]) {
+                assert(tree.remove(keys[i]));
+                present[i] = false;
+            }
+        }
+        for(uint32_t probe = 0; probe < 2000; probe ++) {
+            seed = seed * 1103515245 + 12345;
+            uint32_t position = (seed >> 4) % 201000;
+
+            uint32_t before = RANDOM;
+            uint32_t after = RANDOM;
+            for(uint32_t i = 0; i < RANDOM; i ++) {
+                if(!present[i]) continue;
+                if(keys[i] <= position && (before == RANDOM || keys[i] > keys[before])) {
+                    before = i;
+                }
+                if(keys[i] >= position && (after == RANDOM || keys[i] < keys[after])) {
+                    after = i;
+                }
+            }
+
+            uint32_t *found = tree.find_before(position, key);
+            assert(before == RANDOM ? !found : (found && *found == before && key == keys[before]));
+            found = tree.find_after(position, key);
+            assert(after == RANDOM ? !found : (found && *found == after && key == keys[after]));
+        }
+
+        uint32_t count = 0;
+        tree.range(50000, 150000, [&](uint32_t k, uint32_t &v) {
+            assert(present[v] && keys[v] == k && k >= 50000 && k < 150000);
+            count ++;
+        });
+        for(uint32_t i = 0; i < RANDOM; i ++) {
+            if(present[i] && keys[i] >= 50000 && keys[i] < 150000) {
+                count --;
+            }
+        }
+        assert(count == 0);
+
+        // Removing values while going through them
+        tree.each([&](uint32_t k, uint32_t &v) {
+            assert(tree.remove(k));
+        });
+        assert(tree.empty());
+    }
+};
+
+test::AddTestCase<RadixTreeTest> radixTreeTest;
+}
@@ -1,7 +1,38 @@
 #include "structures/shared_ptr.hpp"
+#include "task/task.hpp"
 #include "test/test.hpp"
 
 namespace _tests {
+static volatile uint32_t destroyed;
+
+class Counted : public shared_ptr_ns::RefCounted {
+public:
+    uint32_t val;
+
+    Counted(uint32_t val) : val(val) {};
+    virtual ~Counted() {
+        __sync_fetch_and_add(&destroyed, 1);
+    }
+};
+
+class DerivedCounted : public Counted {
+public:
+    DerivedCounted(uint32_t val) : Counted(val) {};
+};
+
+static shared_ptr<Counted> *shared;
+static volatile uint32_t finished;
+
+static void _copy_worker() {
+    for(uint32_t i = 0; i < 10000; i ++) {
+        shared_ptr<Counted> copy = *shared;
+        shared_ptr<Counted> another = copy;
+        if(i % 256 == 0) {
+            task::task_yield();
+        }
+    }
+    __sync_fetch_and_add(&finished, 1);
+}
 class SharedPtrTest : public test::TestCase {
 public:
     SharedPtrTest() : test::TestCase("shared_ptr Test") {};
@@ -96,6 +127,41 @@ public:
         dp = nullptr;
         assert(constructs == 1);
         assert(destructs == 1);
+
+        test("Objects with their own use count");
+        destroyed = 0;
+        shared_ptr<Counted> ep = make_shared<Counted>(3);
+        assert(ep.use_count() == 1);
+        shared_ptr<Counted> fp = shared_ptr<Counted>(ep.get());
+        assert(ep.use_count() == 2);
+        assert(fp == ep);
+        ep = nullptr;
+        assert(destroyed == 0);
+        assert(fp->val == 3);
+        fp = nullptr;
+        assert(destroyed == 1);
+
+        test("Deleting through a base class");
+        ep = make_shared<DerivedCounted>(4);
+        fp = ep;
+        assert(ep->val == 4);
+        ep = nullptr;
+        fp.reset(new Counted(5));
+        assert(destroyed == 2);
+        fp = nullptr;
+        assert(destroyed == 3);
+
+        test("Copying on many CPUs at once");
+        shared = new shared_ptr<Counted>(make_shared<Counted>(6));
+        finished = 0;
+        for(uint32_t i = 0; i < 4; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&_copy_worker);
+        }
+        while(finished < 4) task::task_yield();
+        assert(shared->use_count() == 1);
+        assert(destroyed == 3);
+        delete shared;
+        assert(destroyed == 4);
     }
 };
 
@@ -0,0 +1,73 @@
+#include <stdint.h>
+
+#include "structures/spinlock.hpp"
+#include "main/errno.h"
+
+namespace spinlock {
+    int Spinlock::lock() {
+        uint16_t ticket = __sync_fetch_and_add(&next, 1);
+
+        while(serving != ticket) {
+            asm volatile ("pause");
+        }
+
+        return EOK;
+    }
+
+    int Spinlock::trylock() {
+        uint16_t ticket = serving;
+
+        // Only take a ticket if it will be served straight away; if nobody holds the lock, serving can't change
+        if(!__sync_bool_compare_and_swap(&next, ticket, (uint16_t)(ticket + 1))) {
+            return EBUSY;
+        }
+
+        return EOK;
+    }
+
+    int Spinlock::unlock() {
+        asm volatile ("" : : : "memory");
+        serving = serving + 1;
+
+        return EOK;
+    }
+
+
+    int McsLock::lock(Node &node) {
+        Node *prev;
+
+        node.next = nullptr;
+        node.waiting = true;
+
+        prev = __sync_lock_test_and_set(&tail, &node);
+        if(prev) {
+            // Someone else has it, join the queue and wait for them to pass it to us
+            prev->next = &node;
+            while(node.waiting) {
+                asm volatile ("pause");
+            }
+        }
+
+        asm volatile ("" : : : "memory");
+        return EOK;
+    }
+
+    int McsLock::unlock(Node &node) {
+        asm volatile ("" : : : "memory");
+
+        if(!node.next) {
+            if(__sync_bool_compare_and_swap(&tail, &node, nullptr)) {
+                // Nobody is waiting
+                return EOK;
+            }
+
+            // Someone has swapped themselves into the tail, but hasn't linked themselves to us yet
+            while(!node.next) {
+                asm volatile ("pause");
+            }
+        }
+
+        node.next->waiting = false;
+        return EOK;
+    }
+}
@@ -5,11 +5,259 @@
 #include "mem/kmem.hpp"
 #include "structures/utf8.hpp"
 #include "structures/shared_ptr.hpp"
+#include "structures/spinlock.hpp"
+#include "main/asm_utils.hpp"
 #include "test/test.hpp"
 
 namespace utf8 {
     static const char *_empty_string = "";
 
+    // The intern table, entries are only ever added to the front of a bucket and never removed, so it can be searched
+    //  without taking the lock
+    struct _atom_t {
+        _atom_t *volatile next;
+        uint32_t hash;
+        uint32_t bytes;
+        // Followed by the string itself
+
+        char *string() {
+            return (char *)(this + 1);
+        }
+    };
+
+    static const uint32_t _ATOM_BUCKETS = 256;
+    static _atom_t *volatile _atoms[_ATOM_BUCKETS];
+    static spinlock::Spinlock _atoms_lock;
+
+    static _atom_t *_find_atom(_atom_t *atom, const char *string, uint32_t bytes, uint32_t hash) {
+        for(; atom; atom = atom->next) {
+            if(atom->hash == hash && atom->bytes == bytes && !memcmp(atom->string(), string, bytes)) {
+                return atom;
+            }
+        }
+        return nullptr;
+    }
+
+    // Strings shorter than this aren't worth disabling interrupts to use SSE2 on
+    static const size_t _SSE2_THRESHOLD = 64;
+
+    // Returns how many of the `blocks` 16 byte blocks at the start of `string` contain only ASCII before one which
+    //  doesn't, interrupts must be disabled
+    static size_t _sse2_ascii_blocks(const uint8_t *string, size_t blocks) {
+        size_t done = 0;
+        uint32_t mask;
+
+        __asm__ volatile ("\
+            1:\n\
+            movdqu (%2), %%xmm0\n\
+            pmovmskb %%xmm0, %1\n\
+            test %1, %1\n\
+            jnz 2f\n\
+            add $16, %2\n\
+            inc %0\n\
+            cmp %3, %0\n\
+            jb 1b\n\
+            2:"
+            : "+r"(done), "=&r"(mask), "+r"(string) : "r"(blocks) : "memory" SSE_CLOBBERS("xmm0"));
+
+        return done;
+    }
+
+    // Counts the continuation bytes in `blocks` (at most 255) 16 byte blocks, interrupts must be disabled
+    static uint32_t _sse2_continuations(const uint8_t *string, uint32_t blocks) {
+        uint32_t low;
+        uint32_t high;
+
+        // Continuation bytes are 0x80 to 0xbf, which are less than 0xc0 as signed bytes. Each block subtracts -1 from
+        //  the byte counters for each one it has, then they are all added together with psadbw
+        __asm__ volatile ("\
+            mov $0xc0c0c0c0, %0\n\
+            movd %0, %%xmm1\n\
+            pshufd $0, %%xmm1, %%xmm1\n\
+            pxor %%xmm2, %%xmm2\n\
+            pxor %%xmm3, %%xmm3\n\
+            1:\n\
+            movdqu (%2), %%xmm4\n\
+            movdqa %%xmm1, %%xmm0\n\
+            pcmpgtb %%xmm4, %%xmm0\n\
+            psubb %%xmm0, %%xmm2\n\
+            add $16, %2\n\
+            dec %3\n\
+            jnz 1b\n\
+            psadbw %%xmm3, %%xmm2\n\
+            movd %%xmm2, %0\n\
+            pshufd $2, %%xmm2, %%xmm2\n\
+            movd %%xmm2, %1"
+            : "=&r"(low), "=&r"(high), "+r"(string), "+r"(blocks)
+            : : "memory" SSE_CLOBBERS("xmm0", "xmm1", "xmm2", "xmm3", "xmm4"));
+
+        return low + high;
+    }
+
+    // Returns the offset of the first byte equal to `c` in `blocks` 16 byte blocks, or `blocks * 16` if there isn't
+    //  one, interrupts must be disabled
+    static size_t _sse2_find(const uint8_t *string, uint8_t c, size_t blocks) {
+        size_t offset = 0;
+        uint32_t mask = c * 0x01010101;
+
+        __asm__ volatile ("\
+            movd %1, %%xmm1\n\
+            pshufd $0, %%xmm1, %%xmm1\n\
+            1:\n\
+            movdqu (%2), %%xmm0\n\
+            pcmpeqb %%xmm1, %%xmm0\n\
+            pmovmskb %%xmm0, %1\n\
+            test %1, %1\n\
+            jnz 2f\n\
+            add $16, %2\n\
+            add $16, %0\n\
+            dec %3\n\
+            jnz 1b\n\
+            jmp 3f\n\
+            2:\n\
+            bsf %1, %1\n\
+            add %1, %0\n\
+            3:"
+            : "+r"(offset), "+r"(mask), "+r"(string), "+r"(blocks) : : "memory" SSE_CLOBBERS("xmm0", "xmm1"));
+
+        return offset;
+    }
+
+    // Returns the length of the valid UTF-8 sequence starting at string[i], or 0 if there isn't one there
+    static uint32_t _sequence_length(const uint8_t *string, size_t i, size_t length) {
+        uint8_t first = string[i];
+        uint32_t extra;
+        uint8_t low = 0x80;
+        uint8_t high = 0xbf;
+
+        if(first < 0x80) {
+            return 1;
+        }else if(first >= 0xc2 && first <= 0xdf) {
+            extra = 1;
+        }else if(first == 0xe0) {
+            // Overlong
+            extra = 2;
+            low = 0xa0;
+        }else if(first >= 0xe1 && first <= 0xef) {
+            // Surrogates
+            extra = 2;
+            if(first == 0xed) {
+                high = 0x9f;
+            }
+        }else if(first == 0xf0) {
+            // Overlong
+            extra = 3;
+            low = 0x90;
+        }else if(first >= 0xf1 && first <= 0xf3) {
+            extra = 3;
+        }else if(first == 0xf4) {
+            // Above U+10FFFF
+            extra = 3;
+            high = 0x8f;
+        }else{
+            return 0;
+        }
+
+        if(length - i <= extra) {
+            return 0;
+        }
+        if(string[i + 1] < low || string[i + 1] > high) {
+            return 0;
+        }
+        for(uint32_t j = 2; j <= extra; j ++) {
+            if((string[i + j] & 0xc0) != 0x80) {
+                return 0;
+            }
+        }
+
+        return extra + 1;
+    }
+
+    size_t valid_length(const char *string, size_t length) {
+        const uint8_t *s = (const uint8_t *)string;
+        bool vector = length >= _SSE2_THRESHOLD && sse2_enabled();
+        uint32_t eflags = 0;
+        size_t i = 0;
+
+        if(vector) {
+            eflags = push_cli();
+        }
+
+        while(i < length) {
+            if(vector && length - i >= 16) {
+                i += _sse2_ascii_blocks(s + i, (length - i) / 16) * 16;
+            }
+
+            // The next 16 bytes have something other than ASCII in them (or are at the end), check them one sequence
+            //  at a time
+            size_t end = length - i > 16 ? i + 16 : length;
+            while(i < end) {
+                uint32_t sequence = _sequence_length(s, i, length);
+                if(!sequence) {
+                    goto done;
+                }
+                i += sequence;
+            }
+        }
+
+        done:
+        if(vector) {
+            pop_flags(eflags);
+        }
+        return i < length ? i : length;
+    }
+
+    bool valid(const char *string, size_t length) {
+        return valid_length(string, length) == length;
+    }
+
+    size_t count_chars(const char *string, size_t length) {
+        const uint8_t *s = (const uint8_t *)string;
+        size_t continuations = 0;
+        size_t i = 0;
+
+        if(length >= _SSE2_THRESHOLD && sse2_enabled()) {
+            uint32_t eflags = push_cli();
+            while(length - i >= 16) {
+                uint32_t blocks = (length - i) / 16 > 255 ? 255 : (length - i) / 16;
+                continuations += _sse2_continuations(s + i, blocks);
+                i += blocks * 16;
+            }
+            pop_flags(eflags);
+        }
+
+        for(; i < length; i ++) {
+            if((s[i] & 0xc0) == 0x80) {
+                continuations ++;
+            }
+        }
+
+        return length - continuations;
+    }
+
+    size_t find_byte(const char *string, size_t length, char c) {
+        const uint8_t *s = (const uint8_t *)string;
+        size_t i = 0;
+
+        if(length >= _SSE2_THRESHOLD && sse2_enabled()) {
+            uint32_t eflags = push_cli();
+            i = _sse2_find(s, c, length / 16);
+            pop_flags(eflags);
+
+            if(i < (length & ~15)) {
+                return i;
+            }
+        }
+
+        for(; i < length; i ++) {
+            if(s[i] == (uint8_t)c) {
+                return i;
+            }
+        }
+
+        return Utf8::npos;
+    }
+
     Utf8::Utf8(const char *string) : string(string), byte_count(strlen(string)) {}
 
     Utf8 Utf8::own(const char *buffer, uint32_t size) {
@@ -27,16 +275,50 @@ namespace utf8 {
         return base;
     }
 
-    Utf8::Utf8(const Utf8 &copy) : string_ptr(copy.string_ptr), string(copy.string),
-        byte_count(copy.byte_count) {}
-    Utf8::Utf8(Utf8 &&move) : string_ptr(::move(move.string_ptr)), string(move.string),
-        byte_count(move.byte_count) {
+    Utf8::Utf8(const Utf8 &copy) : string_ptr(copy.string_ptr) {
+        copy_from(copy);
+    }
+    Utf8::Utf8(Utf8 &&move) : string_ptr(::move(move.string_ptr)) {
+        copy_from(move);
         move.string = _empty_string;
         move.byte_count = 0;
+        move.hash_value = 0;
+        move.char_count = npos;
+        move.atom = false;
     }
 
     Utf8::Utf8() : string_ptr(shared_ptr<const char>(nullptr)), string(_empty_string), byte_count(0) {}
 
+    // Copies everything but string_ptr, pointing into our own small buffer if the other string was in its one
+    void Utf8::copy_from(const Utf8 &other) {
+        if(other.string == other.small) {
+            memcpy(small, other.small, other.byte_count + 1);
+            string = small;
+        }else{
+            string = other.string;
+        }
+        byte_count = other.byte_count;
+        hash_value = other.hash_value;
+        char_count = other.char_count;
+        atom = other.atom;
+    }
+
+    // Makes this (newly constructed) Utf8 own a buffer of the given length, which the caller must fill and terminate
+    char *Utf8::reserve(size_t length) {
+        char *buffer;
+
+        if(length <= SMALL_SIZE) {
+            buffer = small;
+        }else{
+            buffer = (char *)kmem::kmalloc(length + 1, 0);
+            string_ptr = shared_ptr<const char>(buffer);
+        }
+
+        string = buffer;
+        byte_count = length;
+        return buffer;
+    }
+
     const char *Utf8::to_string() const {
         return string;
     }
@@ -46,45 +328,88 @@ namespace utf8 {
     }
 
     Utf8 Utf8::substr(size_t pos, size_t len) const {
-        size_t c;
-
         if(len > bytes() - pos) {
             len = bytes() - pos;
         }
 
-        char *newbuff = (char *)kmem::kmalloc(len + 1, 0);
-
-        for(c = 0; c < len; c ++) {
-            newbuff[c] = string[pos + c];
+        if(pos == 0 && len == bytes()) {
+            return *this;
         }
 
+        Utf8 sub;
+        char *newbuff = sub.reserve(len);
+        memcpy(newbuff, string + pos, len);
         newbuff[len] = '\0';
-        return Utf8::own(newbuff, len);
+
+        return sub;
     }
 
     uint32_t Utf8::chars() const {
-        uint32_t p = 0;
-        uint32_t c = 0;
-        while(p < UINT32_MAX) {
-            if(string[p] == '\0') {
-                return c;
-            }
-            if(!(string[p] & 0x80)) {
-                c ++;
+        if(char_count == npos) {
+            char_count = count_chars(string, byte_count);
+        }
+        return char_count;
+    }
+
+    bool Utf8::valid() const {
+        return utf8::valid(string, byte_count);
+    }
+
+    uint32_t Utf8::hash() const {
+        if(!hash_value) {
+            // FNV-1a
+            uint32_t h = 2166136261u;
+            for(uint32_t p = 0; p < byte_count; p ++) {
+                h ^= (uint8_t)string[p];
+                h *= 16777619u;
             }
-            if(string[p] & 0xc0) {
-                c ++;
+            hash_value = h ? h : 1;
+        }
+        return hash_value;
+    }
+
+    Utf8 Utf8::intern() const {
+        if(atom) {
+            return *this;
+        }
+
+        uint32_t h = hash();
+        _atom_t *volatile &bucket = _atoms[h % _ATOM_BUCKETS];
+        _atom_t *found = _find_atom(bucket, string, byte_count, h);
+
+        if(!found) {
+            uint32_t eflags = push_cli();
+            _atoms_lock.lock();
+            found = _find_atom(bucket, string, byte_count, h);
+            if(!found) {
+                found = (_atom_t *)kmem::kmalloc(sizeof(_atom_t) + byte_count + 1, 0);
+                found->next = bucket;
+                found->hash = h;
+                found->bytes = byte_count;
+                memcpy(found->string(), string, byte_count);
+                found->string()[byte_count] = '\0';
+
+                // Readers don't take the lock, so the atom must be filled in before it can be seen
+                __sync_synchronize();
+                bucket = found;
             }
-            p ++;
+            _atoms_lock.unlock();
+            pop_flags(eflags);
         }
-        return c;
+
+        Utf8 interned;
+        interned.string = found->string();
+        interned.byte_count = found->bytes;
+        interned.hash_value = h;
+        interned.atom = true;
+        return interned;
     }
 
     int Utf8::compare(size_t pos, size_t len, const Utf8& str, size_t subpos, size_t sublen) const {
         size_t count = len > sublen ? sublen : len;
 
         // Check if we are just pointers to the same string
-        if(string == str.string) {
+        if(string + pos == str.string + subpos && len == sublen) {
             return 0;
         }
 
@@ -112,6 +437,10 @@ namespace utf8 {
     }
 
     size_t Utf8::find(const Utf8 &str, size_t pos) const {
+        if(str.bytes() > bytes()) {
+            return Utf8::npos;
+        }
+
         for(; pos <= bytes() - str.bytes(); pos ++) {
             if(!compare(pos, str.bytes(), str)) {
                 return pos;
@@ -122,13 +451,13 @@ namespace utf8 {
     }
 
     size_t Utf8::find(char c, size_t pos) const {
-        for(; pos <= bytes(); pos ++) {
-            if(string[pos] == c) {
-                return pos;
-            }
+        if(pos > bytes()) {
+            return Utf8::npos;
         }
 
-        return Utf8::npos;
+        // Includes the null terminator
+        size_t found = find_byte(string + pos, bytes() + 1 - pos, c);
+        return found == Utf8::npos ? Utf8::npos : pos + found;
     }
 
     bool Utf8::operator==(const Utf8 &other) const {
@@ -142,17 +471,16 @@ namespace utf8 {
             return false;
         }
 
-        uint32_t p = 0;
-        while(p < UINT32_MAX) {
-            if(string[p] != other.string[p]) {
-                return false;
-            }
-            if(string[p] == '\0') {
-                return true;
-            }
-            p ++;
+        // Different interned strings always have different contents
+        if(atom && other.atom) {
+            return false;
         }
-        return true;
+
+        if(hash_value && other.hash_value && hash_value != other.hash_value) {
+            return false;
+        }
+
+        return !memcmp(string, other.string, byte_count);
     }
 
     bool Utf8::operator!=(const Utf8 &other) const {
@@ -178,20 +506,25 @@ namespace utf8 {
     }
 
     Utf8& Utf8::operator=(Utf8 &other) {
-        string = other.string;
         string_ptr = other.string_ptr;
-        byte_count = other.byte_count;
+        copy_from(other);
 
         return *this;
     }
 
     Utf8& Utf8::operator=(Utf8 &&other) {
-        string = other.string;
+        if(&other == this) {
+            return *this;
+        }
+
         string_ptr = move(other.string_ptr);
-        byte_count = other.byte_count;
+        copy_from(other);
 
         other.string = _empty_string;
         other.byte_count = 0;
+        other.hash_value = 0;
+        other.char_count = npos;
+        other.atom = false;
 
         return *this;
     }
@@ -204,7 +537,8 @@ namespace utf8 {
             st = UINT32_MAX - 1;
         }
 
-        char *newbuff = (char *)kmem::kmalloc(sa+sb+1, 0);
+        Utf8 result;
+        char *newbuff = result.reserve(st);
         for(uint32_t p = 0; p < sa && (p < UINT32_MAX - 1); p ++) {
             newbuff[p] = string[p];
         }
@@ -213,7 +547,7 @@ namespace utf8 {
         }
         newbuff[st] = '\0';
 
-        return Utf8::own(newbuff, st);
+        return result;
     }
 
     Utf8 Utf8::operator+(const char *other) {
@@ -224,7 +558,8 @@ namespace utf8 {
             st = UINT32_MAX - 1;
         }
 
-        char *newbuff = (char *)kmem::kmalloc(sa+sb+1, 0);
+        Utf8 result;
+        char *newbuff = result.reserve(st);
         for(uint32_t p = 0; p < sa && (p < UINT32_MAX - 1); p ++) {
             newbuff[p] = string[p];
         }
@@ -233,7 +568,7 @@ namespace utf8 {
         }
         newbuff[st] = '\0';
 
-        return Utf8::own(newbuff, st);
+        return result;
     }
 
     char Utf8::operator[] (int x) const {
@@ -364,10 +699,11 @@ namespace utf8 {
 
         va_end(ap);
 
-        char* out_buf = new char[out.size() + 1];
+        Utf8 result;
+        char *out_buf = result.reserve(out.size());
         memcpy(out_buf, out.data(), out.size());
         out_buf[out.size()] = '\0';
-        return Utf8::own(out_buf, out.size());
+        return result;
     }
 }
 
@@ -421,6 +757,77 @@ public:
         Utf8 h("Hello");
         Utf8 w("World");
         assert(f2.format(&h, &w) == "Hello World");
+
+        test("Small strings");
+        Utf8 sentence("A string which is too long to be stored inline");
+        Utf8 word = sentence.substr(2, 6);
+        assert(word == "string");
+        assert(word.to_string() != sentence.to_string() + 2);
+        Utf8 word_copy = word;
+        assert(word_copy == "string");
+        assert(word_copy.to_string() != word.to_string());
+        Utf8 word_moved = move(word_copy);
+        assert(word_moved == "string");
+        assert(word_copy == "");
+        assert(sentence.substr(2, Utf8::npos) == "string which is too long to be stored inline");
+        assert(sentence.substr(0, Utf8::npos).to_string() == sentence.to_string());
+
+        test("Counting characters");
+        assert(Utf8("abc").chars() == 3);
+        assert(Utf8("\xc3\xa9t\xc3\xa9").chars() == 3);
+        assert(Utf8("\xe2\x82\xac").chars() == 1);
+
+        test("Hashing");
+        assert(Utf8("hash").hash() == (Utf8("ha") + "sh").hash());
+        assert(Utf8("hash").hash() != Utf8("hasH").hash());
+
+        test("Interning");
+        Utf8 i1 = Utf8("interned").intern();
+        Utf8 i2 = (Utf8("inter") + "ned").intern();
+        assert(i1.interned() && i2.interned());
+        assert(!Utf8("interned").interned());
+        assert(i1.to_string() == i2.to_string());
+        assert(i1 == i2);
+        assert(i1 != Utf8("other").intern());
+        assert(i1 == Utf8("interned"));
+        assert(i1.intern().to_string() == i1.to_string());
+
+        test("Validating short strings");
+        assert(Utf8("plain ascii").valid());
+        assert(Utf8("\xc3\xa9t\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80").valid());
+        assert(!Utf8("\x80").valid());
+        assert(!Utf8("\xc0\xaf").valid());
+        assert(!Utf8("\xe0\x80\xaf").valid());
+        assert(!Utf8("\xed\xa0\x80").valid());
+        assert(!Utf8("\xf4\x90\x80\x80").valid());
+        assert(!Utf8("\xff").valid());
+        assert(utf8::valid_length("ab\xe2\x82", 4) == 2);
+
+        test("Scanning long strings");
+        const uint32_t LONG = 500;
+        char *text = (char *)kmem::kmalloc(LONG + 1, 0);
+        uint32_t expected_chars = 0;
+        for(uint32_t i = 0; i < LONG; expected_chars ++) {
+            if(expected_chars % 7 == 6 && i + 2 <= LONG) {
+                text[i ++] = '\xc3';
+                text[i ++] = '\xa9';
+            }else{
+                text[i ++] = 'a' + expected_chars % 26;
+            }
+        }
+        text[LONG] = '\0';
+        assert(utf8::valid(text, LONG));
+        assert(utf8::count_chars(text, LONG) == expected_chars);
+        assert(Utf8(text).chars() == expected_chars);
+        assert(utf8::find_byte(text, LONG, '!') == Utf8::npos);
+        text[321] = '!';
+        assert(utf8::find_byte(text, LONG, '!') == 321);
+        assert(Utf8(text).find('!', 100) == 321);
+        assert(Utf8(text).find('\0') == LONG);
+        text[321] = '\xc3';
+        text[322] = 'a';
+        assert(utf8::valid_length(text, LONG) == 321);
+        kmem::kfree(text);
     }
 };
 
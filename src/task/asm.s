@@ -1,8 +1,23 @@
+# Every saved thread stack has the address of the code that restores it on top, so any of them can be entered with ret
+
+.globl task_asm_restore_full
+task_asm_restore_full:
+    call task_switch_finish;
+    popal;
+    popf;
+    ret;
+
+task_asm_restore_light:
+    call task_switch_finish;
+    pop %edi;
+    pop %esi;
+    pop %ebx;
+    pop %ebp;
+    ret $4;
+
 .globl task_asm_enter
 task_asm_enter:
     mov %ecx, %esp;
-    popal;
-    popf;
     ret;
 
 .globl task_asm_entry_point
@@ -14,11 +29,29 @@ task_asm_entry_point:
 task_asm_yield:
     pushf;
     pushal;
+    push $task_asm_restore_full;
     mov %esp, %eax;
     mov %ecx, %esp;
     push %eax;
     call task_yield_done;
 
+# Only the callee saved registers need to be kept, the caller has interrupts disabled and restores the flags itself
+.globl task_asm_switch
+task_asm_switch:
+    mov 4(%esp), %eax;
+    push %ebp;
+    push %ebx;
+    push %esi;
+    push %edi;
+    push $task_asm_restore_light;
+    mov %esp, (%ecx);
+    test %eax, %eax;
+    jz 1f;
+    mov %eax, %cr3;
+1:
+    mov %edx, %esp;
+    ret;
+
 .globl task_asm_set_stack
 task_asm_set_stack:
     mov %ecx, %esp;
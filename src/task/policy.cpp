@@ -0,0 +1,169 @@
+#include <stdint.h>
+
+#include "task/policy.hpp"
+#include "task/task.hpp"
+#include "main/clock.hpp"
+#include "int/lapic.hpp"
+
+namespace task {
+    RoundRobinPolicy round_robin_policy;
+    FairPolicy fair_policy;
+
+    // From nice -20 to 19, each about 1.25 times the next so that one step of nice is about 10% of the CPU
+    static const uint32_t _weights[NICE_MAX - NICE_MIN + 1] = {
+        88761, 71755, 56483, 46273, 36291,
+        29154, 23254, 18705, 14949, 11916,
+        9548, 7620, 6100, 4904, 3906,
+        3121, 2501, 1991, 1586, 1277,
+        1024, 820, 655, 526, 423,
+        335, 272, 215, 172, 137,
+        110, 87, 70, 56, 45,
+        36, 29, 23, 18, 15
+    };
+
+
+    shared_ptr<Thread> Policy::remove(RunQueue &queue, Thread &thread) {
+        shared_ptr<Thread> found;
+
+        for(auto t = queue.threads.begin(); t != queue.threads.end(); t ++) {
+            if(t->get() == &thread) {
+                found = move(*t);
+                queue.threads.erase(t);
+                break;
+            }
+        }
+
+        return found;
+    }
+
+    void Policy::charge(RunQueue &queue, Thread &thread, uint64_t ns) {}
+
+    uint64_t Policy::slice(RunQueue &queue, Thread &thread) {
+        return clock::NS_PER_SEC / lapic::SWITCHES_PER_SECOND;
+    }
+
+    bool Policy::preempts(RunQueue &queue, Thread &thread) {
+        return false;
+    }
+
+    void Policy::detach(RunQueue &queue, Thread &thread) {}
+
+    void Policy::attach(RunQueue &queue, Thread &thread) {}
+
+    shared_ptr<Thread> Policy::take_first(RunQueue &queue, uint32_t cpu) {
+        shared_ptr<Thread> thread;
+
+        for(auto t = queue.threads.begin(); t != queue.threads.end(); t ++) {
+            if((*t)->affinity & CPU_MASK(cpu)) {
+                thread = move(*t);
+                queue.threads.erase(t);
+                break;
+            }
+        }
+
+        return thread;
+    }
+
+
+    void RoundRobinPolicy::enqueue(RunQueue &queue, shared_ptr<Thread> thread, enqueue_reason_t reason) {
+        queue.threads.push_back(move(thread));
+    }
+
+    shared_ptr<Thread> RoundRobinPolicy::pick(RunQueue &queue, uint32_t cpu) {
+        return take_first(queue, cpu);
+    }
+
+
+    uint32_t FairPolicy::weight(int8_t nice) {
+        return _weights[nice - NICE_MIN];
+    }
+
+    // The smallest vruntime of the queue and the given (running) thread, if that is larger than it was
+    void FairPolicy::update_min(RunQueue &queue, int64_t vruntime) {
+        if(!queue.threads.empty() && queue.threads.front()->vruntime < vruntime) {
+            vruntime = queue.threads.front()->vruntime;
+        }
+
+        if(vruntime > queue.min_vruntime) {
+            queue.min_vruntime = vruntime;
+        }
+    }
+
+    void FairPolicy::enqueue(RunQueue &queue, shared_ptr<Thread> thread, enqueue_reason_t reason) {
+        if(reason == ENQUEUE_WOKEN) {
+            int64_t floor = queue.min_vruntime - (int64_t)SLEEPER_CREDIT;
+            if(thread->vruntime < floor) {
+                thread->vruntime = floor;
+            }
+        }else if(reason == ENQUEUE_YIELDED) {
+            // Let every other queued thread run first
+            if(!queue.threads.empty() && queue.threads.back()->vruntime > thread->vruntime) {
+                thread->vruntime = queue.threads.back()->vruntime;
+            }
+            queue.threads.push_back(move(thread));
+            return;
+        }
+
+        // Keep the queue sorted by vruntime, with threads that have the same one in the order they were added. A
+        //  preempted thread has usually run for longer than everything queued, and a woken one for less, so check
+        //  the ends before walking the list.
+        if(queue.threads.empty() || queue.threads.back()->vruntime <= thread->vruntime) {
+            queue.threads.push_back(move(thread));
+            return;
+        }
+        if(thread->vruntime < queue.threads.front()->vruntime) {
+            queue.threads.push_front(move(thread));
+            return;
+        }
+
+        auto prev = queue.threads.begin();
+        for(auto t = ++ queue.threads.begin(); (*t)->vruntime <= thread->vruntime; t ++) {
+            prev = t;
+        }
+
+        queue.threads.insert_after(prev, move(thread));
+    }
+
+    shared_ptr<Thread> FairPolicy::pick(RunQueue &queue, uint32_t cpu) {
+        shared_ptr<Thread> thread = take_first(queue, cpu);
+
+        if(thread) {
+            update_min(queue, thread->vruntime);
+        }
+        return thread;
+    }
+
+    void FairPolicy::charge(RunQueue &queue, Thread &thread, uint64_t ns) {
+        thread.vruntime += (int64_t)(ns * NICE_0_WEIGHT / weight(thread.nice));
+        update_min(queue, thread.vruntime);
+    }
+
+    uint64_t FairPolicy::slice(RunQueue &queue, Thread &thread) {
+        uint64_t own = weight(thread.nice);
+        uint64_t total = own;
+        uint32_t count = 1;
+
+        for(shared_ptr<Thread> &t : queue.threads) {
+            total += weight(t->nice);
+            count ++;
+        }
+
+        // Every thread gets its share of LATENCY, unless there are so many that would make slices too short
+        uint64_t period = count * MIN_GRANULARITY > LATENCY ? count * MIN_GRANULARITY : LATENCY;
+        uint64_t slice = period * own / total;
+
+        return slice > MIN_GRANULARITY ? slice : MIN_GRANULARITY;
+    }
+
+    bool FairPolicy::preempts(RunQueue &queue, Thread &thread) {
+        return thread.vruntime + (int64_t)WAKEUP_GRANULARITY < queue.running_vruntime;
+    }
+
+    void FairPolicy::detach(RunQueue &queue, Thread &thread) {
+        thread.vruntime -= queue.min_vruntime;
+    }
+
+    void FairPolicy::attach(RunQueue &queue, Thread &thread) {
+        thread.vruntime += queue.min_vruntime;
+    }
+}
@@ -0,0 +1,100 @@
+#include <stdint.h>
+
+#include "task/rcu.hpp"
+#include "main/cpu.hpp"
+#include "structures/spinlock.hpp"
+#include "int/lapic.hpp"
+
+namespace rcu {
+    struct _retired_t {
+        void (*destroy)(void *);
+        void *object;
+        cpu_mask_t waiting; // CPUs which have yet to pass a quiescent state
+        uint32_t counts[MAX_CORES]; // The quiescent counts of every CPU when the object was retired
+        _retired_t *next;
+    };
+
+    volatile uint32_t pending;
+
+    static volatile uint32_t _counts[MAX_CORES];
+    static volatile cpu_mask_t _idle;
+    static _retired_t *_retired;
+    static spinlock::Spinlock _lock;
+
+    void quiescent() {
+        _counts[cpu::id()] ++;
+    }
+
+    void idle_enter() {
+        __sync_fetch_and_or(&_idle, CPU_MASK(cpu::id()));
+    }
+
+    void idle_exit() {
+        __sync_fetch_and_and(&_idle, ~CPU_MASK(cpu::id()));
+    }
+
+    void retire(void (*destroy)(void *), void *object) {
+        _retired_t *retired = new _retired_t;
+        retired->destroy = destroy;
+        retired->object = object;
+
+        // The object must be unpublished before any of the counts are read
+        __sync_synchronize();
+
+        spinlock::IrqSave guard(_lock);
+        // This CPU is not in a read section, so it doesn't need to wait for itself
+        retired->waiting = cpu::online & ~CPU_MASK(cpu::id());
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            retired->counts[i] = _counts[i];
+        }
+        retired->next = _retired;
+        _retired = retired;
+        __sync_fetch_and_add(&pending, 1);
+    }
+
+    void reclaim() {
+        _retired_t *done = nullptr;
+
+        uint32_t eflags = push_cli();
+        _lock.lock();
+        cpu_mask_t stalled = 0;
+        for(_retired_t **r = &_retired; *r;) {
+            _retired_t *retired = *r;
+
+            for(uint32_t i = 0; i < MAX_CORES; i ++) {
+                if((retired->waiting & CPU_MASK(i)) && _counts[i] != retired->counts[i]) {
+                    retired->waiting &= ~CPU_MASK(i);
+                }
+            }
+
+            if(retired->waiting) {
+                stalled |= retired->waiting;
+                r = &retired->next;
+            }else{
+                *r = retired->next;
+                retired->next = done;
+                done = retired;
+            }
+        }
+        _lock.unlock();
+
+        // Interrupt handlers may read while the CPU is idle, so it can't count as quiescent; wake it up instead so it goes
+        //  around the scheduler loop
+        stalled &= _idle & ~CPU_MASK(cpu::id());
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            if(stalled & CPU_MASK(i)) {
+                lapic::wake(i);
+            }
+        }
+        pop_flags(eflags);
+
+        // Destroying the objects may free memory or send IPIs, so don't hold the lock while doing so
+        while(done) {
+            _retired_t *next = done->next;
+            done->destroy(done->object);
+            delete done;
+            __sync_fetch_and_sub(&pending, 1);
+            done = next;
+        }
+    }
+}
@@ -8,10 +8,17 @@
 #include "mem/object.hpp"
 #include "mem/kmem.hpp"
 #include "structures/mutex.hpp"
+#include "structures/spinlock.hpp"
 #include "structures/shared_ptr.hpp"
 #include "structures/list.hpp"
-#include "structures/list.hpp"
+#include "structures/id_table.hpp"
+#include "task/rcu.hpp"
+#include "task/timer.hpp"
+#include "task/policy.hpp"
+#include "main/clock.hpp"
 #include "main/asm_utils.hpp"
+#include "int/lapic.hpp"
+#include "test/test.hpp"
 
 extern "C" {
     #include "task/asm.h"
@@ -19,79 +26,289 @@ extern "C" {
 
 namespace task {
     const uint8_t _INIT_FLAGS = 0x0;
+    const uint32_t _NO_CPU = ~0u;
 
     shared_ptr<Process> kernel_process;
+    volatile bool direct_switching = true;
 
     static uint32_t process_counter;
     static uint32_t task_counter;
 
-    static list<shared_ptr<Process>> processes;
+    static id_table::IdTable<Process> processes;
+
+    static mutex::Mutex _mutex("task");
+
+    // Protects Thread::in_use, Thread::blocked_on and Thread::cpu_time, only taken with interrupts disabled
+    static spinlock::Spinlock _state_lock;
+
+    // Threads which are ready to run on a given CPU, in the order the policy picks them from; `run` and `preempt` are
+    //  protected by the lock
+    // The stats, `slice` and `preempted` are only used by the CPU that owns the queue, except for `contended` and
+    //  `wakeups`, which are only changed while holding the queue's lock
+    struct _run_queue_t {
+        spinlock::Spinlock lock;
+        RunQueue run;
+        volatile uint32_t length;
+        volatile bool preempt; // Another thread should be run as soon as possible
+        bool preempted; // The thread being switched out didn't yield by itself
+        uint64_t slice; // The time slice of the running thread
+        shared_ptr<Thread> prev; // A thread switched away from by _switch_direct, which task_switch_finish handles
+        enqueue_reason_t prev_reason;
+        scheduler_stats_t stats;
+    };
+    static _run_queue_t _queues[MAX_CORES];
 
-    static mutex::Mutex waiting_mutex;
-    static mutex::Mutex _mutex;
+    // Only changed while every run queue is locked
+    static Policy *_policy = FAIR_SCHEDULER ? (Policy *)&fair_policy : (Policy *)&round_robin_policy;
 
-    list<shared_ptr<Thread>> waiting_threads;
+    // CPUs which have nothing to run and are waiting in hlt
+    static volatile cpu_mask_t _idle;
 
-    vector<Utf8> wchans;
-    wchan_t no_wchan;
+    vector<WaitQueue *> wchans;
+
+    // Threads in sleep_for, which are only woken by their timeout
+    static WaitQueue _sleepers(Utf8("sleep"));
 
 
     void init() {
         kernel_process = make_shared<Process>(0, 0);
-        processes.push_back(kernel_process);
-        kernel_process->process_id = 0;
-        // All other fields 0 by default
+        processes.set(kernel_process->process_id, kernel_process);
+    }
 
-        no_wchan = new_wchan(Utf8("."));
+    // Interrupts must be disabled
+    static void _lock_queue(_run_queue_t &queue) {
+        if(queue.lock.trylock()) {
+            queue.lock.lock();
+            queue.stats.contended ++;
+        }
     }
 
-    shared_ptr<Process> get_process(uint32_t id) {
-        for(const auto &p : processes) {
-            if(p->process_id == id) return p;
+    // Interrupts must be disabled
+    static void _enqueue(shared_ptr<Thread> thread, uint32_t id, enqueue_reason_t reason) {
+        _run_queue_t &queue = _queues[id];
+        Thread &t = *thread;
+        bool wake;
+        bool preempt = false;
+
+        if(t.last_cpu != id && t.last_cpu != _NO_CPU) {
+            _run_queue_t &from = _queues[t.last_cpu];
+            _lock_queue(from);
+            _policy->detach(from.run, t);
+            from.lock.unlock();
+        }
+
+        _lock_queue(queue);
+        if(t.last_cpu != id) {
+            _policy->attach(queue.run, t);
+            t.last_cpu = id;
+        }
+        _policy->enqueue(queue.run, move(thread), reason);
+        queue.length ++;
+
+        if(reason == ENQUEUE_WOKEN && queue.run.running && !queue.preempt && _policy->preempts(queue.run, t)) {
+            queue.preempt = true;
+            preempt = true;
+        }
+
+        // The queue must be updated before checking whether the CPU is idle, since it checks them the other way around
+        __sync_synchronize();
+        wake = id != cpu::id() && (_idle & CPU_MASK(id));
+        if(wake) {
+            queue.stats.wakeups ++;
+        }
+        queue.lock.unlock();
+
+        if(wake || preempt) {
+            lapic::wake(id);
         }
+    }
 
-        return shared_ptr<Process>();
+    // Interrupts must be disabled
+    // Picks a CPU to run a thread that has just become runnable; an idle one if there are any, otherwise this one if
+    //  the thread may run on it
+    static uint32_t _pick_cpu(Thread &thread) {
+        cpu_mask_t allowed = thread.affinity & cpu::online;
+        cpu_mask_t idle = _idle & allowed;
+        uint32_t id = cpu::id();
+
+        if(idle) {
+            return __builtin_ctz(idle);
+        }
+        if(allowed & CPU_MASK(id)) {
+            return id;
+        }
+        if(thread.last_cpu != _NO_CPU && (allowed & CPU_MASK(thread.last_cpu))) {
+            return thread.last_cpu;
+        }
+        return __builtin_ctz(allowed);
     }
 
+    // Interrupts must be disabled
+    // Takes the thread that should run next on CPU `id` from a queue, which is moved out of the queue's accounting if
+    //  it isn't that CPU's
+    static shared_ptr<Thread> _dequeue(_run_queue_t &queue, uint32_t id) {
+        shared_ptr<Thread> thread;
 
-    Process::Process(uint32_t owner, uint32_t group) : process_id(process_counter++) {}
+        if(!queue.length) {
+            return thread;
+        }
 
-    shared_ptr<Thread> Process::new_thread(addr_logical_t entry_point) {
-        shared_ptr<Process> me = get_process(process_id);
-        shared_ptr<Thread> t = (threads.emplace_back(make_shared<Thread>(me, entry_point)), threads.back());
-        t->wchan = no_wchan;
+        _lock_queue(queue);
+        thread = _policy->pick(queue.run, id);
+        if(thread) {
+            queue.length --;
+            if(&queue != &_queues[id]) {
+                _policy->detach(queue.run, *thread);
+                thread->last_cpu = _NO_CPU;
+            }
+        }
+        queue.lock.unlock();
 
-        waiting_mutex.lock();
-        waiting_threads.push_front(t);
-        waiting_mutex.unlock();
-        return t;
+        return thread;
     }
 
-    shared_ptr<Thread> Process::get_thread(uint32_t id) const {
-        for(auto t = threads.cbegin(); t != threads.cend(); t ++) {
-            if((*t)->thread_id == id) {
-                return *t;
+    // Interrupts must be disabled
+    // Takes a thread from the longest run queue of any other CPU
+    static shared_ptr<Thread> _steal(uint32_t id) {
+        uint32_t victim = id;
+        uint32_t longest = 0;
+
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            if(i != id && (cpu::online & CPU_MASK(i)) && _queues[i].length > longest) {
+                victim = i;
+                longest = _queues[i].length;
             }
         }
-        return shared_ptr<Thread>();
+
+        if(victim == id) {
+            return shared_ptr<Thread>();
+        }
+        return _dequeue(_queues[victim], id);
     }
 
-    void Process::remove_thread(uint32_t id) {
-        for(auto t = threads.begin(); t != threads.end(); t ++) {
-            if((*t)->thread_id == id) {
-                threads.erase(t);
-                return;
+    // Interrupts must be disabled
+    // Records that a thread is about to run on this CPU, and returns the length of its time slice
+    static uint64_t _start_running(_run_queue_t &queue, uint32_t id, Thread &thread) {
+        uint64_t slice;
+
+        _lock_queue(queue);
+        if(thread.last_cpu != id) {
+            // Stolen from another CPU
+            _policy->attach(queue.run, thread);
+            thread.last_cpu = id;
+        }
+        queue.run.running = true;
+        queue.run.running_vruntime = thread.vruntime;
+        queue.preempt = false;
+        slice = _policy->slice(queue.run, thread);
+        queue.lock.unlock();
+
+        thread.run_start = clock::now_ns();
+        return slice;
+    }
+
+    // Interrupts must be disabled
+    // Charges the thread that was running on this CPU for the time it ran, this must be done before it can be woken
+    static void _stop_running(_run_queue_t &queue, Thread &thread) {
+        uint64_t ran = clock::now_ns() - thread.run_start;
+
+        _lock_queue(queue);
+        _policy->charge(queue.run, thread, ran);
+        queue.run.running = false;
+        queue.lock.unlock();
+
+        _state_lock.lock();
+        thread.cpu_time += ran;
+        _state_lock.unlock();
+    }
+
+    scheduler_stats_t scheduler_stats() {
+        scheduler_stats_t total = {0, 0, 0, 0, 0};
+
+        uint32_t eflags = push_cli();
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            _run_queue_t &queue = _queues[i];
+
+            queue.lock.lock();
+            total.switches += queue.stats.switches;
+            total.steals += queue.stats.steals;
+            total.contended += queue.stats.contended;
+            total.wakeups += queue.stats.wakeups;
+            total.direct += queue.stats.direct;
+            queue.lock.unlock();
+        }
+        pop_flags(eflags);
+
+        return total;
+    }
+
+    void set_policy(Policy &policy) {
+        uint32_t eflags = push_cli();
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            _queues[i].lock.lock();
+        }
+
+        _policy = &policy;
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            RunQueue &run = _queues[i].run;
+            list<shared_ptr<Thread>> threads;
+
+            while(!run.threads.empty()) {
+                threads.push_back(move(run.threads.front()));
+                run.threads.pop_front();
+            }
+            while(!threads.empty()) {
+                policy.enqueue(run, move(threads.front()), ENQUEUE_PREEMPTED);
+                threads.pop_front();
             }
         }
+
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            _queues[i].lock.unlock();
+        }
+        pop_flags(eflags);
+    }
+
+    Policy &get_policy() {
+        return *_policy;
+    }
+
+    shared_ptr<Process> get_process(uint32_t id) {
+        return processes.get(id);
+    }
+
+
+    Process::Process(uint32_t owner, uint32_t group)
+        : process_id(__sync_fetch_and_add(&process_counter, 1)), owner(owner), group(group), thread_counter(0) {}
+
+    shared_ptr<Thread> Process::new_thread(addr_logical_t entry_point, vm::Map *copy) {
+        shared_ptr<Process> me = get_process(process_id);
+        shared_ptr<Thread> t = make_shared<Thread>(me, entry_point, copy);
+        t->blocked_on = nullptr;
+        threads.set(t->thread_id, t);
+
+        uint32_t eflags = push_cli();
+        _enqueue(t, _pick_cpu(*t), ENQUEUE_WOKEN);
+        pop_flags(eflags);
+        return t;
+    }
+
+    shared_ptr<Thread> Process::get_thread(uint32_t id) const {
+        return threads.get(id);
+    }
+
+    void Process::remove_thread(uint32_t id) {
+        threads.remove(id);
     }
 
 
     /**
-     * @todo Copy all the objects into the new memory map
      * @todo Get the stack object properly
      */
-    Thread::Thread(shared_ptr<Process> process, addr_logical_t entry)
-        : process(process), thread_id(++process->thread_counter), task_id(++task_counter), in_use(false) {
+    Thread::Thread(shared_ptr<Process> process, addr_logical_t entry, vm::Map *copy)
+        : process(process), thread_id(__sync_add_and_fetch(&process->thread_counter, 1)),
+        task_id(__sync_add_and_fetch(&task_counter, 1)), blocked_on(nullptr), in_use(false), ended(false), nice(0),
+        affinity(~(cpu_mask_t)0), vruntime(0), run_start(0), last_cpu(_NO_CPU), cpu_time(0) {
         bool kernel = process->process_id == 0;
         uint32_t *sp;
         idt_proc_state_t pstate = {0, 0, 0, 0, 0, 0, 0, 0};
@@ -100,19 +317,27 @@ namespace task {
         _mutex.lock();
 
         // Create the virtual memory map
-        vm = make_unique<vm::Map>(process->process_id, task_id, kernel);
+        if(copy) {
+            vm = copy->clone(process->process_id, task_id, kernel);
+        }else{
+            vm = make_unique<vm::Map>(process->process_id, task_id, kernel);
+        }
 
-        // Create the stack object
-        stack = make_shared<object::EmptyObject>(1, page::PAGE_TABLE_RW, 0, 0);
+        // Create the stack object, which is never shared since faults on it can't be handled
+        stack = make_shared<object::EmptyObject>(1, page::PAGE_TABLE_RW, object::FLAG_NO_CLONE, 0);
         stack->generate(0, 1);
 
         vm->add_object(stack, TASK_STACK_TOP - PAGE_SIZE, 0, 1);
 
-        stack_installed = page::kinstall(stack->pages->page, 0);
+        stack_installed = page::kinstall(stack->find_page(0)->page, page::PAGE_TABLE_RW);
 
         // Initial stack format:
+        // task_asm_restore_full
         // [pushad values]
+        // flags
+        // task_asm_entry_point
         // entry eip
+        // task_end
         sp = (uint32_t *)((addr_logical_t)stack_installed + PAGE_SIZE) - 1;
         *sp = (addr_logical_t)task_end;
         sp --;
@@ -122,13 +347,16 @@ namespace task {
         sp --;
         *sp = _INIT_FLAGS;
         sp -= (sizeof(pstate) / 4);
-        memcpy(sp - (sizeof(pstate) / 4), &pstate, sizeof(pstate));
-
-        stack_pointer = TASK_STACK_TOP - sizeof(void *) * 4 - sizeof(pstate);
+        memcpy(sp, &pstate, sizeof(pstate));
+        sp --;
+        *sp = (addr_logical_t)task_asm_restore_full;
 
-        page::kuninstall(stack_installed, stack->pages->page);
+        stack_pointer = TASK_STACK_TOP - sizeof(void *) * 5 - sizeof(pstate);
 
         _mutex.unlock();
+
+        // This may need to wait for other CPUs to flush their TLBs, so don't hold the lock
+        page::kuninstall(stack_installed, stack->find_page(0)->page);
     }
 
 
@@ -138,12 +366,70 @@ namespace task {
     }
 
     void Thread::end() {
-        uint32_t eflags = push_cli();
-        _mutex.lock();
         ended = true;
         process->remove_thread(thread_id);
-        _mutex.unlock();
+    }
+
+    void Thread::set_nice(int32_t value) {
+        if(value < NICE_MIN) {
+            value = NICE_MIN;
+        }else if(value > NICE_MAX) {
+            value = NICE_MAX;
+        }
+        nice = value;
+    }
+
+    error_t Thread::set_affinity(cpu_mask_t mask) {
+        if(!(mask & cpu::online)) {
+            return EINVAL;
+        }
+
+        affinity = mask;
+        __sync_synchronize();
+
+        uint32_t eflags = push_cli();
+        bool self = cpu::info().thread.get() == this;
+        bool move_self = self && !(mask & CPU_MASK(cpu::id()));
+
+        if(!self) {
+            // If it is waiting to run on a CPU it can't run on any more, take it off that queue
+            shared_ptr<Thread> found;
+            for(uint32_t i = 0; i < MAX_CORES && !found; i ++) {
+                _run_queue_t &queue = _queues[i];
+                if(mask & CPU_MASK(i) || !queue.length) {
+                    continue;
+                }
+
+                _lock_queue(queue);
+                found = _policy->remove(queue.run, *this);
+                if(found) {
+                    queue.length --;
+                }
+                queue.lock.unlock();
+            }
+
+            if(found) {
+                uint32_t id = _pick_cpu(*found);
+                _enqueue(move(found), id, ENQUEUE_PREEMPTED);
+            }
+        }
         pop_flags(eflags);
+
+        if(move_self) {
+            // task_yield_done will put us on a run queue of a CPU we can run on
+            task_yield();
+        }
+        return EOK;
+    }
+
+    uint64_t Thread::get_cpu_time() {
+        uint32_t eflags = push_cli();
+        _state_lock.lock();
+        uint64_t time = cpu_time;
+        _state_lock.unlock();
+        pop_flags(eflags);
+
+        return time;
     }
 
 
@@ -160,10 +446,89 @@ namespace task {
     }
 
     void wait(wchan_t wchan) {
-        shared_ptr<Thread> t = get_thread();
-        t->wchan = wchan;
+        wchans[wchan]->wait();
+    }
 
-        task_yield();
+    bool wake_one(wchan_t wchan) {
+        return wchans[wchan]->wake_one();
+    }
+
+    uint32_t wake_all(wchan_t wchan) {
+        return wchans[wchan]->wake_all();
+    }
+
+    // Interrupts must be disabled
+    // Marks a thread that has just been switched away from on the given CPU as no longer in use, and puts it back on a
+    //  run queue unless it went to sleep
+    static void _release(shared_ptr<Thread> thread, uint32_t id, enqueue_reason_t reason) {
+        // If the thread went to sleep, whatever wakes it will see that it has stopped running and put it on a run queue
+        _state_lock.lock();
+        thread->in_use = false;
+        bool runnable = !thread->blocked_on;
+        _state_lock.unlock();
+
+        if(runnable) {
+            uint32_t target = (thread->affinity & CPU_MASK(id)) ? id : _pick_cpu(*thread);
+            _enqueue(move(thread), target, reason);
+        }
+    }
+
+    // Interrupts must be disabled
+    // Switches from the current thread straight to the next one on this CPU's run queue, without going through the
+    //  CPU's stack and task::schedule. Returns false without doing anything if the queue is empty, otherwise returns
+    //  once the current thread is run again
+    static bool _switch_direct(cpu::Status &info) {
+        uint32_t id = cpu::id();
+        _run_queue_t &queue = _queues[id];
+
+        // Nothing that yields can be in an RCU read section
+        rcu::quiescent();
+
+        shared_ptr<Thread> next = _dequeue(queue, id);
+        if(!next) {
+            return false;
+        }
+
+        _state_lock.lock();
+        if(next->in_use) {
+            panic("Found an in use thread in the run queue");
+        }
+        if(next->blocked_on) {
+            panic("Found a sleeping thread in the run queue");
+        }
+        next->in_use = true;
+        _state_lock.unlock();
+
+        // The current thread stays in use until task_switch_finish runs on the next thread's stack, so no other CPU
+        //  can start running it while we are still on its stack
+        Thread *prev = info.thread.get();
+        queue.prev = move(info.thread);
+        queue.prev_reason = queue.preempted ? ENQUEUE_PREEMPTED : ENQUEUE_YIELDED;
+        queue.preempted = false;
+        _stop_running(queue, *prev);
+
+        queue.stats.switches ++;
+        queue.stats.direct ++;
+        queue.slice = _start_running(queue, id, *next);
+        lapic::start_tick(queue.slice);
+
+        uint32_t sp = next->stack_pointer;
+        addr_phys_t dir = prev->vm->switch_to(next->vm.get());
+        info.thread = move(next);
+        task_asm_switch(&prev->stack_pointer, sp, dir);
+
+        return true;
+    }
+
+    // Called with interrupts disabled whenever a thread is switched to, before it starts running again
+    extern "C" void task_switch_finish() {
+        _run_queue_t &queue = _queues[cpu::id()];
+
+        if(!queue.prev) {
+            return;
+        }
+
+        _release(move(queue.prev), cpu::id(), queue.prev_reason);
     }
 
     extern "C" void task_yield() {
@@ -171,6 +536,11 @@ namespace task {
         cpu::Status& info = cpu::info();
         bool in_thread = (bool)info.thread;
         uint32_t stack = (uint32_t)info.stack + PAGE_SIZE;
+
+        if(in_thread && direct_switching && _switch_direct(info)) {
+            pop_flags(eflags);
+            return;
+        }
         pop_flags(eflags);
 
         // Do nothing if we are not in a task
@@ -186,6 +556,8 @@ namespace task {
         asm volatile ("cli");
         shared_ptr<Thread> current;
         cpu::Status& info = cpu::info();
+        uint32_t id = cpu::id();
+        _run_queue_t &queue = _queues[id];
         current = info.thread;
         info.thread = nullptr;
         current->stack_pointer = sp;
@@ -193,17 +565,15 @@ namespace task {
         // And then use the "normal" memory map
         current->vm->exit();
 
-        current->in_use = false;
+        _stop_running(queue, *current);
+        enqueue_reason_t reason = queue.preempted ? ENQUEUE_PREEMPTED : ENQUEUE_YIELDED;
+        queue.preempted = false;
+
+        _release(move(current), id, reason);
 
         // We are now free and can be interrupted again
         asm volatile ("sti");
 
-        waiting_mutex.lock();
-        if(current->wchan == no_wchan) {
-            waiting_threads.push_front(current);
-        }
-        waiting_mutex.unlock();
-
         schedule();
     }
 
@@ -212,47 +582,64 @@ namespace task {
 
         asm volatile ("cli");
         cpu::Status &info = cpu::info();
+        uint32_t id = cpu::id();
+        _run_queue_t &queue = _queues[id];
         info.awaiting_schedule = true;
         info.thread = nullptr;
 
         while(true) {
-            if(waiting_mutex.trylock()) {
-                asm volatile ("sti");
-                asm volatile ("hlt");
-                continue;
+            // This CPU can't be in the middle of reading anything protected by RCU
+            rcu::quiescent();
+
+            next = _dequeue(queue, id);
+            if(next) {
+                break;
             }
 
-            if(waiting_threads.empty()){
-                waiting_mutex.unlock();
-                asm volatile ("sti");
-                asm volatile ("hlt");
-                continue;
+            next = _steal(id);
+            if(next) {
+                queue.stats.steals ++;
+                break;
             }
 
-            break;
+            // Other CPUs check this after adding to our queue, so check the queue again after setting it
+            __sync_fetch_and_or(&_idle, CPU_MASK(id));
+            if(!queue.length) {
+                // Nothing to preempt, so don't take timer interrupts until there is
+                lapic::stop_tick();
+                rcu::idle_enter();
+                // sti doesn't take effect until after hlt starts, so a wakeup that arrives in between isn't missed
+                asm volatile ("sti; hlt; cli");
+                rcu::idle_exit();
+            }
+            __sync_fetch_and_and(&_idle, ~CPU_MASK(id));
         }
 
-        next = waiting_threads.back();
-        waiting_threads.pop_back();
-        waiting_mutex.unlock();
-
+        queue.stats.switches ++;
         info.awaiting_schedule = false;
 
-        _mutex.lock();
+        _state_lock.lock();
         bool ok = true;
 
         if(next->in_use) {
             ok = false;
-            panic("Found an in use thread in the waiting list");
+            panic("Found an in use thread in the run queue");
+        }
+
+        if(next->blocked_on) {
+            ok = false;
+            panic("Found a sleeping thread in the run queue");
         }
 
         if(ok) {
             next->in_use = true;
         }
 
-        _mutex.unlock();
+        _state_lock.unlock();
 
         if(ok) {
+            queue.slice = _start_running(queue, id, *next);
+            lapic::start_tick(queue.slice);
             task_enter(move(next));
         }else{
             schedule();
@@ -263,18 +650,30 @@ namespace task {
     extern "C" void task_timer_yield() {
         cpu::Status& info = cpu::info();
 
-        if(!info.thread && !info.awaiting_schedule) {
-            // Not running a thread or waiting for a schedule, do nothing
+        if(!info.thread) {
+            // Not running a thread (or waiting for a schedule), so there is nothing to preempt
+            return;
+        }
+
+        _run_queue_t &queue = _queues[cpu::id()];
+        uint64_t ran = clock::now_ns() - info.thread->run_start;
+        if(!queue.preempt && ran < queue.slice) {
+            // A tick or wakeup that arrived before the slice was over
+            lapic::start_tick(queue.slice - ran);
             return;
         }
 
+        queue.preempted = true;
         task_yield();
     }
 
     extern "C" void __attribute__((noreturn)) task_end_done() {
         shared_ptr<Thread> current = cpu::info().thread;
         cpu::info().thread = nullptr;
+        _stop_running(_queues[cpu::id()], *current);
 
+        // We are on the CPU's stack now, so the thread's memory map can be left
+        current->vm->exit();
         current->end();
         current = nullptr;
 
@@ -314,20 +713,315 @@ namespace task {
     }
 
     wchan_t new_wchan(Utf8 name) {
-        wchans.push_back(move(name));
+        wchans.push_back(new WaitQueue(move(name)));
         return wchans.size() - 1;
     }
 
-    void resume(shared_ptr<Thread> thread) {
-        _mutex.lock();
-        if(thread->wchan != no_wchan) {
-            thread->wchan = no_wchan;
-            _mutex.unlock();
-            waiting_mutex.lock();
-            waiting_threads.push_front(thread);
-            waiting_mutex.unlock();
+    bool resume(shared_ptr<Thread> thread) {
+        bool was_blocked;
+        bool stopped;
+
+        uint32_t eflags = push_cli();
+        _state_lock.lock();
+        was_blocked = thread->blocked_on;
+        stopped = !thread->in_use;
+        thread->blocked_on = nullptr;
+        _state_lock.unlock();
+
+        if(was_blocked && stopped) {
+            uint32_t id = _pick_cpu(*thread);
+            _enqueue(move(thread), id, ENQUEUE_WOKEN);
+        }
+        pop_flags(eflags);
+
+        return was_blocked;
+    }
+
+
+    void sleep_for(uint64_t ns) {
+        _sleepers.wait_until([]() { return false; }, ns);
+    }
+
+
+    Timeout::Timeout(uint64_t ns) : deadline(clock::now_ns() + ns), fired(false), thread(cpu::current_thread()),
+        timer(&expire, this) {
+        timer::add(timer, deadline);
+    }
+
+    Timeout::~Timeout() {
+        // This waits for the callback if it is running, so it doesn't use this object after it has been freed
+        timer::cancel(timer);
+    }
+
+    bool Timeout::expired() const {
+        // Timers may not fire while interrupts are disabled, or before the LAPIC timer has been calibrated
+        return fired || clock::now_ns() >= deadline;
+    }
+
+    void Timeout::expire(void *data) {
+        Timeout &timeout = *(Timeout *)data;
+
+        timeout.fired = true;
+        if(timeout.thread) {
+            resume(timeout.thread);
+        }
+    }
+
+
+    bool WaitQueue::prepare_wait() {
+        shared_ptr<Thread> thread;
+
+        uint32_t eflags = push_cli();
+        thread = cpu::current_thread_noint();
+        if(!thread) {
+            pop_flags(eflags);
+            return false;
+        }
+
+        lock.lock();
+        _state_lock.lock();
+        thread->blocked_on = this;
+        _state_lock.unlock();
+        waiters.push_back(move(thread));
+        lock.unlock();
+        pop_flags(eflags);
+
+        return true;
+    }
+
+    bool WaitQueue::cancel_wait() {
+        uint32_t eflags = push_cli();
+        shared_ptr<Thread> thread = cpu::current_thread_noint();
+        bool found = false;
+
+        lock.lock();
+        for(auto t = waiters.begin(); t != waiters.end(); t ++) {
+            if(*t == thread) {
+                waiters.erase(t);
+                found = true;
+                break;
+            }
+        }
+        lock.unlock();
+
+        // If we were woken in the meantime, this does nothing, since the thread is still running
+        _state_lock.lock();
+        thread->blocked_on = nullptr;
+        _state_lock.unlock();
+        pop_flags(eflags);
+
+        return found;
+    }
+
+    void WaitQueue::sleep() {
+        // If we have already been woken, this just yields
+        task_yield();
+    }
+
+    void WaitQueue::halt() {
+        uint32_t eflags = push_flags();
+
+        if(eflags & cpu::IF) {
+            asm volatile ("hlt");
+        }
+    }
+
+    void WaitQueue::wait() {
+        if(prepare_wait()) {
+            sleep();
         }else{
-            _mutex.unlock();
+            halt();
+        }
+    }
+
+    // The lock must be held
+    shared_ptr<Thread> WaitQueue::take_front() {
+        shared_ptr<Thread> thread;
+
+        if(!waiters.empty()) {
+            thread = move(waiters.front());
+            waiters.pop_front();
+        }
+        return thread;
+    }
+
+    shared_ptr<Thread> WaitQueue::dequeue() {
+        shared_ptr<Thread> thread;
+
+        uint32_t eflags = push_cli();
+        lock.lock();
+        thread = take_front();
+        lock.unlock();
+        pop_flags(eflags);
+
+        return thread;
+    }
+
+    bool WaitQueue::empty() const {
+        return waiters.empty();
+    }
+
+    bool WaitQueue::wake_one() {
+        shared_ptr<Thread> thread = dequeue();
+
+        if(!thread) {
+            return false;
         }
+
+        resume(move(thread));
+        return true;
     }
+
+    uint32_t WaitQueue::wake_all() {
+        list<shared_ptr<Thread>> woken;
+        uint32_t count = 0;
+
+        // Take them all at once, so threads that wait again straight away aren't woken twice
+        uint32_t eflags = push_cli();
+        lock.lock();
+        while(!waiters.empty()) {
+            woken.push_back(move(waiters.front()));
+            waiters.pop_front();
+        }
+        lock.unlock();
+
+        while(!woken.empty()) {
+            resume(move(woken.front()));
+            woken.pop_front();
+            count ++;
+        }
+        pop_flags(eflags);
+
+        return count;
+    }
+}
+
+namespace _tests {
+static task::WaitQueue *queue;
+static volatile bool ready;
+static volatile uint32_t woken;
+
+static void _wait_worker() {
+    queue->wait_until([]() { return ready; });
+    __sync_fetch_and_add(&woken, 1);
+}
+
+class WaitQueueTest : public test::TestCase {
+public:
+    WaitQueueTest() : test::TestCase("Wait Queue Test") {};
+
+    void run_test() override {
+        queue = new task::WaitQueue(Utf8("test"));
+        ready = false;
+        woken = 0;
+
+        test("Sleeping threads are not run");
+        shared_ptr<task::Thread> a = task::kernel_process->new_thread((addr_logical_t)&_wait_worker);
+        shared_ptr<task::Thread> b = task::kernel_process->new_thread((addr_logical_t)&_wait_worker);
+        while(!a->blocked_on || !b->blocked_on) task::task_yield();
+        for(uint32_t i = 0; i < 100; i ++) task::task_yield();
+        assert(woken == 0);
+
+        test("Waking threads whose condition is false");
+        assert(queue->wake_all() == 2);
+        while(!a->blocked_on || !b->blocked_on) task::task_yield();
+        assert(woken == 0);
+
+        test("Waking threads whose condition is true");
+        ready = true;
+        assert(queue->wake_one());
+        while(woken < 1) task::task_yield();
+        assert(queue->wake_one());
+        while(woken < 2) task::task_yield();
+        assert(!queue->wake_one());
+
+        test("Timing out");
+        uint64_t start = clock::now_ns();
+        assert(!queue->wait_until([]() { return false; }, 10 * 1000000ull));
+        assert(clock::now_ns() - start >= 10 * 1000000ull);
+        assert(queue->empty());
+        assert(queue->wait_until([]() { return ready; }, 10 * 1000000ull));
+
+        test("Sleeping");
+        start = clock::now_ns();
+        task::sleep_for(20 * 1000000ull);
+        assert(clock::now_ns() - start >= 20 * 1000000ull);
+
+        delete queue;
+    }
+};
+
+test::AddTestCase<WaitQueueTest> waitQueueTest;
+
+
+static volatile cpu_mask_t ran_on;
+static volatile uint32_t finished;
+
+static void _pinned_worker() {
+    task::get_thread()->set_affinity(CPU_MASK(0));
+    for(uint32_t i = 0; i < 100; i ++) {
+        uint32_t eflags = push_cli();
+        __sync_fetch_and_or(&ran_on, CPU_MASK(cpu::id()));
+        pop_flags(eflags);
+        task::task_yield();
+    }
+    __sync_fetch_and_add(&finished, 1);
+}
+
+class PolicyTest : public test::TestCase {
+public:
+    PolicyTest() : test::TestCase("Scheduling Policy Test") {};
+
+    void run_test() override {
+        task::Policy &policy = task::get_policy();
+        task::set_policy(task::fair_policy);
+
+        test("Threads only run on CPUs in their affinity mask");
+        ran_on = 0;
+        finished = 0;
+        task::kernel_process->new_thread((addr_logical_t)&_pinned_worker);
+        task::kernel_process->new_thread((addr_logical_t)&_pinned_worker);
+        while(finished < 2) task::task_yield();
+        assert(ran_on == CPU_MASK(0));
+        assert(task::get_thread()->set_affinity(0) == EINVAL);
+
+        test("Nice values");
+        assert(task::FairPolicy::weight(task::NICE_MIN) > task::FairPolicy::weight(0));
+        assert(task::FairPolicy::weight(0) == task::FairPolicy::NICE_0_WEIGHT);
+        assert(task::FairPolicy::weight(task::NICE_MAX) < task::FairPolicy::weight(0));
+        // Drive the policy with a queue of its own, so only its accounting decides who runs. The threads are never
+        //  started.
+        task::FairPolicy &fair = task::fair_policy;
+        task::RunQueue queue = {};
+        shared_ptr<task::Thread> a = make_shared<task::Thread>(task::kernel_process, (addr_logical_t)&_pinned_worker);
+        shared_ptr<task::Thread> b = make_shared<task::Thread>(task::kernel_process, (addr_logical_t)&_pinned_worker);
+        b->set_nice(5);
+        fair.attach(queue, *a);
+        fair.enqueue(queue, a, task::ENQUEUE_WOKEN);
+        fair.attach(queue, *b);
+        fair.enqueue(queue, b, task::ENQUEUE_WOKEN);
+        uint64_t a_time = 0;
+        uint64_t b_time = 0;
+        for(uint32_t i = 0; i < 1000; i ++) {
+            shared_ptr<task::Thread> t = fair.pick(queue, 0);
+            assert(t);
+            queue.running = true;
+            queue.running_vruntime = t->vruntime;
+            uint64_t ns = fair.slice(queue, *t);
+            fair.charge(queue, *t, ns);
+            (t == a ? a_time : b_time) += ns;
+            queue.running = false;
+            fair.enqueue(queue, move(t), task::ENQUEUE_PREEMPTED);
+        }
+        // The weights are 1024 and 335, and both threads should have been charged about the same vruntime
+        assert(a_time > b_time * 2 && a_time < b_time * 4);
+        int64_t gap = a->vruntime - b->vruntime;
+        assert(gap < (int64_t)task::FairPolicy::LATENCY && gap > -(int64_t)task::FairPolicy::LATENCY);
+        queue.threads.clear();
+
+        task::set_policy(policy);
+    }
+};
+
+test::AddTestCase<PolicyTest> policyTest;
 }
@@ -0,0 +1,323 @@
+#include <stdint.h>
+
+#include "task/timer.hpp"
+#include "main/clock.hpp"
+#include "main/cpu.hpp"
+#include "main/asm_utils.hpp"
+#include "int/lapic.hpp"
+#include "structures/spinlock.hpp"
+#include "test/test.hpp"
+
+namespace timer {
+    const uint64_t _NONE = ~0ull;
+    const uint32_t _NO_CPU = ~0u;
+
+    // Returns how many slots after `start` the first set bit of `bits` is, treating it as a ring, or LEVEL_SIZE if none
+    static uint32_t _first_from(uint64_t bits, uint32_t start) {
+        if(start) {
+            bits = (bits >> start) | (bits << (LEVEL_SIZE - start));
+        }
+
+        if((uint32_t)bits) {
+            return __builtin_ctz((uint32_t)bits);
+        }else if(bits >> 32) {
+            return 32 + __builtin_ctz((uint32_t)(bits >> 32));
+        }
+        return LEVEL_SIZE;
+    }
+
+    // Everything but the lapic event is protected by the lock
+    struct _wheel_t {
+        spinlock::Spinlock lock;
+        uint64_t base; // The next jiffy to be processed
+        Timer *slots[LEVELS][LEVEL_SIZE];
+        uint64_t occupied[LEVELS]; // Which slots have timers in them
+        Timer *volatile running; // The timer whose callback is currently being run
+        lapic::timer_event_t event; // Set for the next jiffy that needs processing
+        uint64_t event_jiffy;
+        stats_t stats;
+
+        void insert(Timer &timer) {
+            uint32_t level = 0;
+
+            if(timer.expires < base) {
+                timer.expires = base;
+            }
+
+            while(((timer.expires >> (level * LEVEL_BITS)) - (base >> (level * LEVEL_BITS))) >= LEVEL_SIZE) {
+                level ++;
+                if(level == LEVELS) {
+                    // Too far in the future, put it in the last slot of the top level
+                    level = LEVELS - 1;
+                    timer.expires = ((base >> (level * LEVEL_BITS)) + LEVEL_SIZE - 1) << (level * LEVEL_BITS);
+                    break;
+                }
+            }
+
+            uint32_t slot = (timer.expires >> (level * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+            timer.level = level;
+            timer.slot = slot;
+            timer.next = slots[level][slot];
+            if(timer.next) {
+                timer.next->pprev = &timer.next;
+            }
+            timer.pprev = &slots[level][slot];
+            slots[level][slot] = &timer;
+            occupied[level] |= 1ull << slot;
+        }
+
+        void unlink(Timer &timer) {
+            *timer.pprev = timer.next;
+            if(timer.next) {
+                timer.next->pprev = timer.pprev;
+            }
+            if(!slots[timer.level][timer.slot]) {
+                occupied[timer.level] &= ~(1ull << timer.slot);
+            }
+            timer.pprev = nullptr;
+            timer.next = nullptr;
+        }
+
+        // Moves the timers in the slot of the given level that starts at `base` to lower levels
+        void cascade(uint32_t level) {
+            uint32_t slot = (base >> (level * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+            Timer *timer = slots[level][slot];
+
+            slots[level][slot] = nullptr;
+            occupied[level] &= ~(1ull << slot);
+            while(timer) {
+                Timer *next = timer->next;
+                insert(*timer);
+                stats.cascaded ++;
+                timer = next;
+            }
+        }
+
+        // The first jiffy at which a slot with timers in it needs to be processed
+        uint64_t next_jiffy() {
+            uint64_t best = _NONE;
+
+            for(uint32_t level = 0; level < LEVELS; level ++) {
+                if(!occupied[level]) {
+                    continue;
+                }
+
+                uint32_t shift = level * LEVEL_BITS;
+                uint64_t unit = base >> shift;
+                uint64_t jiffy;
+                if(level == 0) {
+                    jiffy = base + _first_from(occupied[0], unit & (LEVEL_SIZE - 1));
+                }else{
+                    // Slots before the current one have been cascaded already. The current one has only been cascaded
+                    //  if base is past its start; expire can leave base exactly on the start of a slot without
+                    //  processing it.
+                    uint64_t first = (base & ((1ull << shift) - 1)) ? unit + 1 : unit;
+                    jiffy = (first + _first_from(occupied[level], first & (LEVEL_SIZE - 1))) << shift;
+                }
+
+                if(jiffy < best) {
+                    best = jiffy;
+                }
+            }
+
+            return best;
+        }
+
+        // Sets the lapic timer for the next jiffy that needs processing, must be called on the wheel's own CPU
+        void arm() {
+            uint64_t jiffy = next_jiffy();
+
+            if(jiffy == event_jiffy && (event.pending || jiffy == _NONE)) {
+                return;
+            }
+
+            lapic::cancel_timer(event);
+            event_jiffy = jiffy;
+            if(jiffy == _NONE) {
+                return;
+            }
+
+            uint64_t now = clock::now_ns();
+            uint64_t target = jiffy << JIFFY_SHIFT;
+            lapic::add_timer(event, read_tsc() + (target > now ? clock::ns_to_tsc(target - now) : 0));
+        }
+
+        // Runs every timer that has expired, called from the lapic timer interrupt
+        static void expire(void *data) {
+            _wheel_t &wheel = *(_wheel_t *)data;
+            uint64_t now = clock::now_ns() >> JIFFY_SHIFT;
+
+            wheel.lock.lock();
+            while(wheel.base <= now) {
+                uint64_t next = wheel.next_jiffy();
+                if(next > now) {
+                    wheel.base = now + 1;
+                    break;
+                }
+                wheel.base = next;
+
+                for(uint32_t level = LEVELS - 1; level > 0; level --) {
+                    if(!(wheel.base & ((1ull << (level * LEVEL_BITS)) - 1))) {
+                        wheel.cascade(level);
+                    }
+                }
+
+                Timer *timer;
+                while((timer = wheel.slots[0][wheel.base & (LEVEL_SIZE - 1)])) {
+                    wheel.unlink(*timer);
+                    wheel.running = timer;
+                    wheel.stats.expired ++;
+
+                    // The callback may add or cancel timers on this wheel
+                    wheel.lock.unlock();
+                    timer->callback(timer->data);
+                    wheel.lock.lock();
+                    wheel.running = nullptr;
+                }
+
+                wheel.base ++;
+            }
+
+            wheel.event_jiffy = _NONE;
+            wheel.arm();
+            wheel.lock.unlock();
+        }
+    };
+
+    static _wheel_t _wheels[MAX_CORES];
+
+    void add(Timer &timer, uint64_t deadline) {
+        cancel(timer);
+
+        uint32_t eflags = push_cli();
+        uint32_t id = cpu::id();
+        _wheel_t &wheel = _wheels[id];
+
+        wheel.lock.lock();
+        if(!wheel.event.callback) {
+            // First use of this wheel
+            wheel.base = clock::now_ns() >> JIFFY_SHIFT;
+            wheel.event.callback = &_wheel_t::expire;
+            wheel.event.data = &wheel;
+            wheel.event_jiffy = _NONE;
+        }
+
+        timer.expires = (deadline + (1 << JIFFY_SHIFT) - 1) >> JIFFY_SHIFT;
+        timer.cpu = id;
+        wheel.insert(timer);
+        wheel.stats.added ++;
+        wheel.arm();
+        wheel.lock.unlock();
+        pop_flags(eflags);
+    }
+
+    bool cancel(Timer &timer) {
+        bool was_pending = false;
+
+        uint32_t eflags = push_cli();
+        while(true) {
+            uint32_t id = timer.cpu;
+            _wheel_t &wheel = _wheels[id];
+
+            wheel.lock.lock();
+            if(timer.cpu != id) {
+                // Moved to another wheel while we were waiting for the lock
+                wheel.lock.unlock();
+                continue;
+            }
+
+            if(timer.pending()) {
+                wheel.unlink(timer);
+                wheel.stats.cancelled ++;
+                was_pending = true;
+            }
+
+            // If the callback is running, wait for it to finish; the lock isn't held while it runs
+            bool running = wheel.running == &timer && id != cpu::id();
+            wheel.lock.unlock();
+
+            if(!running) {
+                break;
+            }
+            while(wheel.running == &timer) {
+                asm volatile ("pause");
+            }
+            break;
+        }
+        pop_flags(eflags);
+
+        return was_pending;
+    }
+
+    stats_t stats() {
+        stats_t total = {0, 0, 0, 0};
+
+        uint32_t eflags = push_cli();
+        for(uint32_t i = 0; i < MAX_CORES; i ++) {
+            _wheel_t &wheel = _wheels[i];
+
+            wheel.lock.lock();
+            total.added += wheel.stats.added;
+            total.cancelled += wheel.stats.cancelled;
+            total.expired += wheel.stats.expired;
+            total.cascaded += wheel.stats.cascaded;
+            wheel.lock.unlock();
+        }
+        pop_flags(eflags);
+
+        return total;
+    }
+}
+
+namespace _tests {
+static volatile uint32_t fired[8];
+
+static void _timer_test_callback(void *data) {
+    __sync_fetch_and_add(&fired[(uint32_t)data], 1);
+}
+
+class TimerTest : public test::TestCase {
+public:
+    TimerTest() : test::TestCase("Timer Wheel Test") {};
+
+    static const uint64_t MS = 1000000;
+
+    void run_test() override {
+        timer::Timer timers[4];
+        for(uint32_t i = 0; i < 4; i ++) {
+            fired[i] = 0;
+            timers[i].callback = &_timer_test_callback;
+            timers[i].data = (void *)i;
+        }
+
+        test("Timers expire in order");
+        uint64_t start = clock::now_ns();
+        timer::add(timers[0], start + 5 * MS);
+        timer::add(timers[1], start + 150 * MS); // In the second level
+        timer::add(timers[2], start + 20 * MS);
+        assert(timers[0].pending() && timers[1].pending() && timers[2].pending());
+        while(!fired[2]) task::task_yield();
+        assert(fired[0] == 1);
+        assert(fired[1] == 0);
+        assert(clock::now_ns() >= start + 20 * MS);
+        while(!fired[1]) task::task_yield();
+        assert(clock::now_ns() >= start + 150 * MS);
+        assert(!timers[1].pending());
+
+        test("Cancelling timers");
+        timer::add(timers[3], clock::now_ns() + 10 * MS);
+        assert(timer::cancel(timers[3]));
+        assert(!timer::cancel(timers[3]));
+        start = clock::now_ns();
+        while(clock::now_ns() < start + 30 * MS) task::task_yield();
+        assert(fired[3] == 0);
+
+        test("Timers in the past fire straight away");
+        timer::add(timers[3], 0);
+        while(!fired[3]) task::task_yield();
+        assert(fired[3] == 1);
+    }
+};
+
+test::AddTestCase<TimerTest> timerTest;
+}
@@ -0,0 +1,61 @@
+#include <stdarg.h>
+
+#include "test/bench.hpp"
+#include "structures/list.hpp"
+#include "main/printk.hpp"
+#include "main/asm_utils.hpp"
+#include "hw/pit.hpp"
+#include "main/clock.hpp"
+
+namespace test {
+    list<Benchmark *> benchmarks;
+
+    void run_benchmarks() {
+        for(Benchmark *b : benchmarks) {
+            b->do_benchmark();
+        }
+    }
+
+    void Benchmark::do_benchmark() {
+        printk("BENCH: %s\n", name.to_string());
+        run_benchmark();
+    }
+
+    void Benchmark::start(const char *name) {
+        current_measurement = name;
+
+        // Wait for the start of a PIT tick, so the wall time is as accurate as possible
+        uint32_t ticks = pit::time;
+        while(pit::time == ticks) {}
+
+        start_ticks = pit::time;
+        start_ns = clock::now_ns();
+        start_cycles = read_tsc();
+    }
+
+    bool Benchmark::running(uint32_t ticks) {
+        return pit::time - start_ticks < ticks;
+    }
+
+    uint64_t Benchmark::stop(uint64_t ops) {
+        uint64_t cycles = read_tsc() - start_cycles;
+        uint64_t ns = clock::now_ns() - start_ns;
+        uint64_t per_sec = 0;
+        uint64_t per_op = 0;
+
+        if(ns) per_sec = ops * clock::NS_PER_SEC / ns;
+        if(ops) per_op = cycles / ops;
+
+        printk("> %s: %llu ops/sec, %llu cycles/op\n", current_measurement, per_sec, per_op);
+
+        return cycles;
+    }
+
+    void Benchmark::report(const char *fmt, ...) {
+        va_list va;
+        va_start(va, fmt);
+        printk("> ");
+        vprintk(fmt, va);
+        va_end(va);
+    }
+}
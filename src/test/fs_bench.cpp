@@ -0,0 +1,79 @@
+#include <stdint.h>
+
+#include "fs/filesystem.hpp"
+#include "mem/kmem.hpp"
+#include "structures/utf8.hpp"
+#include "test/bench.hpp"
+
+namespace _benchmarks {
+using namespace filesystem;
+
+class PathBenchmark : public test::Benchmark {
+public:
+    PathBenchmark() : test::Benchmark("Path Lookup") {};
+
+    static const uint32_t DIRS = 64;
+
+    // A single directory, which contains itself under lots of names
+    class BenchFilesystem : public Filesystem {
+    public:
+        shared_ptr<Inode> root;
+
+        BenchFilesystem() : Filesystem(shared_ptr<Storage>()) {
+            root = make_shared<Inode>(*this, 1, InodeType::DIRECTORY, 0);
+            root->children.push_back({1, Utf8(".")});
+            root->children.push_back({1, Utf8("..")});
+            for(uint32_t i = 0; i < DIRS; i ++) {
+                root->children.push_back({1, Utf8("dir%d").format(i)});
+            }
+            root->children.push_back({1, Utf8("a_directory_with_a_long_name")});
+        }
+
+        Failable<shared_ptr<Inode>> read_inode(uint64_t inode_no) override {
+            if(inode_no == 1) {
+                return Failable<shared_ptr<Inode>>(EOK, root);
+            }else{
+                return Failable<shared_ptr<Inode>>(ENOENT);
+            }
+        }
+
+        Failable<shared_ptr<Inode>> root_inode() override {
+            return read_inode(1);
+        }
+    };
+
+    void measure(const char *name, shared_ptr<FilePathEntry> &base, const Utf8 &path) {
+        uint64_t ops = 0;
+        uint64_t allocations = kmem::allocations();
+        FilePathEntry err_loc;
+
+        start(name);
+        while(running()) {
+            shared_ptr<FilePathEntry> entry = parse_path(path, base);
+            if(entry->populate(err_loc)) {
+                panic("Path lookup benchmark failed to find %s", path.to_string());
+            }
+            ops ++;
+        }
+        stop(ops);
+
+        uint64_t hundredths = ops ? (kmem::allocations() - allocations) * 100 / ops : 0;
+        report("%llu.%02llu allocations per lookup\n", hundredths / 100, hundredths % 100);
+    }
+
+    void run_benchmark() override {
+        BenchFilesystem *fs = new BenchFilesystem();
+        shared_ptr<FilePathEntry> root = make_shared<FilePathEntry>(Utf8(""), nullptr, fs->root);
+
+        measure("Short names", root, Utf8("dir3/dir17/dir40/dir63"));
+        measure("Long names", root,
+            Utf8("a_directory_with_a_long_name/a_directory_with_a_long_name/a_directory_with_a_long_name"));
+        measure("Dots", root, Utf8("./dir63/../dir63/."));
+
+        root = nullptr;
+        delete fs;
+    }
+};
+
+test::AddBenchmark<PathBenchmark> pathBenchmark;
+}
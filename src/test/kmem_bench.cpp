@@ -0,0 +1,164 @@
+#include <stdint.h>
+
+#include "mem/kmem.hpp"
+#include "test/bench.hpp"
+#include "task/task.hpp"
+#include "hw/acpi.hpp"
+
+namespace _benchmarks {
+class KmemBenchmark : public test::Benchmark {
+public:
+    KmemBenchmark() : test::Benchmark("Kernel Memory Allocation") {};
+
+    static const uint32_t FRAGMENTS = 512;
+    static const uint32_t BATCH = 64;
+
+    void measure(const char *name, size_t size, uint8_t flags) {
+        void *ptrs[BATCH];
+        uint64_t ops = 0;
+
+        start(name);
+        while(running()) {
+            for(uint32_t i = 0; i < BATCH; i ++) {
+                ptrs[i] = kmem::kmalloc(size, flags);
+            }
+            for(uint32_t i = 0; i < BATCH; i ++) {
+                kmem::kfree(ptrs[i]);
+            }
+            ops += BATCH;
+        }
+        stop(ops);
+    }
+
+    void run_benchmark() override {
+        // Threads only have a single page of stack, so this can't go there
+        void **fragments = new void*[FRAGMENTS * 2];
+
+        measure("16 byte kmalloc/kfree, free list", 16, kmem::KMALLOC_NOSLAB);
+        measure("16 byte kmalloc/kfree, slab", 16, 0);
+        measure("256 byte kmalloc/kfree, free list", 256, kmem::KMALLOC_NOSLAB);
+        measure("256 byte kmalloc/kfree, slab", 256, 0);
+
+        // Fragment the free list, so it looks more like a heap that has been running for a while
+        for(uint32_t i = 0; i < FRAGMENTS * 2; i ++) {
+            fragments[i] = kmem::kmalloc(32, kmem::KMALLOC_NOSLAB);
+        }
+        for(uint32_t i = 0; i < FRAGMENTS * 2; i += 2) {
+            kmem::kfree(fragments[i]);
+        }
+
+        measure("64 byte kmalloc/kfree, fragmented free list", 64, kmem::KMALLOC_NOSLAB);
+        measure("64 byte kmalloc/kfree, slab", 64, 0);
+        measure("1024 byte kmalloc/kfree, fragmented free list", 1024, kmem::KMALLOC_NOSLAB);
+        measure("1024 byte kmalloc/kfree, slab", 1024, 0);
+
+        for(uint32_t i = 1; i < FRAGMENTS * 2; i += 2) {
+            kmem::kfree(fragments[i]);
+        }
+        delete[] fragments;
+    }
+};
+
+test::AddBenchmark<KmemBenchmark> kmemBenchmark;
+
+
+class KmemStressBenchmark : public test::Benchmark {
+public:
+    KmemStressBenchmark() : test::Benchmark("Kernel Memory Allocation Scaling") {};
+
+    static const uint32_t BATCH = 16;
+
+    static volatile bool go;
+    static volatile bool halt;
+    static volatile uint32_t started;
+    static volatile uint32_t finished;
+    static volatile uint64_t ops[MAX_CORES];
+    static volatile uint32_t corrupted;
+
+    // Each worker repeatedly allocates a batch of objects of mixed sizes, tags them, checks the tags and frees them
+    static void worker() {
+        uint8_t *ptrs[BATCH];
+        uint8_t tag = __sync_fetch_and_add(&started, 1) + 1;
+        uint64_t done = 0;
+        uint32_t bad = 0;
+
+        while(!go) {
+            task::task_yield();
+        }
+
+        while(!halt) {
+            for(uint32_t i = 0; i < BATCH; i ++) {
+                size_t size = 16 << (i % 6);
+                ptrs[i] = (uint8_t *)kmem::kmalloc(size, 0);
+                ptrs[i][0] = tag;
+                ptrs[i][size - 1] = tag;
+            }
+            for(uint32_t i = 0; i < BATCH; i ++) {
+                size_t size = 16 << (i % 6);
+                if(ptrs[i][0] != tag || ptrs[i][size - 1] != tag) bad ++;
+                kmem::kfree(ptrs[i]);
+            }
+            done += BATCH;
+        }
+
+        ops[tag - 1] = done;
+        __sync_fetch_and_add(&corrupted, bad);
+        __sync_fetch_and_add(&finished, 1);
+    }
+
+    uint64_t measure(uint32_t threads) {
+        uint64_t total = 0;
+
+        go = false;
+        halt = false;
+        started = 0;
+        finished = 0;
+        corrupted = 0;
+
+        for(uint32_t i = 0; i < threads; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&worker);
+        }
+        while(started < threads) {
+            task::task_yield();
+        }
+
+        start("Parallel kmalloc/kfree");
+        go = true;
+        while(running()) {
+            task::task_yield();
+        }
+        halt = true;
+        while(finished < threads) {
+            task::task_yield();
+        }
+        for(uint32_t i = 0; i < threads; i ++) {
+            total += ops[i];
+        }
+        stop(total);
+
+        return total;
+    }
+
+    void run_benchmark() override {
+        uint32_t cores = acpi::proc_count ? acpi::proc_count : 1;
+        uint64_t single = 0;
+
+        for(uint32_t threads = 1; threads <= cores && threads <= MAX_CORES; threads ++) {
+            uint64_t total = measure(threads);
+            if(threads == 1) single = total;
+
+            report("%d thread(s): %llu%% of single thread throughput, %d corrupted objects\n",
+                threads, single ? total * 100 / single : 0, corrupted);
+        }
+    }
+};
+
+volatile bool KmemStressBenchmark::go;
+volatile bool KmemStressBenchmark::halt;
+volatile uint32_t KmemStressBenchmark::started;
+volatile uint32_t KmemStressBenchmark::finished;
+volatile uint64_t KmemStressBenchmark::ops[MAX_CORES];
+volatile uint32_t KmemStressBenchmark::corrupted;
+
+test::AddBenchmark<KmemStressBenchmark> kmemStressBenchmark;
+}
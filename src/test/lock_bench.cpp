@@ -0,0 +1,134 @@
+#include <stdint.h>
+
+#include "structures/mutex.hpp"
+#include "structures/spinlock.hpp"
+#include "test/bench.hpp"
+#include "task/task.hpp"
+#include "hw/acpi.hpp"
+#include "main/asm_utils.hpp"
+
+namespace _benchmarks {
+class LockBenchmark : public test::Benchmark {
+public:
+    LockBenchmark() : test::Benchmark("Lock Scaling") {};
+
+    enum kind_t {
+        MUTEX,
+        TICKET,
+        MCS
+    };
+
+    static volatile kind_t kind;
+    static volatile bool go;
+    static volatile bool halt;
+    static volatile uint32_t started;
+    static volatile uint32_t finished;
+    static volatile uint64_t ops[MAX_CORES];
+    static volatile uint32_t shared;
+
+    static mutex::Mutex mutex;
+    static spinlock::Spinlock ticket;
+    static spinlock::McsLock mcs;
+
+    // Each worker repeatedly takes the lock with interrupts disabled (as the kernel's internal locks are) and updates a
+    //  shared counter
+    static void worker() {
+        uint32_t id = __sync_fetch_and_add(&started, 1);
+        spinlock::McsLock::Node node;
+        uint64_t done = 0;
+
+        while(!go) {
+            task::task_yield();
+        }
+
+        while(!halt) {
+            uint32_t eflags = push_cli();
+            switch(kind) {
+                case MUTEX:
+                    mutex.lock();
+                    shared ++;
+                    mutex.unlock();
+                    break;
+
+                case TICKET:
+                    ticket.lock();
+                    shared ++;
+                    ticket.unlock();
+                    break;
+
+                case MCS:
+                    mcs.lock(node);
+                    shared ++;
+                    mcs.unlock(node);
+                    break;
+            }
+            pop_flags(eflags);
+            done ++;
+        }
+
+        ops[id] = done;
+        __sync_fetch_and_add(&finished, 1);
+    }
+
+    void measure(const char *name, kind_t k, uint32_t threads) {
+        uint64_t total = 0;
+        uint64_t least = ~0ull;
+        uint64_t most = 0;
+
+        kind = k;
+        go = false;
+        halt = false;
+        started = 0;
+        finished = 0;
+
+        for(uint32_t i = 0; i < threads; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&worker);
+        }
+        while(started < threads) {
+            task::task_yield();
+        }
+
+        start(name);
+        go = true;
+        while(running()) {
+            task::task_yield();
+        }
+        halt = true;
+        while(finished < threads) {
+            task::task_yield();
+        }
+        for(uint32_t i = 0; i < threads; i ++) {
+            total += ops[i];
+            if(ops[i] < least) least = ops[i];
+            if(ops[i] > most) most = ops[i];
+        }
+        stop(total);
+
+        report("%d thread(s): slowest thread got %llu%% of the fastest thread's acquisitions\n", threads,
+            most ? least * 100 / most : 0);
+    }
+
+    void run_benchmark() override {
+        uint32_t cores = acpi::proc_count ? acpi::proc_count : 1;
+
+        for(uint32_t threads = 1; threads <= cores && threads <= MAX_CORES; threads ++) {
+            measure("mutex::Mutex with interrupts disabled", MUTEX, threads);
+            measure("spinlock::Spinlock", TICKET, threads);
+            measure("spinlock::McsLock", MCS, threads);
+        }
+    }
+};
+
+volatile LockBenchmark::kind_t LockBenchmark::kind;
+volatile bool LockBenchmark::go;
+volatile bool LockBenchmark::halt;
+volatile uint32_t LockBenchmark::started;
+volatile uint32_t LockBenchmark::finished;
+volatile uint64_t LockBenchmark::ops[MAX_CORES];
+volatile uint32_t LockBenchmark::shared;
+mutex::Mutex LockBenchmark::mutex;
+spinlock::Spinlock LockBenchmark::ticket;
+spinlock::McsLock LockBenchmark::mcs;
+
+test::AddBenchmark<LockBenchmark> lockBenchmark;
+}
@@ -0,0 +1,42 @@
+#include <stdint.h>
+
+#include "mem/page.hpp"
+#include "int/lapic.hpp"
+#include "test/bench.hpp"
+
+namespace _benchmarks {
+class PageBenchmark : public test::Benchmark {
+public:
+    PageBenchmark() : test::Benchmark("Kernel Page Mapping") {};
+
+    void measure(const char *name, uint32_t count) {
+        page::Page *page = page::alloc(0, count);
+        uint64_t ops = 0;
+        uint64_t ipis = lapic::command_stats.ipis;
+        uint64_t wait_cycles = lapic::command_stats.wait_cycles;
+
+        start(name);
+        while(running()) {
+            void *installed = page::kinstall(page, page::PAGE_TABLE_RW);
+            page::kuninstall(installed, page);
+            ops ++;
+        }
+        stop(ops);
+
+        ipis = lapic::command_stats.ipis - ipis;
+        wait_cycles = lapic::command_stats.wait_cycles - wait_cycles;
+        report("%llu IPIs, %llu cycles waiting for other CPUs per op\n",
+            ops ? ipis / ops : 0, ops ? wait_cycles / ops : 0);
+
+        page::free(page);
+    }
+
+    void run_benchmark() override {
+        measure("kinstall/kuninstall 1 page", 1);
+        measure("kinstall/kuninstall 16 pages", 16);
+        measure("kinstall/kuninstall 256 pages", 256);
+    }
+};
+
+test::AddBenchmark<PageBenchmark> pageBenchmark;
+}
@@ -0,0 +1,126 @@
+#include <stdint.h>
+
+#include "structures/shared_ptr.hpp"
+#include "task/task.hpp"
+#include "test/bench.hpp"
+#include "hw/acpi.hpp"
+
+namespace _benchmarks {
+class SharedPtrBenchmark : public test::Benchmark {
+public:
+    SharedPtrBenchmark() : test::Benchmark("shared_ptr") {};
+
+    class Counted : public shared_ptr_ns::RefCounted {
+    public:
+        uint32_t val;
+
+        Counted(uint32_t val) : val(val) {};
+    };
+
+    static shared_ptr<uint32_t> *shared;
+    static volatile bool go;
+    static volatile bool halt;
+    static volatile uint32_t started;
+    static volatile uint32_t finished;
+    static volatile uint64_t ops[MAX_CORES];
+
+    // Copies and destroys the same pointer as every other worker
+    static void worker() {
+        uint32_t id = __sync_fetch_and_add(&started, 1);
+        uint64_t done = 0;
+
+        while(!go) {
+            task::task_yield();
+        }
+
+        while(!halt) {
+            shared_ptr<uint32_t> copy = *shared;
+            done ++;
+        }
+
+        ops[id] = done;
+        __sync_fetch_and_add(&finished, 1);
+    }
+
+    void measure_contended(uint32_t threads) {
+        shared = new shared_ptr<uint32_t>(make_shared<uint32_t>(1));
+        go = false;
+        halt = false;
+        started = 0;
+        finished = 0;
+
+        for(uint32_t i = 0; i < threads; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&worker);
+        }
+
+        start("Copy and destroy, shared by every thread");
+        go = true;
+        while(running()) {
+            task::task_yield();
+        }
+        halt = true;
+        while(finished < threads) {
+            task::task_yield();
+        }
+
+        uint64_t total = 0;
+        for(uint32_t i = 0; i < threads; i ++) {
+            total += ops[i];
+        }
+        stop(total);
+        report("%d thread(s)\n", threads);
+
+        delete shared;
+    }
+
+    void run_benchmark() override {
+        uint32_t cores = acpi::proc_count ? acpi::proc_count : 1;
+        uint64_t count = 0;
+
+        start("make_shared and destroy");
+        while(running()) {
+            shared_ptr<uint32_t> p = make_shared<uint32_t>(count);
+            count ++;
+        }
+        stop(count);
+
+        count = 0;
+        start("Construct from a pointer and destroy");
+        while(running()) {
+            shared_ptr<uint32_t> p = shared_ptr<uint32_t>(new uint32_t(count));
+            count ++;
+        }
+        stop(count);
+
+        count = 0;
+        start("make_shared and destroy, intrusive count");
+        while(running()) {
+            shared_ptr<Counted> p = make_shared<Counted>(count);
+            count ++;
+        }
+        stop(count);
+
+        count = 0;
+        shared_ptr<uint32_t> original = make_shared<uint32_t>(1);
+        start("Copy and destroy");
+        while(running()) {
+            shared_ptr<uint32_t> copy = original;
+            count ++;
+        }
+        stop(count);
+
+        for(uint32_t threads = 1; threads <= cores && threads <= MAX_CORES; threads *= 2) {
+            measure_contended(threads);
+        }
+    }
+};
+
+shared_ptr<uint32_t> *SharedPtrBenchmark::shared;
+volatile bool SharedPtrBenchmark::go;
+volatile bool SharedPtrBenchmark::halt;
+volatile uint32_t SharedPtrBenchmark::started;
+volatile uint32_t SharedPtrBenchmark::finished;
+volatile uint64_t SharedPtrBenchmark::ops[MAX_CORES];
+
+test::AddBenchmark<SharedPtrBenchmark> sharedPtrBenchmark;
+}
@@ -0,0 +1,339 @@
+#include <stdint.h>
+
+#include "mem/vm.hpp"
+#include "main/clock.hpp"
+#include "main/cpu.hpp"
+#include "task/task.hpp"
+#include "task/policy.hpp"
+#include "task/timer.hpp"
+#include "test/bench.hpp"
+#include "hw/acpi.hpp"
+
+namespace _benchmarks {
+static volatile uint32_t turn;
+static volatile bool partner_stop;
+static volatile bool partner_done;
+
+// Passes the turn back to the benchmark thread whenever it gets it
+static void _partner() {
+    while(!partner_stop) {
+        if(turn == 1) turn = 0;
+        task::task_yield();
+    }
+    partner_done = true;
+}
+
+class TaskBenchmark : public test::Benchmark {
+public:
+    TaskBenchmark() : test::Benchmark("Context Switching") {};
+
+    void report_loads(uint64_t ops, uint32_t loads) {
+        report("%llu.%02llu CR3 loads per op\n", ops ? loads / ops : 0, ops ? (loads * 100 / ops) % 100 : 0);
+    }
+
+    void measure_yield(const char *name) {
+        uint64_t ops = 0;
+        uint32_t loads = vm::cr3_loads;
+
+        start(name);
+        while(running()) {
+            task::task_yield();
+            ops ++;
+        }
+        stop(ops);
+        report_loads(ops, vm::cr3_loads - loads);
+    }
+
+    void measure_ping_pong(const char *name) {
+        uint64_t ops = 0;
+        uint32_t loads;
+
+        turn = 0;
+        partner_stop = false;
+        partner_done = false;
+        task::kernel_process->new_thread((addr_logical_t)&_partner);
+
+        loads = vm::cr3_loads;
+        start(name);
+        while(running()) {
+            turn = 1;
+            while(turn == 1) task::task_yield();
+            ops ++;
+        }
+        stop(ops);
+        report_loads(ops, vm::cr3_loads - loads);
+
+        partner_stop = true;
+        while(!partner_done) task::task_yield();
+    }
+
+    // Both threads are kept on this CPU, so every yield switches between them
+    void measure_switches(const char *name) {
+        uint64_t ops = 0;
+        uint64_t start_ns;
+        uint64_t elapsed;
+        uint64_t switches;
+        task::scheduler_stats_t before;
+        task::scheduler_stats_t after;
+        shared_ptr<task::Thread> me = task::get_thread();
+
+        uint32_t eflags = push_cli();
+        cpu_mask_t here = CPU_MASK(cpu::id());
+        pop_flags(eflags);
+        me->set_affinity(here);
+
+        turn = 0;
+        partner_stop = false;
+        partner_done = false;
+        task::kernel_process->new_thread((addr_logical_t)&_partner)->set_affinity(here);
+
+        before = task::scheduler_stats();
+        start(name);
+        start_ns = clock::now_ns();
+        while(running()) {
+            turn = 1;
+            while(turn == 1) task::task_yield();
+            ops ++;
+        }
+        elapsed = clock::now_ns() - start_ns;
+        after = task::scheduler_stats();
+        stop(ops);
+
+        switches = after.switches - before.switches;
+        report("%llu ns per switch, %llu%% of switches direct\n", switches ? elapsed / switches : 0,
+            switches ? (after.direct - before.direct) * 100 / switches : 0);
+
+        partner_stop = true;
+        while(!partner_done) task::task_yield();
+        me->set_affinity(~(cpu_mask_t)0);
+    }
+
+    void run_benchmark() override {
+        bool lazy = vm::lazy_switching;
+        bool direct = task::direct_switching;
+
+        task::direct_switching = false;
+        vm::lazy_switching = false;
+        measure_yield("Yield, reloading CR3");
+        measure_ping_pong("Ping-pong, reloading CR3");
+
+        vm::lazy_switching = true;
+        measure_yield("Yield, lazy CR3");
+        measure_ping_pong("Ping-pong, lazy CR3");
+        measure_switches("Pinned ping-pong, through the scheduler");
+
+        task::direct_switching = true;
+        measure_switches("Pinned ping-pong, direct switch");
+
+        vm::lazy_switching = lazy;
+        task::direct_switching = direct;
+    }
+};
+
+test::AddBenchmark<TaskBenchmark> taskBenchmark;
+
+
+class SchedulerBenchmark : public test::Benchmark {
+public:
+    SchedulerBenchmark() : test::Benchmark("Scheduler Scaling") {};
+
+    static volatile bool halt;
+    static volatile uint32_t finished;
+
+    static void worker() {
+        while(!halt) {
+            task::task_yield();
+        }
+        __sync_fetch_and_add(&finished, 1);
+    }
+
+    void measure(uint32_t threads) {
+        task::scheduler_stats_t before;
+        task::scheduler_stats_t after;
+        uint64_t switches;
+
+        halt = false;
+        finished = 0;
+
+        for(uint32_t i = 0; i < threads; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&worker);
+        }
+
+        before = task::scheduler_stats();
+        start("Yielding threads");
+        while(running()) {
+            task::task_yield();
+        }
+        after = task::scheduler_stats();
+        switches = after.switches - before.switches;
+        stop(switches);
+
+        halt = true;
+        while(finished < threads) {
+            task::task_yield();
+        }
+
+        report("%d thread(s): %llu steals, %llu wakeups, %llu contended locks per 1000 switches\n", threads,
+            switches ? (after.steals - before.steals) * 1000 / switches : 0,
+            switches ? (after.wakeups - before.wakeups) * 1000 / switches : 0,
+            switches ? (after.contended - before.contended) * 1000 / switches : 0);
+    }
+
+    void run_benchmark() override {
+        uint32_t cores = acpi::proc_count ? acpi::proc_count : 1;
+
+        for(uint32_t threads = 1; threads <= cores * 2 && threads <= MAX_CORES * 2; threads ++) {
+            measure(threads);
+        }
+    }
+};
+
+volatile bool SchedulerBenchmark::halt;
+volatile uint32_t SchedulerBenchmark::finished;
+
+test::AddBenchmark<SchedulerBenchmark> schedulerBenchmark;
+
+
+class LatencyBenchmark : public test::Benchmark {
+public:
+    LatencyBenchmark() : test::Benchmark("Wakeup Latency") {};
+
+    static const uint32_t MAX_SAMPLES = 4096;
+    static const uint64_t US = 1000;
+
+    // A latency sensitive thread, which sleeps until its timer posts an event
+    struct Sleeper {
+        timer::Timer timer;
+        task::WaitQueue queue;
+        volatile uint64_t posted_at;
+        volatile bool posted;
+
+        Sleeper() : timer(&post, this), queue(Utf8("latency")), posted_at(0), posted(false) {};
+
+        static void post(void *data) {
+            Sleeper &sleeper = *(Sleeper *)data;
+
+            sleeper.posted_at = clock::now_ns();
+            sleeper.posted = true;
+            sleeper.queue.wake_one();
+        }
+    };
+
+    static Sleeper *sleepers;
+    static volatile uint32_t claimed;
+    static volatile bool halt;
+    static volatile uint32_t finished;
+    static uint64_t samples[MAX_SAMPLES];
+    static volatile uint32_t sample_count;
+
+    static void spinner() {
+        while(!halt) {}
+        __sync_fetch_and_add(&finished, 1);
+    }
+
+    static void sleeper() {
+        uint32_t id = __sync_fetch_and_add(&claimed, 1);
+        Sleeper &me = sleepers[id];
+
+        while(!halt) {
+            me.posted = false;
+            // Spread the wakeups out, so they don't all happen at once
+            timer::add(me.timer, clock::now_ns() + 2000 * US + (id * 337 * US) % (1000 * US));
+            me.queue.wait_until([&me]() { return me.posted; });
+
+            uint64_t latency = clock::now_ns() - me.posted_at;
+            uint32_t slot = __sync_fetch_and_add(&sample_count, 1);
+            if(slot < MAX_SAMPLES) {
+                samples[slot] = latency;
+            }
+        }
+        __sync_fetch_and_add(&finished, 1);
+    }
+
+    uint64_t percentile(uint32_t count, uint32_t p) {
+        uint32_t i = count * p / 100;
+        return samples[i < count ? i : count - 1];
+    }
+
+    void measure(task::Policy &policy, uint32_t cores) {
+        uint32_t spinners = cores * 2;
+        uint32_t count;
+
+        task::set_policy(policy);
+        sleepers = new Sleeper[cores];
+        claimed = 0;
+        halt = false;
+        finished = 0;
+        sample_count = 0;
+
+        for(uint32_t i = 0; i < spinners; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&spinner);
+        }
+        for(uint32_t i = 0; i < cores; i ++) {
+            task::kernel_process->new_thread((addr_logical_t)&sleeper);
+        }
+
+        start(policy.name);
+        while(running(test::Benchmark::DEFAULT_TICKS * 4)) {
+            task::sleep_for(10000 * US);
+        }
+        count = sample_count;
+        stop(count);
+
+        halt = true;
+        while(finished < spinners + cores) {
+            task::sleep_for(1000 * US);
+        }
+        for(uint32_t i = 0; i < cores; i ++) {
+            // The last callback may still be running on another CPU
+            timer::cancel(sleepers[i].timer);
+        }
+        delete[] sleepers;
+
+        if(count > MAX_SAMPLES) {
+            count = MAX_SAMPLES;
+        }
+        if(!count) {
+            report("No wakeups measured\n");
+            return;
+        }
+
+        // Insertion sort, there aren't many samples
+        for(uint32_t i = 1; i < count; i ++) {
+            uint64_t value = samples[i];
+            uint32_t j = i;
+            for(; j > 0 && samples[j - 1] > value; j --) {
+                samples[j] = samples[j - 1];
+            }
+            samples[j] = value;
+        }
+
+        report("%d CPU-bound, %d latency sensitive thread(s): p50 %lluus, p90 %lluus, p99 %lluus, max %lluus\n",
+            spinners, cores, percentile(count, 50) / US, percentile(count, 90) / US, percentile(count, 99) / US,
+            samples[count - 1] / US);
+    }
+
+    void run_benchmark() override {
+        uint32_t cores = acpi::proc_count ? acpi::proc_count : 1;
+        task::Policy &policy = task::get_policy();
+
+        if(cores > MAX_CORES) {
+            cores = MAX_CORES;
+        }
+
+        measure(task::round_robin_policy, cores);
+        measure(task::fair_policy, cores);
+
+        task::set_policy(policy);
+    }
+};
+
+LatencyBenchmark::Sleeper *LatencyBenchmark::sleepers;
+volatile uint32_t LatencyBenchmark::claimed;
+volatile bool LatencyBenchmark::halt;
+volatile uint32_t LatencyBenchmark::finished;
+uint64_t LatencyBenchmark::samples[LatencyBenchmark::MAX_SAMPLES];
+volatile uint32_t LatencyBenchmark::sample_count;
+
+test::AddBenchmark<LatencyBenchmark> latencyBenchmark;
+}
@@ -0,0 +1,118 @@
+#include <stdint.h>
+
+#include "int/lapic.hpp"
+#include "main/clock.hpp"
+#include "task/timer.hpp"
+#include "task/task.hpp"
+#include "test/bench.hpp"
+#include "hw/acpi.hpp"
+
+namespace _benchmarks {
+class TimerBenchmark : public test::Benchmark {
+public:
+    TimerBenchmark() : test::Benchmark("Timer Interrupts") {};
+
+    static uint64_t interrupts(uint32_t cores) {
+        uint64_t total = 0;
+
+        for(uint32_t i = 0; i < cores; i ++) {
+            total += lapic::timer_stats(i).interrupts;
+        }
+        return total;
+    }
+
+    // Every other CPU is idle while this thread yields to itself, so this mostly counts their interrupts
+    void measure(const char *name, bool tickless, uint32_t cores) {
+        bool old = lapic::tickless;
+        uint64_t before;
+
+        lapic::set_tickless(tickless);
+
+        before = interrupts(cores);
+        start(name);
+        while(running()) {
+            task::task_yield();
+        }
+        stop(interrupts(cores) - before);
+
+        lapic::set_tickless(old);
+    }
+
+    void run_benchmark() override {
+        uint32_t cores = acpi::proc_count ? acpi::proc_count : 1;
+        if(cores > MAX_CORES) cores = MAX_CORES;
+
+        report("%d CPU(s), using %s mode\n", cores, lapic::tsc_deadline ? "TSC-deadline" : "one-shot");
+        measure("Timer interrupts with a periodic tick", false, cores);
+        measure("Timer interrupts with tickless idle", true, cores);
+    }
+};
+
+test::AddBenchmark<TimerBenchmark> timerBenchmark;
+
+
+class TimerWheelBenchmark : public test::Benchmark {
+public:
+    TimerWheelBenchmark() : test::Benchmark("Timer Wheel") {};
+
+    static const uint32_t TIMERS = 20000;
+    static const uint64_t MS = 1000000;
+
+    static volatile uint32_t fired;
+
+    static void callback(void *data) {
+        __sync_fetch_and_add(&fired, 1);
+    }
+
+    // Deadlines spread over the given range, so the timers land in every level of the wheel
+    static uint64_t deadline(uint32_t i, uint64_t base, uint64_t range) {
+        return base + (uint64_t)((i * 2654435761u) % TIMERS) * range / TIMERS;
+    }
+
+    void run_benchmark() override {
+        timer::Timer *timers = new timer::Timer[TIMERS];
+        timer::stats_t before;
+        timer::stats_t after;
+        uint64_t now;
+
+        for(uint32_t i = 0; i < TIMERS; i ++) {
+            timers[i].callback = &callback;
+        }
+
+        now = clock::now_ns();
+        start("Adding timers up to an hour away");
+        for(uint32_t i = 0; i < TIMERS; i ++) {
+            timer::add(timers[i], deadline(i, now + 1000 * MS, 3600000 * MS));
+        }
+        stop(TIMERS);
+
+        start("Cancelling timers");
+        for(uint32_t i = 0; i < TIMERS; i ++) {
+            timer::cancel(timers[i]);
+        }
+        stop(TIMERS);
+
+        // These all expire within the next 200ms, so they are expired by the timer interrupt as the benchmark waits
+        fired = 0;
+        before = timer::stats();
+        now = clock::now_ns();
+        for(uint32_t i = 0; i < TIMERS; i ++) {
+            timer::add(timers[i], deadline(i, now, 200 * MS));
+        }
+
+        start("Expiring timers over 200ms");
+        while(fired < TIMERS) {
+            task::task_yield();
+        }
+        stop(TIMERS);
+        after = timer::stats();
+        report("%llu cascades\n", after.cascaded - before.cascaded);
+
+        delete[] timers;
+    }
+};
+
+volatile uint32_t TimerWheelBenchmark::fired;
+
+test::AddBenchmark<TimerWheelBenchmark> timerWheelBenchmark;
+}
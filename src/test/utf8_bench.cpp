@@ -0,0 +1,79 @@
+#include <stdint.h>
+
+#include "mem/kmem.hpp"
+#include "structures/utf8.hpp"
+#include "test/bench.hpp"
+
+namespace _benchmarks {
+class Utf8Benchmark : public test::Benchmark {
+public:
+    Utf8Benchmark() : test::Benchmark("UTF-8") {};
+
+    static const size_t SIZE = 16 * 1024;
+
+    enum function_t { VALID, COUNT, FIND };
+
+    // Fills the buffer with a repeating sentence, `sentence` must be valid UTF-8
+    void fill(char *buffer, const char *sentence) {
+        size_t length = strlen(sentence);
+
+        for(size_t i = 0; i < SIZE; i += length) {
+            memcpy(buffer + i, sentence, SIZE - i > length ? length : SIZE - i);
+        }
+
+        // Don't leave a partial character at the end
+        buffer[utf8::valid_length(buffer, SIZE - 4)] = '\0';
+    }
+
+    void measure(const char *name, function_t function, const char *buffer, size_t size) {
+        uint64_t ops = 0;
+        uint64_t cycles;
+        uint64_t hundredths;
+        volatile size_t result;
+
+        start(name);
+        while(running(5)) {
+            switch(function) {
+                case VALID: result = utf8::valid(buffer, size); break;
+                case COUNT: result = utf8::count_chars(buffer, size); break;
+                case FIND: result = utf8::find_byte(buffer, size, '\n'); break;
+            }
+            ops ++;
+        }
+        cycles = stop(ops);
+        (void)result;
+
+        hundredths = cycles ? (ops * size * 100) / cycles : 0;
+        report("%d bytes: %llu.%02llu bytes/cycle\n", size, hundredths / 100, hundredths % 100);
+    }
+
+    void measure_corpus(const char *corpus, char *buffer) {
+        size_t length = strlen(buffer);
+
+        report("%s\n", corpus);
+        for(size_t size = 16; size <= length; size *= 4) {
+            size_t prefix = utf8::valid_length(buffer, size);
+            measure("valid", VALID, buffer, prefix);
+            measure("count_chars", COUNT, buffer, prefix);
+            measure("find_byte", FIND, buffer, prefix);
+        }
+    }
+
+    void run_benchmark() override {
+        char *buffer = (char *)kmem::kmalloc(SIZE, 0);
+
+        fill(buffer, "The quick brown fox jumps over the lazy dog. ");
+        measure_corpus("ASCII", buffer);
+
+        fill(buffer, "Le c\xc5\x93ur d\xc3\xa9\xc3\xa7u \xc3\xa0 la f\xc3\xaate du ma\xc3\xaftre. ");
+        measure_corpus("Mostly ASCII, with some two byte characters", buffer);
+
+        fill(buffer, "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe6\x96\x87\xe7\xab\xa0\xe3\x80\x82 ");
+        measure_corpus("Mostly three byte characters", buffer);
+
+        kmem::kfree(buffer);
+    }
+};
+
+test::AddBenchmark<Utf8Benchmark> utf8Benchmark;
+}
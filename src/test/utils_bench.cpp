@@ -0,0 +1,73 @@
+#include <stdint.h>
+
+#include "main/utils.hpp"
+#include "mem/kmem.hpp"
+#include "test/bench.hpp"
+
+namespace _benchmarks {
+class MemoryBenchmark : public test::Benchmark {
+public:
+    MemoryBenchmark() : test::Benchmark("Memory Functions") {};
+
+    static const size_t MAX_SIZE = 64 * 1024;
+
+    enum function_t { MEMCPY, MEMMOVE, MEMSET };
+
+    void measure(const char *name, function_t function, uint8_t *a, uint8_t *b, size_t size) {
+        uint64_t ops = 0;
+        uint64_t cycles;
+        uint64_t hundredths;
+
+        start(name);
+        while(running(5)) {
+            for(uint32_t i = 0; i < 16; i ++) {
+                switch(function) {
+                    case MEMCPY: memcpy(a, b, size); break;
+                    case MEMMOVE: memmove(a + 1, a, size); break;
+                    case MEMSET: memset(a, i, size); break;
+                }
+            }
+            ops += 16;
+        }
+        cycles = stop(ops);
+
+        hundredths = cycles ? (ops * size * 100) / cycles : 0;
+        report("%d bytes: %llu.%02llu bytes/cycle\n", size, hundredths / 100, hundredths % 100);
+    }
+
+    void run_benchmark() override {
+        // Leave room to page align the buffers, and for the overlapping memmove
+        uint8_t *a_buff = (uint8_t *)kmem::kmalloc(MAX_SIZE + PAGE_SIZE, 0);
+        uint8_t *b_buff = (uint8_t *)kmem::kmalloc(MAX_SIZE + PAGE_SIZE, 0);
+        uint8_t *a = (uint8_t *)(((addr_logical_t)a_buff + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+        uint8_t *b = (uint8_t *)(((addr_logical_t)b_buff + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+        uint64_t ops = 0;
+
+        for(size_t size = 8; size <= MAX_SIZE; size *= 2) {
+            measure("memcpy", MEMCPY, a, b, size);
+            measure("memmove (overlapping)", MEMMOVE, a, b, size);
+            measure("memset", MEMSET, a, b, size);
+        }
+
+        start("zero_page");
+        while(running(5)) {
+            zero_page(a);
+            ops ++;
+        }
+        stop(ops);
+
+        ops = 0;
+        start("copy_page");
+        while(running(5)) {
+            copy_page(a, b);
+            ops ++;
+        }
+        stop(ops);
+
+        kmem::kfree(a_buff);
+        kmem::kfree(b_buff);
+    }
+};
+
+test::AddBenchmark<MemoryBenchmark> memoryBenchmark;
+}
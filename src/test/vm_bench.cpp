@@ -0,0 +1,196 @@
+#include <stdint.h>
+
+#include "mem/vm.hpp"
+#include "mem/object.hpp"
+#include "mem/kmem.hpp"
+#include "main/cpu.hpp"
+#include "task/task.hpp"
+#include "test/bench.hpp"
+
+namespace _benchmarks {
+// Only creates page descriptors without any memory behind them, so it can have far more pages than there is RAM
+class DescriptorObject : public object::Object {
+public:
+    DescriptorObject(uint32_t max_pages) : Object(max_pages, 0, 0, 0) {};
+
+    page::Page *do_generate(addr_logical_t addr, uint32_t count) override {
+        return page::create(0, 0, count);
+    }
+};
+
+class FaultBenchmark : public test::Benchmark {
+public:
+    FaultBenchmark() : test::Benchmark("Page Faults") {};
+
+    // Well away from anything else mapped into the kernel process
+    static const addr_logical_t BASE = 0x10000000;
+
+    // Maps `objects` one page objects (with a page between each), then touches every one of them
+    void measure(uint32_t objects) {
+        vm::Map *map = cpu::current_thread()->vm.get();
+        shared_ptr<object::Object> *mapped = new shared_ptr<object::Object>[objects];
+        uint64_t faults = 0;
+
+        start("Map, fault in and unmap");
+        while(running()) {
+            for(uint32_t i = 0; i < objects; i ++) {
+                mapped[i] = make_shared<object::EmptyObject>(1, page::PAGE_TABLE_RW, 0, 0);
+                map->add_object(mapped[i], BASE + i * 2 * PAGE_SIZE, 0, 1);
+            }
+
+            // Fault them in in an order that isn't the order they were added in
+            for(uint32_t i = 0; i < objects; i ++) {
+                uint32_t o = (i * 7919) % objects;
+                *(volatile uint32_t *)(BASE + o * 2 * PAGE_SIZE) = i;
+            }
+            faults += objects;
+
+            for(uint32_t i = 0; i < objects; i ++) {
+                map->remove_object(mapped[i]);
+                mapped[i] = nullptr;
+            }
+        }
+        stop(faults);
+
+        report("%d objects mapped\n", objects);
+        delete[] mapped;
+    }
+
+    // Maps a single object of `pages` pages and touches every page of it, in order or not
+    void measure_touch(uint32_t pages, bool sequential) {
+        vm::Map *map = cpu::current_thread()->vm.get();
+        uint64_t touches = 0;
+        uint32_t faults = map->faults;
+
+        start(sequential ? "Touch every page of an object in order" : "Touch every page of an object at random");
+        while(running()) {
+            shared_ptr<object::Object> obj = make_shared<object::EmptyObject>(pages, page::PAGE_TABLE_RW, 0, 0);
+            map->add_object(obj, BASE, 0, pages);
+
+            for(uint32_t i = 0; i < pages; i ++) {
+                uint32_t p = sequential ? i : (i * 7919) % pages;
+                *(volatile uint32_t *)(BASE + p * PAGE_SIZE) = i;
+            }
+            touches += pages;
+
+            map->remove_object(obj);
+        }
+        stop(touches);
+
+        faults = map->faults - faults;
+        report("%d pages: %d faults, %llu.%02llu faults per page\n", pages, faults,
+            touches ? faults / touches : 0, touches ? faults * 100 / touches % 100 : 0);
+    }
+
+    // Maps an object of `pages` resident pages, then repeatedly clones the map and writes to every `stride`th page
+    //  (or none of them, if stride is 0) while the clone exists
+    void measure_clone(uint32_t pages, uint32_t stride) {
+        shared_ptr<task::Thread> thread = cpu::current_thread();
+        vm::Map *map = thread->vm.get();
+        uint64_t clones = 0;
+        uint32_t cow_faults;
+
+        shared_ptr<object::Object> obj = make_shared<object::EmptyObject>(pages, page::PAGE_TABLE_RW, 0, 0);
+        map->add_object(obj, BASE, 0, pages);
+        obj->generate(0, pages);
+        cow_faults = map->cow_faults;
+
+        start(stride ? "Clone a map and write to some of its pages" : "Clone a map");
+        while(running()) {
+            unique_ptr<vm::Map> copy = map->clone(thread->process->process_id, thread->task_id, true);
+
+            for(uint32_t i = 0; stride && i < pages; i += stride) {
+                *(volatile uint32_t *)(BASE + i * PAGE_SIZE) = i;
+            }
+            clones ++;
+        }
+        stop(clones);
+
+        cow_faults = map->cow_faults - cow_faults;
+        report("%d resident pages, writing to %d of them: %llu copy-on-write faults per clone\n", pages,
+            stride ? (pages + stride - 1) / stride : 0, clones ? cow_faults / clones : 0);
+        map->remove_object(obj);
+    }
+
+    // Generates every other page of an object of `pages` pages, then fills in the gaps with a single generate call
+    void measure_populate(uint32_t pages) {
+        uint64_t generated = 0;
+
+        start("Populate a sparse object");
+        while(running()) {
+            shared_ptr<object::Object> obj = make_shared<DescriptorObject>(pages);
+            for(uint32_t i = 1; i < pages; i += 2) {
+                obj->generate(i * PAGE_SIZE, 1);
+            }
+            obj->generate(0, pages);
+            generated += pages;
+        }
+        stop(generated);
+
+        report("%d pages\n", pages);
+    }
+
+    // Reads one word from every page of a buffer, over and over, so that nearly every read needs a different TLB entry
+    void stream(const char *name, volatile uint32_t *buffer, uint32_t pages) {
+        uint64_t reads = 0;
+        uint32_t sum = 0;
+
+        start(name);
+        while(running()) {
+            for(uint32_t i = 0; i < pages; i ++) {
+                sum += buffer[i * PAGE_SIZE / sizeof(uint32_t)];
+            }
+            reads += pages;
+        }
+        stop(reads);
+        (void)sum;
+    }
+
+    // Maps an object of `pages` resident pages, with or without large pages, and streams over it
+    void measure_stream(uint32_t pages, bool large) {
+        vm::Map *map = cpu::current_thread()->vm.get();
+
+        shared_ptr<object::Object> obj = make_shared<object::EmptyObject>(pages, page::PAGE_TABLE_RW,
+            large ? object::FLAG_LARGE_PAGES : 0, 0);
+        map->add_object(obj, BASE, 0, pages);
+        for(uint32_t i = 0; i < pages; i ++) {
+            *(volatile uint32_t *)(BASE + i * PAGE_SIZE) = i;
+        }
+
+        stream(large ? "Read every page of an object, 4MiB pages" : "Read every page of an object, 4KiB pages",
+            (volatile uint32_t *)BASE, pages);
+        report("%d pages\n", pages);
+        map->remove_object(obj);
+    }
+
+    void run_benchmark() override {
+        measure(16);
+        measure(256);
+        measure(4096);
+
+        measure_touch(1024, true);
+        measure_touch(1024, false);
+
+        measure_clone(256, 0);
+        measure_clone(4096, 0);
+        measure_clone(4096, 64);
+        measure_clone(4096, 8);
+
+        measure_populate(64 * 1024);
+
+        // 64MiB each
+        measure_stream(16384, false);
+        measure_stream(16384, true);
+
+        // Large enough that kmem grows the heap by whole 4MiB blocks, which are mapped with 4MiB pages
+        volatile uint32_t *heap = (volatile uint32_t *)kmem::kmalloc(16384 * PAGE_SIZE, 0);
+        for(uint32_t i = 0; i < 16384; i ++) {
+            heap[i * PAGE_SIZE / sizeof(uint32_t)] = i;
+        }
+        stream("Read every page of a kmalloc buffer", heap, 16384);
+        kmem::kfree((void *)heap);
+    }
+};
+
+test::AddBenchmark<FaultBenchmark> faultBenchmark;
+}